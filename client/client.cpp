@@ -52,6 +52,8 @@
 static const size_t MAX_MESSAGES_PER_CHAT = 100;
 static const size_t MAX_CHARACTERS_INPUT = 254;
 static const int UNRECOGNIZED_MSG = -1;
+// The biggest message the server can send us (a full GOT_MESSAGES).
+static const size_t MAX_INFLATED_MSG_SIZE = 1 + 1 + 255 * (1 + 255 + 1 + 255);
 
 // ***********************************************
 // UTILS
@@ -110,8 +112,7 @@ void print_msg(UWU_String *msg, char *prefix, char *action) {
 int remove_all(void *context, struct hashmap_element_s *const e) {
   UWU_ChatHistory *data = (UWU_ChatHistory *)e->data;
 
-  UWU_ChatHistory_deinit(data);
-  free(data);
+  UWU_ChatHistory_free(data);
   return -1;
 }
 
@@ -125,8 +126,7 @@ int remove_if_matches(void *context, struct hashmap_element_s *const e) {
   if (UWU_String_equal(user_name, &hash_key)) {
     UWU_ChatHistory *data = (UWU_ChatHistory *)e->data;
 
-    UWU_ChatHistory_deinit(data);
-    free(data);
+    UWU_ChatHistory_free(data);
     return -1;
   }
 
@@ -144,24 +144,29 @@ void register_user(UWU_User *user, UWU_UserList *userList, hashmap_s *chats) {
     UWU_PANIC("Fatal: Failed to insert Group chat to the UserCollection!\n");
   }
 
+  // The user borrows its name, so the history takes ownership of it.
+  UWU_String username = UWU_Username_view(&user->username);
   UWU_ChatHistory *userChat =
-      (UWU_ChatHistory *)malloc(sizeof(UWU_ChatHistory));
+      UWU_ChatHistory_new(MAX_MESSAGES_PER_CHAT, username, err);
   if (userChat == NULL) {
     UWU_PANIC("Fatal: Failed to allocate memory for groupal chat history\n");
   }
-  *userChat = UWU_ChatHistory_init(MAX_MESSAGES_PER_CHAT, user->username, err);
 
-  if (0 != hashmap_put(chats, user->username.data, user->username.length,
-                       userChat)) {
+  if (0 != hashmap_put(chats, username.data, username.length, userChat)) {
     UWU_PANIC("Fatal: Error creating a chat entry for the group chat.");
   }
 };
 
 void unregister_user(UWU_User *user, UWU_UserList *userList, hashmap_s *chats) {
+  // `user` may be the node we're removing, so keep a copy of its name.
+  char username_data[255];
+  UWU_String username = UWU_Username_view(&user->username);
+  memcpy(username_data, username.data, username.length);
+  username.data = username_data;
 
-  hashmap_iterate_pairs(chats, remove_if_matches, &user->username);
+  hashmap_iterate_pairs(chats, remove_if_matches, &username);
 
-  UWU_UserList_removeByUsernameIfExists(userList, &user->username);
+  UWU_UserList_removeByUsernameIfExists(userList, &username);
 };
 
 // ***********************************************
@@ -233,7 +238,7 @@ UWU_ClientState init_ClientState(char *username, char *url, UWU_Err err) {
   UWU_String current_username = {.data = username_data, .length = name_length};
 
   // User initialization
-  state.CurrentUser.username = current_username;
+  state.CurrentUser.username = UWU_Username_borrow(&current_username);
   state.CurrentUser.status = ACTIVE;
 
   // CREATE USER LIST
@@ -256,7 +261,8 @@ UWU_ClientState init_ClientState(char *username, char *url, UWU_Err err) {
   }
   *group_chat_name = '~';
   UWU_String group_name = {.data = group_chat_name, .length = 1};
-  UWU_User group_user = {.username = group_name, .status = ACTIVE};
+  UWU_User group_user = {.username = UWU_Username_borrow(&group_name),
+                         .status = ACTIVE};
 
   register_user(&group_user, &state.ActiveUsers, &state.Chats);
 
@@ -276,7 +282,10 @@ void deinit_ClientState(UWU_ClientState *state) {
   hashmap_destroy(&state->Chats);
 
   MG_INFO(("Cleaning Current User"));
-  UWU_String_freeWithMalloc(&state->CurrentUser.username);
+  // The current user borrows the name allocated on `init_ClientState`.
+  UWU_String current_username =
+      UWU_Username_view(&state->CurrentUser.username);
+  UWU_String_freeWithMalloc(&current_username);
 
   MG_INFO(("Cleaning User List..."));
   UWU_UserList_deinit(&state->ActiveUsers);
@@ -341,7 +350,8 @@ public:
       }
       *group_chat_name = '~';
       UWU_String group_name = {.data = group_chat_name, .length = 1};
-      UWU_User group_user = {.username = group_name, .status = ACTIVE};
+      UWU_User group_user = {.username = UWU_Username_borrow(&group_name),
+                             .status = ACTIVE};
 
       register_user(&group_user, &UWU_STATE->ActiveUsers, &UWU_STATE->Chats);
 
@@ -363,10 +373,12 @@ public:
             (UWU_ConnStatus)msg.data[index + usernameLen + 1];
 
         UWU_String usernameStr = {.data = usernameValue, .length = usernameLen};
-        UWU_User user = {.username = usernameStr, .status = userStatus};
+        UWU_User user = {.username = UWU_Username_borrow(&usernameStr),
+                         .status = userStatus};
 
         // Ignore our own username.
-        if (UWU_String_equal(&UWU_STATE->CurrentUser.username, &usernameStr)) {
+        if (UWU_Username_equal(&UWU_STATE->CurrentUser.username,
+                               &user.username)) {
           free(usernameValue);
           lenUsernames += usernameLen + 1;
           continue;
@@ -399,7 +411,8 @@ public:
         if (err != NO_ERROR) {
           UWU_PANIC("Unable to register new user");
         }
-        UWU_User user = UWU_User{.username = usernameStr, .status = req_status};
+        UWU_User user = UWU_User{.username = UWU_Username_borrow(&usernameStr),
+                                 .status = req_status};
 
         register_user(&user, &UWU_STATE->ActiveUsers, &UWU_STATE->Chats);
         printf("INSERTING %.*s\n", username_length, req_username.data);
@@ -412,11 +425,12 @@ public:
       UWU_ConnStatus req_status = (UWU_ConnStatus)msg.data[2 + username_length];
       UWU_String req_username = {.data = &msg.data[2],
                                  .length = username_length};
-      if (UWU_String_equal(&UWU_STATE->CurrentUser.username, &req_username)) {
+      UWU_String current_username =
+          UWU_Username_view(&UWU_STATE->CurrentUser.username);
+      if (UWU_String_equal(&current_username, &req_username)) {
         UWU_STATE->CurrentUser.status = req_status;
-        printf("CHANGING %.*s STATUS TO : %d\n",
-               UWU_STATE->CurrentUser.username.length,
-               UWU_STATE->CurrentUser.username.data, (int)req_status);
+        printf("CHANGING %.*s STATUS TO : %d\n", current_username.length,
+               current_username.data, (int)req_status);
       } else {
         UWU_Bool found_it = FALSE;
         UWU_Bool should_delete = FALSE;
@@ -427,24 +441,24 @@ public:
             continue;
           }
 
-          if (UWU_String_equal(&current->data.username, &req_username)) {
+          UWU_String username = UWU_Username_view(&current->data.username);
+          if (UWU_String_equal(&username, &req_username)) {
             found_it = TRUE;
             if (req_status == DISCONNETED) {
               should_delete = TRUE;
               userToDelete = &current->data;
             } else {
               current->data.status = req_status;
-              printf("CHANGING %.*s STATUS TO : %d\n",
-                     current->data.username.length, current->data.username.data,
-                     (int)req_status);
+              printf("CHANGING %.*s STATUS TO : %d\n", username.length,
+                     username.data, (int)req_status);
             }
           }
         }
         if (should_delete) {
-          printf("DELETING %.*s \n", userToDelete->username.length,
-                 userToDelete->username.data);
+          UWU_String username = UWU_Username_view(&userToDelete->username);
+          printf("DELETING %.*s \n", username.length, username.data);
 
-          if (UWU_String_equal(&userToDelete->username,
+          if (UWU_String_equal(&username,
                                &UWU_STATE->currentChat->channel_name)) {
             emit selectedUserDisconnected();
             UWU_STATE->currentChat = NULL;
@@ -495,12 +509,13 @@ public:
       UWU_String contact = {.data = username, .length = username_length};
       UWU_String content = {.data = chat, .length = msg_length};
 
-      UWU_ChatEntry entry =
-          UWU_ChatEntry{.content = content, .origin_username = contact};
+      UWU_ChatEntry entry = UWU_ChatEntry{
+          .content = content, .origin_username = UWU_Username_borrow(&contact)};
 
       UWU_ChatHistory *history = NULL;
 
-      if (UWU_String_equal(&UWU_STATE->CurrentUser.username, &contact)) {
+      if (UWU_Username_equal(&UWU_STATE->CurrentUser.username,
+                             &entry.origin_username)) {
         // If its from the current user append it to the current chat.
         history = UWU_STATE->currentChat;
       } else {
@@ -557,7 +572,8 @@ public:
             UWU_String{.data = username, .length = lenUsername};
 
         UWU_ChatEntry entry =
-            UWU_ChatEntry{.content = content, .origin_username = contact};
+            UWU_ChatEntry{.content = content,
+                          .origin_username = UWU_Username_borrow(&contact)};
 
         UWU_ChatHistory_addMessage(history, &entry);
 
@@ -568,6 +584,17 @@ public:
       }
       emit msgPrococessed();
     } break;
+    case OFFLINE_MESSAGES:
+      // The server also stores them on the DM histories of the senders that
+      // are still connected, they show up once their chat is opened.
+      break;
+    case OLDER_MESSAGES:
+      // The client never asks for them, it only shows what GOT_MESSAGES
+      // brings.
+      break;
+    case SEARCH_RESULTS:
+      // The client doesn't search yet.
+      break;
     default:
       fprintf(stderr, "Error: Unrecognized message from server!\n");
       emit errorMsg(UNRECOGNIZED_MSG);
@@ -615,6 +642,8 @@ public slots:
   void stop() {
     printf("\nClosing websocket connection...\n");
     mg_mgr_free(&mgr);
+    UWU_Deflate_releaseThreadCtx();
+    UWU_Pools_releaseThreadCaches();
   }
 
   static void ws_listener(struct mg_connection *c, int ev, void *ev_data) {
@@ -645,7 +674,23 @@ public slots:
       // Copying message
       struct mg_ws_message *wm = (struct mg_ws_message *)ev_data;
       UWU_Err err = NO_ERROR;
-      UWU_String msg = UWU_String_fromMongoose(&wm->data, err);
+      mg_str payload = wm->data;
+
+      // The server compresses big frames (like GOT_MESSAGES) when we offer
+      // permessage-deflate on connect.
+      if (wm->flags & UWU_WS_FLAG_COMPRESSED) {
+        UWU_String compressed = {.data = wm->data.buf,
+                                 .length = wm->data.len};
+        UWU_String inflated =
+            UWU_Deflate_inflate(&compressed, MAX_INFLATED_MSG_SIZE, err);
+        if (err != NO_ERROR || inflated.data == NULL) {
+          MG_ERROR(("Failed to inflate message from server!"));
+          return;
+        }
+        payload = mg_str_n(inflated.data, inflated.length);
+      }
+
+      UWU_String msg = UWU_String_fromMongoose(&payload, err);
 
       // Launching thread
       MessageTask *task = new MessageTask(msg);
@@ -672,7 +717,9 @@ public slots:
     // Initialise event manager
     mg_mgr_init(&mgr);
     // Create client
-    ws_conn = mg_ws_connect(&mgr, s_url, ws_listener, this, NULL);
+    ws_conn = mg_ws_connect(&mgr, s_url, ws_listener, this,
+                            "Sec-WebSocket-Extensions: %s\r\n",
+                            UWU_WS_DEFLATE_EXTENSION);
     mg_log_set(1); // Disable debu logging.
 
     // WS Event loop
@@ -762,8 +809,8 @@ void change_status_handler(UWU_ConnStatus status) {
     return;
   }
 
-  UWU_User *currentUser = &UWU_STATE->CurrentUser;
-  size_t username_length = currentUser->username.length;
+  UWU_String username = UWU_Username_view(&UWU_STATE->CurrentUser.username);
+  size_t username_length = username.length;
   size_t length = 3 + username_length;
   char *data = (char *)malloc(length);
   if (data == NULL) {
@@ -774,7 +821,7 @@ void change_status_handler(UWU_ConnStatus status) {
   data[1] = username_length;
 
   for (size_t i = 0; i < username_length; i++) {
-    data[2 + i] = UWU_String_charAt(&currentUser->username, i);
+    data[2 + i] = UWU_String_charAt(&username, i);
   }
 
   data[length - 1] = status;
@@ -1044,7 +1091,8 @@ public:
     const UWU_User &user = node->data;
 
     if (role == Qt::DisplayRole || role == UsernameRole) {
-      return QString::fromUtf8(user.username.data, user.username.length);
+      UWU_String username = UWU_Username_view(&user.username);
+      return QString::fromUtf8(username.data, username.length);
     } else if (role == StatusRole) {
       return statusToString(user.status);
     } else if (role == StatusIconRole) {
@@ -1081,8 +1129,9 @@ public:
       return Qt::NoItemFlags;
 
     const UWU_User &user = node->data;
+    UWU_String username_view = UWU_Username_view(&user.username);
     QString username =
-        QString::fromUtf8(user.username.data, user.username.length);
+        QString::fromUtf8(username_view.data, username_view.length);
 
     if (username.isEmpty()) {
       return Qt::ItemIsEnabled;
@@ -1448,8 +1497,9 @@ public:
       return QString("");
 
     UWU_ChatEntry entry = chatHistory->messages[index.row()];
-    QString sender = QString::fromUtf8(entry.origin_username.data,
-                                       entry.origin_username.length);
+    UWU_String origin_username = UWU_Username_view(&entry.origin_username);
+    QString sender =
+        QString::fromUtf8(origin_username.data, origin_username.length);
     QString content =
         QString::fromUtf8(entry.content.data, entry.content.length);
 
@@ -23,7 +23,7 @@
     in {
       prod_server = pkgs.writeShellApplication {
         name = "CHAD_server";
-        runtimeInputs = [pkgs.clang pkgs.lld];
+        runtimeInputs = [pkgs.clang pkgs.lld pkgs.zlib];
         text = ''
           cd ./server/
           cc -o nob nob.c
@@ -40,6 +40,7 @@
         packages = [
           pkgs.clang
           pkgs.lld
+          pkgs.zlib
         ];
       };
 
@@ -48,6 +49,9 @@
           pkgs.clang
           pkgs.clang-tools
           pkgs.lld
+          # llvm-profdata for `./nob -pgo`
+          pkgs.llvm
+          pkgs.zlib
           pkgs.go-task
           pkgs.gf
 
@@ -1,5 +1,6 @@
 #include "../server/deps/mongoose/mongoose.h"
 #include "pthread.h"
+#include <sched.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -7,6 +8,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <zlib.h>
 
 /* *****************************************************************************
 Welcum
@@ -32,6 +34,7 @@ static const UWU_Err MALLOC_FAILED = (size_t *)2;
 static const UWU_Err ARENA_ALLOC_NO_SPACE = (size_t *)3;
 static const UWU_Err NO_SPACE_LEFT = (size_t *)4;
 static const UWU_Err HASHMAP_INITIALIZATION_ERROR = (size_t *)5;
+static const UWU_Err COMPRESSION_FAILED = (size_t *)6;
 
 typedef int UWU_Bool;
 static const UWU_Bool TRUE = 1;
@@ -92,6 +95,8 @@ typedef enum {
   CHANGE_STATUS,
   SEND_MESSAGE,
   GET_MESSAGES,
+  // Looks for messages with some terms, check `UWU_SEARCH_RESULT_SIZE`.
+  SEARCH,
 } UWU_ServerMessages;
 
 // Represents all the "type codes" of messages the client receives from the
@@ -102,8 +107,21 @@ typedef enum {
   GOT_USER,
   REGISTERED_USER,
   CHANGED_STATUS,
+  // A new message, check `UWU_MESSAGE_STAMP_SIZE`.
   GOT_MESSAGE,
   GOT_MESSAGES,
+  // Answer to a SEND_MESSAGE that carried a nonce, check `UWU_ACK_SIZE`.
+  ACKED_MESSAGE,
+  // DMs sent to the user while it was disconnected, delivered once when it
+  // connects again. Same shape as GOT_MESSAGES, every message comes from the
+  // user it carries:
+  // | type | num msgs | length user | username | length msg | msg | ...
+  OFFLINE_MESSAGES,
+  // Answer to a GET_MESSAGES that carried the ID to page before, check
+  // `UWU_PAGE_BEFORE_SIZE`.
+  OLDER_MESSAGES,
+  // Answer to a SEARCH.
+  SEARCH_RESULTS,
 } UWU_ClientMessages;
 
 typedef enum {
@@ -115,88 +133,498 @@ typedef enum {
   EMPTY_MESSAGE,
   // You're trying to communicate with a disconnected user!
   USER_ALREADY_DISCONNECTED,
+  // You're sending requests too fast, the request was dropped!
+  RATE_LIMITED,
+  // The user is disconnected and can't take more messages until it connects!
+  MAILBOX_FULL,
 } UWU_Errors;
 
+// A SEND_MESSAGE may end with a nonce chosen by the client:
+// | type | length user | username | length msg | msg | nonce (4 bytes) |
+// The server then answers with an ACKED_MESSAGE:
+// | type | nonce (4 bytes) | id (8 bytes) | timestamp ms (8 bytes) |
+// Numbers are big endian. Sending the same nonce again returns the same ACK
+// without storing the message twice, also after reconnecting while the
+// server keeps the user's offline mailbox. Only the last 16 nonces of every
+// user are remembered.
+static const size_t UWU_NONCE_SIZE = 4;
+static const size_t UWU_ACK_SIZE = 1 + 4 + 8 + 8;
+
+// The id of the ACK of a DM to a disconnected user. It waits on its mailbox
+// and isn't on a chat yet, it gets a real ID once it's delivered.
+static const uint64_t UWU_MAILBOX_MESSAGE_ID = 0;
+
+// A GOT_MESSAGE ends with the ID and timestamp the message got on its chat:
+// | type | length from | from | length msg | msg | id (8 bytes) |
+// timestamp ms (8 bytes) |
+// Clients that don't need them can ignore the bytes after the message. The
+// IDs of a DM keep growing even if its history is dropped and created again.
+// GOT_MESSAGES keeps its shape, a GET_MESSAGES with a before id of 0 gets the
+// newest messages with their IDs instead.
+static const size_t UWU_MESSAGE_STAMP_SIZE = 8 + 8;
+
+// A GET_MESSAGES may end with the ID of a message, to read the ones before it:
+// | type | length user | username | before id (8 bytes) |
+// The server then answers with an OLDER_MESSAGES, oldest first:
+// | type | length user | username | num msgs | messages |
+// Every message is:
+// | id (8 bytes) | timestamp ms (8 bytes) | length from | from | length msg |
+// msg |
+// A before id of 0 reads the newest messages. Pages hold up to 50 messages
+// and may have gaps where messages were lost. `num msgs` is 0 once there are no
+// older messages.
+static const size_t UWU_PAGE_BEFORE_SIZE = 8;
+
+// A SEARCH looks for the messages of the group chat and the DMs of the user
+// that have every term of a query, check `Search Index`:
+// | type | length query | query |
+// The server answers with a SEARCH_RESULTS, newest first:
+// | type | num msgs | messages |
+// Every message is:
+// | length chat | chat | id (8 bytes) | timestamp ms (8 bytes) | length from |
+// from | length msg | msg |
+// Where chat is `~` for the group chat and the other user for DMs. Results
+// hold up to 20 messages, this is the most a single one takes.
+#define UWU_SEARCH_RESULT_SIZE (1 + 255 + 8 + 8 + 1 + 255 + 1 + 255)
+
+// Reads a big endian number of `size` bytes.
+uint64_t UWU_readBigEndian(const char *src, size_t size) {
+  uint64_t value = 0;
+  for (size_t i = 0; i < size; i++) {
+    value = (value << 8) | (uint8_t)src[i];
+  }
+  return value;
+}
+
+// Writes the lower `size` bytes of `value` in big endian.
+void UWU_writeBigEndian(char *dest, uint64_t value, size_t size) {
+  for (size_t i = size; i > 0; i--) {
+    dest[i - 1] = (char)(value & 0xFF);
+    value >>= 8;
+  }
+}
+
+// Current wall clock time in milliseconds since the epoch.
+uint64_t UWU_nowMs() {
+  struct timespec now = {};
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
 /* *****************************************************************************
 Arenas
 ***************************************************************************** */
 
 // The arena is a simple abstraction over the concept of storing data on the
-// heap. Think of it as a fixed append-only stack, you can only append elements
-// to the end or remove them all together.
-typedef struct {
+// heap. Think of it as an append-only stack, you can only append elements to
+// the end or remove them all together.
+//
+// The memory is split in blocks chained together. When the current block can't
+// hold an allocation a new one is added to the chain, so the arena only grows
+// as much as the biggest request needs. Blocks that are no longer used are
+// kept in a per-thread free list so the next arena (or the next request) can
+// reuse them without calling malloc.
+typedef struct UWU_ArenaBlock {
+  // The block that was in use before this one.
+  struct UWU_ArenaBlock *prev;
+  // How many bytes of data this block can hold.
   size_t capacity;
+  // How many bytes of data are in use.
   size_t size;
-  uint8_t *data;
+  // The data starts right after this header.
+} UWU_ArenaBlock;
+
+typedef struct {
+  // The block new allocations are taken from.
+  UWU_ArenaBlock *current;
+  // The first block of the chain, resetting the arena keeps only this one.
+  UWU_ArenaBlock *first;
+  // The minimum capacity of every block in the chain.
+  size_t block_size;
 } UWU_Arena;
 
-// Initializes a new arena with the specified capacity!
+// A position inside an arena, obtained with `UWU_Arena_save`.
+//
+// Restoring it with `UWU_Arena_restore` frees everything allocated after it.
+typedef struct {
+  UWU_ArenaBlock *block;
+  size_t size;
+} UWU_ArenaMarker;
+
+// The default alignment of arena allocations, enough for any primitive type.
+static const size_t UWU_ARENA_ALIGNMENT = 16;
+// The maximum amount of bytes a thread keeps on its free list, bigger blocks
+// are returned to malloc.
+static const size_t UWU_ARENA_MAX_FREE_BYTES = 16 * 1024;
+
+// Blocks not used by any arena of the current thread.
+typedef struct {
+  // Linked list of blocks using `prev`.
+  UWU_ArenaBlock *blocks;
+  // The sum of the capacity of all blocks in the list.
+  size_t bytes;
+} UWU_ArenaFreeList;
+
+static __thread UWU_ArenaFreeList UWU_ARENA_FREE_BLOCKS = {};
+
+// Bytes malloc'd for the blocks of all threads, free lists included.
+// ALWAYS read it with `__atomic` builtins.
+static size_t UWU_ARENA_BYTES = 0;
+
+uint8_t *UWU_ArenaBlock_data(UWU_ArenaBlock *block) {
+  return (uint8_t *)(block + 1);
+}
+
+// Gets a block that can hold at least `capacity` bytes.
+// Reuses a block from the thread free list if possible.
+//
+// Returns NULL if malloc fails.
+UWU_ArenaBlock *UWU_ArenaBlock_get(size_t capacity) {
+  UWU_ArenaFreeList *free_list = &UWU_ARENA_FREE_BLOCKS;
+  for (UWU_ArenaBlock **current = &free_list->blocks; *current != NULL;
+       current = &(*current)->prev) {
+    UWU_ArenaBlock *block = *current;
+    if (block->capacity >= capacity) {
+      *current = block->prev;
+      free_list->bytes -= block->capacity;
+      block->prev = NULL;
+      block->size = 0;
+      return block;
+    }
+  }
+
+  UWU_ArenaBlock *block =
+      (UWU_ArenaBlock *)malloc(sizeof(UWU_ArenaBlock) + capacity);
+  if (block == NULL) {
+    return NULL;
+  }
+  __atomic_fetch_add(&UWU_ARENA_BYTES, sizeof(UWU_ArenaBlock) + capacity,
+                     __ATOMIC_RELAXED);
+
+  block->prev = NULL;
+  block->capacity = capacity;
+  block->size = 0;
+  return block;
+}
+
+// Gives back a block to the thread free list.
+// If the free list is already full the block is freed.
+void UWU_ArenaBlock_put(UWU_ArenaBlock *block) {
+  UWU_ArenaFreeList *free_list = &UWU_ARENA_FREE_BLOCKS;
+  if (free_list->bytes + block->capacity > UWU_ARENA_MAX_FREE_BYTES) {
+    __atomic_fetch_sub(&UWU_ARENA_BYTES, sizeof(UWU_ArenaBlock) + block->capacity,
+                       __ATOMIC_RELAXED);
+    free(block);
+    return;
+  }
+
+  block->prev = free_list->blocks;
+  free_list->blocks = block;
+  free_list->bytes += block->capacity;
+}
+
+// Initializes a new arena, every block will hold at least `capacity` bytes.
 UWU_Arena UWU_Arena_init(size_t capacity, UWU_Err err) {
   UWU_Arena arena = {};
-  arena.data = (uint8_t *)malloc(sizeof(uint8_t) * capacity);
+  arena.first = UWU_ArenaBlock_get(capacity);
 
-  if (arena.data == NULL) {
+  if (arena.first == NULL) {
     err = MALLOC_FAILED;
     return arena;
   }
 
-  arena.capacity = capacity;
-  arena.size = 0;
+  arena.current = arena.first;
+  arena.block_size = capacity;
 
   return arena;
 }
 
-// Tries to allocate on the arena.
+// Tries to allocate on the arena with the specified alignment.
 //
 // - arena: The specific arena to use for allocation.
 // - size: The amount of bytes to allocate.
+// - alignment: Must be a power of 2.
 // - err: The err parameter, refer to the start of lib for an explanation.
 //
 // Success: Returns a pointer to the first byte of the memory region requested.
-// Failure: Sets err equal to `ARENA_ALLOC_NO_SPACE`.
-void *UWU_Arena_alloc(UWU_Arena *arena, size_t size, UWU_Err err) {
-  UWU_Bool has_space = arena->size + size <= arena->capacity;
-  if (!has_space) {
-    err = ARENA_ALLOC_NO_SPACE;
-    return NULL;
-  } else {
-    void *mem_start = &arena->data[arena->size];
-    arena->size += size;
-    return mem_start;
+// Failure: Sets err equal to `ARENA_ALLOC_NO_SPACE` if a new block couldn't
+// be allocated.
+void *UWU_Arena_allocAligned(UWU_Arena *arena, size_t size, size_t alignment,
+                             UWU_Err err) {
+  UWU_ArenaBlock *block = arena->current;
+  uintptr_t start = (uintptr_t)UWU_ArenaBlock_data(block);
+  uintptr_t aligned = (start + block->size + alignment - 1) & ~(alignment - 1);
+  size_t offset = aligned - start;
+
+  if (offset + size > block->capacity) {
+    size_t capacity = size + alignment - 1;
+    if (capacity < arena->block_size) {
+      capacity = arena->block_size;
+    }
+
+    UWU_ArenaBlock *next = UWU_ArenaBlock_get(capacity);
+    if (next == NULL) {
+      err = ARENA_ALLOC_NO_SPACE;
+      return NULL;
+    }
+
+    next->prev = block;
+    arena->current = next;
+    block = next;
+
+    start = (uintptr_t)UWU_ArenaBlock_data(block);
+    aligned = (start + alignment - 1) & ~(alignment - 1);
+    offset = aligned - start;
   }
+
+  block->size = offset + size;
+  return (void *)aligned;
 }
 
-// Tries to allocate all the remaining space on the arena.
-// This operation can fail since the arena may or may not have any space
-// available!
+// Tries to allocate on the arena.
+// The memory is aligned to `UWU_ARENA_ALIGNMENT`.
 //
 // - arena: The specific arena to use for allocation.
+// - size: The amount of bytes to allocate.
 // - err: The err parameter, refer to the start of lib for an explanation.
 //
 // Success: Returns a pointer to the first byte of the memory region requested.
 // Failure: Sets err equal to `ARENA_ALLOC_NO_SPACE`.
-void *UWU_Arena_allocRemaining(UWU_Arena *arena, UWU_Err err) {
-  UWU_Bool has_space = (arena->capacity - arena->size) != 0;
-  if (!has_space) {
-    err = ARENA_ALLOC_NO_SPACE;
-    return NULL;
-  } else {
-    void *mem_start = &arena->data[arena->size];
-    arena->size = arena->capacity;
-    return mem_start;
+void *UWU_Arena_alloc(UWU_Arena *arena, size_t size, UWU_Err err) {
+  return UWU_Arena_allocAligned(arena, size, UWU_ARENA_ALIGNMENT, err);
+}
+
+// Saves the current position of the arena.
+UWU_ArenaMarker UWU_Arena_save(UWU_Arena *arena) {
+  UWU_ArenaMarker marker = {
+      .block = arena->current,
+      .size = arena->current->size,
+  };
+  return marker;
+}
+
+// Frees everything allocated after the marker was saved.
+// Blocks no longer needed go back to the thread free list.
+//
+// The marker must come from this arena and not be older than a previous
+// restore or reset!
+void UWU_Arena_restore(UWU_Arena *arena, UWU_ArenaMarker marker) {
+  while (arena->current != marker.block) {
+    UWU_ArenaBlock *prev = arena->current->prev;
+    UWU_ArenaBlock_put(arena->current);
+    arena->current = prev;
   }
+
+  arena->current->size = marker.size;
 }
 
 // Resets the arena for future use.
-// IT DOES NOT FREE THE MEMORY OF THE ARENA! Use `deinit` for that.
-void UWU_Arena_reset(UWU_Arena *arena) { arena->size = 0; }
+// Only the first block is kept, the rest go back to the thread free list.
+void UWU_Arena_reset(UWU_Arena *arena) {
+  UWU_ArenaMarker start = {.block = arena->first, .size = 0};
+  UWU_Arena_restore(arena, start);
+}
 
-// Resets and frees all memory associated with this arena.
+// Gives back all memory associated with this arena to the thread free list.
 // DO NOT USE an arena that has already been deinited!
 void UWU_Arena_deinit(UWU_Arena arena) {
-  arena.capacity = 0;
-  arena.size = 0;
-  free(arena.data);
+  if (arena.first == NULL) {
+    return;
+  }
+
+  UWU_Arena_reset(&arena);
+  UWU_ArenaBlock_put(arena.first);
+}
+
+// Frees the arena blocks kept by the current thread.
+// Call it before a thread that used arenas exits.
+void UWU_Arena_releaseThreadBlocks() {
+  UWU_ArenaFreeList *free_list = &UWU_ARENA_FREE_BLOCKS;
+  while (free_list->blocks != NULL) {
+    UWU_ArenaBlock *prev = free_list->blocks->prev;
+    __atomic_fetch_sub(&UWU_ARENA_BYTES,
+                       sizeof(UWU_ArenaBlock) + free_list->blocks->capacity,
+                       __ATOMIC_RELAXED);
+    free(free_list->blocks);
+    free_list->blocks = prev;
+  }
+  free_list->bytes = 0;
+}
+
+/* *****************************************************************************
+Pools
+***************************************************************************** */
+
+// A pool hands out objects of a fixed size.
+//
+// Objects are carved out of big slabs, so creating them doesn't go through
+// malloc. Freed objects go to a small per-thread cache first, once the cache
+// is full half of it is moved to the free list of the pool, which is shared by
+// all threads.
+//
+// Pools are meant to be static and live for the whole program, declare them
+// with `UWU_POOL_STATIC`.
+typedef struct UWU_PoolObject {
+  struct UWU_PoolObject *next;
+} UWU_PoolObject;
+
+typedef struct {
+  // Index of this pool inside the per-thread caches.
+  // Must be unique and smaller than `UWU_POOL_MAX_POOLS`.
+  size_t id;
+  // The size of every object handed out by the pool.
+  size_t object_size;
+  // Objects not used by anyone, shared by all threads.
+  UWU_PoolObject *free_list;
+  // All the slabs allocated so far, chained using their first object.
+  UWU_PoolObject *slabs;
+  // Lock it before touching `free_list` or `slabs`.
+  pthread_mutex_t mx;
+} UWU_Pool;
+
+// The maximum number of pools a program can have.
+#define UWU_POOL_MAX_POOLS 8
+// How many objects each thread can keep on its cache for each pool.
+static const size_t UWU_POOL_CACHE_SIZE = 32;
+// The size of each slab of objects.
+static const size_t UWU_POOL_SLAB_SIZE = 16 * 1024;
+
+// Initializes a static pool, `size` is rounded up so objects stay aligned.
+#define UWU_POOL_STATIC(pool_id, size)                                         \
+  {                                                                            \
+    .id = (pool_id), .object_size = ((size) + 15) & ~(size_t)15,               \
+    .free_list = NULL, .slabs = NULL, .mx = PTHREAD_MUTEX_INITIALIZER,         \
+  }
+
+// The objects a thread keeps for a single pool.
+typedef struct {
+  UWU_PoolObject *objects;
+  size_t count;
+} UWU_PoolCache;
+
+static __thread UWU_PoolCache UWU_POOL_CACHES[UWU_POOL_MAX_POOLS] = {};
+
+// Fills the cache of the thread from the shared free list, allocating a new
+// slab if the free list is empty.
+//
+// The pool must be locked!
+// Returns FALSE if a new slab couldn't be allocated.
+UWU_Bool UWU_Pool_refill(UWU_Pool *pool, UWU_PoolCache *cache) {
+  if (pool->free_list == NULL) {
+    // The first object of each slab is used to chain the slabs together.
+    size_t objects_per_slab = UWU_POOL_SLAB_SIZE / pool->object_size;
+    if (objects_per_slab < 2) {
+      objects_per_slab = 2;
+    }
+
+    uint8_t *slab = (uint8_t *)malloc(objects_per_slab * pool->object_size);
+    if (slab == NULL) {
+      return FALSE;
+    }
+
+    UWU_PoolObject *slab_header = (UWU_PoolObject *)slab;
+    slab_header->next = pool->slabs;
+    pool->slabs = slab_header;
+
+    for (size_t i = objects_per_slab - 1; i >= 1; i--) {
+      UWU_PoolObject *object = (UWU_PoolObject *)&slab[i * pool->object_size];
+      object->next = pool->free_list;
+      pool->free_list = object;
+    }
+  }
+
+  while (pool->free_list != NULL && cache->count < UWU_POOL_CACHE_SIZE / 2) {
+    UWU_PoolObject *object = pool->free_list;
+    pool->free_list = object->next;
+
+    object->next = cache->objects;
+    cache->objects = object;
+    cache->count++;
+  }
+
+  return TRUE;
+}
+
+// Gets an uninitialized object from the pool.
+//
+// Success: Returns a pointer to an object of `pool->object_size` bytes.
+// Failure: Sets err equal to `MALLOC_FAILED`.
+void *UWU_Pool_alloc(UWU_Pool *pool, UWU_Err err) {
+  UWU_PoolCache *cache = &UWU_POOL_CACHES[pool->id];
+
+  if (cache->objects == NULL) {
+    UWU_PanicIf(pthread_mutex_lock(&pool->mx) != 0,
+                "Fatal: Can't lock the pool mutex!");
+    UWU_Bool refilled = UWU_Pool_refill(pool, cache);
+    UWU_PanicIf(pthread_mutex_unlock(&pool->mx) != 0,
+                "Fatal: Can't unlock the pool mutex!");
+
+    if (!refilled) {
+      err = MALLOC_FAILED;
+      return NULL;
+    }
+  }
+
+  UWU_PoolObject *object = cache->objects;
+  cache->objects = object->next;
+  cache->count--;
+  return object;
+}
+
+// Moves `count` objects from the thread cache to the shared free list.
+void UWU_Pool_drainCache(UWU_Pool *pool, UWU_PoolCache *cache, size_t count) {
+  UWU_PanicIf(pthread_mutex_lock(&pool->mx) != 0,
+              "Fatal: Can't lock the pool mutex!");
+  for (size_t i = 0; i < count && cache->objects != NULL; i++) {
+    UWU_PoolObject *object = cache->objects;
+    cache->objects = object->next;
+    cache->count--;
+
+    object->next = pool->free_list;
+    pool->free_list = object;
+  }
+  UWU_PanicIf(pthread_mutex_unlock(&pool->mx) != 0,
+              "Fatal: Can't unlock the pool mutex!");
+}
+
+// Gives back an object to the pool.
+// The object can be freed from any thread, not only the one that allocated it.
+void UWU_Pool_free(UWU_Pool *pool, void *ptr) {
+  if (ptr == NULL) {
+    return;
+  }
+
+  UWU_PoolCache *cache = &UWU_POOL_CACHES[pool->id];
+  UWU_PoolObject *object = (UWU_PoolObject *)ptr;
+  object->next = cache->objects;
+  cache->objects = object;
+  cache->count++;
+
+  if (cache->count > UWU_POOL_CACHE_SIZE) {
+    UWU_Pool_drainCache(pool, cache, UWU_POOL_CACHE_SIZE / 2);
+  }
+}
+
+// Gives back all objects cached by the current thread to the pool.
+// Call it before a thread that used the pool exits.
+void UWU_Pool_releaseThreadCache(UWU_Pool *pool) {
+  UWU_PoolCache *cache = &UWU_POOL_CACHES[pool->id];
+  UWU_Pool_drainCache(pool, cache, cache->count);
+}
+
+// Frees the slabs of the pool. Every object it handed out must be freed and
+// every thread that used it must have released its cache!
+void UWU_Pool_deinit(UWU_Pool *pool) {
+  UWU_PanicIf(pthread_mutex_lock(&pool->mx) != 0,
+              "Fatal: Can't lock the pool mutex!");
+  while (pool->slabs != NULL) {
+    UWU_PoolObject *slab = pool->slabs;
+    pool->slabs = slab->next;
+    free(slab);
+  }
+  pool->free_list = NULL;
+  UWU_PanicIf(pthread_mutex_unlock(&pool->mx) != 0,
+              "Fatal: Can't unlock the pool mutex!");
 }
 
 /* *****************************************************************************
@@ -254,6 +682,22 @@ UWU_Bool UWU_String_endsWith(const UWU_String *const str,
   return FALSE;
 }
 
+// Returns `TRUE` if `needle` appears anywhere inside `str`.
+UWU_Bool UWU_String_contains(const UWU_String *const str,
+                             const UWU_String *const needle) {
+  if (str->length < needle->length) {
+    return FALSE;
+  }
+
+  for (size_t i = 0; i + needle->length <= str->length; i++) {
+    if (0 == memcmp(&str->data[i], needle->data, needle->length)) {
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
 // Returns `TRUE` if `first` goes first alphabetically speaking.
 // False otherwise.
 UWU_Bool UWU_String_firstGoesFirst(const UWU_String *const first,
@@ -389,6 +833,47 @@ UWU_String UWU_String_copy(const UWU_String *const src, UWU_Err err) {
   return str;
 }
 
+// Usernames and channel names have at most 255 bytes, so their copies come
+// from pools instead of malloc. Short names (the common case) use a smaller
+// object size.
+static UWU_Pool UWU_SHORT_STRING_POOL = UWU_POOL_STATIC(0, 32);
+static UWU_Pool UWU_STRING_POOL = UWU_POOL_STATIC(1, 256);
+
+// Copies `src` into a new `UWU_String` allocated on a pool if it fits.
+// Free it with `UWU_String_freePooled`!
+UWU_String UWU_String_copyPooled(const UWU_String *const src, UWU_Err err) {
+  if (src->length > UWU_STRING_POOL.object_size) {
+    return UWU_String_copy(src, err);
+  }
+
+  UWU_Pool *pool = src->length <= UWU_SHORT_STRING_POOL.object_size
+                       ? &UWU_SHORT_STRING_POOL
+                       : &UWU_STRING_POOL;
+
+  UWU_String str = {};
+  str.data = (char *)UWU_Pool_alloc(pool, err);
+  if (str.data == NULL) {
+    err = MALLOC_FAILED;
+    return str;
+  }
+
+  memcpy(str.data, src->data, src->length);
+  str.length = src->length;
+
+  return str;
+}
+
+// Frees a string created with `UWU_String_copyPooled`.
+void UWU_String_freePooled(const UWU_String *const str) {
+  if (str->length > UWU_STRING_POOL.object_size) {
+    UWU_String_freeWithMalloc(str);
+  } else if (str->length <= UWU_SHORT_STRING_POOL.object_size) {
+    UWU_Pool_free(&UWU_SHORT_STRING_POOL, str->data);
+  } else {
+    UWU_Pool_free(&UWU_STRING_POOL, str->data);
+  }
+}
+
 uint8_t UWU_String_getChar(const UWU_String *const str, size_t idx) {
   if (idx >= 0 && idx < str->length) {
     return str->data[idx];
@@ -411,435 +896,3294 @@ UWU_Bool UWU_String_equal(const UWU_String *a, const UWU_String *b) {
   return 0 == memcmp(a->data, b->data, a->length);
 }
 
+// Computes the FNV-1a hash of a string.
+uint32_t UWU_String_hash(const UWU_String *const str) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < str->length; i++) {
+    hash ^= (uint8_t)str->data[i];
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
 /* *****************************************************************************
-Server Users
+Usernames
 ***************************************************************************** */
 
+// Usernames up to this length are stored inside the `UWU_Username` itself.
+#define UWU_USERNAME_INLINE_CAPACITY 24
+
+// Flags of a `UWU_Username`.
+typedef enum {
+  // The name is on `inline_data` instead of `data`.
+  UWU_USERNAME_INLINE = 1,
+  // The name was copied and must be freed.
+  UWU_USERNAME_OWNED = 2,
+} UWU_UsernameFlags;
+
+// A compact username with its hash and length precomputed.
+//
+// Short names are stored inline so comparing two users doesn't chase any
+// pointer, equality checks reject on hash or length before touching the bytes.
+//
+// A username can be:
+// * Owned: Created with `UWU_Username_copy`, free it with `UWU_Username_free`.
+// * Borrowed: Created with `UWU_Username_borrow`, it only points to a string
+// someone else owns. Useful to pass a name to functions that copy it.
+//
+// Inline data lives inside the struct, so a view obtained with
+// `UWU_Username_view` is only valid as long as the username it came from!
+//
+// It takes 32 bytes, half a cache line.
 typedef struct {
-  UWU_String username;
-  UWU_ConnStatus status;
-  time_t last_action;
-  struct mg_connection *conn;
-} UWU_User;
+  uint32_t hash;
+  uint8_t length;
+  // Check `UWU_UsernameFlags`.
+  uint8_t flags;
+  union {
+    char inline_data[UWU_USERNAME_INLINE_CAPACITY];
+    char *data;
+  };
+} UWU_Username;
+
+// Creates a username that points to the data of `src`.
+// It doesn't own the data so it doesn't need to be freed.
+UWU_Username UWU_Username_borrow(const UWU_String *const src) {
+  UWU_Username username = {};
+  username.hash = UWU_String_hash(src);
+  username.length = (uint8_t)src->length;
+  username.flags = 0;
+  username.data = src->data;
+  return username;
+}
 
-UWU_User UWU_User_copyFrom(UWU_User *src, UWU_Err err) {
-  UWU_User copy = {};
+// Gets a string view of the username.
+UWU_String UWU_Username_view(const UWU_Username *const username) {
+  UWU_String view = {
+      .data = (username->flags & UWU_USERNAME_INLINE)
+                  ? (char *)username->inline_data
+                  : username->data,
+      .length = username->length,
+  };
+  return view;
+}
 
-  UWU_String user_name_copy = UWU_String_copy(&src->username, err);
-  if (err != NO_ERROR) {
-    err = MALLOC_FAILED;
+// Copies the username, short names are stored inline and long ones on a pool.
+//
+// Success: Returns an owned username.
+// Failure: Sets err equal to `MALLOC_FAILED`.
+UWU_Username UWU_Username_copy(const UWU_Username *const src, UWU_Err err) {
+  UWU_Username copy = {};
+  copy.hash = src->hash;
+  copy.length = src->length;
+  copy.flags = UWU_USERNAME_OWNED;
+
+  UWU_String view = UWU_Username_view(src);
+  if (view.length <= UWU_USERNAME_INLINE_CAPACITY) {
+    copy.flags |= UWU_USERNAME_INLINE;
+    memcpy(copy.inline_data, view.data, view.length);
     return copy;
   }
 
-  copy.username = user_name_copy;
-  copy.status = src->status;
-  copy.last_action = src->last_action;
-  copy.conn = src->conn;
+  UWU_String heap_copy = UWU_String_copyPooled(&view, err);
+  if (heap_copy.data == NULL) {
+    err = MALLOC_FAILED;
+    copy.length = 0;
+    copy.flags |= UWU_USERNAME_INLINE;
+    return copy;
+  }
 
+  copy.data = heap_copy.data;
   return copy;
 }
 
-// Frees all resources associated with this user.
-//
-// This does not include the user itself!
-void UWU_User_free(UWU_User *ref) { UWU_String_freeWithMalloc(&ref->username); }
+// Frees the memory of an owned username.
+// Does nothing for borrowed or inline usernames.
+void UWU_Username_free(UWU_Username *username) {
+  if ((username->flags & UWU_USERNAME_OWNED) &&
+      !(username->flags & UWU_USERNAME_INLINE)) {
+    UWU_String view = UWU_Username_view(username);
+    UWU_String_freePooled(&view);
+  }
 
-// Represents a node inside the linked list.
-struct UWU_UserListNode {
-  // The linked list will always hold two nodes at the extremes.
-  // This nodes are the sentinels nodes, all other nodes should NOT BE sentinels
-  // nodes.
-  UWU_Bool is_sentinel;
-  // The data the node is holding.
-  UWU_User data;
-  // The previous node in the list.
-  struct UWU_UserListNode *previous;
-  // The next node in the list.
-  struct UWU_UserListNode *next;
-};
+  username->length = 0;
+  username->flags |= UWU_USERNAME_INLINE;
+}
 
-// Creates a new `UWU_UserListNode` with `data`.
+// Compares a username with a string, `hash` must be `UWU_String_hash(str)`.
+// Compute the hash once when comparing the same string with many usernames.
+UWU_Bool UWU_Username_equalString(const UWU_Username *const username,
+                                  const UWU_String *const str, uint32_t hash) {
+  if (username->hash != hash || username->length != str->length) {
+    return FALSE;
+  }
+
+  UWU_String view = UWU_Username_view(username);
+  return 0 == memcmp(view.data, str->data, str->length);
+}
+
+UWU_Bool UWU_Username_equal(const UWU_Username *const a,
+                            const UWU_Username *const b) {
+  UWU_String b_view = UWU_Username_view(b);
+  return UWU_Username_equalString(a, &b_view, b->hash);
+}
+
+/* *****************************************************************************
+Flat Map
+***************************************************************************** */
+
+// A hash map from `UWU_String` keys to pointers, inspired by Swiss tables.
 //
-// Both `next` and `previous` pointers are set to `NULL`.
-// It does not own data.
-struct UWU_UserListNode UWU_UserListNode_newWithValue(UWU_User data) {
-  struct UWU_UserListNode node = {
-      .is_sentinel = FALSE,
-      .data = data,
-      .previous = NULL,
-      .next = NULL,
-  };
+// Every slot has a control byte: `UWU_FLATMAP_EMPTY` or the top 7 bits of the
+// key hash. Lookups compare a whole group of control bytes against the hash
+// at once (16 with SSE2, 32 with AVX2), so most misses and hits only touch a
+// single cache line of control bytes before looking at any key.
+//
+// Collisions use linear probing and deleting shifts the following entries
+// back, so the table never has tombstones and never needs to be cleaned.
+//
+// Growing doesn't rehash everything at once. A bigger table is allocated and
+// every write moves at most `UWU_FLATMAP_MIGRATE_SLOTS` slots of the old table
+// into it, so no single operation pays for the whole resize. Meanwhile lookups
+// check both tables.
+//
+// The map DOES NOT OWN the keys, they must live as long as the entry. Usually
+// the key is a field of the value.
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define UWU_FLATMAP_GROUP_WIDTH 32
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define UWU_FLATMAP_GROUP_WIDTH 16
+#else
+#define UWU_FLATMAP_GROUP_WIDTH 16
+#endif
+
+static const uint8_t UWU_FLATMAP_EMPTY = 0x80;
+// Marks the slots of the old table that were already migrated or removed.
+// Lookups on the old table probe past them.
+static const uint8_t UWU_FLATMAP_MOVED = 0xFE;
+// The map grows when more than 7/8 of the slots are full.
+static const size_t UWU_FLATMAP_MAX_LOAD_NUM = 7;
+static const size_t UWU_FLATMAP_MAX_LOAD_DEN = 8;
+// Slots of the old table migrated by every write while growing. The new table
+// doubles the capacity, so any value above 1 finishes migrating before the new
+// table fills up.
+static const size_t UWU_FLATMAP_MIGRATE_SLOTS = 64;
 
-  return node;
+typedef struct {
+  UWU_String key;
+  void *value;
+  // The mixed hash of the key, saved so growing and deleting don't rehash.
+  uint32_t hash;
+} UWU_FlatMapSlot;
+
+typedef struct {
+  // One control byte per slot plus a copy of the first
+  // `UWU_FLATMAP_GROUP_WIDTH` bytes at the end, so a group can be loaded
+  // starting from any slot.
+  uint8_t *ctrl;
+  UWU_FlatMapSlot *slots;
+  // Always a power of 2, 0 if the table isn't allocated.
+  size_t capacity;
+  size_t count;
+} UWU_FlatMapTable;
+
+// A table that stopped being part of the map but may still be read.
+typedef struct UWU_FlatMapRetired {
+  struct UWU_FlatMapRetired *next;
+  UWU_FlatMapTable table;
+} UWU_FlatMapRetired;
+
+typedef struct {
+  // New entries always go here.
+  UWU_FlatMapTable table;
+  // The table being migrated while the map grows, empty otherwise.
+  UWU_FlatMapTable old;
+  // Slots of `old` already migrated.
+  size_t migrated;
+  // Entries on both tables.
+  size_t count;
+  // When TRUE, the old table isn't freed once migrated. It's kept on `retired`
+  // until `UWU_FlatMap_freeRetired` is called, so readers that don't hold the
+  // map lock never probe freed memory.
+  UWU_Bool retire_tables;
+  UWU_FlatMapRetired *retired;
+} UWU_FlatMap;
+
+// Bitmask of the bytes inside a group, bit `i` is set if the byte `i` matched.
+typedef uint32_t UWU_FlatMapMask;
+
+// Finalizer of MurmurHash3, spreads the bits of a weak hash.
+uint32_t UWU_FlatMap_mix(uint32_t hash) {
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6bu;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35u;
+  hash ^= hash >> 16;
+  return hash;
 }
 
-// Creates a copy from `other` and allocates it on the heap.
-struct UWU_UserListNode *UWU_UserListNode_copy(struct UWU_UserListNode *other,
-                                               UWU_Err err) {
-  struct UWU_UserListNode *copy =
-      (struct UWU_UserListNode *)malloc(sizeof(struct UWU_UserListNode));
-  if (copy == NULL) {
-    err = MALLOC_FAILED;
-    return NULL;
+// The control byte for a hash, the top 7 bits.
+uint8_t UWU_FlatMap_h2(uint32_t hash) { return (uint8_t)(hash >> 25); }
+
+// Returns the bytes of the group starting at `ctrl` equal to `byte`.
+UWU_FlatMapMask UWU_FlatMap_match(const uint8_t *ctrl, uint8_t byte) {
+#if defined(__AVX2__)
+  __m256i group = _mm256_loadu_si256((const __m256i *)ctrl);
+  return (UWU_FlatMapMask)_mm256_movemask_epi8(
+      _mm256_cmpeq_epi8(group, _mm256_set1_epi8((char)byte)));
+#elif defined(__SSE2__)
+  __m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+  return (UWU_FlatMapMask)_mm_movemask_epi8(
+      _mm_cmpeq_epi8(group, _mm_set1_epi8((char)byte)));
+#else
+  UWU_FlatMapMask mask = 0;
+  for (size_t i = 0; i < UWU_FLATMAP_GROUP_WIDTH; i++) {
+    mask |= (UWU_FlatMapMask)(ctrl[i] == byte) << i;
   }
+  return mask;
+#endif
+}
 
-  UWU_User data_copy = UWU_User_copyFrom(&other->data, err);
-  if (err != NO_ERROR) {
-    err = MALLOC_FAILED;
-    return NULL;
+// Sets the control byte of a slot, keeping the mirrored bytes up to date.
+void UWU_FlatMap_setCtrl(UWU_FlatMapTable *table, size_t idx, uint8_t byte) {
+  table->ctrl[idx] = byte;
+  if (idx < UWU_FLATMAP_GROUP_WIDTH) {
+    table->ctrl[table->capacity + idx] = byte;
   }
+}
 
-  copy->data = data_copy;
-  copy->previous = other->previous;
-  copy->next = other->next;
-  copy->is_sentinel = other->is_sentinel;
+// Allocates an empty table with `slots` slots, a power of 2.
+// Returns a table with 0 capacity if the allocation failed.
+UWU_FlatMapTable UWU_FlatMapTable_alloc(size_t slots) {
+  UWU_FlatMapTable table = {};
+  table.ctrl = (uint8_t *)malloc(slots + UWU_FLATMAP_GROUP_WIDTH);
+  // Zeroed so readers that race with a writer never see garbage keys.
+  table.slots = (UWU_FlatMapSlot *)calloc(slots, sizeof(UWU_FlatMapSlot));
+  if (table.ctrl == NULL || table.slots == NULL) {
+    free(table.ctrl);
+    free(table.slots);
+    UWU_FlatMapTable empty = {};
+    return empty;
+  }
 
-  return copy;
+  memset(table.ctrl, UWU_FLATMAP_EMPTY, slots + UWU_FLATMAP_GROUP_WIDTH);
+  table.capacity = slots;
+  return table;
 }
 
-// Free all the resources associated with this node.
-void UWU_UserListNode_deinit(struct UWU_UserListNode *ref) {
-  UWU_User_free(&ref->data);
-
-  // Reset pointers...
-  ref->next = NULL;
-  ref->previous = NULL;
+void UWU_FlatMapTable_free(UWU_FlatMapTable *table) {
+  free(table->ctrl);
+  free(table->slots);
+  UWU_FlatMapTable empty = {};
+  *table = empty;
 }
 
-// Saves a list of users, the implementation is a linked list.
-// Appending items to the start and end are O(1) operations.
-// Since it's a collection, you can remove and add new users at any time.
+// Initializes a map that can hold at least `capacity` entries before growing.
 //
-// The list OWNS THE VALUES, so every addition is a copy, and every removal is a
-// free!
-typedef struct {
-  // A pointer to the start of the list
-  // By default is NULL.
-  struct UWU_UserListNode *start;
-  // A pointer to the end of the list
-  // By default is NULL.
-  struct UWU_UserListNode *end;
+// Success: Returns the new map.
+// Failure: Sets err equal to `MALLOC_FAILED`, `map.table.capacity` is 0.
+UWU_FlatMap UWU_FlatMap_init(size_t capacity, UWU_Err err) {
+  UWU_FlatMap map = {};
+
+  size_t slots = UWU_FLATMAP_GROUP_WIDTH;
+  while (slots * UWU_FLATMAP_MAX_LOAD_NUM / UWU_FLATMAP_MAX_LOAD_DEN <
+         capacity) {
+    slots *= 2;
+  }
 
-  // The length of this list!
-  // This value will be valid as long as items are only added using the methods
-  // from the `UWU_UserList` API
-  size_t length;
+  map.table = UWU_FlatMapTable_alloc(slots);
+  if (map.table.capacity == 0) {
+    err = MALLOC_FAILED;
+  }
+  return map;
+}
 
-  // If you need thread safety, lock/unlock this mutex before/after every
-  // operation!
-  pthread_mutex_t mx;
-} UWU_UserList;
+// Frees the tables retired by the map.
+void UWU_FlatMap_freeRetired(UWU_FlatMap *map) {
+  while (map->retired != NULL) {
+    UWU_FlatMapRetired *next = map->retired->next;
+    UWU_FlatMapTable_free(&map->retired->table);
+    free(map->retired);
+    map->retired = next;
+  }
+}
 
-// Attempts to find a user by it's name.
-// Returns a reference to the found user. NULL otherwise.
-UWU_User *UWU_UserList_findByName(UWU_UserList *list, UWU_String *name) {
-  for (struct UWU_UserListNode *current = list->start; current != NULL;
-       current = current->next) {
-    if (current->is_sentinel) {
-      continue;
+// Frees the memory of the map, it doesn't touch keys or values!
+void UWU_FlatMap_deinit(UWU_FlatMap *map) {
+  UWU_FlatMap_freeRetired(map);
+  UWU_FlatMapTable_free(&map->table);
+  UWU_FlatMapTable_free(&map->old);
+  UWU_FlatMap empty = {};
+  *map = empty;
+}
+
+// Finds the slot of `table` that holds `key`, on a table writers may be
+// changing meanwhile, check `UWU_StripedMap`.
+//
+// - hash: The mixed hash of the key.
+// - seq: The sequence counter writers make odd while they change the table,
+// NULL if nobody can. Every candidate key is copied and only compared if the
+// counter is still `expected`, a torn key may point past the end of its data.
+//
+// Returns the index of the slot or `table->capacity` if it's not there.
+// Returns `SIZE_MAX` if the counter changed, the table can't be trusted then.
+size_t UWU_FlatMap_findGuarded(const UWU_FlatMapTable *table,
+                               const UWU_String *key, uint32_t hash,
+                               const uint32_t *seq, uint32_t expected) {
+  if (table->capacity == 0) {
+    return 0;
+  }
+
+  size_t mask = table->capacity - 1;
+  uint8_t h2 = UWU_FlatMap_h2(hash);
+  size_t pos = hash & mask;
+
+  for (size_t probed = 0; probed < table->capacity;
+       probed += UWU_FLATMAP_GROUP_WIDTH) {
+    const uint8_t *group = &table->ctrl[pos];
+    UWU_FlatMapMask empty = UWU_FlatMap_match(group, UWU_FLATMAP_EMPTY);
+    UWU_FlatMapMask candidates = UWU_FlatMap_match(group, h2);
+    // Entries never live after an empty slot of their probe sequence.
+    if (empty != 0) {
+      candidates &= (empty & -empty) - 1;
+    }
+
+    while (candidates != 0) {
+      size_t idx = (pos + __builtin_ctz(candidates)) & mask;
+      const UWU_FlatMapSlot *slot = &table->slots[idx];
+      uint32_t slot_hash = slot->hash;
+      UWU_String slot_key = slot->key;
+      if (seq != NULL) {
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(seq, __ATOMIC_RELAXED) != expected) {
+          return SIZE_MAX;
+        }
+      }
+      if (slot_hash == hash && UWU_String_equal(&slot_key, key)) {
+        return idx;
+      }
+      candidates &= candidates - 1;
     }
 
-    if (UWU_String_equal(&current->data.username, name)) {
-      return &current->data;
+    if (empty != 0) {
+      break;
     }
+    pos = (pos + UWU_FLATMAP_GROUP_WIDTH) & mask;
   }
 
-  return NULL;
+  return table->capacity;
 }
 
-// Tries to update the first user it finds with the given username.
-// Returns true if it found a user to update. False otherwise.
-UWU_Bool UWU_UserList_updateUserByName(UWU_UserList *list, UWU_String *name,
-                                       UWU_User new_data) {
-  for (struct UWU_UserListNode *current = list->start; current != NULL;
-       current = current->next) {
-    if (current->is_sentinel) {
-      continue;
-    }
+// Finds the slot of `table` that holds `key`.
+//
+// - hash: The mixed hash of the key.
+//
+// Returns the index of the slot or `table->capacity` if it's not there.
+size_t UWU_FlatMap_find(const UWU_FlatMapTable *table, const UWU_String *key,
+                        uint32_t hash) {
+  return UWU_FlatMap_findGuarded(table, key, hash, NULL, 0);
+}
 
-    if (!UWU_String_equal(&current->data.username, name)) {
-      continue;
-    }
+// Finds the slot that holds `key` on any of the tables of the map.
+//
+// - hash: The mixed hash of the key.
+//
+// Returns the slot or NULL if the key is not in the map. `table` is set to the
+// table that holds it.
+UWU_FlatMapSlot *UWU_FlatMap_findSlot(const UWU_FlatMap *map,
+                                      const UWU_String *key, uint32_t hash,
+                                      const UWU_FlatMapTable **table) {
+  size_t idx = UWU_FlatMap_find(&map->table, key, hash);
+  if (idx < map->table.capacity) {
+    *table = &map->table;
+    return &map->table.slots[idx];
+  }
 
-    current->data = new_data;
-    return TRUE;
+  idx = UWU_FlatMap_find(&map->old, key, hash);
+  if (idx < map->old.capacity) {
+    *table = &map->old;
+    return &map->old.slots[idx];
   }
 
-  return FALSE;
+  return NULL;
 }
 
-UWU_UserList UWU_UserList_init(UWU_Err err) {
-  UWU_String sentinel_name = {
-      .data = "<sentinel>",
-      .length = strlen("<sentinel>"),
-  };
-  UWU_User def_user = {.username = sentinel_name, .status = DISCONNETED};
-  struct UWU_UserListNode start_node = UWU_UserListNode_newWithValue(def_user);
-  struct UWU_UserListNode *start_copy = UWU_UserListNode_copy(&start_node, err);
-  start_copy->is_sentinel = TRUE;
+// Gets the value associated with `key`, NULL if it's not in the map.
+//
+// - hash: `UWU_String_hash(key)`, useful when the hash is already known, for
+// example from a `UWU_Username`.
+void *UWU_FlatMap_getHashed(const UWU_FlatMap *map, const UWU_String *key,
+                            uint32_t hash) {
+  const UWU_FlatMapTable *table = NULL;
+  UWU_FlatMapSlot *slot =
+      UWU_FlatMap_findSlot(map, key, UWU_FlatMap_mix(hash), &table);
+  if (slot == NULL) {
+    return NULL;
+  }
 
-  struct UWU_UserListNode end_node = UWU_UserListNode_newWithValue(def_user);
-  struct UWU_UserListNode *end_copy = UWU_UserListNode_copy(&end_node, err);
-  end_copy->is_sentinel = TRUE;
+  return slot->value;
+}
 
-  // Setup references...
-  start_copy->next = end_copy;
-  end_copy->previous = start_copy;
+// Gets the value associated with `key`, NULL if it's not in the map.
+void *UWU_FlatMap_get(const UWU_FlatMap *map, const UWU_String *key) {
+  return UWU_FlatMap_getHashed(map, key, UWU_String_hash(key));
+}
 
-  UWU_UserList def_list = {.start = start_copy, .end = end_copy, .length = 0};
-  pthread_mutex_init(&def_list.mx, NULL);
-  return def_list;
+// Writes an entry that is not on the table yet on the first empty slot of its
+// probe sequence. The table must have at least one empty slot!
+void UWU_FlatMap_insertUnique(UWU_FlatMapTable *table,
+                              const UWU_FlatMapSlot *entry) {
+  size_t mask = table->capacity - 1;
+  size_t pos = entry->hash & mask;
+
+  for (;;) {
+    UWU_FlatMapMask empty =
+        UWU_FlatMap_match(&table->ctrl[pos], UWU_FLATMAP_EMPTY);
+    if (empty != 0) {
+      size_t idx = (pos + __builtin_ctz(empty)) & mask;
+      table->slots[idx] = *entry;
+      UWU_FlatMap_setCtrl(table, idx, UWU_FlatMap_h2(entry->hash));
+      table->count++;
+      return;
+    }
+    pos = (pos + UWU_FLATMAP_GROUP_WIDTH) & mask;
+  }
 }
 
-// Destroys all pointers and frees all memory of all nodes.
-void UWU_UserList_deinit(UWU_UserList *list) {
-  struct UWU_UserListNode *current = list->start;
+// Moves up to `slots` slots of the old table into the new one.
+// Frees the old table once it's empty.
+void UWU_FlatMap_migrate(UWU_FlatMap *map, size_t slots) {
+  UWU_FlatMapTable *old = &map->old;
+  for (size_t i = 0; i < slots && old->count > 0; i++, map->migrated++) {
+    uint8_t ctrl = old->ctrl[map->migrated];
+    if (ctrl == UWU_FLATMAP_EMPTY || ctrl == UWU_FLATMAP_MOVED) {
+      continue;
+    }
 
-  while (current != NULL) {
-    struct UWU_UserListNode *tmp = current;
-    current = current->next;
-    UWU_UserListNode_deinit(tmp);
+    UWU_FlatMap_insertUnique(&map->table, &old->slots[map->migrated]);
+    // Entries after this one may still be probed through this slot.
+    UWU_FlatMap_setCtrl(old, map->migrated, UWU_FLATMAP_MOVED);
+    old->count--;
   }
 
-  free(list->end);
-  free(list->start);
-  pthread_mutex_destroy(&list->mx);
+  if (old->capacity != 0 && old->count == 0) {
+    if (map->retire_tables) {
+      UWU_FlatMapRetired *retired =
+          (UWU_FlatMapRetired *)malloc(sizeof(UWU_FlatMapRetired));
+      UWU_PanicIf(retired == NULL, "Fatal: Can't retire a flat map table!");
+      retired->table = *old;
+      retired->next = map->retired;
+      map->retired = retired;
+      UWU_FlatMapTable empty = {};
+      *old = empty;
+    } else {
+      UWU_FlatMapTable_free(old);
+    }
+    map->migrated = 0;
+  }
 }
 
-// Inserts a specified node to the start of the list.
-// Remember, the list owns the values so this will create a copy of `*node`
-// and therefore it can fail!
-void UWU_UserList_insertStart(UWU_UserList *list, struct UWU_UserListNode *node,
-                              UWU_Err err) {
-  struct UWU_UserListNode *copy = UWU_UserListNode_copy(node, err);
-  if (err != NO_ERROR) {
-    return;
+// Starts moving the map to a table with double the capacity. If the previous
+// growth didn't finish yet it's completed first.
+// Returns FALSE if the new table couldn't be allocated.
+UWU_Bool UWU_FlatMap_grow(UWU_FlatMap *map) {
+  UWU_FlatMap_migrate(map, map->old.capacity);
+
+  UWU_FlatMapTable bigger = UWU_FlatMapTable_alloc(map->table.capacity * 2);
+  if (bigger.capacity == 0) {
+    return FALSE;
   }
 
-  struct UWU_UserListNode *second_node = list->start->next;
+  map->old = map->table;
+  map->table = bigger;
+  map->migrated = 0;
+  return TRUE;
+}
 
-  // Update already existing nodes...
-  second_node->previous = copy;
-  list->start->next = copy;
+// Associates `value` with `key`, replacing the previous value if any.
+//
+// - hash: `UWU_String_hash(key)`.
+//
+// Success: Returns TRUE.
+// Failure: Returns FALSE and sets err equal to `MALLOC_FAILED` if the map
+// needed to grow and couldn't.
+UWU_Bool UWU_FlatMap_putHashed(UWU_FlatMap *map, const UWU_String *key,
+                               uint32_t hash, void *value, UWU_Err err) {
+  uint32_t mixed = UWU_FlatMap_mix(hash);
+  const UWU_FlatMapTable *table = NULL;
+  UWU_FlatMapSlot *slot = UWU_FlatMap_findSlot(map, key, mixed, &table);
+  if (slot != NULL) {
+    slot->key = *key;
+    slot->value = value;
+    return TRUE;
+  }
 
-  // Update copy node...
-  copy->previous = list->start;
-  copy->next = second_node;
+  if ((map->count + 1) * UWU_FLATMAP_MAX_LOAD_DEN >
+          map->table.capacity * UWU_FLATMAP_MAX_LOAD_NUM &&
+      !UWU_FlatMap_grow(map)) {
+    err = MALLOC_FAILED;
+    return FALSE;
+  }
 
-  list->length += 1;
+  UWU_FlatMapSlot entry = {.key = *key, .value = value, .hash = mixed};
+  UWU_FlatMap_insertUnique(&map->table, &entry);
+  map->count++;
+  UWU_FlatMap_migrate(map, UWU_FLATMAP_MIGRATE_SLOTS);
+  return TRUE;
 }
 
-// Inserts a specified node to the end of the list.
-// Remember, the list owns the values so this will create a copy of `*node`
-// and therefore it can fail!
-void UWU_UserList_insertEnd(UWU_UserList *list, struct UWU_UserListNode *node,
-                            UWU_Err err) {
+// Associates `value` with `key`, replacing the previous value if any.
+// Check `UWU_FlatMap_putHashed` for the return value.
+UWU_Bool UWU_FlatMap_put(UWU_FlatMap *map, const UWU_String *key, void *value,
+                         UWU_Err err) {
+  return UWU_FlatMap_putHashed(map, key, UWU_String_hash(key), value, err);
+}
 
-  struct UWU_UserListNode *copy = UWU_UserListNode_copy(node, err);
-  if (err != NO_ERROR) {
-    return;
+// Empties the slot `idx` of the new table and moves back the entries after it
+// that belong before it, so lookups never find a hole in their probe sequence.
+void UWU_FlatMap_removeAt(UWU_FlatMapTable *table, size_t idx) {
+  size_t mask = table->capacity - 1;
+  size_t hole = idx;
+
+  for (size_t next = (hole + 1) & mask; table->ctrl[next] != UWU_FLATMAP_EMPTY;
+       next = (next + 1) & mask) {
+    size_t home = table->slots[next].hash & mask;
+    // The entry can move to the hole if the hole isn't before its home.
+    if (((hole - home) & mask) < ((next - home) & mask)) {
+      table->slots[hole] = table->slots[next];
+      UWU_FlatMap_setCtrl(table, hole, table->ctrl[next]);
+      hole = next;
+    }
   }
 
-  struct UWU_UserListNode *ante_node = list->end->previous;
+  UWU_FlatMap_setCtrl(table, hole, UWU_FLATMAP_EMPTY);
+  table->count--;
+}
 
-  // Update already existing nodes...
-  ante_node->next = copy;
-  list->end->previous = copy;
+// Removes `key` from the map.
+// Returns the value it had, NULL if the key wasn't on the map.
+void *UWU_FlatMap_removeHashed(UWU_FlatMap *map, const UWU_String *key,
+                               uint32_t hash) {
+  const UWU_FlatMapTable *table = NULL;
+  UWU_FlatMapSlot *slot =
+      UWU_FlatMap_findSlot(map, key, UWU_FlatMap_mix(hash), &table);
+  if (slot == NULL) {
+    return NULL;
+  }
 
-  // Update copy node...
-  copy->previous = ante_node;
-  copy->next = list->end;
+  void *value = slot->value;
+  size_t idx = slot - table->slots;
+  if (table == &map->table) {
+    UWU_FlatMap_removeAt(&map->table, idx);
+  } else {
+    // The old table is only read until it's freed, a marker is enough.
+    UWU_FlatMap_setCtrl(&map->old, idx, UWU_FLATMAP_MOVED);
+    map->old.count--;
+  }
+  map->count--;
 
-  list->length += 1;
+  UWU_FlatMap_migrate(map, UWU_FLATMAP_MIGRATE_SLOTS);
+  return value;
 }
 
-// Tries to remove a user by it's username, if the username is not found then
-// it simply does nothing.
-//
-// REMEMBER!! This frees the associated memory of the removed node.
-void UWU_UserList_removeByUsernameIfExists(UWU_UserList *list,
-                                           UWU_String *username) {
+// Removes `key` from the map.
+// Returns the value it had, NULL if the key wasn't on the map.
+void *UWU_FlatMap_remove(UWU_FlatMap *map, const UWU_String *key) {
+  return UWU_FlatMap_removeHashed(map, key, UWU_String_hash(key));
+}
 
-  for (struct UWU_UserListNode *current = list->start; current != NULL;
-       current = current->next) {
-    if (current->is_sentinel) {
+// Decides if an entry should be removed by `UWU_FlatMap_removeIf`.
+// The predicate may free the value if it returns TRUE.
+typedef UWU_Bool (*UWU_FlatMap_Predicate)(void *context, UWU_String key,
+                                          void *value);
+
+// Removes all the entries for which `predicate` returns TRUE.
+// Returns the number of entries removed.
+size_t UWU_FlatMap_removeIf(UWU_FlatMap *map, UWU_FlatMap_Predicate predicate,
+                            void *context) {
+  // This already visits every entry, finishing the migration costs the same.
+  UWU_FlatMap_migrate(map, map->old.capacity);
+
+  UWU_FlatMapTable *table = &map->table;
+  size_t removed = 0;
+  for (size_t i = 0; i < table->capacity;) {
+    if (table->ctrl[i] == UWU_FLATMAP_EMPTY ||
+        !predicate(context, table->slots[i].key, table->slots[i].value)) {
+      i++;
       continue;
     }
 
-    UWU_String current_username = current->data.username;
-
-    if (UWU_String_equal(username, &current_username)) {
-      struct UWU_UserListNode *previous = current->previous;
-      struct UWU_UserListNode *next = (current->next);
+    // Removing may shift an unchecked entry into this slot, so check it again.
+    UWU_FlatMap_removeAt(table, i);
+    map->count--;
+    removed++;
+  }
 
-      // Update references from list...
-      previous->next = current->next;
-      next->previous = current->previous;
+  return removed;
+}
 
-      UWU_UserListNode_deinit(current);
-      free(current); // The node is always on the heap thanks to
-                     // `UWU_UserListNode_copy`!
-      list->length -= 1;
-      current = previous;
+// Called by `UWU_FlatMap_forEach` with every entry.
+typedef void (*UWU_FlatMap_Visitor)(void *context, UWU_String key,
+                                    void *value);
+
+// Calls `visitor` with every entry, in no particular order. The visitor MUST
+// NOT change the map.
+void UWU_FlatMap_forEach(UWU_FlatMap *map, UWU_FlatMap_Visitor visitor,
+                         void *context) {
+  // Entries still on the old table haven't been moved yet.
+  UWU_FlatMapTable *tables[] = {&map->old, &map->table};
+  for (size_t t = 0; t < 2; t++) {
+    for (size_t i = 0; i < tables[t]->capacity; i++) {
+      uint8_t ctrl = tables[t]->ctrl[i];
+      if (ctrl != UWU_FLATMAP_EMPTY && ctrl != UWU_FLATMAP_MOVED) {
+        visitor(context, tables[t]->slots[i].key, tables[t]->slots[i].value);
+      }
     }
   }
 }
 
-// Represents a message on a given chat history.
+/* *****************************************************************************
+Striped Map
+***************************************************************************** */
+
+// A `UWU_FlatMap` split into `UWU_STRIPED_MAP_STRIPES` independent stripes, each
+// one with its own lock. The stripe of a key is picked from its hash, so
+// writers of different keys rarely wait on each other.
 //
-// The ChatEntry should own it's memory! So it should receive a copy of
-// `content` and `origin_username`.
+// Lookups don't take any lock. Every stripe has a sequence counter that
+// writers make odd while they change the map, a reader probes a copy of the
+// map and only trusts the result if the counter didn't change meanwhile. After
+// `UWU_STRIPED_MAP_READ_ATTEMPTS` failed attempts it falls back to the lock.
+//
+// While lock-free readers are inside a stripe, removed values and old tables
+// aren't freed, they're kept until a writer finds the stripe without readers.
+// So a value returned by `UWU_StripedMap_get` stays valid until it's removed
+// and the stripe is written again.
+#define UWU_STRIPED_MAP_STRIPES 16
+static const size_t UWU_STRIPED_MAP_READ_ATTEMPTS = 4;
+
+// Frees a value once no reader can reach it.
+typedef void (*UWU_StripedMap_FreeValue)(void *value);
+
+// Every stripe lives on its own cache lines so writers of different stripes
+// don't invalidate each other.
 typedef struct {
-  // The content of the message.
-  UWU_String content;
-  // The username of the person sending the message.
-  UWU_String origin_username;
-} UWU_ChatEntry;
+  pthread_mutex_t mx;
+  // Even while nobody writes, odd while a writer changes the map.
+  uint32_t seq;
+  // Lock-free readers currently probing this stripe.
+  uint32_t readers;
+  UWU_FlatMap map;
+  // Values removed while readers were inside the stripe.
+  void **retired_values;
+  size_t retired_count;
+  size_t retired_capacity;
+
+  // Contention counters, ALWAYS read and update them with `__atomic` builtins.
+  // Times the lock was taken.
+  uint64_t locks;
+  // Times the lock was already held by another thread.
+  uint64_t contended;
+  // Lock-free lookups that had to retry because of a writer.
+  uint64_t read_retries;
+  // Lookups that gave up and took the lock.
+  uint64_t read_fallbacks;
+} __attribute__((aligned(64))) UWU_MapStripe;
 
-UWU_ChatEntry UWU_ChatEntry_copy(UWU_ChatEntry *src, UWU_Err err) {
-  UWU_ChatEntry def = {};
+typedef struct {
+  UWU_MapStripe stripes[UWU_STRIPED_MAP_STRIPES];
+  UWU_StripedMap_FreeValue free_value;
+} UWU_StripedMap;
 
-  UWU_String content_copy = UWU_String_copy(&src->content, err);
-  if (err != NO_ERROR) {
-    return def;
-  }
-  UWU_String username_copy = UWU_String_copy(&src->origin_username, err);
-  if (err != NO_ERROR) {
-    return def;
+// Initializes a map that can hold around `capacity` entries before growing.
+//
+// - free_value: Frees the removed values, may be NULL.
+//
+// Success: Returns the new map.
+// Failure: Sets err equal to `MALLOC_FAILED`, `map.stripes[0].map` has no
+// table.
+UWU_StripedMap UWU_StripedMap_init(size_t capacity,
+                                   UWU_StripedMap_FreeValue free_value,
+                                   UWU_Err err) {
+  UWU_StripedMap map = {};
+  map.free_value = free_value;
+
+  for (size_t i = 0; i < UWU_STRIPED_MAP_STRIPES; i++) {
+    UWU_MapStripe *stripe = &map.stripes[i];
+    stripe->map = UWU_FlatMap_init(capacity / UWU_STRIPED_MAP_STRIPES, err);
+    if (stripe->map.table.capacity == 0) {
+      for (size_t j = 0; j < i; j++) {
+        UWU_FlatMap_deinit(&map.stripes[j].map);
+      }
+      err = MALLOC_FAILED;
+      return map;
+    }
+    stripe->map.retire_tables = TRUE;
+    pthread_mutex_init(&stripe->mx, NULL);
   }
 
-  UWU_ChatEntry dest = {
-      .content = content_copy,
-      .origin_username = username_copy,
-  };
+  return map;
+}
 
-  return dest;
+// The stripe that holds the keys with hash `hash`.
+//
+// The bits below the control byte of the flat map are used, the low bits pick
+// the slot inside the stripe.
+UWU_MapStripe *UWU_StripedMap_stripe(UWU_StripedMap *map, uint32_t hash) {
+  uint32_t mixed = UWU_FlatMap_mix(hash);
+  return &map->stripes[(mixed >> 21) & (UWU_STRIPED_MAP_STRIPES - 1)];
 }
 
-void UWU_ChatEntry_free(UWU_ChatEntry *src) {
-  UWU_String_freeWithMalloc(&src->content);
-  UWU_String_freeWithMalloc(&src->origin_username);
+void UWU_MapStripe_lock(UWU_MapStripe *stripe) {
+  if (pthread_mutex_trylock(&stripe->mx) != 0) {
+    __atomic_fetch_add(&stripe->contended, 1, __ATOMIC_RELAXED);
+    UWU_PanicIf(pthread_mutex_lock(&stripe->mx) != 0,
+                "Fatal: Can't lock the map stripe mutex!");
+  }
+  __atomic_fetch_add(&stripe->locks, 1, __ATOMIC_RELAXED);
 }
-// Represents a message history of a certain chat
-//
-// Messages are stored on the `*messages` buffer. If the buffer is full the
-// oldest data is overridden.
-//
-// To iterate the data in order please obtain an iterator using:
-// `UWU_ChatHistory_iter()`
-typedef struct {
-  // A pointer to an array of `ChatEntry`.
-  UWU_ChatEntry *messages;
-  // The name of the channel that points to this history the server state
-  UWU_String channel_name;
-  // The number of chat messages filling the array.
-  size_t count;
-  // How much memory is left in the array of `ChatEntry`.
-  size_t capacity;
-  // The idx of the next message to insert in the array.
-  size_t next_idx;
-  // If you need thread safety lock/unlock this mutex before/after every
-  // operation!
-  pthread_mutex_t mx;
-} UWU_ChatHistory;
 
-// Creates a new ChatHistory with the specified capacity for messages.
-// It does not own the channel_name value.
-UWU_ChatHistory UWU_ChatHistory_init(size_t capacity, UWU_String channel_name,
-                                     UWU_Err err) {
-  UWU_ChatHistory ht = {};
+// Frees the retired tables and values if no reader is inside the stripe.
+// Must be called holding the stripe lock, outside a write.
+void UWU_MapStripe_reclaim(UWU_MapStripe *stripe,
+                           UWU_StripedMap_FreeValue free_value) {
+  if (stripe->map.retired == NULL && stripe->retired_count == 0) {
+    return;
+  }
 
-  ht.messages = (UWU_ChatEntry *)malloc(sizeof(UWU_ChatEntry[capacity]));
-  if (ht.messages == NULL) {
-    err = MALLOC_FAILED;
-    return ht;
+  // Pairs with the increment of `readers`: either the reader sees the retired
+  // items unlinked or we see the reader.
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&stripe->readers, __ATOMIC_ACQUIRE) != 0) {
+    return;
   }
 
-  ht.capacity = capacity;
-  ht.count = 0;
-  ht.next_idx = 0;
-  ht.channel_name = channel_name;
-  pthread_mutex_init(&ht.mx, NULL);
+  UWU_FlatMap_freeRetired(&stripe->map);
+  for (size_t i = 0; i < stripe->retired_count; i++) {
+    if (free_value != NULL) {
+      free_value(stripe->retired_values[i]);
+    }
+  }
+  stripe->retired_count = 0;
+}
 
-  return ht;
+void UWU_MapStripe_unlock(UWU_MapStripe *stripe) {
+  UWU_PanicIf(pthread_mutex_unlock(&stripe->mx) != 0,
+              "Fatal: Can't unlock the map stripe mutex!");
 }
 
-void UWU_ChatHistory_deinit(UWU_ChatHistory *ht) {
-  for (size_t i = 0; i < ht->count; i++) {
-    UWU_ChatEntry_free(&ht->messages[i]);
+// Marks the start of a change to the stripe, readers will retry.
+void UWU_MapStripe_writeBegin(UWU_MapStripe *stripe) {
+  __atomic_store_n(&stripe->seq, stripe->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void UWU_MapStripe_writeEnd(UWU_MapStripe *stripe) {
+  __atomic_store_n(&stripe->seq, stripe->seq + 1, __ATOMIC_RELEASE);
+}
+
+// Keeps `value` until no reader can reach it.
+void UWU_MapStripe_retireValue(UWU_MapStripe *stripe, void *value) {
+  if (stripe->retired_count == stripe->retired_capacity) {
+    size_t capacity =
+        stripe->retired_capacity == 0 ? 8 : stripe->retired_capacity * 2;
+    void **values =
+        (void **)realloc(stripe->retired_values, sizeof(void *) * capacity);
+    UWU_PanicIf(values == NULL, "Fatal: Can't retire a map value!");
+    stripe->retired_values = values;
+    stripe->retired_capacity = capacity;
   }
-  free(ht->messages);
-  UWU_String_freeWithMalloc(&ht->channel_name);
-  pthread_mutex_destroy(&ht->mx);
+  stripe->retired_values[stripe->retired_count++] = value;
 }
 
-// Adds a new entry to the ChatHistory.
+// Looks `key` up on `snapshot`, a copy of the map of `stripe` taken without
+// its lock while its sequence was `seq`.
 //
-// If the ChatHistory is already full then it wraps around and adds it to the
-// back.
-// It copies the entry given.
-void UWU_ChatHistory_addMessage(UWU_ChatHistory *hist, UWU_ChatEntry *entry) {
-  UWU_Err err = NO_ERROR;
-  size_t next_idx = hist->next_idx % hist->capacity;
-  UWU_ChatEntry clone = UWU_ChatEntry_copy(entry, err);
-  if (err != NO_ERROR) {
-    UWU_PANIC("Fatal: Failed to copy msg into chat history!");
-    return;
+// Success: Returns TRUE and sets `value`, NULL if the key isn't there.
+// Failure: Returns FALSE if a writer changed the stripe meanwhile.
+UWU_Bool UWU_MapStripe_tryGet(UWU_MapStripe *stripe,
+                              const UWU_FlatMap *snapshot,
+                              const UWU_String *key, uint32_t hash,
+                              uint32_t seq, void **value) {
+  uint32_t mixed = UWU_FlatMap_mix(hash);
+  const UWU_FlatMapTable *tables[] = {&snapshot->table, &snapshot->old};
+  *value = NULL;
+  for (size_t t = 0; t < 2; t++) {
+    size_t idx =
+        UWU_FlatMap_findGuarded(tables[t], key, mixed, &stripe->seq, seq);
+    if (idx == SIZE_MAX) {
+      return FALSE;
+    }
+    if (idx < tables[t]->capacity) {
+      *value = tables[t]->slots[idx].value;
+      break;
+    }
   }
 
-  hist->messages[next_idx] = clone;
-
-  hist->count += 1;
-  hist->next_idx += 1;
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&stripe->seq, __ATOMIC_RELAXED) == seq;
 }
 
-// Clears all messages in the given ChatHistory.
-// Frees each ChatEntry and resets the internal state.
-void UWU_ChatHistory_clear(UWU_ChatHistory *hist) {
-  if (hist == NULL || hist->messages == NULL)
-    return;
+// Looks `key` up on its stripe. If `pin` is TRUE the caller stays counted as
+// a reader of the stripe when it returns.
+void *UWU_MapStripe_lookup(UWU_MapStripe *stripe, const UWU_String *key,
+                           uint32_t hash, UWU_Bool pin) {
+  __atomic_fetch_add(&stripe->readers, 1, __ATOMIC_SEQ_CST);
+
+  for (size_t i = 0; i < UWU_STRIPED_MAP_READ_ATTEMPTS; i++) {
+    uint32_t seq = __atomic_load_n(&stripe->seq, __ATOMIC_ACQUIRE);
+    if (seq % 2 == 0) {
+      // The copy may be torn, but then the sequence changed and it's thrown
+      // away. Its tables can't be freed while we're counted as a reader.
+      UWU_FlatMap snapshot = stripe->map;
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      void *value = NULL;
+      if (__atomic_load_n(&stripe->seq, __ATOMIC_RELAXED) == seq) {
+        if (UWU_MapStripe_tryGet(stripe, &snapshot, key, hash, seq, &value)) {
+          if (!pin) {
+            __atomic_fetch_sub(&stripe->readers, 1, __ATOMIC_RELEASE);
+          }
+          return value;
+        }
+      }
+    }
+    __atomic_fetch_add(&stripe->read_retries, 1, __ATOMIC_RELAXED);
+  }
 
-  for (size_t i = 0; i < hist->count; i++) {
-    UWU_ChatEntry_free(&hist->messages[i]);
+  // A pinned reader stays counted, so what it finds under the lock can't be
+  // freed until it unpins.
+  if (!pin) {
+    __atomic_fetch_sub(&stripe->readers, 1, __ATOMIC_RELEASE);
   }
+  __atomic_fetch_add(&stripe->read_fallbacks, 1, __ATOMIC_RELAXED);
 
-  hist->count = 0;
-  hist->next_idx = 0;
+  UWU_MapStripe_lock(stripe);
+  void *value = UWU_FlatMap_getHashed(&stripe->map, key, hash);
+  UWU_MapStripe_unlock(stripe);
+  return value;
 }
 
-// Gives limits for iterating over a `UWU_ChatHistory` in insertion order.
-// `start` and `end` ARE NOT indexes! Make sure to apply the % operator
-// because they can grow far beyond what the collection could hold!
-typedef struct {
+// Gets the value associated with `key`, NULL if it's not in the map.
+// Doesn't take any lock unless writers keep changing the stripe.
+//
+// - hash: `UWU_String_hash(key)`.
+void *UWU_StripedMap_getHashed(UWU_StripedMap *map, const UWU_String *key,
+                               uint32_t hash) {
+  return UWU_MapStripe_lookup(UWU_StripedMap_stripe(map, hash), key, hash,
+                              FALSE);
+}
+
+// Gets the value associated with `key`, NULL if it's not in the map.
+void *UWU_StripedMap_get(UWU_StripedMap *map, const UWU_String *key) {
+  return UWU_StripedMap_getHashed(map, key, UWU_String_hash(key));
+}
+
+// Same as `UWU_StripedMap_get`, but the value isn't freed even if it's removed
+// until `UWU_StripedMap_unpin` is called with `*stripe`. ALWAYS unpin it, even
+// if the value is NULL, and don't keep it pinned for long: nothing removed
+// from the stripe is freed meanwhile.
+void *UWU_StripedMap_getPinned(UWU_StripedMap *map, const UWU_String *key,
+                               UWU_MapStripe **stripe) {
+  uint32_t hash = UWU_String_hash(key);
+  *stripe = UWU_StripedMap_stripe(map, hash);
+  return UWU_MapStripe_lookup(*stripe, key, hash, TRUE);
+}
+
+// Lets the values removed from `stripe` be freed again.
+void UWU_StripedMap_unpin(UWU_MapStripe *stripe) {
+  __atomic_fetch_sub(&stripe->readers, 1, __ATOMIC_RELEASE);
+}
+
+// Associates `value` with `key`. The key MUST NOT be on the map already, since
+// readers may still be using the previous value.
+//
+// Success: Returns TRUE.
+// Failure: Returns FALSE and sets err equal to `MALLOC_FAILED`.
+UWU_Bool UWU_StripedMap_put(UWU_StripedMap *map, const UWU_String *key,
+                            void *value, UWU_Err err) {
+  uint32_t hash = UWU_String_hash(key);
+  UWU_MapStripe *stripe = UWU_StripedMap_stripe(map, hash);
+
+  UWU_MapStripe_lock(stripe);
+  UWU_MapStripe_writeBegin(stripe);
+  UWU_Bool ok = UWU_FlatMap_putHashed(&stripe->map, key, hash, value, err);
+  UWU_MapStripe_writeEnd(stripe);
+  UWU_MapStripe_reclaim(stripe, map->free_value);
+  UWU_MapStripe_unlock(stripe);
+
+  return ok;
+}
+
+// Associates `value` with `key` unless the key is already on the map. Use it
+// when several threads may create the value at the same time.
+//
+// Success: Returns the value on the map, if it's not `value` the caller still
+// owns `value`.
+// Failure: Returns NULL and sets err equal to `MALLOC_FAILED`.
+void *UWU_StripedMap_putIfAbsent(UWU_StripedMap *map, const UWU_String *key,
+                                 void *value, UWU_Err err) {
+  uint32_t hash = UWU_String_hash(key);
+  UWU_MapStripe *stripe = UWU_StripedMap_stripe(map, hash);
+
+  UWU_MapStripe_lock(stripe);
+  void *current = UWU_FlatMap_getHashed(&stripe->map, key, hash);
+  if (current == NULL) {
+    UWU_MapStripe_writeBegin(stripe);
+    if (UWU_FlatMap_putHashed(&stripe->map, key, hash, value, err)) {
+      current = value;
+    }
+    UWU_MapStripe_writeEnd(stripe);
+    UWU_MapStripe_reclaim(stripe, map->free_value);
+  }
+  UWU_MapStripe_unlock(stripe);
+
+  return current;
+}
+
+typedef struct {
+  UWU_MapStripe *stripe;
+  UWU_FlatMap_Predicate predicate;
+  void *context;
+} UWU_StripedMapRemoveContext;
+
+// Retires the values removed by `UWU_StripedMap_removeIf`.
+UWU_Bool UWU_StripedMap_retireIf(void *context, UWU_String key, void *value) {
+  UWU_StripedMapRemoveContext *ctx = (UWU_StripedMapRemoveContext *)context;
+  if (!ctx->predicate(ctx->context, key, value)) {
+    return FALSE;
+  }
+
+  UWU_MapStripe_retireValue(ctx->stripe, value);
+  return TRUE;
+}
+
+// Removes all the entries for which `predicate` returns TRUE, their values are
+// freed with `map->free_value` once no reader can reach them. The predicate
+// MUST NOT free the value itself!
+//
+// Returns the number of entries removed.
+size_t UWU_StripedMap_removeIf(UWU_StripedMap *map,
+                               UWU_FlatMap_Predicate predicate,
+                               void *context) {
+  size_t removed = 0;
+  for (size_t i = 0; i < UWU_STRIPED_MAP_STRIPES; i++) {
+    UWU_MapStripe *stripe = &map->stripes[i];
+    UWU_StripedMapRemoveContext ctx = {
+        .stripe = stripe,
+        .predicate = predicate,
+        .context = context,
+    };
+
+    UWU_MapStripe_lock(stripe);
+    UWU_MapStripe_writeBegin(stripe);
+    removed += UWU_FlatMap_removeIf(&stripe->map, UWU_StripedMap_retireIf, &ctx);
+    UWU_MapStripe_writeEnd(stripe);
+    UWU_MapStripe_reclaim(stripe, map->free_value);
+    UWU_MapStripe_unlock(stripe);
+  }
+
+  return removed;
+}
+
+// Calls `visitor` with every entry while holding the lock of its stripe, so
+// the values can't be removed meanwhile. The visitor MUST NOT change the map!
+void UWU_StripedMap_forEach(UWU_StripedMap *map, UWU_FlatMap_Visitor visitor,
+                            void *context) {
+  for (size_t i = 0; i < UWU_STRIPED_MAP_STRIPES; i++) {
+    UWU_MapStripe *stripe = &map->stripes[i];
+    UWU_MapStripe_lock(stripe);
+    UWU_FlatMap_forEach(&stripe->map, visitor, context);
+    UWU_MapStripe_unlock(stripe);
+  }
+}
+
+// Returns TRUE for every entry.
+UWU_Bool UWU_StripedMap_all(void *context, UWU_String key, void *value) {
+  return TRUE;
+}
+
+// Removes the entry of `key`, its value is freed with `map->free_value` once
+// no reader can reach it.
+//
+// Returns TRUE if the key was on the map.
+UWU_Bool UWU_StripedMap_remove(UWU_StripedMap *map, const UWU_String *key) {
+  uint32_t hash = UWU_String_hash(key);
+  UWU_MapStripe *stripe = UWU_StripedMap_stripe(map, hash);
+
+  UWU_MapStripe_lock(stripe);
+  UWU_MapStripe_writeBegin(stripe);
+  void *value = UWU_FlatMap_removeHashed(&stripe->map, key, hash);
+  if (value != NULL) {
+    UWU_MapStripe_retireValue(stripe, value);
+  }
+  UWU_MapStripe_writeEnd(stripe);
+  UWU_MapStripe_reclaim(stripe, map->free_value);
+  UWU_MapStripe_unlock(stripe);
+
+  return value != NULL;
+}
+
+// Frees every value and the map itself. No other thread may use the map!
+void UWU_StripedMap_deinit(UWU_StripedMap *map) {
+  UWU_StripedMap_removeIf(map, UWU_StripedMap_all, NULL);
+
+  for (size_t i = 0; i < UWU_STRIPED_MAP_STRIPES; i++) {
+    UWU_MapStripe *stripe = &map->stripes[i];
+    UWU_MapStripe_reclaim(stripe, map->free_value);
+    free(stripe->retired_values);
+    UWU_FlatMap_deinit(&stripe->map);
+    pthread_mutex_destroy(&stripe->mx);
+  }
+}
+
+/* *****************************************************************************
+Compression
+***************************************************************************** */
+
+// RSV1 bit of a websocket frame header. When permessage-deflate (RFC 7692) was
+// negotiated during the upgrade, a frame with this bit set carries a deflated
+// payload.
+static const int UWU_WS_FLAG_COMPRESSED = 0x40;
+
+// The extension offer/response we use for permessage-deflate.
+//
+// Both sides reset their context after each message, so a context can be
+// shared by every connection handled on the same thread.
+static const char UWU_WS_DEFLATE_EXTENSION[] =
+    "permessage-deflate; server_no_context_takeover; "
+    "client_no_context_takeover";
+
+// Every deflated message ends with this marker, RFC 7692 says it must be
+// stripped before sending and appended again before inflating.
+static const uint8_t UWU_DEFLATE_TAIL[] = {0x00, 0x00, 0xff, 0xff};
+
+// zlib streams and output buffers are expensive to create, so each thread
+// keeps its own pair and resets them between messages.
+typedef struct {
+  z_stream deflate;
+  UWU_Bool deflate_ready;
+  z_stream inflate;
+  UWU_Bool inflate_ready;
+  // Output buffer shared by both streams.
+  uint8_t *out;
+  size_t out_capacity;
+} UWU_DeflateCtx;
+
+static __thread UWU_DeflateCtx UWU_DEFLATE_CTX = {};
+
+// Makes sure the thread output buffer can hold at least `capacity` bytes.
+static UWU_Bool UWU_DeflateCtx_reserve(UWU_DeflateCtx *ctx, size_t capacity) {
+  if (ctx->out_capacity >= capacity) {
+    return TRUE;
+  }
+
+  uint8_t *out = (uint8_t *)realloc(ctx->out, capacity);
+  if (out == NULL) {
+    return FALSE;
+  }
+
+  ctx->out = out;
+  ctx->out_capacity = capacity;
+  return TRUE;
+}
+
+// Compresses `src` as a single permessage-deflate message.
+//
+// The returned string points to a buffer owned by the calling thread, it stays
+// valid until the next call to any `UWU_Deflate_*` function on this thread.
+//
+// Failure: Sets err equal to `COMPRESSION_FAILED` and returns an empty string.
+UWU_String UWU_Deflate_compress(const UWU_String *const src, UWU_Err err) {
+  UWU_String compressed = {};
+  UWU_DeflateCtx *ctx = &UWU_DEFLATE_CTX;
+
+  if (!ctx->deflate_ready) {
+    if (Z_OK != deflateInit2(&ctx->deflate, Z_BEST_SPEED, Z_DEFLATED, -15, 8,
+                             Z_DEFAULT_STRATEGY)) {
+      err = COMPRESSION_FAILED;
+      return compressed;
+    }
+    ctx->deflate_ready = TRUE;
+  } else if (Z_OK != deflateReset(&ctx->deflate)) {
+    err = COMPRESSION_FAILED;
+    return compressed;
+  }
+
+  // The sync flush marker is not included on the zlib bound.
+  size_t bound = deflateBound(&ctx->deflate, src->length) + 16;
+  if (!UWU_DeflateCtx_reserve(ctx, bound)) {
+    err = COMPRESSION_FAILED;
+    return compressed;
+  }
+
+  ctx->deflate.next_in = (Bytef *)src->data;
+  ctx->deflate.avail_in = src->length;
+  ctx->deflate.next_out = ctx->out;
+  ctx->deflate.avail_out = ctx->out_capacity;
+
+  int result = deflate(&ctx->deflate, Z_SYNC_FLUSH);
+  if (result != Z_OK || ctx->deflate.avail_in != 0 ||
+      ctx->deflate.avail_out == 0) {
+    err = COMPRESSION_FAILED;
+    return compressed;
+  }
+
+  size_t length = ctx->out_capacity - ctx->deflate.avail_out;
+  if (length >= sizeof(UWU_DEFLATE_TAIL) &&
+      0 == memcmp(&ctx->out[length - sizeof(UWU_DEFLATE_TAIL)],
+                  UWU_DEFLATE_TAIL, sizeof(UWU_DEFLATE_TAIL))) {
+    length -= sizeof(UWU_DEFLATE_TAIL);
+  }
+
+  compressed.data = (char *)ctx->out;
+  compressed.length = length;
+  return compressed;
+}
+
+// Inflates a permessage-deflate message.
+//
+// - src: The compressed payload, WITHOUT the trailing sync flush marker.
+// - max_length: The maximum size the inflated message can have.
+// - err: The err parameter, refer to the start of lib for an explanation.
+//
+// The returned string points to a buffer owned by the calling thread, it stays
+// valid until the next call to any `UWU_Deflate_*` function on this thread.
+//
+// Failure: Sets err equal to `COMPRESSION_FAILED` and returns an empty string.
+UWU_String UWU_Deflate_inflate(const UWU_String *const src, size_t max_length,
+                               UWU_Err err) {
+  UWU_String inflated = {};
+  UWU_DeflateCtx *ctx = &UWU_DEFLATE_CTX;
+
+  if (!ctx->inflate_ready) {
+    if (Z_OK != inflateInit2(&ctx->inflate, -15)) {
+      err = COMPRESSION_FAILED;
+      return inflated;
+    }
+    ctx->inflate_ready = TRUE;
+  } else if (Z_OK != inflateReset(&ctx->inflate)) {
+    err = COMPRESSION_FAILED;
+    return inflated;
+  }
+
+  // One extra byte lets us tell apart a message of exactly `max_length` bytes
+  // from one that doesn't fit.
+  size_t capacity_limit = max_length + 1;
+  size_t capacity = src->length * 4 + 64;
+  if (capacity > capacity_limit) {
+    capacity = capacity_limit;
+  }
+  if (!UWU_DeflateCtx_reserve(ctx, capacity)) {
+    err = COMPRESSION_FAILED;
+    return inflated;
+  }
+
+  size_t length = 0;
+  UWU_Bool stream_ended = FALSE;
+  const uint8_t *inputs[] = {(const uint8_t *)src->data, UWU_DEFLATE_TAIL};
+  size_t input_lengths[] = {src->length, sizeof(UWU_DEFLATE_TAIL)};
+
+  for (size_t i = 0; i < 2 && !stream_ended; i++) {
+    ctx->inflate.next_in = (Bytef *)inputs[i];
+    ctx->inflate.avail_in = input_lengths[i];
+
+    do {
+      if (length == ctx->out_capacity) {
+        size_t new_capacity = ctx->out_capacity * 2;
+        if (new_capacity > capacity_limit) {
+          new_capacity = capacity_limit;
+        }
+        if (new_capacity <= length ||
+            !UWU_DeflateCtx_reserve(ctx, new_capacity)) {
+          err = COMPRESSION_FAILED;
+          return inflated;
+        }
+      }
+
+      ctx->inflate.next_out = &ctx->out[length];
+      ctx->inflate.avail_out = ctx->out_capacity - length;
+
+      int result = inflate(&ctx->inflate, Z_SYNC_FLUSH);
+      length = ctx->out_capacity - ctx->inflate.avail_out;
+      if (result == Z_STREAM_END) {
+        stream_ended = TRUE;
+        break;
+      }
+      if (result == Z_BUF_ERROR && ctx->inflate.avail_in == 0) {
+        // Nothing left to inflate from this input.
+        break;
+      }
+      if (result != Z_OK) {
+        err = COMPRESSION_FAILED;
+        return inflated;
+      }
+    } while (ctx->inflate.avail_in > 0 || length == ctx->out_capacity);
+  }
+
+  if (length > max_length) {
+    err = COMPRESSION_FAILED;
+    return inflated;
+  }
+
+  inflated.data = (char *)ctx->out;
+  inflated.length = length;
+  return inflated;
+}
+
+// Frees the compression contexts of the calling thread.
+//
+// Call it before a thread that used the `UWU_Deflate_*` API exits.
+void UWU_Deflate_releaseThreadCtx() {
+  UWU_DeflateCtx *ctx = &UWU_DEFLATE_CTX;
+  if (ctx->deflate_ready) {
+    deflateEnd(&ctx->deflate);
+  }
+  if (ctx->inflate_ready) {
+    inflateEnd(&ctx->inflate);
+  }
+  free(ctx->out);
+
+  UWU_DeflateCtx empty = {};
+  *ctx = empty;
+}
+
+/* *****************************************************************************
+Server Users
+***************************************************************************** */
+
+// Picks which of the `nodes` servers of a cluster owns `username`.
+//
+// Servers and clients compute the same owner, so a username can only be
+// connected to one node and clients can connect to the right one directly.
+size_t UWU_Username_node(const UWU_String *const username, size_t nodes) {
+  // FNV-1a barely changes the high bits of names that only differ on their
+  // last characters (`user1`, `user2`...), so they're mixed first.
+  uint32_t hash = UWU_FlatMap_mix(UWU_String_hash(username));
+  return (size_t)(((uint64_t)hash * nodes) >> 32);
+}
+
+typedef struct {
+  UWU_Username username;
+  UWU_ConnStatus status;
+  time_t last_action;
+  struct mg_connection *conn;
+} UWU_User;
+
+// Copies the user, the copy owns its username.
+UWU_User UWU_User_copyFrom(UWU_User *src, UWU_Err err) {
+  UWU_User copy = {};
+
+  UWU_Username user_name_copy = UWU_Username_copy(&src->username, err);
+  if (user_name_copy.length != src->username.length) {
+    err = MALLOC_FAILED;
+    return copy;
+  }
+
+  copy.username = user_name_copy;
+  copy.status = src->status;
+  copy.last_action = src->last_action;
+  copy.conn = src->conn;
+
+  return copy;
+}
+
+// Frees all resources associated with this user.
+//
+// This does not include the user itself!
+void UWU_User_free(UWU_User *ref) { UWU_Username_free(&ref->username); }
+
+// Represents a node inside the linked list.
+struct UWU_UserListNode {
+  // The linked list will always hold two nodes at the extremes.
+  // This nodes are the sentinels nodes, all other nodes should NOT BE sentinels
+  // nodes.
+  UWU_Bool is_sentinel;
+  // The data the node is holding.
+  UWU_User data;
+  // The previous node in the list.
+  struct UWU_UserListNode *previous;
+  // The next node in the list.
+  struct UWU_UserListNode *next;
+};
+
+// All nodes of every `UWU_UserList` come from this pool.
+static UWU_Pool UWU_USER_NODE_POOL =
+    UWU_POOL_STATIC(2, sizeof(struct UWU_UserListNode));
+
+// Creates a new `UWU_UserListNode` with `data`.
+//
+// Both `next` and `previous` pointers are set to `NULL`.
+// It does not own data.
+struct UWU_UserListNode UWU_UserListNode_newWithValue(UWU_User data) {
+  struct UWU_UserListNode node = {
+      .is_sentinel = FALSE,
+      .data = data,
+      .previous = NULL,
+      .next = NULL,
+  };
+
+  return node;
+}
+
+// Creates a copy from `other` and allocates it on `UWU_USER_NODE_POOL`.
+struct UWU_UserListNode *UWU_UserListNode_copy(struct UWU_UserListNode *other,
+                                               UWU_Err err) {
+  struct UWU_UserListNode *copy =
+      (struct UWU_UserListNode *)UWU_Pool_alloc(&UWU_USER_NODE_POOL, err);
+  if (copy == NULL) {
+    err = MALLOC_FAILED;
+    return NULL;
+  }
+
+  UWU_User data_copy = UWU_User_copyFrom(&other->data, err);
+  if (data_copy.username.length != other->data.username.length) {
+    UWU_Pool_free(&UWU_USER_NODE_POOL, copy);
+    err = MALLOC_FAILED;
+    return NULL;
+  }
+
+  copy->data = data_copy;
+  copy->previous = other->previous;
+  copy->next = other->next;
+  copy->is_sentinel = other->is_sentinel;
+
+  return copy;
+}
+
+// Free all the resources associated with this node.
+void UWU_UserListNode_deinit(struct UWU_UserListNode *ref) {
+  UWU_User_free(&ref->data);
+
+  // Reset pointers...
+  ref->next = NULL;
+  ref->previous = NULL;
+}
+
+// Saves a list of users, the implementation is a linked list.
+// Appending items to the start and end are O(1) operations.
+// Since it's a collection, you can remove and add new users at any time.
+//
+// The list OWNS THE VALUES, so every addition is a copy, and every removal is a
+// free!
+//
+// Nodes are also indexed by username, so usernames MUST BE UNIQUE inside a
+// list!
+typedef struct {
+  // A pointer to the start of the list
+  // By default is NULL.
+  struct UWU_UserListNode *start;
+  // A pointer to the end of the list
+  // By default is NULL.
+  struct UWU_UserListNode *end;
+
+  // The length of this list!
+  // This value will be valid as long as items are only added using the methods
+  // from the `UWU_UserList` API
+  size_t length;
+
+  // Maps each username to its `struct UWU_UserListNode`.
+  // The keys point to the usernames inside the nodes.
+  UWU_FlatMap by_name;
+
+  // If you need thread safety, lock/unlock this mutex before/after every
+  // operation!
+  pthread_mutex_t mx;
+} UWU_UserList;
+
+// Attempts to find a user by it's name.
+// Returns a reference to the found user. NULL otherwise.
+UWU_User *UWU_UserList_findByName(UWU_UserList *list, UWU_String *name) {
+  struct UWU_UserListNode *node =
+      (struct UWU_UserListNode *)UWU_FlatMap_get(&list->by_name, name);
+  if (node == NULL) {
+    return NULL;
+  }
+
+  return &node->data;
+}
+
+// Tries to update the first user it finds with the given username.
+// Returns true if it found a user to update. False otherwise.
+UWU_Bool UWU_UserList_updateUserByName(UWU_UserList *list, UWU_String *name,
+                                       UWU_User new_data) {
+  struct UWU_UserListNode *node =
+      (struct UWU_UserListNode *)UWU_FlatMap_get(&list->by_name, name);
+  if (node == NULL) {
+    return FALSE;
+  }
+
+  // The index points to the old username, so it has to be updated too.
+  UWU_FlatMap_remove(&list->by_name, name);
+  node->data = new_data;
+  UWU_String new_name = UWU_Username_view(&node->data.username);
+  UWU_Err err = NO_ERROR;
+  UWU_PanicIf(!UWU_FlatMap_putHashed(&list->by_name, &new_name,
+                                     node->data.username.hash, node, err),
+              "Fatal: Can't index the updated user!");
+  return TRUE;
+}
+
+UWU_UserList UWU_UserList_init(UWU_Err err) {
+  UWU_String sentinel_name = {
+      .data = "<sentinel>",
+      .length = strlen("<sentinel>"),
+  };
+  UWU_User def_user = {.username = UWU_Username_borrow(&sentinel_name),
+                       .status = DISCONNETED};
+  struct UWU_UserListNode start_node = UWU_UserListNode_newWithValue(def_user);
+  struct UWU_UserListNode *start_copy = UWU_UserListNode_copy(&start_node, err);
+  start_copy->is_sentinel = TRUE;
+
+  struct UWU_UserListNode end_node = UWU_UserListNode_newWithValue(def_user);
+  struct UWU_UserListNode *end_copy = UWU_UserListNode_copy(&end_node, err);
+  end_copy->is_sentinel = TRUE;
+
+  // Setup references...
+  start_copy->next = end_copy;
+  end_copy->previous = start_copy;
+
+  UWU_UserList def_list = {.start = start_copy, .end = end_copy, .length = 0};
+  def_list.by_name = UWU_FlatMap_init(16, err);
+  if (def_list.by_name.table.capacity == 0) {
+    err = MALLOC_FAILED;
+  }
+  pthread_mutex_init(&def_list.mx, NULL);
+  return def_list;
+}
+
+// Adds a node that was just copied into the list to the username index.
+// Returns FALSE if the index couldn't grow.
+UWU_Bool UWU_UserList_index(UWU_UserList *list,
+                            struct UWU_UserListNode *node) {
+  UWU_Err err = NO_ERROR;
+  UWU_String name = UWU_Username_view(&node->data.username);
+  return UWU_FlatMap_putHashed(&list->by_name, &name, node->data.username.hash,
+                               node, err);
+}
+
+// Destroys all pointers and frees all memory of all nodes.
+void UWU_UserList_deinit(UWU_UserList *list) {
+  struct UWU_UserListNode *current = list->start;
+
+  while (current != NULL) {
+    struct UWU_UserListNode *tmp = current;
+    current = current->next;
+    UWU_UserListNode_deinit(tmp);
+    UWU_Pool_free(&UWU_USER_NODE_POOL, tmp);
+  }
+
+  UWU_FlatMap_deinit(&list->by_name);
+  pthread_mutex_destroy(&list->mx);
+}
+
+// Inserts a specified node to the start of the list.
+// Remember, the list owns the values so this will create a copy of `*node`
+// and therefore it can fail!
+void UWU_UserList_insertStart(UWU_UserList *list, struct UWU_UserListNode *node,
+                              UWU_Err err) {
+  struct UWU_UserListNode *copy = UWU_UserListNode_copy(node, err);
+  if (copy == NULL) {
+    return;
+  }
+
+  if (!UWU_UserList_index(list, copy)) {
+    UWU_UserListNode_deinit(copy);
+    UWU_Pool_free(&UWU_USER_NODE_POOL, copy);
+    err = MALLOC_FAILED;
+    return;
+  }
+
+  struct UWU_UserListNode *second_node = list->start->next;
+
+  // Update already existing nodes...
+  second_node->previous = copy;
+  list->start->next = copy;
+
+  // Update copy node...
+  copy->previous = list->start;
+  copy->next = second_node;
+
+  list->length += 1;
+}
+
+// Inserts a specified node to the end of the list.
+// Remember, the list owns the values so this will create a copy of `*node`
+// and therefore it can fail!
+void UWU_UserList_insertEnd(UWU_UserList *list, struct UWU_UserListNode *node,
+                            UWU_Err err) {
+
+  struct UWU_UserListNode *copy = UWU_UserListNode_copy(node, err);
+  if (copy == NULL) {
+    return;
+  }
+
+  if (!UWU_UserList_index(list, copy)) {
+    UWU_UserListNode_deinit(copy);
+    UWU_Pool_free(&UWU_USER_NODE_POOL, copy);
+    err = MALLOC_FAILED;
+    return;
+  }
+
+  struct UWU_UserListNode *ante_node = list->end->previous;
+
+  // Update already existing nodes...
+  ante_node->next = copy;
+  list->end->previous = copy;
+
+  // Update copy node...
+  copy->previous = ante_node;
+  copy->next = list->end;
+
+  list->length += 1;
+}
+
+// Tries to remove a user by it's username, if the username is not found then
+// it simply does nothing.
+//
+// REMEMBER!! This frees the associated memory of the removed node.
+void UWU_UserList_removeByUsernameIfExists(UWU_UserList *list,
+                                           UWU_String *username) {
+  struct UWU_UserListNode *current =
+      (struct UWU_UserListNode *)UWU_FlatMap_remove(&list->by_name, username);
+  if (current == NULL) {
+    return;
+  }
+
+  struct UWU_UserListNode *previous = current->previous;
+  struct UWU_UserListNode *next = (current->next);
+
+  // Update references from list...
+  previous->next = current->next;
+  next->previous = current->previous;
+
+  UWU_UserListNode_deinit(current);
+  // The node is always on the pool thanks to `UWU_UserListNode_copy`!
+  UWU_Pool_free(&UWU_USER_NODE_POOL, current);
+  list->length -= 1;
+}
+
+// Represents a message on a given chat history.
+//
+// The ChatEntry should own it's memory! So it should receive a copy of
+// `content` and `origin_username`. Both live on the string pools, so readers
+// racing with a writer never touch memory given back to the system.
+typedef struct {
+  // The content of the message.
+  UWU_String content;
+  // The username of the person sending the message.
+  UWU_Username origin_username;
+  // Assigned by the history, it's the position of the message on it plus 1.
+  // So IDs are monotonic and follow the order of the chat.
+  uint64_t id;
+  // When the server received the message, in milliseconds since the epoch.
+  uint64_t timestamp_ms;
+} UWU_ChatEntry;
+
+UWU_ChatEntry UWU_ChatEntry_copy(UWU_ChatEntry *src, UWU_Err err) {
+  UWU_ChatEntry def = {};
+
+  UWU_String content_copy = UWU_String_copyPooled(&src->content, err);
+  if (content_copy.data == NULL) {
+    return def;
+  }
+  UWU_Username username_copy = UWU_Username_copy(&src->origin_username, err);
+  if (username_copy.length != src->origin_username.length) {
+    UWU_String_freePooled(&content_copy);
+    return def;
+  }
+
+  UWU_ChatEntry dest = {
+      .content = content_copy,
+      .origin_username = username_copy,
+      .id = src->id,
+      .timestamp_ms = src->timestamp_ms,
+  };
+
+  return dest;
+}
+
+void UWU_ChatEntry_free(UWU_ChatEntry *src) {
+  UWU_String_freePooled(&src->content);
+  UWU_Username_free(&src->origin_username);
+}
+
+// Bytes a copy of the entry uses besides its slot on the history.
+size_t UWU_ChatEntry_bytes(UWU_ChatEntry *entry) {
+  return entry->content.length + entry->origin_username.length;
+}
+// Represents a message history of a certain chat
+//
+// Messages are stored on the `*messages` buffer. If the buffer is full the
+// oldest data is overridden.
+//
+// To iterate the data in order please obtain an iterator using:
+// `UWU_ChatHistory_iter()`
+//
+// Writers lock `mx`. Readers can skip it with `UWU_ChatHistory_readBegin` and
+// `UWU_ChatHistory_serialize`, writers bump `seq` so they notice overlapping
+// writes and retry.
+typedef struct {
+  // A pointer to an array of `ChatEntry`.
+  UWU_ChatEntry *messages;
+  // The name of the channel that points to this history the server state
+  UWU_String channel_name;
+  // The number of chat messages filling the array.
+  size_t count;
+  // How much memory is left in the array of `ChatEntry`.
+  size_t capacity;
+  // The idx of the next message to insert in the array.
+  size_t next_idx;
+  // If you need thread safety lock/unlock this mutex before/after every
+  // operation!
+  pthread_mutex_t mx;
+  // Odd while a writer changes the history, incremented by every write.
+  uint32_t seq;
+  // Bytes of memory the history uses, messages included.
+  size_t bytes;
+  // When the history was last read or written, in milliseconds since the
+  // epoch. Set by its users, ALWAYS use `__atomic` builtins.
+  uint64_t used_ms;
+} UWU_ChatHistory;
+
+// Creates a new ChatHistory with the specified capacity for messages.
+// It does not own the channel_name value.
+UWU_ChatHistory UWU_ChatHistory_init(size_t capacity, UWU_String channel_name,
+                                     UWU_Err err) {
+  UWU_ChatHistory ht = {};
+
+  ht.messages = (UWU_ChatEntry *)malloc(sizeof(UWU_ChatEntry[capacity]));
+  if (ht.messages == NULL) {
+    err = MALLOC_FAILED;
+    return ht;
+  }
+
+  ht.capacity = capacity;
+  ht.count = 0;
+  ht.next_idx = 0;
+  ht.seq = 0;
+  ht.channel_name = channel_name;
+  ht.bytes = sizeof(UWU_ChatHistory) + sizeof(UWU_ChatEntry[capacity]) +
+             channel_name.length;
+  pthread_mutex_init(&ht.mx, NULL);
+
+  return ht;
+}
+
+void UWU_ChatHistory_deinit(UWU_ChatHistory *ht) {
+  // Histories may start at any `next_idx`, the messages aren't always at the
+  // start of the array.
+  for (size_t i = ht->next_idx - ht->count; i < ht->next_idx; i++) {
+    UWU_ChatEntry_free(&ht->messages[i % ht->capacity]);
+  }
+  free(ht->messages);
+  UWU_String_freeWithMalloc(&ht->channel_name);
+  pthread_mutex_destroy(&ht->mx);
+}
+
+// All the `UWU_ChatHistory` created with `UWU_ChatHistory_new` come from this
+// pool.
+static UWU_Pool UWU_CHAT_HISTORY_POOL =
+    UWU_POOL_STATIC(3, sizeof(UWU_ChatHistory));
+
+// Same as `UWU_ChatHistory_init` but the history lives on
+// `UWU_CHAT_HISTORY_POOL`. Free it with `UWU_ChatHistory_free`.
+UWU_ChatHistory *UWU_ChatHistory_new(size_t capacity, UWU_String channel_name,
+                                     UWU_Err err) {
+  UWU_ChatHistory *ht =
+      (UWU_ChatHistory *)UWU_Pool_alloc(&UWU_CHAT_HISTORY_POOL, err);
+  if (ht == NULL) {
+    err = MALLOC_FAILED;
+    return NULL;
+  }
+
+  *ht = UWU_ChatHistory_init(capacity, channel_name, err);
+  if (ht->messages == NULL) {
+    UWU_Pool_free(&UWU_CHAT_HISTORY_POOL, ht);
+    err = MALLOC_FAILED;
+    return NULL;
+  }
+
+  return ht;
+}
+
+// Deinits and frees a history created with `UWU_ChatHistory_new`.
+void UWU_ChatHistory_free(UWU_ChatHistory *ht) {
+  UWU_ChatHistory_deinit(ht);
+  UWU_Pool_free(&UWU_CHAT_HISTORY_POOL, ht);
+}
+
+// Gives back the objects the current thread cached from the pools of this
+// file. Call it before a thread that used users or histories exits.
+void UWU_Pools_releaseThreadCaches() {
+  UWU_Pool_releaseThreadCache(&UWU_SHORT_STRING_POOL);
+  UWU_Pool_releaseThreadCache(&UWU_STRING_POOL);
+  UWU_Pool_releaseThreadCache(&UWU_USER_NODE_POOL);
+  UWU_Pool_releaseThreadCache(&UWU_CHAT_HISTORY_POOL);
+}
+
+// Frees the slabs of the pools of this file, once nothing they handed out is
+// in use. Call it after `UWU_Pools_releaseThreadCaches` on the last thread.
+void UWU_Pools_deinit() {
+  UWU_Pool_deinit(&UWU_SHORT_STRING_POOL);
+  UWU_Pool_deinit(&UWU_STRING_POOL);
+  UWU_Pool_deinit(&UWU_USER_NODE_POOL);
+  UWU_Pool_deinit(&UWU_CHAT_HISTORY_POOL);
+}
+
+// Marks the start of a change to the history, optimistic readers will retry.
+void UWU_ChatHistory_writeBegin(UWU_ChatHistory *hist) {
+  __atomic_store_n(&hist->seq, hist->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void UWU_ChatHistory_writeEnd(UWU_ChatHistory *hist) {
+  __atomic_store_n(&hist->seq, hist->seq + 1, __ATOMIC_RELEASE);
+}
+
+// Adds a new entry to the ChatHistory.
+//
+// If the ChatHistory is already full then it wraps around and adds it to the
+// back.
+// It copies the entry given.
+//
+// Returns the ID assigned to the message.
+uint64_t UWU_ChatHistory_addMessage(UWU_ChatHistory *hist,
+                                    UWU_ChatEntry *entry) {
+  UWU_Err err = NO_ERROR;
+  size_t next_idx = hist->next_idx % hist->capacity;
+  UWU_ChatEntry clone = UWU_ChatEntry_copy(entry, err);
+  if (clone.content.data == NULL) {
+    UWU_PANIC("Fatal: Failed to copy msg into chat history!");
+    return 0;
+  }
+  clone.id = hist->next_idx + 1;
+
+  UWU_ChatEntry overridden = {};
+  UWU_Bool is_full = hist->count >= hist->capacity;
+
+  UWU_ChatHistory_writeBegin(hist);
+  // The oldest message gets overridden once the history is full.
+  if (is_full) {
+    overridden = hist->messages[next_idx];
+  } else {
+    hist->count += 1;
+  }
+  hist->messages[next_idx] = clone;
+  hist->next_idx += 1;
+  UWU_ChatHistory_writeEnd(hist);
+
+  hist->bytes += UWU_ChatEntry_bytes(&clone);
+  if (is_full) {
+    hist->bytes -= UWU_ChatEntry_bytes(&overridden);
+    UWU_ChatEntry_free(&overridden);
+  }
+
+  return clone.id;
+}
+
+// Clears all messages in the given ChatHistory.
+// Frees each ChatEntry and resets the internal state.
+void UWU_ChatHistory_clear(UWU_ChatHistory *hist) {
+  if (hist == NULL || hist->messages == NULL)
+    return;
+
+  UWU_ChatHistory_writeBegin(hist);
+  for (size_t i = hist->next_idx - hist->count; i < hist->next_idx; i++) {
+    UWU_ChatEntry *entry = &hist->messages[i % hist->capacity];
+    hist->bytes -= UWU_ChatEntry_bytes(entry);
+    UWU_ChatEntry_free(entry);
+  }
+
+  hist->count = 0;
+  hist->next_idx = 0;
+  UWU_ChatHistory_writeEnd(hist);
+}
+
+// Gives limits for iterating over a `UWU_ChatHistory` in insertion order.
+// `start` and `end` ARE NOT indexes! Make sure to apply the % operator
+// because they can grow far beyond what the collection could hold!
+typedef struct {
   size_t start;
   size_t end;
 } UWU_ChatHistory_Iterator;
 
-UWU_ChatHistory_Iterator UWU_ChatHistory_iter(UWU_ChatHistory *ht) {
-  UWU_ChatHistory_Iterator iter = {};
+UWU_ChatHistory_Iterator UWU_ChatHistory_iter(UWU_ChatHistory *ht) {
+  UWU_ChatHistory_Iterator iter = {};
+
+  // Histories may start at any `next_idx`, the messages aren't always at the
+  // start of the array.
+  iter.end = ht->next_idx;
+  iter.start = iter.end - ht->count;
+
+  return iter;
+}
+
+// Gets an item from the history!
+// Panics if index is outside of bounds.
+UWU_ChatEntry UWU_ChatHistory_get(UWU_ChatHistory *ht, size_t idx) {
+  UWU_ChatEntry entry = {};
+  if (idx < 0 || idx >= ht->capacity) {
+    UWU_PANIC("Trying to get a ChatEntry (idx: %d) from ChatHistory (count: "
+              "%d, capacity: %d)",
+              idx, ht->count, ht->capacity);
+    return entry;
+  }
+
+  entry = ht->messages[idx];
+  return entry;
+}
+
+// Starts an optimistic read of the history without locking it.
+// Returns the generation to validate the read with, it's odd if a writer is
+// changing the history right now.
+uint32_t UWU_ChatHistory_readBegin(UWU_ChatHistory *hist) {
+  return __atomic_load_n(&hist->seq, __ATOMIC_ACQUIRE);
+}
+
+// Returns TRUE if no writer changed the history since `UWU_ChatHistory_readBegin`
+// returned `seq`.
+UWU_Bool UWU_ChatHistory_readValidate(UWU_ChatHistory *hist, uint32_t seq) {
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return seq % 2 == 0 && __atomic_load_n(&hist->seq, __ATOMIC_RELAXED) == seq;
+}
+
+// The bytes `UWU_ChatHistory_serialize` needs. Without the lock it's only an
+// estimate, writers may change the history meanwhile.
+size_t UWU_ChatHistory_serializedSize(UWU_ChatHistory *hist) {
+  size_t size = 0;
+  UWU_ChatHistory_Iterator iter = UWU_ChatHistory_iter(hist);
+  for (size_t i = iter.start; i < iter.end; i++) {
+    UWU_ChatEntry *entry = &hist->messages[i % hist->capacity];
+    size += 2 + entry->origin_username.length + entry->content.length;
+  }
+  return size;
+}
+
+// Copies the messages in insertion order into `dest` as
+// `<username length><username><content length><content>`.
+//
+// - seq: The value returned by `UWU_ChatHistory_readBegin`. Every entry is
+// validated before its strings are copied, so the copy never follows a pointer
+// of a torn entry.
+//
+// Success: Returns TRUE and sets `length` and `count`.
+// Failure: Returns FALSE if a writer overlapped or `dest` is too small.
+UWU_Bool UWU_ChatHistory_serialize(UWU_ChatHistory *hist, uint32_t seq,
+                                   char *dest, size_t dest_size,
+                                   size_t *length, size_t *count) {
+  if (seq % 2 != 0) {
+    return FALSE;
+  }
+
+  UWU_ChatHistory_Iterator iter = UWU_ChatHistory_iter(hist);
+  if (!UWU_ChatHistory_readValidate(hist, seq) ||
+      iter.end - iter.start > hist->capacity) {
+    return FALSE;
+  }
+
+  size_t written = 0;
+  for (size_t i = iter.start; i < iter.end; i++) {
+    UWU_ChatEntry entry = hist->messages[i % hist->capacity];
+    if (!UWU_ChatHistory_readValidate(hist, seq)) {
+      return FALSE;
+    }
+
+    UWU_String username = UWU_Username_view(&entry.origin_username);
+    size_t size = 2 + username.length + entry.content.length;
+    if (written + size > dest_size) {
+      return FALSE;
+    }
+
+    dest[written] = username.length;
+    memcpy(&dest[written + 1], username.data, username.length);
+    dest[written + 1 + username.length] = entry.content.length;
+    memcpy(&dest[written + 2 + username.length], entry.content.data,
+           entry.content.length);
+    written += size;
+  }
+
+  if (!UWU_ChatHistory_readValidate(hist, seq)) {
+    return FALSE;
+  }
+
+  *length = written;
+  *count = iter.end - iter.start;
+  return TRUE;
+}
+
+/* *****************************************************************************
+Channel History
+***************************************************************************** */
+
+// A message history shared by many writers, like the group chat.
+//
+// Writers don't lock. Each one reserves a position with an atomic fetch-add on
+// `head`, copies the message into the slot of that position and publishes it
+// by storing the slot sequence with release semantics. Messages are stored
+// inline on the slots, so appending never allocates.
+//
+// Readers don't lock either. They copy a slot and check its sequence before
+// and after, so a message that is still being written or was overwritten
+// meanwhile is skipped.
+
+// Lengths are sent as a single byte.
+#define UWU_CHANNEL_MAX_FIELD_LENGTH 255
+// How many times a writer spins before yielding while it waits for the writer
+// of the previous lap of its slot.
+static const size_t UWU_CHANNEL_SPINS_BEFORE_YIELD = 64;
+
+#define UWU_CHANNEL_SLOT_ALIGNMENT 64
+
+// Every slot lives on its own cache lines so concurrent writers don't fight.
+typedef struct {
+  // 0 while the slot was never written.
+  // `2 * position + 1` while the message of `position` is being written.
+  // `2 * position + 2` once it's published.
+  uint64_t seq;
+  // When the server received the message, in milliseconds since the epoch.
+  uint64_t timestamp_ms;
+  uint8_t username_length;
+  uint8_t content_length;
+  char username[UWU_CHANNEL_MAX_FIELD_LENGTH];
+  char content[UWU_CHANNEL_MAX_FIELD_LENGTH];
+} __attribute__((aligned(UWU_CHANNEL_SLOT_ALIGNMENT))) UWU_ChannelSlot;
+
+typedef struct {
+  UWU_ChannelSlot *slots;
+  size_t capacity;
+  // The name of the channel, the history owns it.
+  UWU_String channel_name;
+  // Next position to reserve. It never wraps, use `% capacity` to get the
+  // slot. On its own cache line since every writer updates it.
+  __attribute__((aligned(UWU_CHANNEL_SLOT_ALIGNMENT))) uint64_t head;
+} UWU_ChannelHistory;
+
+// Positions `[start, end)` that may hold a message.
+typedef struct {
+  uint64_t start;
+  uint64_t end;
+} UWU_ChannelHistory_Range;
+
+// Creates a history that keeps the last `capacity` messages.
+// It owns `channel_name`.
+//
+// Success: Returns the new history.
+// Failure: Sets err equal to `MALLOC_FAILED`, the history has no slots.
+UWU_ChannelHistory UWU_ChannelHistory_init(size_t capacity,
+                                           UWU_String channel_name,
+                                           UWU_Err err) {
+  UWU_ChannelHistory hist = {};
+
+  hist.slots = (UWU_ChannelSlot *)aligned_alloc(
+      UWU_CHANNEL_SLOT_ALIGNMENT, sizeof(UWU_ChannelSlot) * capacity);
+  if (hist.slots == NULL) {
+    err = MALLOC_FAILED;
+    return hist;
+  }
+
+  for (size_t i = 0; i < capacity; i++) {
+    hist.slots[i].seq = 0;
+  }
+  hist.capacity = capacity;
+  hist.channel_name = channel_name;
+  hist.head = 0;
+
+  return hist;
+}
+
+void UWU_ChannelHistory_deinit(UWU_ChannelHistory *hist) {
+  free(hist->slots);
+  UWU_String_freeWithMalloc(&hist->channel_name);
+  hist->slots = NULL;
+  hist->capacity = 0;
+}
+
+// Copies a message into the slot of `pos` and publishes it.
+// ONLY the writer that owns `pos` can call this!
+void UWU_ChannelHistory_writeSlot(UWU_ChannelHistory *hist, uint64_t pos,
+                                  const UWU_String *username,
+                                  const UWU_String *content,
+                                  uint64_t timestamp_ms) {
+  UWU_ChannelSlot *slot = &hist->slots[pos % hist->capacity];
+  __atomic_store_n(&slot->seq, 2 * pos + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  size_t username_length = username->length < UWU_CHANNEL_MAX_FIELD_LENGTH
+                               ? username->length
+                               : UWU_CHANNEL_MAX_FIELD_LENGTH;
+  size_t content_length = content->length < UWU_CHANNEL_MAX_FIELD_LENGTH
+                              ? content->length
+                              : UWU_CHANNEL_MAX_FIELD_LENGTH;
+  slot->timestamp_ms = timestamp_ms;
+  slot->username_length = username_length;
+  slot->content_length = content_length;
+  // The placeholders of `UWU_ChannelHistory_store` have no data.
+  if (username_length > 0) {
+    memcpy(slot->username, username->data, username_length);
+  }
+  if (content_length > 0) {
+    memcpy(slot->content, content->data, content_length);
+  }
+
+  __atomic_store_n(&slot->seq, 2 * pos + 2, __ATOMIC_RELEASE);
+}
+
+// Appends a message, overwriting the oldest one if the history is full.
+// Both fields are truncated to `UWU_CHANNEL_MAX_FIELD_LENGTH` bytes.
+//
+// Returns the ID of the message: its position plus 1, like
+// `UWU_ChatHistory_addMessage`.
+uint64_t UWU_ChannelHistory_append(UWU_ChannelHistory *hist,
+                                   const UWU_String *username,
+                                   const UWU_String *content,
+                                   uint64_t timestamp_ms) {
+  uint64_t pos = __atomic_fetch_add(&hist->head, 1, __ATOMIC_RELAXED);
+  UWU_ChannelSlot *slot = &hist->slots[pos % hist->capacity];
+
+  // The writer of the previous lap may still be copying into this slot.
+  uint64_t previous = pos >= hist->capacity ? 2 * (pos - hist->capacity) + 2 : 0;
+  for (size_t spins = 0;
+       __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != previous; spins++) {
+    if (spins >= UWU_CHANNEL_SPINS_BEFORE_YIELD) {
+      sched_yield();
+    }
+  }
+
+  UWU_ChannelHistory_writeSlot(hist, pos, username, content, timestamp_ms);
+  return pos + 1;
+}
+
+// Stores a message with the ID another history gave it, for a history that
+// copies that one. Its writers don't publish in order, so messages may come
+// after newer ones: the positions skipped meanwhile are published empty until
+// their message arrives, readers skip them and writers never wait on them.
+// ONLY a single thread can call this, and never alongside
+// `UWU_ChannelHistory_append`! Filling an empty position doesn't change its
+// sequence, so other threads shouldn't read the history meanwhile either.
+//
+// Returns FALSE if the history already has the message or it's too old to
+// keep.
+UWU_Bool UWU_ChannelHistory_store(UWU_ChannelHistory *hist, uint64_t id,
+                                  const UWU_String *username,
+                                  const UWU_String *content,
+                                  uint64_t timestamp_ms) {
+  uint64_t head = __atomic_load_n(&hist->head, __ATOMIC_RELAXED);
+  uint64_t pos = id - 1;
+  if (id == 0 || pos + hist->capacity < head) {
+    return FALSE;
+  }
+  if (pos < head) {
+    UWU_ChannelSlot *slot = &hist->slots[pos % hist->capacity];
+    if (slot->username_length != 0) {
+      return FALSE;
+    }
+  } else {
+    UWU_String empty = {};
+    uint64_t first =
+        pos - head >= hist->capacity ? pos + 1 - hist->capacity : head;
+    for (uint64_t skipped = first; skipped < pos; skipped++) {
+      UWU_ChannelHistory_writeSlot(hist, skipped, &empty, &empty, 0);
+    }
+  }
+
+  UWU_ChannelHistory_writeSlot(hist, pos, username, content, timestamp_ms);
+  if (pos >= head) {
+    __atomic_store_n(&hist->head, pos + 1, __ATOMIC_RELEASE);
+  }
+  return TRUE;
+}
+
+// The positions of the messages currently on the history.
+UWU_ChannelHistory_Range UWU_ChannelHistory_range(UWU_ChannelHistory *hist) {
+  UWU_ChannelHistory_Range range = {};
+  range.end = __atomic_load_n(&hist->head, __ATOMIC_ACQUIRE);
+  range.start = range.end > hist->capacity ? range.end - hist->capacity : 0;
+  return range;
+}
+
+// Estimates the bytes `UWU_ChannelHistory_copyMessage` needs for the
+// messages of `range`. It's exact unless writers overwrite them meanwhile.
+size_t UWU_ChannelHistory_sizeHint(UWU_ChannelHistory *hist,
+                                   UWU_ChannelHistory_Range range) {
+  size_t size = 0;
+  for (uint64_t pos = range.start; pos < range.end; pos++) {
+    UWU_ChannelSlot *slot = &hist->slots[pos % hist->capacity];
+    size += 2 + __atomic_load_n(&slot->username_length, __ATOMIC_RELAXED) +
+            __atomic_load_n(&slot->content_length, __ATOMIC_RELAXED);
+  }
+  return size;
+}
+
+// Copies the message at `pos` into `dest` as
+// `<username length><username><content length><content>`. Its timestamp is
+// written to `timestamp_ms` unless it's NULL.
+//
+// Returns the bytes written. 0 if the message isn't published yet, was
+// overwritten, is missing from a copy, check `UWU_ChannelHistory_store`, or
+// doesn't fit in `dest_size` bytes.
+size_t UWU_ChannelHistory_copyMessage(UWU_ChannelHistory *hist, uint64_t pos,
+                                      char *dest, size_t dest_size,
+                                      uint64_t *timestamp_ms) {
+  UWU_ChannelSlot *slot = &hist->slots[pos % hist->capacity];
+  uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+  if (seq != 2 * pos + 2) {
+    return 0;
+  }
+
+  size_t username_length = slot->username_length;
+  size_t content_length = slot->content_length;
+  size_t size = 2 + username_length + content_length;
+  if (username_length == 0 || size > dest_size) {
+    return 0;
+  }
+
+  dest[0] = username_length;
+  memcpy(&dest[1], slot->username, username_length);
+  dest[1 + username_length] = content_length;
+  memcpy(&dest[2 + username_length], slot->content, content_length);
+  uint64_t timestamp = slot->timestamp_ms;
+
+  // If a writer started overwriting the slot the copy may be torn.
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) {
+    return 0;
+  }
+
+  if (timestamp_ms != NULL) {
+    *timestamp_ms = timestamp;
+  }
+  return size;
+}
+
+// Waits until the writer of `pos` publishes its message, it reserved the
+// position already. Messages of older positions may still be being written
+// after newer ones are published.
+//
+// Returns TRUE if the message is published, FALSE if it was overwritten.
+UWU_Bool UWU_ChannelHistory_waitPublished(UWU_ChannelHistory *hist,
+                                          uint64_t pos) {
+  UWU_ChannelSlot *slot = &hist->slots[pos % hist->capacity];
+  uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+  for (size_t spins = 0; seq < 2 * pos + 2; spins++) {
+    if (spins >= UWU_CHANNEL_SPINS_BEFORE_YIELD) {
+      sched_yield();
+    }
+    seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+  }
+  return seq == 2 * pos + 2;
+}
+
+/* *****************************************************************************
+History Segments
+***************************************************************************** */
+
+// Older messages of a chat, sealed in blocks once they're about to leave the
+// memory of the server. A segment never changes after it's written.
+//
+// Stored as:
+// | "UWUS" | first id (8 bytes) | num msgs (2 bytes) | compressed records |
+// Every record is:
+// | id (8 bytes) | timestamp ms (8 bytes) | length from | from | length msg |
+// msg |
+// Numbers are big endian, the records are compressed with `UWU_Deflate_*`.
+static const char UWU_SEGMENT_MAGIC[] = {'U', 'W', 'U', 'S'};
+static const size_t UWU_SEGMENT_HEADER_SIZE = 4 + 8 + 2;
+// The biggest a record can be.
+static const size_t UWU_SEGMENT_MAX_RECORD_SIZE = 8 + 8 + 2 + 255 + 255;
+
+// A message of a segment. The strings point inside the records.
+typedef struct {
+  uint64_t id;
+  uint64_t timestamp_ms;
+  UWU_String from;
+  UWU_String content;
+} UWU_SegmentRecord;
+
+// Writes `record` into `dest`, which must have `UWU_SEGMENT_MAX_RECORD_SIZE`
+// bytes left. Both strings are truncated to 255 bytes.
+//
+// Returns the bytes written.
+size_t UWU_SegmentRecord_write(char *dest, const UWU_SegmentRecord *record) {
+  size_t from_length = record->from.length < 255 ? record->from.length : 255;
+  size_t content_length =
+      record->content.length < 255 ? record->content.length : 255;
+
+  UWU_writeBigEndian(dest, record->id, 8);
+  UWU_writeBigEndian(&dest[8], record->timestamp_ms, 8);
+  dest[16] = from_length;
+  memcpy(&dest[17], record->from.data, from_length);
+  dest[17 + from_length] = content_length;
+  memcpy(&dest[18 + from_length], record->content.data, content_length);
+  return 18 + from_length + content_length;
+}
+
+// Reads the record of `records` at `*offset` into `record` and moves `offset`
+// to the next one.
+//
+// Returns FALSE once there are no more records, or the next one is cut.
+UWU_Bool UWU_SegmentRecord_next(const UWU_String *records, size_t *offset,
+                                UWU_SegmentRecord *record) {
+  if (*offset + 18 > records->length) {
+    return FALSE;
+  }
+  const char *data = &records->data[*offset];
+  size_t from_length = (uint8_t)data[16];
+  if (*offset + 18 + from_length > records->length) {
+    return FALSE;
+  }
+  size_t content_length = (uint8_t)data[17 + from_length];
+  if (*offset + 18 + from_length + content_length > records->length) {
+    return FALSE;
+  }
+  *offset += 18 + from_length + content_length;
+
+  UWU_SegmentRecord def = {
+      .id = UWU_readBigEndian(data, 8),
+      .timestamp_ms = UWU_readBigEndian(&data[8], 8),
+      .from = {.data = (char *)&data[17], .length = from_length},
+      .content = {.data = (char *)&data[18 + from_length],
+                  .length = content_length},
+  };
+  *record = def;
+  return TRUE;
+}
+
+// Writes the header of a segment into `dest`, which must have
+// `UWU_SEGMENT_HEADER_SIZE` bytes. The compressed records go right after it.
+void UWU_Segment_writeHeader(char *dest, uint64_t first_id, size_t count) {
+  memcpy(dest, UWU_SEGMENT_MAGIC, sizeof(UWU_SEGMENT_MAGIC));
+  UWU_writeBigEndian(&dest[4], first_id, 8);
+  UWU_writeBigEndian(&dest[12], count, 2);
+}
+
+// Inflates the records of the whole segment `file`.
+//
+// - max_count: The most records the segment can have, anything bigger is
+// rejected.
+// - err: The err parameter, refer to the start of lib for an explanation.
+//
+// The returned string points to a buffer owned by the calling thread, it stays
+// valid until the next call to any `UWU_Deflate_*` function on this thread.
+//
+// Failure: Returns an empty string if the segment is corrupt.
+UWU_String UWU_Segment_records(const UWU_String *const file, size_t max_count,
+                               UWU_Err err) {
+  UWU_String records = {};
+  if (file->length <= UWU_SEGMENT_HEADER_SIZE ||
+      memcmp(file->data, UWU_SEGMENT_MAGIC, sizeof(UWU_SEGMENT_MAGIC)) != 0) {
+    return records;
+  }
+  size_t count = UWU_readBigEndian(&file->data[12], 2);
+  if (count > max_count) {
+    return records;
+  }
+
+  UWU_String compressed = {.data = &file->data[UWU_SEGMENT_HEADER_SIZE],
+                           .length = file->length - UWU_SEGMENT_HEADER_SIZE};
+  return UWU_Deflate_inflate(&compressed, count * UWU_SEGMENT_MAX_RECORD_SIZE,
+                             err);
+}
+
+/* *****************************************************************************
+Search Index
+***************************************************************************** */
+
+// An inverted index of the messages on the history segments: every term maps
+// to the list of messages that have it.
+//
+// Messages are split into terms on everything that isn't an ASCII letter, an
+// ASCII digit or a byte over 0x7F, so UTF-8 words stay whole. Terms are
+// lowercased, the shorter ones than `UWU_SEARCH_MIN_TERM_LENGTH` are skipped
+// and the longer ones than `UWU_SEARCH_MAX_TERM_LENGTH` truncated.
+//
+// Every segment added takes the next `segment_size` document numbers and each
+// message is the one of its position on the segment. Documents only grow, so
+// a posting list stores the deltas between them as varints. Lists are a chain
+// of blocks from the newest to the oldest, queries walk them backwards and
+// the newest segments come out first.
+//
+// Nothing locks, a single thread must own the index.
+
+#define UWU_SEARCH_MIN_TERM_LENGTH 2
+#define UWU_SEARCH_MAX_TERM_LENGTH 32
+// Most terms a query uses, the rest are ignored.
+#define UWU_SEARCH_MAX_TERMS 8
+// Bytes of deltas on a full posting block. A list starts with a small block
+// that grows until it has this size, the next ones start full.
+#define UWU_POSTING_BLOCK_SIZE 256
+// Most documents a block can hold, every delta takes at least a byte.
+#define UWU_POSTING_BLOCK_MAX_DOCS (UWU_POSTING_BLOCK_SIZE + 1)
+static const size_t UWU_POSTING_BLOCK_FIRST_SIZE = 8;
+// The biggest a varint of 64 bits can be.
+static const size_t UWU_VARINT_MAX_SIZE = 10;
+// Documents of dropped chats the index keeps before compacting, as long as
+// they're more than the live ones too.
+static const size_t UWU_SEARCH_COMPACT_MIN_DOCS = 4096;
+
+// The terms of a query, without repeating any.
+typedef struct {
+  char terms[UWU_SEARCH_MAX_TERMS][UWU_SEARCH_MAX_TERM_LENGTH];
+  uint8_t lengths[UWU_SEARCH_MAX_TERMS];
+  size_t count;
+} UWU_SearchTerms;
+
+UWU_Bool UWU_Search_isTermByte(uint8_t c) {
+  return c >= 0x80 || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+         (c >= '0' && c <= '9');
+}
+
+// Reads the next term of `text` starting at `*offset` into `term`, which
+// must have `UWU_SEARCH_MAX_TERM_LENGTH` bytes, and moves `offset` past it.
+//
+// Returns the length of the term, 0 once there are no more.
+size_t UWU_Search_nextTerm(const UWU_String *const text, size_t *offset,
+                           char *term) {
+  for (;;) {
+    while (*offset < text->length &&
+           !UWU_Search_isTermByte(text->data[*offset])) {
+      (*offset)++;
+    }
+    if (*offset >= text->length) {
+      return 0;
+    }
+
+    size_t length = 0;
+    for (; *offset < text->length && UWU_Search_isTermByte(text->data[*offset]);
+         (*offset)++) {
+      uint8_t c = text->data[*offset];
+      if (length < UWU_SEARCH_MAX_TERM_LENGTH) {
+        term[length++] = c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+      }
+    }
+    if (length >= UWU_SEARCH_MIN_TERM_LENGTH) {
+      return length;
+    }
+  }
+}
+
+// Returns the position of the term on `terms`, `terms->count` if it's not
+// there.
+size_t UWU_SearchTerms_find(const UWU_SearchTerms *const terms,
+                            const char *term, size_t length) {
+  for (size_t i = 0; i < terms->count; i++) {
+    if (terms->lengths[i] == length &&
+        memcmp(terms->terms[i], term, length) == 0) {
+      return i;
+    }
+  }
+  return terms->count;
+}
+
+// Splits a query into its terms. Only the first `UWU_SEARCH_MAX_TERMS`
+// different ones are kept.
+UWU_SearchTerms UWU_SearchTerms_parse(const UWU_String *const query) {
+  UWU_SearchTerms terms = {};
+  char term[UWU_SEARCH_MAX_TERM_LENGTH];
+  size_t offset = 0;
+  for (size_t length = UWU_Search_nextTerm(query, &offset, term);
+       length > 0 && terms.count < UWU_SEARCH_MAX_TERMS;
+       length = UWU_Search_nextTerm(query, &offset, term)) {
+    if (UWU_SearchTerms_find(&terms, term, length) == terms.count) {
+      memcpy(terms.terms[terms.count], term, length);
+      terms.lengths[terms.count] = length;
+      terms.count++;
+    }
+  }
+  return terms;
+}
+
+// Returns TRUE if `text` has every term, like a query on the index would. A
+// query without terms matches nothing.
+UWU_Bool UWU_SearchTerms_match(const UWU_SearchTerms *const terms,
+                               const UWU_String *const text) {
+  uint32_t all = (1u << terms->count) - 1;
+  uint32_t found = 0;
+  char term[UWU_SEARCH_MAX_TERM_LENGTH];
+  size_t offset = 0;
+  for (size_t length = UWU_Search_nextTerm(text, &offset, term);
+       length > 0 && found != all;
+       length = UWU_Search_nextTerm(text, &offset, term)) {
+    size_t idx = UWU_SearchTerms_find(terms, term, length);
+    if (idx < terms->count) {
+      found |= 1u << idx;
+    }
+  }
+  return terms->count > 0 && found == all;
+}
+
+// A piece of a posting list, `data` holds the deltas of the documents after
+// `first_doc`.
+typedef struct UWU_PostingBlock {
+  struct UWU_PostingBlock *older;
+  uint64_t first_doc;
+  uint64_t last_doc;
+  uint16_t length;
+  uint16_t capacity;
+  uint8_t data[];
+} UWU_PostingBlock;
+
+// A term of the index, the key of its entry points to `data`.
+typedef struct {
+  UWU_PostingBlock *newest;
+  // Documents on the list.
+  size_t docs;
+  uint8_t length;
+  char data[];
+} UWU_SearchTerm;
+
+// A segment added to the index.
+typedef struct {
+  uint64_t first_doc;
+  uint64_t segment;
+  // The newest timestamp of this segment and every segment added before it,
+  // no older document has a newer message.
+  uint64_t newest_ms;
+  // Position of the chat on `chats`.
+  uint32_t chat;
+  // Messages that were indexed.
+  uint32_t docs;
+} UWU_SearchSegment;
 
-  iter.start = 0;
-  iter.end = ht->count;
+typedef struct {
+  // The key the segments were added with, the index owns it.
+  UWU_String key;
+  // Messages indexed.
+  size_t docs;
+  // TRUE once the chat was dropped, its documents are gone on the next
+  // compaction.
+  UWU_Bool dropped;
+} UWU_SearchChat;
 
-  if (ht->count >= ht->capacity) {
-    iter.end = ht->next_idx;
-    iter.start = iter.end - ht->count;
+typedef struct {
+  // Key: The term, owned by the value.
+  // Value: An `UWU_SearchTerm`.
+  UWU_FlatMap terms;
+  // Key: The key of a chat that wasn't dropped, owned by `chats`.
+  // Value: Its position on `chats` plus 1.
+  UWU_FlatMap chat_numbers;
+  UWU_SearchChat *chats;
+  size_t chat_count;
+  size_t chat_capacity;
+  // Ordered by their first document.
+  UWU_SearchSegment *segments;
+  size_t segment_count;
+  size_t segment_capacity;
+  // The most messages a segment can have.
+  size_t segment_size;
+  uint64_t next_doc;
+  // Documents of the chats that weren't dropped.
+  size_t live_docs;
+  // Documents of dropped chats still on the posting lists.
+  size_t dropped_docs;
+  // Bytes of the terms and their posting lists.
+  size_t bytes;
+} UWU_SearchIndex;
+
+// Creates an empty index.
+//
+// - segment_size: The most messages a segment can have.
+//
+// Success: Returns the new index.
+// Failure: Sets err equal to `MALLOC_FAILED`, `index.terms.table.capacity` is
+// 0.
+UWU_SearchIndex UWU_SearchIndex_init(size_t segment_size, UWU_Err err) {
+  UWU_SearchIndex index = {.segment_size = segment_size};
+  index.terms = UWU_FlatMap_init(1024, err);
+  if (index.terms.table.capacity == 0) {
+    return index;
   }
+  index.chat_numbers = UWU_FlatMap_init(64, err);
+  if (index.chat_numbers.table.capacity == 0) {
+    UWU_FlatMap_deinit(&index.terms);
+  }
+  return index;
+}
 
-  return iter;
+void UWU_PostingBlock_freeAll(UWU_PostingBlock *block) {
+  while (block != NULL) {
+    UWU_PostingBlock *older = block->older;
+    free(block);
+    block = older;
+  }
 }
 
-// Gets an item from the history!
-// Panics if index is outside of bounds.
-UWU_ChatEntry UWU_ChatHistory_get(UWU_ChatHistory *ht, size_t idx) {
-  UWU_ChatEntry entry = {};
-  if (idx < 0 || idx >= ht->capacity) {
-    UWU_PANIC("Trying to get a ChatEntry (idx: %d) from ChatHistory (count: "
-              "%d, capacity: %d)",
-              idx, ht->count, ht->capacity);
-    return entry;
+void UWU_SearchIndex_freeTerm(void *context, UWU_String key, void *value) {
+  UWU_SearchTerm *term = (UWU_SearchTerm *)value;
+  UWU_PostingBlock_freeAll(term->newest);
+  free(term);
+}
+
+void UWU_SearchIndex_deinit(UWU_SearchIndex *index) {
+  UWU_FlatMap_forEach(&index->terms, UWU_SearchIndex_freeTerm, NULL);
+  UWU_FlatMap_deinit(&index->terms);
+  UWU_FlatMap_deinit(&index->chat_numbers);
+  for (size_t i = 0; i < index->chat_count; i++) {
+    UWU_String_freeWithMalloc(&index->chats[i].key);
   }
+  free(index->chats);
+  free(index->segments);
+  UWU_SearchIndex empty = {};
+  *index = empty;
+}
 
-  entry = ht->messages[idx];
-  return entry;
+// Bytes the whole index uses.
+size_t UWU_SearchIndex_bytesUsed(const UWU_SearchIndex *const index) {
+  const UWU_FlatMap *maps[] = {&index->terms, &index->chat_numbers};
+  size_t bytes = index->bytes +
+                 index->chat_capacity * sizeof(UWU_SearchChat) +
+                 index->segment_capacity * sizeof(UWU_SearchSegment);
+  for (size_t i = 0; i < 2; i++) {
+    bytes += (maps[i]->table.capacity + maps[i]->old.capacity) *
+             (sizeof(UWU_FlatMapSlot) + 1);
+  }
+  for (size_t i = 0; i < index->chat_count; i++) {
+    bytes += index->chats[i].key.length;
+  }
+  return bytes;
+}
+
+size_t UWU_Varint_size(uint64_t value) {
+  size_t size = 1;
+  for (; value >= 0x80; value >>= 7) {
+    size++;
+  }
+  return size;
+}
+
+// Returns the bytes written.
+size_t UWU_Varint_write(uint8_t *dest, uint64_t value) {
+  size_t length = 0;
+  for (; value >= 0x80; value >>= 7) {
+    dest[length++] = (value & 0x7F) | 0x80;
+  }
+  dest[length++] = value;
+  return length;
+}
+
+// Reads the varint at `*offset` of `src` and moves `offset` past it.
+uint64_t UWU_Varint_read(const uint8_t *src, size_t *offset) {
+  uint64_t value = 0;
+  for (size_t shift = 0;; shift += 7) {
+    uint8_t byte = src[(*offset)++];
+    value |= (uint64_t)(byte & 0x7F) << shift;
+    if (byte < 0x80) {
+      return value;
+    }
+  }
+}
+
+// Allocates a block that starts on `doc`.
+//
+// Returns NULL if there's no memory.
+UWU_PostingBlock *UWU_PostingBlock_new(uint64_t doc, size_t capacity,
+                                       UWU_PostingBlock *older) {
+  UWU_PostingBlock *block =
+      (UWU_PostingBlock *)malloc(sizeof(UWU_PostingBlock) + capacity);
+  if (block != NULL) {
+    block->older = older;
+    block->first_doc = doc;
+    block->last_doc = doc;
+    block->length = 0;
+    block->capacity = capacity;
+  }
+  return block;
+}
+
+// Appends `doc` to the list that starts at `*newest`, it must be bigger than
+// every document on it.
+//
+// Success: Returns TRUE.
+// Failure: Returns FALSE if there's no memory, the list is unchanged.
+UWU_Bool UWU_PostingList_append(UWU_PostingBlock **newest, uint64_t doc,
+                                size_t *bytes) {
+  UWU_PostingBlock *block = *newest;
+  if (block == NULL) {
+    block = UWU_PostingBlock_new(doc, UWU_POSTING_BLOCK_FIRST_SIZE, NULL);
+    if (block == NULL) {
+      return FALSE;
+    }
+    *bytes += sizeof(UWU_PostingBlock) + block->capacity;
+    *newest = block;
+    return TRUE;
+  }
+
+  uint64_t delta = doc - block->last_doc;
+  if (block->length + UWU_Varint_size(delta) > block->capacity) {
+    if (block->capacity < UWU_POSTING_BLOCK_SIZE) {
+      size_t capacity = 2 * block->capacity;
+      UWU_PostingBlock *grown = (UWU_PostingBlock *)realloc(
+          block, sizeof(UWU_PostingBlock) + capacity);
+      if (grown == NULL) {
+        return FALSE;
+      }
+      *bytes += capacity - grown->capacity;
+      grown->capacity = capacity;
+      block = grown;
+      *newest = block;
+    } else {
+      block = UWU_PostingBlock_new(doc, UWU_POSTING_BLOCK_SIZE, block);
+      if (block == NULL) {
+        return FALSE;
+      }
+      *bytes += sizeof(UWU_PostingBlock) + block->capacity;
+      *newest = block;
+      return TRUE;
+    }
+  }
+
+  block->length += UWU_Varint_write(&block->data[block->length], delta);
+  block->last_doc = doc;
+  return TRUE;
+}
+
+// Decodes the documents of `block` into `docs`, which must have space for
+// `UWU_POSTING_BLOCK_MAX_DOCS`.
+//
+// Returns how many there are.
+size_t UWU_PostingBlock_decode(const UWU_PostingBlock *block, uint64_t *docs) {
+  size_t count = 1;
+  docs[0] = block->first_doc;
+  for (size_t offset = 0; offset < block->length; count++) {
+    docs[count] = docs[count - 1] + UWU_Varint_read(block->data, &offset);
+  }
+  return count;
+}
+
+// Adds `doc` to the list of `term`, creating the term on its first document.
+// A document is added once no matter how many times it has the term.
+//
+// Returns FALSE if there's no memory.
+UWU_Bool UWU_SearchIndex_addTerm(UWU_SearchIndex *index, const char *data,
+                                 size_t length, uint64_t doc) {
+  UWU_String key = {.data = (char *)data, .length = length};
+  UWU_SearchTerm *term = (UWU_SearchTerm *)UWU_FlatMap_get(&index->terms, &key);
+  if (term == NULL) {
+    term = (UWU_SearchTerm *)malloc(sizeof(UWU_SearchTerm) + length);
+    if (term == NULL) {
+      return FALSE;
+    }
+    term->newest = NULL;
+    term->docs = 0;
+    term->length = length;
+    memcpy(term->data, data, length);
+    UWU_String term_key = {.data = term->data, .length = length};
+    UWU_Err err = NO_ERROR;
+    if (!UWU_FlatMap_put(&index->terms, &term_key, term, err)) {
+      free(term);
+      return FALSE;
+    }
+    index->bytes += sizeof(UWU_SearchTerm) + length;
+  } else if (term->newest != NULL && term->newest->last_doc >= doc) {
+    return TRUE;
+  }
+
+  if (!UWU_PostingList_append(&term->newest, doc, &index->bytes)) {
+    return FALSE;
+  }
+  term->docs++;
+  return TRUE;
+}
+
+// The position of the chat `key` on `chats`, it's added if it isn't there.
+//
+// Returns `index->chat_count` if there's no memory.
+size_t UWU_SearchIndex_chat(UWU_SearchIndex *index,
+                            const UWU_String *const key) {
+  uintptr_t number = (uintptr_t)UWU_FlatMap_get(&index->chat_numbers, key);
+  if (number != 0) {
+    return number - 1;
+  }
+
+  if (index->chat_count == index->chat_capacity) {
+    size_t capacity =
+        index->chat_capacity == 0 ? 16 : 2 * index->chat_capacity;
+    UWU_SearchChat *chats = (UWU_SearchChat *)realloc(
+        index->chats, capacity * sizeof(UWU_SearchChat));
+    if (chats == NULL) {
+      return index->chat_count;
+    }
+    index->chats = chats;
+    index->chat_capacity = capacity;
+  }
+
+  UWU_Err err = NO_ERROR;
+  UWU_SearchChat chat = {.key = UWU_String_copy(key, err)};
+  if (chat.key.data == NULL) {
+    return index->chat_count;
+  }
+  if (!UWU_FlatMap_put(&index->chat_numbers, &chat.key,
+                       (void *)(uintptr_t)(index->chat_count + 1), err)) {
+    UWU_String_freeWithMalloc(&chat.key);
+    return index->chat_count;
+  }
+  index->chats[index->chat_count] = chat;
+  return index->chat_count++;
+}
+
+// Indexes the messages of a segment. Check `UWU_SegmentRecord_next` for the
+// format of `records`, messages with IDs outside of the segment are skipped.
+//
+// Success: Returns TRUE.
+// Failure: Returns FALSE if there's no memory. The segment may be partly
+// indexed, some of its messages just won't be found.
+UWU_Bool UWU_SearchIndex_addSegment(UWU_SearchIndex *index,
+                                    const UWU_String *const key,
+                                    uint64_t segment,
+                                    const UWU_String *const records) {
+  size_t chat = UWU_SearchIndex_chat(index, key);
+  if (chat == index->chat_count) {
+    return FALSE;
+  }
+  if (index->segment_count == index->segment_capacity) {
+    size_t capacity =
+        index->segment_capacity == 0 ? 64 : 2 * index->segment_capacity;
+    UWU_SearchSegment *segments = (UWU_SearchSegment *)realloc(
+        index->segments, capacity * sizeof(UWU_SearchSegment));
+    if (segments == NULL) {
+      return FALSE;
+    }
+    index->segments = segments;
+    index->segment_capacity = capacity;
+  }
+
+  // The segment is there before its documents, so they always map to it.
+  UWU_SearchSegment *entry = &index->segments[index->segment_count++];
+  entry->first_doc = index->next_doc;
+  entry->segment = segment;
+  entry->newest_ms = index->segment_count > 1 ? entry[-1].newest_ms : 0;
+  entry->chat = chat;
+  entry->docs = 0;
+  index->next_doc += index->segment_size;
+
+  UWU_Bool indexed = TRUE;
+  uint64_t first_id = segment * index->segment_size + 1;
+  UWU_SegmentRecord record = {};
+  for (size_t offset = 0; UWU_SegmentRecord_next(records, &offset, &record);) {
+    if (record.id < first_id || record.id >= first_id + index->segment_size) {
+      continue;
+    }
+    uint64_t doc = entry->first_doc + (record.id - first_id);
+    char term[UWU_SEARCH_MAX_TERM_LENGTH];
+    size_t term_offset = 0;
+    for (size_t length = UWU_Search_nextTerm(&record.content, &term_offset,
+                                             term);
+         length > 0;
+         length = UWU_Search_nextTerm(&record.content, &term_offset, term)) {
+      indexed = UWU_SearchIndex_addTerm(index, term, length, doc) && indexed;
+    }
+    if (record.timestamp_ms > entry->newest_ms) {
+      entry->newest_ms = record.timestamp_ms;
+    }
+    entry->docs++;
+  }
+
+  index->chats[chat].docs += entry->docs;
+  index->live_docs += entry->docs;
+  return indexed;
+}
+
+// The segment that holds `doc`, which must be on the index.
+UWU_SearchSegment *UWU_SearchIndex_segmentOf(const UWU_SearchIndex *index,
+                                             uint64_t doc) {
+  size_t low = 0;
+  size_t high = index->segment_count;
+  while (high - low > 1) {
+    size_t mid = low + (high - low) / 2;
+    if (index->segments[mid].first_doc <= doc) {
+      low = mid;
+    } else {
+      high = mid;
+    }
+  }
+  return &index->segments[low];
+}
+
+// Rebuilds the list of `value` without the documents of dropped chats.
+// Returns TRUE once the list is empty, so `UWU_FlatMap_removeIf` frees it.
+UWU_Bool UWU_SearchIndex_compactTerm(void *context, UWU_String key,
+                                     void *value) {
+  UWU_SearchIndex *index = (UWU_SearchIndex *)context;
+  UWU_SearchTerm *term = (UWU_SearchTerm *)value;
+
+  // Blocks go from the newest to the oldest, the new list is built oldest
+  // first.
+  size_t block_count = 0;
+  for (UWU_PostingBlock *block = term->newest; block != NULL;
+       block = block->older) {
+    block_count++;
+  }
+  UWU_PostingBlock **blocks =
+      (UWU_PostingBlock **)malloc(block_count * sizeof(UWU_PostingBlock *));
+  if (blocks == NULL) {
+    index->dropped_docs = SIZE_MAX;
+    return FALSE;
+  }
+  size_t i = block_count;
+  for (UWU_PostingBlock *block = term->newest; block != NULL;
+       block = block->older) {
+    blocks[--i] = block;
+  }
+
+  UWU_PostingBlock *newest = NULL;
+  size_t docs = 0;
+  size_t bytes = 0;
+  UWU_Bool rebuilt = TRUE;
+  uint64_t decoded[UWU_POSTING_BLOCK_MAX_DOCS];
+  for (i = 0; i < block_count && rebuilt; i++) {
+    size_t count = UWU_PostingBlock_decode(blocks[i], decoded);
+    for (size_t j = 0; j < count && rebuilt; j++) {
+      UWU_SearchSegment *segment =
+          UWU_SearchIndex_segmentOf(index, decoded[j]);
+      if (index->chats[segment->chat].dropped) {
+        continue;
+      }
+      rebuilt = UWU_PostingList_append(&newest, decoded[j], &bytes);
+      docs++;
+    }
+  }
+
+  if (!rebuilt) {
+    // Keeps the old list, the tables can't be compacted now.
+    UWU_PostingBlock_freeAll(newest);
+    free(blocks);
+    index->dropped_docs = SIZE_MAX;
+    return FALSE;
+  }
+
+  for (i = 0; i < block_count; i++) {
+    index->bytes -= sizeof(UWU_PostingBlock) + blocks[i]->capacity;
+    free(blocks[i]);
+  }
+  free(blocks);
+  index->bytes += bytes;
+  term->newest = newest;
+  term->docs = docs;
+  if (docs > 0) {
+    return FALSE;
+  }
+  index->bytes -= sizeof(UWU_SearchTerm) + term->length;
+  free(term);
+  return TRUE;
+}
+
+// Removes the documents of dropped chats from the posting lists, then their
+// segments and the chats themselves.
+void UWU_SearchIndex_compact(UWU_SearchIndex *index) {
+  size_t dropped_docs = index->dropped_docs;
+  // Set to `SIZE_MAX` by any list that couldn't be rebuilt.
+  index->dropped_docs = 0;
+  UWU_FlatMap_removeIf(&index->terms, UWU_SearchIndex_compactTerm, index);
+  if (index->dropped_docs == SIZE_MAX) {
+    // The lists that failed still have them, so their segments must stay.
+    index->dropped_docs = dropped_docs;
+    return;
+  }
+
+  // Numbers the chats left again, keeping their order.
+  uint32_t *numbers =
+      (uint32_t *)malloc((index->chat_count + 1) * sizeof(uint32_t));
+  if (numbers == NULL) {
+    // The lists don't have the dropped documents anymore, their segments
+    // just take space until the next compaction.
+    return;
+  }
+  size_t chat_count = 0;
+  for (size_t i = 0; i < index->chat_count; i++) {
+    numbers[i] = index->chats[i].dropped ? UINT32_MAX : chat_count++;
+  }
+
+  size_t segment_count = 0;
+  for (size_t i = 0; i < index->segment_count; i++) {
+    UWU_SearchSegment segment = index->segments[i];
+    if (numbers[segment.chat] != UINT32_MAX) {
+      segment.chat = numbers[segment.chat];
+      index->segments[segment_count++] = segment;
+    }
+  }
+  index->segment_count = segment_count;
+
+  for (size_t i = 0; i < index->chat_count; i++) {
+    if (numbers[i] == UINT32_MAX) {
+      UWU_String_freeWithMalloc(&index->chats[i].key);
+      continue;
+    }
+    index->chats[numbers[i]] = index->chats[i];
+    // The key is already there, so this can't fail.
+    UWU_Err err = NO_ERROR;
+    UWU_FlatMap_put(&index->chat_numbers, &index->chats[numbers[i]].key,
+                    (void *)(uintptr_t)(numbers[i] + 1), err);
+  }
+  index->chat_count = chat_count;
+  free(numbers);
+}
+
+// Drops the documents of the chat `key`, which is added again as a new chat
+// the next time one of its segments is. The index is compacted once the
+// dropped documents are enough.
+void UWU_SearchIndex_dropChat(UWU_SearchIndex *index,
+                              const UWU_String *const key) {
+  uintptr_t number = (uintptr_t)UWU_FlatMap_remove(&index->chat_numbers, key);
+  if (number == 0) {
+    return;
+  }
+  UWU_SearchChat *chat = &index->chats[number - 1];
+  chat->dropped = TRUE;
+  index->live_docs -= chat->docs;
+  index->dropped_docs += chat->docs;
+  if (index->dropped_docs >= UWU_SEARCH_COMPACT_MIN_DOCS &&
+      index->dropped_docs > index->live_docs) {
+    UWU_SearchIndex_compact(index);
+  }
+}
+
+// The key of the chat `chat` of a hit.
+UWU_String UWU_SearchIndex_chatKey(const UWU_SearchIndex *index,
+                                   uint32_t chat) {
+  return index->chats[chat].key;
+}
+
+// Walks a posting list backwards, from its newest document.
+typedef struct {
+  // The block being walked, NULL once the list is over.
+  const UWU_PostingBlock *block;
+  uint64_t docs[UWU_POSTING_BLOCK_MAX_DOCS];
+  // The current document is `docs[pos]`.
+  size_t pos;
+} UWU_PostingCursor;
+
+void UWU_PostingCursor_load(UWU_PostingCursor *cursor,
+                            const UWU_PostingBlock *block) {
+  cursor->block = block;
+  if (block != NULL) {
+    cursor->pos = UWU_PostingBlock_decode(block, cursor->docs) - 1;
+  }
+}
+
+// Moves to the previous document.
+void UWU_PostingCursor_prev(UWU_PostingCursor *cursor) {
+  if (cursor->pos > 0) {
+    cursor->pos--;
+  } else {
+    UWU_PostingCursor_load(cursor, cursor->block->older);
+  }
+}
+
+// Moves to the newest document that isn't newer than `doc`, skipping whole
+// blocks without decoding them.
+void UWU_PostingCursor_seek(UWU_PostingCursor *cursor, uint64_t doc) {
+  if (cursor->docs[cursor->pos] <= doc) {
+    return;
+  }
+  if (cursor->docs[0] > doc) {
+    const UWU_PostingBlock *block = cursor->block->older;
+    while (block != NULL && block->first_doc > doc) {
+      block = block->older;
+    }
+    UWU_PostingCursor_load(cursor, block);
+    if (block == NULL) {
+      return;
+    }
+  }
+
+  // `docs[0]` is never newer than `doc` by now.
+  size_t low = 0;
+  size_t high = cursor->pos + 1;
+  while (high - low > 1) {
+    size_t mid = low + (high - low) / 2;
+    if (cursor->docs[mid] <= doc) {
+      low = mid;
+    } else {
+      high = mid;
+    }
+  }
+  cursor->pos = low;
+}
+
+// A message that has every term of a query.
+typedef struct {
+  // The chat of the message, check `UWU_SearchIndex_chatKey`.
+  uint32_t chat;
+  uint64_t segment;
+  uint64_t id;
+  // No message after this one on the query is newer than this.
+  uint64_t newest_ms;
+} UWU_SearchHit;
+
+// Decides if the hits on the chat `chat` of a query are wanted.
+typedef UWU_Bool (*UWU_SearchQuery_Filter)(void *context, uint32_t chat);
+
+// The messages that have every term of a query, newest segment first. The
+// index MUST NOT change while it's used.
+typedef struct {
+  const UWU_SearchIndex *index;
+  // One per term, the rarest first.
+  UWU_PostingCursor cursors[UWU_SEARCH_MAX_TERMS];
+  // 0 once there are no more hits.
+  size_t count;
+  UWU_SearchQuery_Filter filter;
+  void *context;
+  // The last chat the filter was asked about and its answer.
+  uint32_t filtered_chat;
+  UWU_Bool filtered_wanted;
+} UWU_SearchQuery;
+
+// Starts the query of `terms` on `query`, it's too big for the stack of most
+// threads to copy it around.
+//
+// - filter: Skips the segments of the chats it returns FALSE for, without
+// returning their hits. NULL keeps every chat.
+void UWU_SearchQuery_init(UWU_SearchQuery *query, const UWU_SearchIndex *index,
+                          const UWU_SearchTerms *const terms,
+                          UWU_SearchQuery_Filter filter, void *context) {
+  query->index = index;
+  query->count = 0;
+  query->filter = filter;
+  query->context = context;
+  query->filtered_chat = UINT32_MAX;
+  query->filtered_wanted = FALSE;
+
+  const UWU_SearchTerm *found[UWU_SEARCH_MAX_TERMS];
+  for (size_t i = 0; i < terms->count; i++) {
+    UWU_String key = {.data = (char *)terms->terms[i],
+                      .length = terms->lengths[i]};
+    const UWU_SearchTerm *term =
+        (const UWU_SearchTerm *)UWU_FlatMap_get(&index->terms, &key);
+    if (term == NULL) {
+      // Nothing has every term.
+      return;
+    }
+    // Sorted by insertion, queries have a few terms.
+    size_t j = i;
+    for (; j > 0 && found[j - 1]->docs > term->docs; j--) {
+      found[j] = found[j - 1];
+    }
+    found[j] = term;
+  }
+
+  for (size_t i = 0; i < terms->count; i++) {
+    UWU_PostingCursor_load(&query->cursors[i], found[i]->newest);
+  }
+  query->count = terms->count;
+}
+
+// Gets the next hit of the query.
+//
+// Returns FALSE once there are no more.
+UWU_Bool UWU_SearchQuery_next(UWU_SearchQuery *query, UWU_SearchHit *hit) {
+  const UWU_SearchIndex *index = query->index;
+  UWU_PostingCursor *rarest = &query->cursors[0];
+  while (query->count > 0) {
+    if (rarest->block == NULL) {
+      query->count = 0;
+      break;
+    }
+
+    // Every list must have the document, otherwise the rarest one skips to
+    // the newest one the others could have.
+    uint64_t doc = rarest->docs[rarest->pos];
+    UWU_Bool agreed = TRUE;
+    for (size_t i = 1; i < query->count && agreed; i++) {
+      UWU_PostingCursor *cursor = &query->cursors[i];
+      UWU_PostingCursor_seek(cursor, doc);
+      if (cursor->block == NULL) {
+        query->count = 0;
+        return FALSE;
+      }
+      if (cursor->docs[cursor->pos] < doc) {
+        UWU_PostingCursor_seek(rarest, cursor->docs[cursor->pos]);
+        agreed = FALSE;
+      }
+    }
+    if (!agreed) {
+      continue;
+    }
+
+    const UWU_SearchSegment *segment = UWU_SearchIndex_segmentOf(index, doc);
+    if (query->filter != NULL && segment->chat != query->filtered_chat) {
+      query->filtered_chat = segment->chat;
+      query->filtered_wanted = query->filter(query->context, segment->chat);
+    }
+    if (query->filter != NULL && !query->filtered_wanted) {
+      // The documents of a segment are consecutive, none of them is wanted.
+      if (segment->first_doc == 0) {
+        query->count = 0;
+        break;
+      }
+      UWU_PostingCursor_seek(rarest, segment->first_doc - 1);
+      continue;
+    }
+
+    UWU_PostingCursor_prev(rarest);
+    if (index->chats[segment->chat].dropped) {
+      continue;
+    }
+    UWU_SearchHit found = {
+        .chat = segment->chat,
+        .segment = segment->segment,
+        .id = segment->segment * index->segment_size +
+              (doc - segment->first_doc) + 1,
+        .newest_ms = segment->newest_ms,
+    };
+    *hit = found;
+    return TRUE;
+  }
+  return FALSE;
+}
+
+/* *****************************************************************************
+Requests
+***************************************************************************** */
+
+// The requests a client sends, check `UWU_ServerMessages`. Their strings point
+// inside the frame they were decoded from, so they're only valid as long as it
+// is. Every length was already checked against the length of the frame.
+
+// | type | length user | username |
+typedef struct {
+  UWU_String username;
+} UWU_GetUserRequest;
+
+// | type | length user | username | status |
+//
+// The status isn't checked, it may not be an `UWU_ConnStatus`.
+typedef struct {
+  UWU_String username;
+  uint8_t status;
+} UWU_ChangeStatusRequest;
+
+// | type | length user | username | length msg | msg |
+// May end with a nonce, check `UWU_NONCE_SIZE`.
+typedef struct {
+  UWU_String username;
+  UWU_String content;
+  UWU_Bool has_nonce;
+  uint32_t nonce;
+} UWU_SendMessageRequest;
+
+// | type | length user | username |
+// May end with the ID to page before, check `UWU_PAGE_BEFORE_SIZE`.
+typedef struct {
+  UWU_String username;
+  UWU_Bool has_before;
+  uint64_t before;
+} UWU_GetMessagesRequest;
+
+// | type | length query | query |
+typedef struct {
+  UWU_String query;
+} UWU_SearchRequest;
+
+// A decoded request, the field to read depends on its type. LIST_USERS has
+// none.
+typedef struct {
+  UWU_ServerMessages type;
+  union {
+    UWU_GetUserRequest get_user;
+    UWU_ChangeStatusRequest change_status;
+    UWU_SendMessageRequest send_message;
+    UWU_GetMessagesRequest get_messages;
+    UWU_SearchRequest search;
+  };
+} UWU_Request;
+
+// Reads the string at `*offset` of the frame, which starts with its length,
+// and moves `offset` past it.
+//
+// Returns FALSE if the frame ends before the string does.
+UWU_Bool UWU_Request_readString(char *data, size_t length, size_t *offset,
+                                UWU_String *out) {
+  if (*offset >= length) {
+    return FALSE;
+  }
+
+  size_t string_length = (uint8_t)data[*offset];
+  if (length - *offset - 1 < string_length) {
+    return FALSE;
+  }
+
+  out->data = &data[*offset + 1];
+  out->length = string_length;
+  *offset += 1 + string_length;
+  return TRUE;
+}
+
+// Decodes the frame of `length` bytes in `data` into `request`, without
+// copying it.
+//
+// Returns FALSE if the type is unknown or the lengths inside the frame don't
+// add up to its length, then `request` must not be used.
+UWU_Bool UWU_Request_decode(char *data, size_t length, UWU_Request *request) {
+  if (length == 0) {
+    return FALSE;
+  }
+
+  request->type = (UWU_ServerMessages)(uint8_t)data[0];
+  size_t offset = 1;
+  switch (request->type) {
+  case LIST_USERS:
+    return length == 1;
+
+  case GET_USER:
+    return UWU_Request_readString(data, length, &offset,
+                                  &request->get_user.username) &&
+           offset == length;
+
+  case CHANGE_STATUS: {
+    UWU_ChangeStatusRequest *change_status = &request->change_status;
+    if (!UWU_Request_readString(data, length, &offset,
+                                &change_status->username) ||
+        length - offset != 1) {
+      return FALSE;
+    }
+    change_status->status = (uint8_t)data[offset];
+    return TRUE;
+  }
+
+  case SEND_MESSAGE: {
+    UWU_SendMessageRequest *send_message = &request->send_message;
+    send_message->has_nonce = FALSE;
+    send_message->nonce = 0;
+    if (!UWU_Request_readString(data, length, &offset,
+                                &send_message->username) ||
+        !UWU_Request_readString(data, length, &offset,
+                                &send_message->content)) {
+      return FALSE;
+    }
+    if (length - offset == UWU_NONCE_SIZE) {
+      send_message->has_nonce = TRUE;
+      send_message->nonce =
+          (uint32_t)UWU_readBigEndian(&data[offset], UWU_NONCE_SIZE);
+      return TRUE;
+    }
+    return offset == length;
+  }
+
+  case GET_MESSAGES: {
+    UWU_GetMessagesRequest *get_messages = &request->get_messages;
+    get_messages->has_before = FALSE;
+    get_messages->before = 0;
+    if (!UWU_Request_readString(data, length, &offset,
+                                &get_messages->username)) {
+      return FALSE;
+    }
+    if (length - offset == UWU_PAGE_BEFORE_SIZE) {
+      get_messages->has_before = TRUE;
+      get_messages->before =
+          UWU_readBigEndian(&data[offset], UWU_PAGE_BEFORE_SIZE);
+      return TRUE;
+    }
+    return offset == length;
+  }
+
+  case SEARCH:
+    return UWU_Request_readString(data, length, &offset,
+                                  &request->search.query) &&
+           offset == length;
+
+  default:
+    return FALSE;
+  }
 }
@@ -1,3 +1,4 @@
+#include <signal.h>
 #include <stdio.h>
 #define NOB_IMPLEMENTATION
 #define NOB_STRIP_PREFIX
@@ -7,6 +8,15 @@
 #define SRC_FOLDER "src/"
 #define DEPS_FOLDER "deps/"
 #define MONGOOSE_DIR DEPS_FOLDER "mongoose/"
+#define PGO_FOLDER BUILD_FOLDER "pgo/"
+
+// The workload runs against its own port so it doesn't collide with a server
+// that may already be running.
+#define WORKLOAD_URL "ws://localhost:8765"
+// Nodes started by `-cluster-bench`, they listen on consecutive ports
+// starting at the one of `WORKLOAD_URL`.
+#define CLUSTER_BENCH_NODES 3
+#define CLUSTER_BENCH_PORT 8765
 
 #define HELP
 
@@ -16,7 +26,8 @@ bool args_contains(int argc, char **argv, const char *arg, int arg_length) {
   }
 
   for (int i = 0; i < argc; i++) {
-    if (memcmp(argv[i], arg, arg_length) == 0) {
+    if (strlen(argv[i]) == (size_t)arg_length &&
+        memcmp(argv[i], arg, arg_length) == 0) {
       return true;
     }
   }
@@ -24,16 +35,513 @@ bool args_contains(int argc, char **argv, const char *arg, int arg_length) {
   return false;
 }
 
+// Returns the value of an argument with the form `prefix<value>`.
+// NULL if no argument starts with `prefix`.
+const char *args_value(int argc, char **argv, const char *prefix) {
+  size_t prefix_length = strlen(prefix);
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], prefix, prefix_length) == 0) {
+      return argv[i] + prefix_length;
+    }
+  }
+
+  return NULL;
+}
+
+// All the options that change how the server is compiled.
+typedef struct {
+  // Name of the profile: debug, release or pgo.
+  const char *name;
+  // Release and PGO profiles are optimized, debug isn't.
+  bool optimized;
+  bool production;
+  bool verbose;
+  bool tls;
+  bool o3;
+  // Value for `-march`, NULL to use the compiler default.
+  const char *march;
+} Build_Config;
+
+// Runs the command on the builder through bash and resets the builder.
+bool run_bash(String_Builder *sb) {
+  sb_append_null(sb);
+  Cmd cmd = {0};
+  nob_cmd_append(&cmd, "bash", "-c", sb->items);
+  bool ok = nob_cmd_run_sync_and_reset(&cmd);
+  nob_cmd_free(cmd);
+  sb->count = 0;
+  return ok;
+}
+
+void append_compiler(String_Builder *sb, Build_Config *config) {
+  sb_append_cstr(sb, "clang ");
+  if (config->verbose) {
+    sb_append_cstr(sb, "-v ");
+  }
+}
+
+// Appends the optimization flags of the profile.
+//
+// - pgo_flags: Extra flags for profile guided optimization, may be NULL.
+void append_profile_flags(String_Builder *sb, Build_Config *config,
+                          const char *pgo_flags) {
+  if (!config->optimized) {
+    sb_append_cstr(sb, "-g -O0 ");
+  } else {
+    sb_append_cstr(sb, config->o3 ? "-O3 " : "-O2 ");
+    sb_append_cstr(sb, "-flto=thin -DNDEBUG ");
+    if (config->march != NULL) {
+      sb_appendf(sb, "-march=%s ", config->march);
+    }
+  }
+
+  if (pgo_flags != NULL) {
+    sb_appendf(sb, "%s ", pgo_flags);
+  }
+
+  if (config->production) {
+    sb_append_cstr(sb, "-Werror ");
+  }
+
+  if (config->tls) {
+    sb_append_cstr(sb, "-DMG_TLS=MG_TLS_OPENSSL ");
+  }
+}
+
+// Compiles mongoose as a separate object.
+//
+// The flags used are saved next to the object, so it's only recompiled when
+// mongoose or the flags change.
+bool build_mongoose_object(Build_Config *config, const char *output,
+                           const char *pgo_flags) {
+  String_Builder flags = {0};
+  append_profile_flags(&flags, config, pgo_flags);
+
+  String_Builder flags_path = {0};
+  sb_appendf(&flags_path, "%s.flags", output);
+  sb_append_null(&flags_path);
+
+  String_Builder old_flags = {0};
+  bool same_flags = nob_file_exists(flags_path.items) == 1 &&
+                    read_entire_file(flags_path.items, &old_flags) &&
+                    old_flags.count == flags.count &&
+                    memcmp(old_flags.items, flags.items, flags.count) == 0;
+
+  bool ok = true;
+  if (!same_flags || needs_rebuild1(output, MONGOOSE_DIR "mongoose.c") != 0) {
+    String_Builder sb = {0};
+    append_compiler(&sb, config);
+    sb_append_buf(&sb, flags.items, flags.count);
+    sb_appendf(&sb, "-c -o %s " MONGOOSE_DIR "mongoose.c", output);
+    ok = run_bash(&sb) &&
+         write_entire_file(flags_path.items, flags.items, flags.count);
+    sb_free(sb);
+  }
+
+  sb_free(flags);
+  sb_free(flags_path);
+  sb_free(old_flags);
+  return ok;
+}
+
+// Compiles the server binary into `output`.
+//
+// Debug builds include mongoose directly, optimized builds link it as a
+// separate object.
+bool build_server(Build_Config *config, const char *output,
+                  const char *pgo_flags) {
+  String_Builder mongoose_object = {0};
+  if (config->optimized) {
+    sb_appendf(&mongoose_object, BUILD_FOLDER "mongoose-%s%s.o", config->name,
+               pgo_flags != NULL && strstr(pgo_flags, "generate") != NULL
+                   ? "-instrumented"
+                   : "");
+    sb_append_null(&mongoose_object);
+    if (!build_mongoose_object(config, mongoose_object.items, pgo_flags)) {
+      sb_free(mongoose_object);
+      return false;
+    }
+  }
+
+  String_Builder sb = {0};
+  append_compiler(&sb, config);
+  append_profile_flags(&sb, config, pgo_flags);
+  sb_append_cstr(&sb, "-Wall -fuse-ld=lld ");
+  sb_appendf(&sb, "-o %s " SRC_FOLDER "main.c ", output);
+  if (config->optimized) {
+    sb_appendf(&sb, "-DUWU_MONGOOSE_OBJECT %s ", mongoose_object.items);
+  }
+  sb_append_cstr(&sb, "-lz");
+  if (config->tls) {
+    sb_append_cstr(&sb, " -lssl -lcrypto");
+  }
+
+  bool ok = run_bash(&sb);
+  sb_free(sb);
+  sb_free(mongoose_object);
+  return ok;
+}
+
+bool build_workload(Build_Config *config) {
+  String_Builder sb = {0};
+  append_compiler(&sb, config);
+  sb_append_cstr(&sb, "-O2 -Wall -fuse-ld=lld ");
+  sb_append_cstr(&sb, "-o " BUILD_FOLDER "workload " SRC_FOLDER "workload.c "
+                      "-lz");
+  bool ok = run_bash(&sb);
+  sb_free(sb);
+  return ok;
+}
+
+// Builds and runs a micro benchmark, `src/<name>.c`.
+bool run_micro_bench(Build_Config *config, const char *name) {
+  String_Builder sb = {0};
+  append_compiler(&sb, config);
+  sb_append_cstr(&sb, "-O2 -Wall -fuse-ld=lld ");
+  if (config->march != NULL) {
+    sb_appendf(&sb, "-march=%s ", config->march);
+  }
+  sb_appendf(&sb,
+             "-o " BUILD_FOLDER "%s " SRC_FOLDER "%s.c -lz -lpthread && "
+             "./" BUILD_FOLDER "%s",
+             name, name, name);
+  bool ok = run_bash(&sb);
+  sb_free(sb);
+  return ok;
+}
+
+// Builds the request decoder fuzz target, `src/request_fuzz.c`, and runs it
+// for `seconds`. Crashing inputs are saved on `BUILD_FOLDER`.
+bool run_request_fuzz(Build_Config *config, size_t seconds) {
+  String_Builder sb = {0};
+  append_compiler(&sb, config);
+  sb_append_cstr(&sb, "-g -O1 -fsanitize=fuzzer,address,undefined ");
+  sb_appendf(&sb,
+             "-o " BUILD_FOLDER "request_fuzz " SRC_FOLDER
+             "request_fuzz.c -lz -lpthread && "
+             "./" BUILD_FOLDER "request_fuzz -max_len=600 "
+             "-max_total_time=%zu -artifact_prefix=" BUILD_FOLDER,
+             seconds);
+  bool ok = run_bash(&sb);
+  sb_free(sb);
+  return ok;
+}
+
+// Runs the synthetic workload against `server_binary`.
+//
+// - env: Extra environment variables for the server, may be NULL.
+// - server_args: Extra flags for the server, may be NULL.
+// - req_per_sec: Where to save the throughput the workload measured.
+bool run_workload(const char *server_binary, const char *env,
+                  const char *server_args, double *req_per_sec) {
+  String_Builder sb = {0};
+  // The workload measures throughput, so the rate limiter is turned off.
+  sb_appendf(&sb,
+             "exec env %s %s -url " WORKLOAD_URL
+             " -rate-conn 0 -rate-send 0 -rate-get 0 %s > /dev/null 2>&1",
+             env != NULL ? env : "", server_binary,
+             server_args != NULL ? server_args : "");
+  sb_append_null(&sb);
+
+  Cmd cmd = {0};
+  nob_cmd_append(&cmd, "bash", "-c", sb.items);
+  Proc server = nob_cmd_run_async_and_reset(&cmd);
+  sb.count = 0;
+  if (server == NOB_INVALID_PROC) {
+    sb_free(sb);
+    return false;
+  }
+
+  sb_append_cstr(&sb, "./" BUILD_FOLDER "workload -url " WORKLOAD_URL
+                      " > " BUILD_FOLDER "workload.txt");
+  bool ok = run_bash(&sb);
+
+  // The server only writes its profile when it exits cleanly.
+  kill(server, SIGINT);
+  if (!nob_proc_wait(server)) {
+    ok = false;
+  }
+
+  String_Builder output = {0};
+  if (ok && read_entire_file(BUILD_FOLDER "workload.txt", &output)) {
+    sb_append_null(&output);
+    const char *result = strrchr(output.items, '(');
+    ok = result != NULL && sscanf(result, "(%lf req/s)", req_per_sec) == 1;
+  }
+
+  if (!ok) {
+    nob_log(NOB_ERROR, "The workload failed against %s!", server_binary);
+  }
+
+  sb_free(output);
+  sb_free(sb);
+  nob_cmd_free(cmd);
+  return ok;
+}
+
+// Saves the binary size (and benchmark result if any) of the profile and
+// prints the difference against every other profile built before.
+//
+// - req_per_sec: Negative if the benchmark wasn't run.
+void report_profile(const char *profile, const char *binary,
+                    double req_per_sec) {
+  struct stat binary_stat = {0};
+  if (stat(binary, &binary_stat) != 0) {
+    nob_log(NOB_ERROR, "Can't read the size of %s!", binary);
+    return;
+  }
+  size_t size = (size_t)binary_stat.st_size;
+
+  const char *profiles[] = {"debug", "release", "pgo"};
+  String_Builder sb = {0};
+
+  // Keep the last benchmark result if this build didn't run one.
+  double previous_req_per_sec = -1;
+  size_t previous_size = 0;
+  sb_appendf(&sb, BUILD_FOLDER "profile-%s.txt", profile);
+  sb_append_null(&sb);
+  String_Builder saved = {0};
+  if (req_per_sec < 0 && nob_file_exists(sb.items) == 1 &&
+      read_entire_file(sb.items, &saved)) {
+    sb_append_null(&saved);
+    if (sscanf(saved.items, "%zu %lf", &previous_size,
+               &previous_req_per_sec) == 2 &&
+        previous_size == size) {
+      req_per_sec = previous_req_per_sec;
+    }
+  }
+
+  char line[128];
+  int line_length = snprintf(line, sizeof(line), "%zu %f\n", size, req_per_sec);
+  write_entire_file(sb.items, line, line_length);
+
+  nob_log(NOB_INFO, "[%s] binary size: %zu bytes", profile, size);
+  if (req_per_sec >= 0) {
+    nob_log(NOB_INFO, "[%s] workload: %.1f req/s", profile, req_per_sec);
+  }
+
+  for (size_t i = 0; i < ARRAY_LEN(profiles); i++) {
+    if (strcmp(profiles[i], profile) == 0) {
+      continue;
+    }
+
+    sb.count = 0;
+    saved.count = 0;
+    sb_appendf(&sb, BUILD_FOLDER "profile-%s.txt", profiles[i]);
+    sb_append_null(&sb);
+    if (nob_file_exists(sb.items) != 1 || !read_entire_file(sb.items, &saved)) {
+      continue;
+    }
+    sb_append_null(&saved);
+
+    size_t other_size = 0;
+    double other_req_per_sec = -1;
+    if (sscanf(saved.items, "%zu %lf", &other_size, &other_req_per_sec) != 2 ||
+        other_size == 0) {
+      continue;
+    }
+
+    nob_log(NOB_INFO, "[%s] size vs %s: %+.1f%% (%zu bytes)", profile,
+            profiles[i], 100.0 * ((double)size - other_size) / other_size,
+            other_size);
+    if (req_per_sec >= 0 && other_req_per_sec > 0) {
+      nob_log(NOB_INFO, "[%s] workload vs %s: %+.1f%% (%.1f req/s)", profile,
+              profiles[i],
+              100.0 * (req_per_sec - other_req_per_sec) / other_req_per_sec,
+              other_req_per_sec);
+    }
+  }
+
+  sb_free(sb);
+  sb_free(saved);
+}
+
+// Runs the workload against `server_binary` sending with mongoose (epoll) and
+// with io_uring, and prints both results.
+bool compare_io_uring(const char *server_binary) {
+  double epoll_req_per_sec = 0;
+  double uring_req_per_sec = 0;
+  if (!run_workload(server_binary, NULL, NULL, &epoll_req_per_sec) ||
+      !run_workload(server_binary, NULL, "-io-uring", &uring_req_per_sec))
+    return false;
+
+  nob_log(NOB_INFO, "[epoll] workload: %.1f req/s", epoll_req_per_sec);
+  nob_log(NOB_INFO, "[io_uring] workload: %.1f req/s (%+.1f%%)",
+          uring_req_per_sec,
+          100.0 * (uring_req_per_sec - epoll_req_per_sec) / epoll_req_per_sec);
+  return true;
+}
+
+// Runs the workload against a cluster of `nodes` servers running
+// `server_binary`, every client connects to the node of its username.
+//
+// - req_per_sec: Where to save the throughput the workload measured.
+// - p50_ms, p99_ms: Where to save the latency of the DMs.
+bool run_cluster_workload(const char *server_binary, size_t nodes,
+                          double *req_per_sec, double *p50_ms,
+                          double *p99_ms) {
+  String_Builder urls = {0};
+  for (size_t i = 0; i < nodes; i++) {
+    sb_appendf(&urls, "%sws://localhost:%zu", i == 0 ? "" : ",",
+               CLUSTER_BENCH_PORT + i);
+  }
+  sb_append_null(&urls);
+
+  String_Builder sb = {0};
+  Cmd cmd = {0};
+  Proc servers[CLUSTER_BENCH_NODES] = {0};
+  bool ok = true;
+  for (size_t i = 0; i < nodes; i++) {
+    sb.count = 0;
+    sb_appendf(&sb,
+               "exec %s -url ws://localhost:%zu -rate-conn 0 -rate-send 0 "
+               "-rate-get 0",
+               server_binary, CLUSTER_BENCH_PORT + i);
+    if (nodes > 1) {
+      // Every node seals its own copy of the group chat.
+      sb_appendf(&sb,
+                 " -peers %s -node %zu -peer-secret bench -history-dir "
+                 BUILD_FOLDER "history-%zu",
+                 urls.items, i, i);
+    }
+    sb_append_cstr(&sb, " > /dev/null 2>&1");
+    sb_append_null(&sb);
+
+    nob_cmd_append(&cmd, "bash", "-c", sb.items);
+    servers[i] = nob_cmd_run_async_and_reset(&cmd);
+    if (servers[i] == NOB_INVALID_PROC) {
+      ok = false;
+    }
+  }
+
+  if (ok) {
+    sb.count = 0;
+    sb_appendf(&sb,
+               "./" BUILD_FOLDER "workload -url %s > " BUILD_FOLDER
+               "workload.txt",
+               urls.items);
+    ok = run_bash(&sb);
+  }
+
+  for (size_t i = 0; i < nodes; i++) {
+    if (servers[i] != NOB_INVALID_PROC) {
+      kill(servers[i], SIGINT);
+      if (!nob_proc_wait(servers[i])) {
+        ok = false;
+      }
+    }
+  }
+
+  String_Builder output = {0};
+  if (ok && read_entire_file(BUILD_FOLDER "workload.txt", &output)) {
+    sb_append_null(&output);
+    const char *latency = strstr(output.items, "latency p50 ");
+    const char *result = strrchr(output.items, '(');
+    ok = latency != NULL &&
+         sscanf(latency, "latency p50 %lf ms, p99 %lf ms", p50_ms, p99_ms) ==
+             2 &&
+         result != NULL && sscanf(result, "(%lf req/s)", req_per_sec) == 1;
+  }
+
+  if (!ok) {
+    nob_log(NOB_ERROR, "The workload failed against %zu nodes!", nodes);
+  }
+
+  sb_free(output);
+  sb_free(urls);
+  sb_free(sb);
+  nob_cmd_free(cmd);
+  return ok;
+}
+
+// Runs the workload against a single server and against a local cluster, and
+// prints the throughput and DM latency of both.
+bool compare_cluster(const char *server_binary) {
+  double single[3] = {0};
+  double cluster[3] = {0};
+  if (!run_cluster_workload(server_binary, 1, &single[0], &single[1],
+                            &single[2]) ||
+      !run_cluster_workload(server_binary, CLUSTER_BENCH_NODES, &cluster[0],
+                            &cluster[1], &cluster[2]))
+    return false;
+
+  nob_log(NOB_INFO, "[1 node] workload: %.1f req/s, DM p50 %.2f ms, p99 %.2f ms",
+          single[0], single[1], single[2]);
+  nob_log(NOB_INFO,
+          "[%d nodes] workload: %.1f req/s (%+.1f%%), DM p50 %.2f ms, p99 "
+          "%.2f ms",
+          CLUSTER_BENCH_NODES, cluster[0],
+          100.0 * (cluster[0] - single[0]) / single[0], cluster[1],
+          cluster[2]);
+  return true;
+}
+
+// Builds an instrumented server, runs the workload on it and rebuilds the
+// server using the collected profile.
+bool build_with_pgo(Build_Config *config, const char *output) {
+  bool result = true;
+  String_Builder sb = {0};
+  if (!mkdir_if_not_exists(PGO_FOLDER))
+    return_defer(false);
+
+  sb_append_cstr(&sb, "rm -f " PGO_FOLDER "*.profraw");
+  if (!run_bash(&sb))
+    return_defer(false);
+
+  if (!build_server(config, BUILD_FOLDER "main-instrumented",
+                    "-fprofile-instr-generate"))
+    return_defer(false);
+
+  double instrumented_req_per_sec = 0;
+  if (!run_workload(BUILD_FOLDER "main-instrumented",
+                    "LLVM_PROFILE_FILE=" PGO_FOLDER "main-%p.profraw", NULL,
+                    &instrumented_req_per_sec))
+    return_defer(false);
+
+  sb_append_cstr(&sb, "llvm-profdata merge -output=" PGO_FOLDER
+                      "main.profdata " PGO_FOLDER "*.profraw");
+  if (!run_bash(&sb))
+    return_defer(false);
+
+  result = build_server(config, output,
+                        "-fprofile-instr-use=" PGO_FOLDER "main.profdata");
+
+defer:
+  sb_free(sb);
+  return result;
+}
+
 int main(int argc, char **argv) {
   NOB_GO_REBUILD_URSELF(argc, argv);
 
   if (args_contains(argc, argv, "-h", 2)) {
-    fprintf(stderr, "Usage: nob [-compiler options]\n"
-                    "Compiler options:\n"
-                    "  -v: Compiler with verbosity enabled.\n"
-                    "  -c: Compile the terminal client binary.\n"
-                    "  -p: Compile for production.\n"
-                    "  -h: Display help menu.\n");
+    fprintf(stderr,
+            "Usage: nob [-compiler options]\n"
+            "Compiler options:\n"
+            "  -v: Compiler with verbosity enabled.\n"
+            "  -c: Compile the terminal client binary.\n"
+            "  -p: Compile for production (release profile with -Werror).\n"
+            "  -tls: Compile the server with OpenSSL TLS support.\n"
+            "  -release: Compile with -O2, LTO and mongoose as its own "
+            "object.\n"
+            "  -pgo: Release build optimized with a profile of the synthetic "
+            "workload.\n"
+            "  -O3: Use -O3 instead of -O2 on optimized builds.\n"
+            "  -march=CPU: Target CPU of optimized builds (e.g. native).\n"
+            "  -bench: Run the synthetic workload against the new server.\n"
+            "  -map-bench: Only compare the chats map against hashmap.h.\n"
+            "  -history-bench: Only compare group chat appends against a "
+            "mutex.\n"
+            "  -search-bench: Only compare searches on the index against "
+            "scanning the messages.\n"
+            "  -request-bench: Only compare the request decoder against "
+            "reading frames without checks.\n"
+            "  -fuzz: Fuzz the request decoder for a minute.\n"
+            "  -uring-bench: Run the synthetic workload against the new "
+            "server sending with epoll and with io_uring.\n"
+            "  -cluster-bench: Run the synthetic workload against a single "
+            "server and against a local cluster of 3.\n"
+            "  -h: Display help menu.\n");
     return 1;
   }
   Cmd cmd = {0};
@@ -50,6 +558,12 @@ int main(int argc, char **argv) {
     compile_for_production = true;
   }
 
+  bool compile_with_tls = false;
+  if (args_contains(argc, argv, "-tls", 4)) {
+    nob_log(NOB_WARNING, "Will compile with OpenSSL TLS support!");
+    compile_with_tls = true;
+  }
+
   bool compile_terminal_client = false;
   if (args_contains(argc, argv, "-c", 2)) {
     nob_log(NOB_WARNING, "Compiling terminal client!");
@@ -74,7 +588,7 @@ int main(int argc, char **argv) {
     }
 
     sb_append_cstr(&sb, "-Wall -fuse-ld=lld ");
-    sb_append_cstr(&sb, "-o build/client " SRC_FOLDER "cli_client.c");
+    sb_append_cstr(&sb, "-o build/client " SRC_FOLDER "cli_client.c -lz");
 
     nob_cmd_append(&cmd, "bash", "-c", sb.items);
     if (!nob_cmd_run_sync_and_reset(&cmd))
@@ -82,22 +596,73 @@ int main(int argc, char **argv) {
     return 0;
   }
 
-  String_Builder sb = {0};
-  sb_append_cstr(&sb, "clang ");
-  if (compile_with_verbosity) {
-    sb_append_cstr(&sb, "-v ");
+  Build_Config config = {
+      .name = "debug",
+      .optimized = false,
+      .production = compile_for_production,
+      .verbose = compile_with_verbosity,
+      .tls = compile_with_tls,
+      .o3 = args_contains(argc, argv, "-O3", 3),
+      .march = args_value(argc, argv, "-march="),
+  };
+
+  bool use_pgo = args_contains(argc, argv, "-pgo", 4);
+  if (use_pgo) {
+    nob_log(NOB_WARNING, "Will compile with profile guided optimization!");
+    config.name = "pgo";
+    config.optimized = true;
+  } else if (compile_for_production ||
+             args_contains(argc, argv, "-release", 8)) {
+    nob_log(NOB_WARNING, "Will compile an optimized release!");
+    config.name = "release";
+    config.optimized = true;
   }
-  if (!compile_for_production) {
-    sb_append_cstr(&sb, "-g -O0 ");
-  } else {
-    sb_append_cstr(&sb, "-Werror ");
+
+  if (args_contains(argc, argv, "-map-bench", 10)) {
+    return run_micro_bench(&config, "map_bench") ? 0 : 1;
   }
 
-  sb_append_cstr(&sb, "-Wall -fuse-ld=lld ");
-  sb_append_cstr(&sb, "-o build/main " SRC_FOLDER "main.c");
+  if (args_contains(argc, argv, "-history-bench", 14)) {
+    return run_micro_bench(&config, "history_bench") ? 0 : 1;
+  }
 
-  nob_cmd_append(&cmd, "bash", "-c", sb.items);
-  if (!nob_cmd_run_sync_and_reset(&cmd))
+  if (args_contains(argc, argv, "-search-bench", 13)) {
+    return run_micro_bench(&config, "search_bench") ? 0 : 1;
+  }
+
+  if (args_contains(argc, argv, "-request-bench", 14)) {
+    return run_micro_bench(&config, "request_bench") ? 0 : 1;
+  }
+
+  if (args_contains(argc, argv, "-fuzz", 5)) {
+    return run_request_fuzz(&config, 60) ? 0 : 1;
+  }
+
+  bool run_bench = args_contains(argc, argv, "-bench", 6);
+  bool run_uring_bench = args_contains(argc, argv, "-uring-bench", 12);
+  bool run_cluster_bench = args_contains(argc, argv, "-cluster-bench", 14);
+  if ((use_pgo || run_bench || run_uring_bench || run_cluster_bench) &&
+      !build_workload(&config))
     return 1;
+
+  if (use_pgo) {
+    if (!build_with_pgo(&config, BUILD_FOLDER "main"))
+      return 1;
+  } else if (!build_server(&config, BUILD_FOLDER "main", NULL)) {
+    return 1;
+  }
+
+  double req_per_sec = -1;
+  if (run_bench &&
+      !run_workload(BUILD_FOLDER "main", NULL, NULL, &req_per_sec))
+    return 1;
+
+  if (run_uring_bench && !compare_io_uring(BUILD_FOLDER "main"))
+    return 1;
+
+  if (run_cluster_bench && !compare_cluster(BUILD_FOLDER "main"))
+    return 1;
+
+  report_profile(config.name, BUILD_FOLDER "main", req_per_sec);
   return 0;
 }
@@ -0,0 +1,118 @@
+// Micro benchmark of the group chat history used by `./nob -history-bench`.
+//
+// Every thread appends `-messages` messages to a shared history. The lock-free
+// `UWU_ChannelHistory` is compared against a `UWU_ChatHistory` guarded by its
+// mutex, the way the group chat used to work, with 1, 2, 4... `-threads`
+// writers.
+#include "../../lib/lib.c"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// Same capacity as the server's group chat.
+static const size_t BENCH_HISTORY_CAPACITY = 255;
+
+static size_t s_messages = 200000;
+static size_t s_threads = 8;
+
+static UWU_ChannelHistory CHANNEL = {};
+static UWU_ChatHistory LOCKED = {};
+
+static UWU_String BENCH_USERNAME = {.data = (char *)"~", .length = 1};
+static UWU_String BENCH_CONTENT = {
+    .data = (char *)"The quick brown fox jumps over the lazy dog!",
+    .length = 44};
+
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+void *channel_writer(void *arg) {
+  for (size_t i = 0; i < s_messages; i++) {
+    UWU_ChannelHistory_append(&CHANNEL, &BENCH_USERNAME, &BENCH_CONTENT, 0);
+  }
+  return NULL;
+}
+
+void *locked_writer(void *arg) {
+  UWU_ChatEntry entry = {
+      .content = BENCH_CONTENT,
+      .origin_username = UWU_Username_borrow(&BENCH_USERNAME),
+  };
+  for (size_t i = 0; i < s_messages; i++) {
+    UWU_PanicIf(pthread_mutex_lock(&LOCKED.mx) != 0,
+                "Fatal: Can't lock the history mutex!");
+    UWU_ChatHistory_addMessage(&LOCKED, &entry);
+    UWU_PanicIf(pthread_mutex_unlock(&LOCKED.mx) != 0,
+                "Fatal: Can't unlock the history mutex!");
+  }
+  return NULL;
+}
+
+// Runs `threads` writers and returns the appends per second.
+double run_writers(void *(*writer)(void *), size_t threads) {
+  pthread_t pids[threads];
+
+  uint64_t start = now_ns();
+  for (size_t i = 0; i < threads; i++) {
+    if (0 != pthread_create(&pids[i], NULL, writer, NULL)) {
+      fprintf(stderr, "Error: Can't create the writer threads!\n");
+      exit(1);
+    }
+  }
+  for (size_t i = 0; i < threads; i++) {
+    pthread_join(pids[i], NULL);
+  }
+  uint64_t elapsed = now_ns() - start;
+
+  return (double)(threads * s_messages) * 1e9 /
+         (double)(elapsed == 0 ? 1 : elapsed);
+}
+
+int main(int argc, char *argv[]) {
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-messages") == 0 && argv[i + 1] != NULL) {
+      s_messages = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-threads") == 0 && argv[i + 1] != NULL) {
+      s_threads = strtoul(argv[++i], NULL, 10);
+    } else {
+      printf("Usage: %s OPTIONS\n"
+             "  -messages N  - Appends per thread, default: %zu\n"
+             "  -threads N  - Maximum number of writers, default: %zu\n",
+             argv[0], s_messages, s_threads);
+      return 1;
+    }
+  }
+
+  if (s_messages == 0 || s_threads == 0) {
+    fprintf(stderr,
+            "Error: The benchmark needs at least 1 message and 1 thread!\n");
+    return 1;
+  }
+
+  printf("%zu appends per writer\n", s_messages);
+  printf("%-8s %14s %14s\n", "writers", "channel op/s", "mutex op/s");
+  for (size_t threads = 1; threads <= s_threads; threads *= 2) {
+    UWU_Err err = NO_ERROR;
+    CHANNEL = UWU_ChannelHistory_init(BENCH_HISTORY_CAPACITY,
+                                      UWU_String_copy(&BENCH_USERNAME, err),
+                                      err);
+    LOCKED = UWU_ChatHistory_init(BENCH_HISTORY_CAPACITY,
+                                  UWU_String_copy(&BENCH_USERNAME, err), err);
+    if (CHANNEL.slots == NULL || LOCKED.messages == NULL) {
+      fprintf(stderr, "Error: Can't allocate the histories!\n");
+      return 1;
+    }
+
+    double channel = run_writers(channel_writer, threads);
+    double locked = run_writers(locked_writer, threads);
+    printf("%-8zu %14.0f %14.0f\n", threads, channel, locked);
+
+    UWU_ChannelHistory_deinit(&CHANNEL);
+    UWU_ChatHistory_deinit(&LOCKED);
+  }
+
+  return 0;
+}
@@ -4,16 +4,27 @@
 // Example Websocket server. See https://mongoose.ws/tutorials/websocket-server/
 
 #include "../../lib/lib.c"
-#include "../deps/hashmap/hashmap.h"
+#ifdef UWU_MONGOOSE_OBJECT
+// Optimized profiles compile mongoose as its own object, see `nob.c`.
+#include "../deps/mongoose/mongoose.h"
+#else
 #include "../deps/mongoose/mongoose.c"
+#endif
 #include "pthread.h"
 #include "time.h"
+#include <dirent.h>
 #include <fcntl.h>
 #include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
 
 /* *****************************************************************************
 Constants
@@ -23,19 +34,69 @@ static const char *s_listen_on = "ws://localhost:8000";
 static const char *s_ca_path = "ca.pem";
 static const char *s_cert_path = "cert.pem";
 static const char *s_key_path = "key.pem";
+// Frames smaller than this are never compressed, even if the connection
+// negotiated permessage-deflate. Compressing them costs more than it saves.
+static size_t s_deflate_min_size = 1024;
+// Send the frames queued by other threads with io_uring instead of one
+// `send` per connection. Only available on Linux.
+static UWU_Bool s_io_uring = FALSE;
+// Longest time the event loop holds the frames other threads queue, so more
+// of them are sent with the same write. 0 sends them as soon as it wakes up.
+static uint64_t s_coalesce_ms = 0;
+// Frames queued by other threads this big or bigger are sent without copying
+// them, using io_uring zero copy sends. 0 disables it.
+static size_t s_zerocopy_min = 0;
+// Comma separated URLs of every node of the cluster, this one included, in
+// the same order on all of them. NULL runs a single server.
+static const char *s_peers = NULL;
+// Position of this server on `s_peers`.
+static size_t s_node_id = 0;
+// Every node presents it when it links to another one, a link without it is
+// rejected. Needed to run a cluster.
+static const char *s_peer_secret = NULL;
+// URL of the primary this server is a hot standby of. It keeps a copy of its
+// state and listens on `s_listen_on` once the primary goes away. NULL runs a
+// primary.
+static const char *s_follow = NULL;
+// Shared by a primary and its follower, which presents it when it links to
+// the primary. A primary without it can't be followed.
+static const char *s_replica_secret = NULL;
+// Bytes the offline mailboxes can hold in memory, the DMs that don't fit are
+// written to `s_mailbox_dir`.
+static size_t s_mailbox_budget = 4 * 1024 * 1024;
+// Directory for the DMs that don't fit on the mailbox budget.
+static const char *s_mailbox_dir = "mailboxes";
+// Bytes of memory the server tries to stay under. Once they're exceeded the
+// least recently used DM histories are evicted. 0 disables the budget.
+static size_t s_memory_budget = 256 * 1024 * 1024;
+// Directory the evicted DM histories are written to, compressed.
+static const char *s_evict_dir = "evicted";
+// TRUE drops the evicted DM histories instead of writing them.
+static UWU_Bool s_evict_drop = FALSE;
+// Directory the older messages of the chats are sealed into, check
+// `History Tiers`.
+static const char *s_history_dir = "history";
 
 static const char EXIT_PTHREAD_MSG[] = {0};
-// The maximum amount of data a response can have.
-// This allows us to manage requests without having to allocate new memory.
-static const size_t RESP_ARENA_MAX_SIZE = 1 + 1 + 255 * (1 + 255 + 1 + 255);
-// Explanation of the above constant:
+// The size of each block of the response arena.
+// Most responses fit in a single block, bigger ones (like a full GOT_MESSAGES
+// response) chain extra blocks that are released after the request.
+static const size_t RESP_ARENA_BLOCK_SIZE = 512;
+// A GOT_MESSAGES response has the following shape:
 /* clang-format off */
   /* | type (1 byte)  | num msgs (1 byte) | length user (1 byte) | username (max 255 bytes) | length msg (1 bye) | msg (max 255 bytes) |*/
 /* clang-format on */
 
 // The length of the maximum message the server can receive according to the
-// protocol.
-static const size_t REQ_ARENA_MAX_SIZE = 3 + 255;
+// protocol: a SEND_MESSAGE with a 255 bytes username and message plus a nonce.
+static const size_t REQ_ARENA_MAX_SIZE = 3 + 255 + 255 + 4;
+// Bytes added before a request when it's written to the pipe of its handler.
+// - [0]: 1 if the message is from the protocol, 0 if the thread should stop
+// processing messages.
+// - [1..2]: The length of the message, big endian.
+static const size_t REQ_PIPE_HEADER_SIZE = 3;
+// How many ACKs each connection remembers to answer retransmissions.
+#define MAX_REMEMBERED_ACKS 16
 
 // Global group chat
 static const UWU_String GROUP_CHAT_CHANNEL = {.data = "~", .length = 1};
@@ -47,43 +108,245 @@ static const UWU_String SEPARATOR = {.data = "&/)", .length = strlen("&/)")};
 // This value CAN'T be higher than 255 since that's the maximum number of
 // messages that can be sent over the wire.
 static const size_t MAX_MESSAGES_PER_CHAT = 100;
+// Times GET_MESSAGES tries to copy a DM history without locking it before it
+// gives up and locks.
+static const size_t MAX_OPTIMISTIC_HISTORY_READS = 4;
 
 // The amount of seconds that need to pass in order for a user to become IDLE.
 static const time_t IDLE_SECONDS_LIMIT = 15;
-// The amount of seconds that we wait before checking for IDLE users again.
-static const struct timespec IDLE_CHECK_FREQUENCY = {.tv_sec = 3, .tv_nsec = 0};
+
+// How often we check if the TLS files changed on disk.
+static const uint64_t TLS_RELOAD_CHECK_MS = 5000;
+// Longest time the server waits for connections to send what they have
+// queued when it shuts down.
+static const uint64_t SHUTDOWN_DRAIN_MS = 500;
+// Writes the io_uring backend can submit at once.
+static const unsigned RING_ENTRIES = 256;
+// Size of the registered buffer the io_uring writes are copied to.
+static const size_t RING_BUFFER_SIZE = 256 * 1024;
+// How often a node tries to link to the nodes of the cluster it isn't linked
+// to yet.
+static const uint64_t PEER_RETRY_MS = 500;
+// Header the links between servers carry their secret on.
+#define LINK_SECRET_HEADER "X-UWU-Secret"
+// Longest time a follower tries to listen on the URL of the primary it lost,
+// the primary may still be closing its listener.
+static const uint64_t FAILOVER_LISTEN_MS = 1000;
+// How long a follower that took over keeps the DM histories of the users of
+// the old primary, so they find them when they connect again.
+static const uint64_t FAILOVER_GRACE_MS = 30000;
+// Most DMs an offline mailbox holds. They're delivered on a single frame,
+// which counts them with a byte.
+static const size_t MAX_MAILBOX_MESSAGES = 255;
+// Mailboxes of users that don't come back within this time are dropped.
+static const time_t MAILBOX_TTL_SECONDS = 24 * 60 * 60;
+// How often expired mailboxes are looked for.
+static const time_t MAILBOX_SWEEP_SECONDS = 60;
+// How often the memory in use is compared against `s_memory_budget`.
+static const uint64_t MEMORY_CHECK_MS = 1000;
+// Evictions free memory until this percentage of the budget is in use, so
+// they don't run again with the next message.
+static const size_t MEMORY_EVICT_TARGET_PERCENT = 90;
+// Messages sealed on each history segment. The DM histories must hold at least
+// twice as many, so a segment is sealed before its oldest message leaves.
+static const size_t HISTORY_SEGMENT_MESSAGES = 50;
+// Most messages an OLDER_MESSAGES carries. Up to a segment, so a page reads
+// two of them at most.
+static const size_t MAX_PAGE_MESSAGES = 50;
+// Most messages a SEARCH_RESULTS carries.
+#define MAX_SEARCH_RESULTS 20
+// Hits of the search index a SEARCH checks at most, so a common term can't keep
+// the tiers thread busy for long. Only the chats of the user count, the DMs of
+// others are skipped a segment at a time.
+static const size_t MAX_SEARCH_HITS = 10000;
+
+// Refill speed and size of a token bucket.
+typedef struct {
+  // Tokens added every second, 0 disables the bucket.
+  uint64_t per_second;
+  // Most tokens the bucket can hold, the biggest burst it lets through.
+  uint64_t burst;
+} UWU_RateLimit;
+
+// Number of slots needed to index arrays by `UWU_ServerMessages`.
+#define UWU_SERVER_MESSAGE_TYPES (SEARCH + 1)
+
+// Frames per second a connection can send, whatever their type.
+static UWU_RateLimit s_conn_rate = {.per_second = 200, .burst = 400};
+// Extra limits for the requests that are expensive to serve. SEND_MESSAGE
+// may broadcast to everyone, GET_MESSAGES copies a whole history and SEARCH
+// reads every history of the user.
+static UWU_RateLimit s_opcode_rates[UWU_SERVER_MESSAGE_TYPES] = {
+    [SEND_MESSAGE] = {.per_second = 50, .burst = 100},
+    [GET_MESSAGES] = {.per_second = 50, .burst = 100},
+    [SEARCH] = {.per_second = 5, .burst = 10},
+};
 
 /* *****************************************************************************
 Server State
 ***************************************************************************** */
 
+// Counters exported on the `/stats` endpoint.
+//
+// They're shared by all threads, so ALWAYS update them using the `__atomic`
+// builtins.
+typedef struct {
+  // Number of completed TLS handshakes.
+  uint64_t tls_handshakes;
+  // How many of those handshakes resumed a previous session.
+  uint64_t tls_resumed_handshakes;
+  // Sum of the time between accept and handshake completion.
+  uint64_t tls_handshake_us_total;
+  // The slowest handshake seen so far.
+  uint64_t tls_handshake_us_max;
+  // Number of times the TLS credentials were reloaded from disk.
+  uint64_t tls_reloads;
+  // Lock-free DM history copies that overlapped a writer and were retried.
+  uint64_t history_read_retries;
+  // DM history copies that gave up and locked the history.
+  uint64_t history_read_fallbacks;
+  // Frames dropped by the rate limiter, indexed by their type. Index 0 counts
+  // the ones with an unknown type.
+  uint64_t rate_limited[UWU_SERVER_MESSAGE_TYPES];
+  // RATE_LIMITED errors sent back to clients.
+  uint64_t rate_limited_replies;
+  // Requests dropped because their type is unknown or their lengths don't
+  // match the frame.
+  uint64_t invalid_requests;
+  // Batches of writes submitted to io_uring.
+  uint64_t ring_submits;
+  // Writes done by io_uring, one per connection and batch.
+  uint64_t ring_writes;
+  // Outboxes io_uring couldn't write, mongoose sends them instead.
+  uint64_t ring_fallbacks;
+  // Frames sent by io_uring without copying them.
+  uint64_t zerocopy_frames;
+  // How many of those the kernel ended up copying anyway (e.g. on loopback).
+  uint64_t zerocopy_copied;
+  // Frames other threads queued on outboxes.
+  uint64_t queued_frames;
+  // Times other threads woke the event loop up to send them.
+  uint64_t wakeups;
+  // Frames of the primary a follower applied.
+  uint64_t replicated_frames;
+  // Messages a follower got from its primary once it was synced.
+  uint64_t replicated_messages;
+  // Sum of the time between the primary storing those messages and the
+  // follower storing them.
+  uint64_t replication_lag_ms_total;
+  // The biggest of those lags.
+  uint64_t replication_lag_ms_max;
+  // Time between a follower losing its primary and listening on its URL.
+  uint64_t failover_ms;
+  // DMs queued on the mailboxes of disconnected users.
+  uint64_t mailbox_queued;
+  // How many of those didn't fit on the budget and went to disk.
+  uint64_t mailbox_spilled;
+  // DMs delivered from the mailboxes when their users came back.
+  uint64_t mailbox_delivered;
+  // DMs rejected because the mailbox was full.
+  uint64_t mailbox_rejected;
+  // Bytes the mailboxes hold in memory right now.
+  uint64_t mailbox_bytes;
+  // Bytes the DM histories hold in memory right now.
+  uint64_t memory_histories;
+  // Bytes the outboxes hold right now.
+  uint64_t memory_send_queues;
+  // DM histories evicted to disk to stay under the memory budget.
+  uint64_t evicted_histories;
+  // Evicted DM histories loaded back because their chat was used again.
+  uint64_t restored_histories;
+  // DM histories evicted without keeping them.
+  uint64_t dropped_histories;
+  // History segments written to disk.
+  uint64_t sealed_segments;
+  // Segments that couldn't be written, their messages are lost once they
+  // leave the memory.
+  uint64_t lost_segments;
+  // OLDER_MESSAGES that had to read segments.
+  uint64_t cold_pages;
+  // Sum of the time between those requests arriving and their answer being
+  // queued.
+  uint64_t cold_page_us_total;
+  // The slowest of those.
+  uint64_t cold_page_us_max;
+  // SEARCHes answered.
+  uint64_t searches;
+  // Sum of the time between those requests arriving and their answer being
+  // queued.
+  uint64_t search_us_total;
+  // The slowest of those.
+  uint64_t search_us_max;
+  // Bytes the search index uses right now.
+  uint64_t search_index_bytes;
+  // Terms on the search index.
+  uint64_t search_index_terms;
+  // Messages on the search index.
+  uint64_t search_index_messages;
+} UWU_ServerStats;
+
 // Struct to hold all the server state!
 typedef struct {
   // Saves all the active usernames currently connected in this server.
   UWU_UserList active_users;
   // Saves all the messages from the group chat.
-  UWU_ChatHistory group_chat;
+  // Appends and reads don't lock, check `UWU_ChannelHistory`.
+  UWU_ChannelHistory group_chat;
   // Saves all the chat histories.
-  // Key: The combination of both usernames as a UWU_String.
-  // Value: An UWU_History item.
-  struct hashmap_s chats;
-  // Lock/Unlock this mutex before/after every operation done to chats hashmap.
-  pthread_mutex_t chats_mx;
+  // Key: The combination of both usernames, owned by the history.
+  // Value: An UWU_ChatHistory item.
+  //
+  // Lookups don't lock, a history stays valid while both of its users are
+  // connected.
+  UWU_StripedMap chats;
   // Flag to alert all threads that the server is shutting off.
   // ONLY THE MAIN thread should update this value!
   UWU_Bool is_shutting_off;
   // Mongoose message manager.
   struct mg_mgr manager;
+  // Thread running the mongoose event loop.
+  pthread_t event_loop;
+  // Connection that receives the wakeups of the event loop.
+  unsigned long wakeup_conn_id;
+  // TRUE while a wakeup is on its way to the event loop, or while the event
+  // loop holds the queued frames until `flush_at_ms`.
+  UWU_Bool wakeup_pending;
+  // When the event loop sends the frames it's holding, 0 if it isn't.
+  // ONLY the event loop can touch this!
+  uint64_t flush_at_ms;
+  // Outboxes with frames the event loop hasn't sent yet.
+  struct UWU_Outbox *pending_outboxes;
+  pthread_mutex_t pending_outboxes_mx;
+  // The nodes of the cluster, indexed like `s_peers`. The entry of this node
+  // is never used.
+  struct UWU_Peer *peers;
+  // How many nodes the cluster has, 1 for a single server.
+  size_t nodes;
+  // Signaled with `active_users.mx` held when a user becomes ACTIVE or the
+  // server shuts down, so the idle detector can sleep until it has work.
+  pthread_cond_t idle_cond;
+  // Counters exported on `/stats`.
+  UWU_ServerStats stats;
 } UWU_ServerState;
 
 static UWU_ServerState *UWU_STATE = NULL;
 
+// Frees the DM histories removed from `chats`.
+void free_chat_history(void *history) {
+  __atomic_fetch_sub(&UWU_STATE->stats.memory_histories,
+                     ((UWU_ChatHistory *)history)->bytes, __ATOMIC_RELAXED);
+  UWU_ChatHistory_free(history);
+}
+
 UWU_ServerState initialize_server_state(UWU_Err err) {
   UWU_ServerState state = {};
 
   mg_mgr_init(&state.manager);
-
-  pthread_mutex_init(&state.chats_mx, NULL);
+  if (pthread_cond_init(&state.idle_cond, NULL) != 0 ||
+      pthread_mutex_init(&state.pending_outboxes_mx, NULL) != 0) {
+    err = MALLOC_FAILED;
+    return state;
+  }
 
   state.active_users = UWU_UserList_init(err);
   if (err != NO_ERROR) {
@@ -98,12 +361,13 @@ UWU_ServerState initialize_server_state(UWU_Err err) {
   *group_chat_name = '~';
   UWU_String uwu_name = {.data = group_chat_name, .length = 1};
 
-  state.group_chat = UWU_ChatHistory_init(255, uwu_name, err);
-  if (err != NO_ERROR) {
+  state.group_chat = UWU_ChannelHistory_init(255, uwu_name, err);
+  if (state.group_chat.slots == NULL) {
     return state;
   }
 
-  if (0 != hashmap_create(8, &state.chats)) {
+  state.chats = UWU_StripedMap_init(64, free_chat_history, err);
+  if (state.chats.stripes[0].map.table.capacity == 0) {
     err = HASHMAP_INITIALIZATION_ERROR;
     return state;
   }
@@ -123,15 +387,182 @@ void deinitialize_server_state(UWU_ServerState *state) {
   UWU_UserList_deinit(&state->active_users);
 
   MG_INFO(("Cleaning group Chat history..."));
-  UWU_ChatHistory_deinit(&state->group_chat);
-
-  MG_INFO(("Deinitializing mutex..."));
-  pthread_mutex_destroy(&state->chats_mx);
+  UWU_ChannelHistory_deinit(&state->group_chat);
 
   MG_INFO(("Cleaning DM Chat histories..."));
-  hashmap_destroy(&state->chats);
+  UWU_StripedMap_deinit(&state->chats);
+
+  pthread_cond_destroy(&state->idle_cond);
+  pthread_mutex_destroy(&state->pending_outboxes_mx);
+}
+
+/* *****************************************************************************
+Rate Limiting
+***************************************************************************** */
+
+// Tokens are counted in thousandths so slow rates still refill every ms.
+typedef struct {
+  uint64_t millitokens;
+  uint64_t refilled_at_ms;
+} UWU_TokenBucket;
+
+// Takes a token out of `bucket` if it has one.
+// Returns TRUE if the request can go through.
+UWU_Bool UWU_TokenBucket_take(UWU_TokenBucket *bucket,
+                              const UWU_RateLimit *limit, uint64_t now_ms) {
+  if (limit->per_second == 0) {
+    return TRUE;
+  }
+
+  uint64_t capacity = limit->burst * 1000;
+  uint64_t elapsed_ms = now_ms - bucket->refilled_at_ms;
+  bucket->refilled_at_ms = now_ms;
+  // `per_second` tokens per second is `per_second` millitokens per ms.
+  if (elapsed_ms >= capacity / limit->per_second + 1) {
+    bucket->millitokens = capacity;
+  } else {
+    bucket->millitokens += elapsed_ms * limit->per_second;
+    if (bucket->millitokens > capacity) {
+      bucket->millitokens = capacity;
+    }
+  }
+
+  if (bucket->millitokens < 1000) {
+    return FALSE;
+  }
+  bucket->millitokens -= 1000;
+  return TRUE;
+}
+
+// The buckets of a connection.
+//
+// They're only touched from the event loop, so they don't need a lock.
+typedef struct {
+  UWU_TokenBucket conn;
+  UWU_TokenBucket opcodes[UWU_SERVER_MESSAGE_TYPES];
+  // TRUE once the client was told it's being limited. It's cleared by the
+  // next frame that goes through, so a flood only gets one ERROR back.
+  UWU_Bool notified;
+} UWU_RateLimiter;
+
+// Starts every bucket full.
+void UWU_RateLimiter_init(UWU_RateLimiter *limiter, uint64_t now_ms) {
+  limiter->conn.millitokens = s_conn_rate.burst * 1000;
+  limiter->conn.refilled_at_ms = now_ms;
+  for (size_t i = 0; i < UWU_SERVER_MESSAGE_TYPES; i++) {
+    limiter->opcodes[i].millitokens = s_opcode_rates[i].burst * 1000;
+    limiter->opcodes[i].refilled_at_ms = now_ms;
+  }
+  limiter->notified = FALSE;
 }
 
+// Checks a frame of type `type` against the connection and type buckets.
+// Returns TRUE if the frame can be handled.
+UWU_Bool UWU_RateLimiter_allow(UWU_RateLimiter *limiter, uint8_t type,
+                               uint64_t now_ms) {
+  if (!UWU_TokenBucket_take(&limiter->conn, &s_conn_rate, now_ms)) {
+    return FALSE;
+  }
+  if (type < UWU_SERVER_MESSAGE_TYPES &&
+      !UWU_TokenBucket_take(&limiter->opcodes[type], &s_opcode_rates[type],
+                            now_ms)) {
+    return FALSE;
+  }
+  return TRUE;
+}
+
+// Writes the header of a server frame, they're never masked.
+// Returns the length of the header, 10 bytes at most.
+size_t ws_frame_header(char *header, size_t length, int op) {
+  header[0] = (char)(op | 128);
+  if (length < 126) {
+    header[1] = (char)length;
+    return 2;
+  }
+  if (length < 65536) {
+    header[1] = 126;
+    UWU_writeBigEndian(&header[2], length, 2);
+    return 4;
+  }
+  header[1] = 127;
+  UWU_writeBigEndian(&header[2], length, 8);
+  return 10;
+}
+
+// Sends a frame on the connection. ONLY the event loop can call this!
+void send_frame(struct mg_connection *conn, const char *data, size_t length,
+                int op) {
+  size_t sent_count = mg_ws_send(conn, data, length, op);
+  if (sent_count < length) {
+    UWU_PANIC("Fatal: Couln't send the complete message! %d != %d.\n",
+              sent_count, length);
+  }
+}
+
+// A frame sent without copying it, check `s_zerocopy_min`.
+//
+// The kernel reads it after the send returns, so it's refcounted: the outbox
+// holds a reference until it's flushed and io_uring until the kernel is done.
+typedef struct {
+  size_t refs;
+  // Used by io_uring to find the write of the frame.
+  size_t write_index;
+  size_t length;
+  // The whole frame, header included.
+  char data[];
+} UWU_ZeroCopyFrame;
+
+// Builds the frame of `payload`.
+//
+// Success: Returns the frame with a single reference.
+// Failure: Returns NULL if there's no memory.
+UWU_ZeroCopyFrame *UWU_ZeroCopyFrame_create(const char *payload, size_t length,
+                                            int op) {
+  UWU_ZeroCopyFrame *frame = malloc(sizeof(UWU_ZeroCopyFrame) + 10 + length);
+  if (frame == NULL) {
+    return NULL;
+  }
+  frame->refs = 1;
+  frame->write_index = 0;
+  frame->length = ws_frame_header(frame->data, length, op);
+  memcpy(frame->data + frame->length, payload, length);
+  frame->length += length;
+  return frame;
+}
+
+void UWU_ZeroCopyFrame_release(UWU_ZeroCopyFrame *frame) {
+  if (__atomic_sub_fetch(&frame->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    free(frame);
+  }
+}
+
+// Opcode of the outbox entries that hold a `UWU_ZeroCopyFrame *` instead of a
+// payload. Websocket opcodes never reach it.
+static const int OUTBOX_ZEROCOPY_OP = 0xFF;
+
+// Reads the frame stored on an outbox entry.
+UWU_ZeroCopyFrame *outbox_zerocopy_frame(const char *payload) {
+  UWU_ZeroCopyFrame *frame = NULL;
+  memcpy(&frame, payload, sizeof(frame));
+  return frame;
+}
+
+// Frames other threads want to send on a connection.
+//
+// Mongoose connections can only be touched by the event loop, so the other
+// threads queue their frames here and wake the loop up to send them.
+typedef struct UWU_Outbox {
+  pthread_mutex_t mx;
+  // Queued frames: | opcode (1 byte) | length (4 bytes) | payload |
+  char *data;
+  size_t length;
+  size_t capacity;
+  // TRUE while the outbox is on the pending list of the server.
+  UWU_Bool scheduled;
+  struct UWU_Outbox *next_pending;
+  struct mg_connection *conn;
+} UWU_Outbox;
+
 // Information associated with a specific connection.
 typedef struct {
   // The username associated with this connection.
@@ -140,11 +571,111 @@ typedef struct {
   int writer;
   // The ID of the pthread that handles all the messages.
   pthread_t pid;
+  // TRUE if the client negotiated permessage-deflate during the upgrade.
+  UWU_Bool deflate;
+  // Limits how fast this connection can send requests.
+  UWU_RateLimiter limiter;
+  // Frames queued by other threads.
+  UWU_Outbox outbox;
 } UWU_WSConnInfo;
 
-// Frees the username.
+// Frees the frames that were never sent.
+void UWU_Outbox_deinit(UWU_Outbox *outbox) {
+  for (size_t offset = 0; offset < outbox->length;) {
+    size_t length = UWU_readBigEndian(&outbox->data[offset + 1], 4);
+    if ((uint8_t)outbox->data[offset] == OUTBOX_ZEROCOPY_OP) {
+      UWU_ZeroCopyFrame_release(outbox_zerocopy_frame(&outbox->data[offset + 5]));
+    }
+    offset += 5 + length;
+  }
+  __atomic_fetch_sub(&UWU_STATE->stats.memory_send_queues, outbox->capacity,
+                     __ATOMIC_RELAXED);
+  pthread_mutex_destroy(&outbox->mx);
+  free(outbox->data);
+}
+
+// Type codes of the frames the nodes of a cluster send each other, and a
+// primary sends its follower. Numbers are big endian.
+//
+// Messages carry the ID the sender gave them. Every node of a cluster stores
+// the messages of the others under IDs of its own, so an ID only means
+// something on the node of the client that got it. A follower stores the IDs
+// of its primary instead, they stay valid once it takes over.
+typedef enum {
+  // A REGISTERED_USER or CHANGED_STATUS of a user of the sender:
+  // | type | client frame |
+  PEER_PRESENCE = 1,
+  // A message to the group chat:
+  // | type | id (8 bytes) | timestamp ms (8 bytes) | length msg | msg |
+  PEER_GROUP_MESSAGE,
+  // A DM for a user of the receiver:
+  // | type | id (8 bytes) | timestamp ms (8 bytes) | length from | from |
+  // | length to | to | length msg | msg |
+  PEER_DIRECT_MESSAGE,
+  // Tells a follower it has the whole state of its primary, the frames after
+  // it are new changes:
+  // | type |
+  PEER_SYNCED,
+  // Where the IDs of a DM history the primary dropped left off, check
+  // `UWU_ChatFloor`:
+  // | type | next idx (8 bytes) | key |
+  PEER_CHAT_FLOOR,
+  // A DM history the primary evicted, check `UWU_EvictedChat`:
+  // | type | next idx (8 bytes) | length key (2 bytes) | key |
+  // | compressed history |
+  PEER_EVICTED_CHAT,
+  // A history segment the primary wrote, check `History Segments` on lib. They
+  // may reach the follower after PEER_SYNCED:
+  // | type | segment (8 bytes) | length key (2 bytes) | key | segment file |
+  PEER_SEGMENT,
+} UWU_PeerMessages;
+
+// Another node of the cluster.
+//
+// Users of other nodes are on the active users list without a connection,
+// the frames that concern them go through the link to their node.
+typedef struct UWU_Peer {
+  // URL the node listens on.
+  UWU_String url;
+  // The link to the node, or the attempt to create it. NULL if there's none.
+  // ONLY the event loop can touch this!
+  struct mg_connection *conn;
+  // Frames for the node. Its connection is only set while the link is open,
+  // frames queued while it's down are dropped.
+  UWU_Outbox outbox;
+} UWU_Peer;
+
+// Both ends of the hot standby replication.
+//
+// The primary sends its follower every change of its state, as the same
+// frames the nodes of a cluster send each other. The follower applies them
+// without any client and takes over once the primary goes away.
+typedef struct {
+  // Primary: The follower. Its outbox connection is only set while it's
+  // linked.
+  UWU_Peer follower;
+  // Primary: TRUE while the follower is linked, so other threads know they
+  // have to replicate their changes.
+  UWU_Bool follower_linked;
+  // Follower: The link to the primary, or the attempt to create it. NULL if
+  // there's none.
+  struct mg_connection *primary;
+  // Follower: TRUE while the link to the primary is open.
+  UWU_Bool linked;
+  // Follower: TRUE once it has the whole state of the primary.
+  UWU_Bool synced;
+  // Follower: When it lost the link to the primary, 0 while it has it.
+  uint64_t lost_at_ms;
+} UWU_Replication;
+
+// ONLY the event loop can touch it, except for `follower_linked` and the
+// outbox of the follower.
+static UWU_Replication UWU_REPLICATION = {};
+
+// Frees the username and the queued frames.
 void UWU_WSConnInfo_deinit(UWU_WSConnInfo *info) {
-  UWU_String_freeWithMalloc(&info->username);
+  UWU_String_freePooled(&info->username);
+  UWU_Outbox_deinit(&info->outbox);
 }
 
 typedef struct {
@@ -154,15 +685,388 @@ typedef struct {
   struct mg_connection *c;
 } UWU_ThreadConnInfo;
 
+// Connections come and go all the time, so their info comes from pools. The
+// event loop frees the info of the connection and every handler the info of
+// its thread.
+static UWU_Pool UWU_CONN_INFO_POOL =
+    UWU_POOL_STATIC(4, sizeof(UWU_WSConnInfo));
+static UWU_Pool UWU_THREAD_INFO_POOL =
+    UWU_POOL_STATIC(5, sizeof(UWU_ThreadConnInfo));
+
+/* *****************************************************************************
+io_uring Sends
+***************************************************************************** */
+#ifdef __linux__
+
+// A write of the current batch. Its bytes live on the registered buffer, or on
+// `zerocopy` if it's sending a frame without copying it.
+typedef struct {
+  struct mg_connection *conn;
+  size_t offset;
+  size_t length;
+  UWU_ZeroCopyFrame *zerocopy;
+} UWU_RingWrite;
+
+// The io_uring instance that sends the outboxes when the server runs with
+// `-io-uring`. It talks to the kernel directly, liburing isn't a dependency.
+//
+// Every time the event loop wakes up the frames queued on all connections are
+// copied to a registered buffer and written with a single `io_uring_enter`,
+// instead of one `send` per connection. ONLY the event loop can use it!
+typedef struct {
+  int fd;
+  // Submission queue, shared with the kernel.
+  void *sq_ring;
+  size_t sq_ring_size;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  // Completion queue, shared with the kernel.
+  void *cq_ring;
+  size_t cq_ring_size;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+  // Registered buffer the frames of the batch are copied to.
+  char *buffer;
+  size_t buffer_length;
+  // Writes of the batch, a connection has one at most.
+  UWU_RingWrite *writes;
+  size_t writes_count;
+  size_t writes_capacity;
+  // Zero copy frames the kernel may still be reading.
+  size_t zerocopy_inflight;
+} UWU_Ring;
+
+static UWU_Ring UWU_RING = {.fd = -1};
+
+// Maps one of the rings shared with the kernel.
+//
+// Success: Returns the mapping.
+// Failure: Returns NULL.
+void *UWU_Ring_map(int fd, size_t size, off_t offset) {
+  void *ring = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, offset);
+  return ring == MAP_FAILED ? NULL : ring;
+}
+
+// Handles the result of a write. What the socket didn't take is queued on the
+// connection, so mongoose sends it once the socket is writable again.
+void UWU_Ring_complete(UWU_Ring *ring, UWU_RingWrite *write, int result) {
+  const char *data = write->zerocopy != NULL ? write->zerocopy->data
+                                             : ring->buffer + write->offset;
+  if (result == -EAGAIN) {
+    result = 0;
+  }
+  if (result < 0) {
+    mg_error(write->conn, "io_uring write failed: %d", -result);
+    return;
+  }
+  if ((size_t)result < write->length &&
+      !mg_send(write->conn, data + result, write->length - result)) {
+    mg_error(write->conn, "OOM");
+  }
+}
+
+// Handles the completions the kernel posted so far.
+// Returns how many writes of the batch completed.
+size_t UWU_Ring_reap(UWU_Ring *ring) {
+  size_t completed = 0;
+  unsigned head = *ring->cq_head;
+  unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++) {
+    struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+    if ((cqe->user_data & 1) == 0) {
+      UWU_Ring_complete(ring, &ring->writes[cqe->user_data >> 1], cqe->res);
+      completed++;
+      continue;
+    }
+
+    // Zero copy sends post their result and then, once the kernel is done
+    // with the frame, a notification.
+    UWU_ZeroCopyFrame *frame = (UWU_ZeroCopyFrame *)(uintptr_t)(
+        cqe->user_data & ~(uint64_t)1);
+    if (cqe->flags & IORING_CQE_F_NOTIF) {
+      if (cqe->res & IORING_NOTIF_USAGE_ZC_COPIED) {
+        __atomic_fetch_add(&UWU_STATE->stats.zerocopy_copied, 1,
+                           __ATOMIC_RELAXED);
+      }
+    } else {
+      UWU_Ring_complete(ring, &ring->writes[frame->write_index], cqe->res);
+      completed++;
+      if (cqe->flags & IORING_CQE_F_MORE) {
+        continue;
+      }
+    }
+    ring->zerocopy_inflight--;
+    UWU_ZeroCopyFrame_release(frame);
+  }
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  return completed;
+}
+
+void UWU_Ring_deinit(UWU_Ring *ring) {
+  // The kernel may still be reading zero copy frames of closed connections,
+  // give it a moment to let them go.
+  for (int attempt = 0; ring->fd >= 0 && ring->zerocopy_inflight > 0 &&
+                        attempt < SHUTDOWN_DRAIN_MS;
+       attempt++) {
+    syscall(__NR_io_uring_enter, ring->fd, 0, 0, IORING_ENTER_GETEVENTS, NULL,
+            0);
+    UWU_Ring_reap(ring);
+    if (ring->zerocopy_inflight > 0) {
+      usleep(1000);
+    }
+  }
+  if (ring->zerocopy_inflight > 0) {
+    MG_ERROR(("%lu zero copy frames were never released!",
+              (unsigned long)ring->zerocopy_inflight));
+  }
+
+  if (ring->sq_ring != NULL) {
+    munmap(ring->sq_ring, ring->sq_ring_size);
+  }
+  if (ring->cq_ring != NULL) {
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  }
+  if (ring->sqes != NULL) {
+    munmap(ring->sqes, ring->sqes_size);
+  }
+  if (ring->fd >= 0) {
+    close(ring->fd);
+  }
+  free(ring->buffer);
+  free(ring->writes);
+
+  UWU_Ring def = {.fd = -1};
+  *ring = def;
+}
+
+// Creates the ring and registers its buffer.
+//
+// Success: Returns TRUE.
+// Failure: Returns FALSE if the kernel doesn't allow io_uring or we ran out of
+// memory. The ring is left deinitialized.
+UWU_Bool UWU_Ring_init(UWU_Ring *ring) {
+  struct io_uring_params params = {};
+  ring->fd = (int)syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+  if (ring->fd < 0) {
+    return FALSE;
+  }
+
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sq_ring = UWU_Ring_map(ring->fd, ring->sq_ring_size, IORING_OFF_SQ_RING);
+  ring->cq_ring = UWU_Ring_map(ring->fd, ring->cq_ring_size, IORING_OFF_CQ_RING);
+  ring->sqes = UWU_Ring_map(ring->fd, ring->sqes_size, IORING_OFF_SQES);
+  ring->buffer = malloc(RING_BUFFER_SIZE);
+  ring->writes_capacity = params.sq_entries;
+  ring->writes = malloc(sizeof(UWU_RingWrite) * ring->writes_capacity);
+  if (ring->sq_ring == NULL || ring->cq_ring == NULL || ring->sqes == NULL ||
+      ring->buffer == NULL || ring->writes == NULL) {
+    UWU_Ring_deinit(ring);
+    return FALSE;
+  }
+
+  char *sq = ring->sq_ring;
+  char *cq = ring->cq_ring;
+  ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+  ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+  // The kernel pins the buffer once instead of on every write.
+  struct iovec buffer = {.iov_base = ring->buffer,
+                         .iov_len = RING_BUFFER_SIZE};
+  if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS,
+              &buffer, 1) < 0) {
+    UWU_Ring_deinit(ring);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+// Submits the writes of the batch and waits for all of them.
+//
+// The sockets are non-blocking, so the kernel completes every write right
+// away with what the socket could take.
+void UWU_Ring_submit(UWU_Ring *ring) {
+  if (ring->writes_count == 0) {
+    return;
+  }
+
+  unsigned tail = *ring->sq_tail;
+  for (size_t i = 0; i < ring->writes_count; i++) {
+    UWU_RingWrite *write = &ring->writes[i];
+    unsigned index = (tail + i) & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = (int)(size_t)write->conn->fd;
+    sqe->len = (uint32_t)write->length;
+    if (write->zerocopy != NULL) {
+      sqe->opcode = IORING_OP_SEND_ZC;
+      sqe->addr = (uint64_t)(uintptr_t)write->zerocopy->data;
+      // Without it the kernel would wait for the socket to be writable.
+      sqe->msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+      // Frames are aligned, so the lowest bit tells them apart from writes.
+      sqe->user_data = (uint64_t)(uintptr_t)write->zerocopy | 1;
+      write->zerocopy->write_index = i;
+    } else {
+      sqe->opcode = IORING_OP_WRITE_FIXED;
+      sqe->addr = (uint64_t)(uintptr_t)(ring->buffer + write->offset);
+      // Sockets don't have a position.
+      sqe->off = (uint64_t)-1;
+      sqe->buf_index = 0;
+      sqe->user_data = (uint64_t)i << 1;
+    }
+    ring->sq_array[index] = index;
+  }
+  __atomic_store_n(ring->sq_tail, tail + (unsigned)ring->writes_count,
+                   __ATOMIC_RELEASE);
+
+  size_t to_submit = ring->writes_count;
+  size_t completed = 0;
+  while (completed < ring->writes_count) {
+    long submitted = syscall(__NR_io_uring_enter, ring->fd, to_submit, 1,
+                             IORING_ENTER_GETEVENTS, NULL, 0);
+    if (submitted < 0) {
+      UWU_PanicIf(errno != EINTR, "Fatal: Can't submit the io_uring writes!");
+      continue;
+    }
+    to_submit -= (size_t)submitted;
+    completed += UWU_Ring_reap(ring);
+  }
+
+  __atomic_fetch_add(&UWU_STATE->stats.ring_submits, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&UWU_STATE->stats.ring_writes, ring->writes_count,
+                     __ATOMIC_RELAXED);
+  ring->writes_count = 0;
+  ring->buffer_length = 0;
+}
+
+// Sends a frame of a connection that has a write on the batch with mongoose.
+// The batch is submitted first so the frames stay in order.
+//
+// - write: The write of the connection on the batch, may be NULL.
+void UWU_Ring_copyFrame(UWU_Ring *ring, UWU_RingWrite **write,
+                        struct mg_connection *c, const char *payload,
+                        size_t length, int op) {
+  if (*write != NULL) {
+    UWU_Ring_submit(ring);
+    *write = NULL;
+  }
+
+  if (op == OUTBOX_ZEROCOPY_OP) {
+    UWU_ZeroCopyFrame *frame = outbox_zerocopy_frame(payload);
+    if (!mg_send(c, frame->data, frame->length)) {
+      mg_error(c, "OOM");
+    }
+    UWU_ZeroCopyFrame_release(frame);
+  } else {
+    send_frame(c, payload, length, op);
+  }
+}
+
+// Moves the frames queued on a detached outbox to the batch. Frames are
+// copied to a single write, zero copy frames get their own write. The batch is
+// submitted whenever it's full or the connection needs a second write.
+//
+// Success: Returns TRUE, the outbox is empty and can be scheduled again.
+// Failure: Returns FALSE if io_uring can't write this connection, for example
+// because it uses TLS. The outbox is left untouched.
+UWU_Bool UWU_Ring_stageOutbox(UWU_Ring *ring, UWU_Outbox *outbox) {
+  struct mg_connection *c = outbox->conn;
+  if (c == NULL) {
+    // A peer that is down, flushing drops the frames.
+    return FALSE;
+  }
+  UWU_PanicIf(pthread_mutex_lock(&outbox->mx) != 0,
+              "Fatal: Can't lock the outbox mutex!");
+
+  if (c->is_tls || c->is_closing) {
+    UWU_PanicIf(pthread_mutex_unlock(&outbox->mx) != 0,
+                "Fatal: Can't unlock the outbox mutex!");
+    __atomic_fetch_add(&UWU_STATE->stats.ring_fallbacks, 1, __ATOMIC_RELAXED);
+    return FALSE;
+  }
+
+  UWU_RingWrite *write = NULL;
+  for (size_t offset = 0; offset < outbox->length;) {
+    int op = (uint8_t)outbox->data[offset];
+    size_t length = UWU_readBigEndian(&outbox->data[offset + 1], 4);
+    const char *payload = &outbox->data[offset + 5];
+    offset += 5 + length;
+
+    UWU_Bool zerocopy = op == OUTBOX_ZEROCOPY_OP;
+    if (write != NULL && (zerocopy || write->zerocopy != NULL ||
+                          ring->buffer_length + 10 + length >
+                              RING_BUFFER_SIZE)) {
+      UWU_Ring_submit(ring);
+      write = NULL;
+    }
+
+    // Mongoose has data queued if the last write was short, what comes after
+    // has to wait behind it.
+    if (c->send.len > 0 || c->is_closing ||
+        (!zerocopy && 10 + length > RING_BUFFER_SIZE)) {
+      __atomic_fetch_add(&UWU_STATE->stats.ring_fallbacks, 1,
+                         __ATOMIC_RELAXED);
+      UWU_Ring_copyFrame(ring, &write, c, payload, length, op);
+      continue;
+    }
+
+    if (write == NULL) {
+      if (ring->writes_count == ring->writes_capacity ||
+          (!zerocopy && ring->buffer_length + 10 + length > RING_BUFFER_SIZE)) {
+        UWU_Ring_submit(ring);
+      }
+      write = &ring->writes[ring->writes_count++];
+      write->conn = c;
+      write->offset = ring->buffer_length;
+      write->length = 0;
+      write->zerocopy = NULL;
+    }
+
+    if (zerocopy) {
+      // The outbox reference is now owned by io_uring.
+      write->zerocopy = outbox_zerocopy_frame(payload);
+      write->length = write->zerocopy->length;
+      ring->zerocopy_inflight++;
+      __atomic_fetch_add(&UWU_STATE->stats.zerocopy_frames, 1,
+                         __ATOMIC_RELAXED);
+    } else {
+      char *frame = ring->buffer + ring->buffer_length;
+      size_t header_length = ws_frame_header(frame, length, op);
+      memcpy(frame + header_length, payload, length);
+      write->length += header_length + length;
+      ring->buffer_length += header_length + length;
+    }
+  }
+
+  outbox->length = 0;
+  outbox->scheduled = FALSE;
+  UWU_PanicIf(pthread_mutex_unlock(&outbox->mx) != 0,
+              "Fatal: Can't unlock the outbox mutex!");
+  return TRUE;
+}
+
+#endif
+
 /* *****************************************************************************
 Utilities functions
 ***************************************************************************** */
-int remove_if_matches(void *context, struct hashmap_element_s *const e) {
+// Matches the DM histories of the user given as context.
+UWU_Bool remove_if_matches(void *context, UWU_String hash_key, void *value) {
   UWU_String *user_name = context;
-  UWU_String hash_key = {
-      .data = (char *)e->key,
-      .length = e->key_len,
-  };
 
   UWU_String tmp_after = UWU_String_combineWithOther(user_name, &SEPARATOR);
   UWU_String tmp_before = UWU_String_combineWithOther(&SEPARATOR, user_name);
@@ -173,723 +1077,5508 @@ int remove_if_matches(void *context, struct hashmap_element_s *const e) {
   UWU_String_freeWithMalloc(&tmp_after);
   UWU_String_freeWithMalloc(&tmp_before);
 
-  if (starts_with_username || ends_with_username) {
-    UWU_ChatHistory *data = e->data;
+  return starts_with_username || ends_with_username;
+}
 
-    UWU_ChatHistory_deinit(data);
-    free(data);
-    return -1;
+// The key of the DM history of two users on `chats`.
+// Free it with `UWU_String_freeWithMalloc`.
+UWU_String direct_chat_key(const UWU_String *const a,
+                           const UWU_String *const b) {
+  const UWU_String *first = a;
+  const UWU_String *other = b;
+  if (!UWU_String_firstGoesFirst(first, other)) {
+    first = b;
+    other = a;
   }
 
-  return 0;
+  UWU_String tmp = UWU_String_combineWithOther(first, &SEPARATOR);
+  UWU_String combined = UWU_String_combineWithOther(&tmp, other);
+  UWU_String_freeWithMalloc(&tmp);
+  return combined;
 }
 
-void update_last_action(UWU_User *info) {
-  info->last_action = time(NULL);
-  if ((time_t)-1 == info->last_action) {
-    UWU_PANIC("Fatal: Failed to obtain current time!\n");
-    return;
+// The other user of the DM history `key` of `username`, as a view into `key`.
+UWU_String chat_partner(const UWU_String *const key,
+                        const UWU_String *const username) {
+  UWU_String partner = {
+      .data = key->data,
+      .length = key->length - username->length - SEPARATOR.length,
+  };
+  if (memcmp(key->data, username->data, username->length) == 0 &&
+      memcmp(&key->data[username->length], SEPARATOR.data,
+             SEPARATOR.length) == 0) {
+    partner.data = &key->data[username->length + SEPARATOR.length];
   }
+  return partner;
 }
 
-// Send a message to a specific connection.
-void send_msg(struct mg_connection *conn, const UWU_String *const msg) {
-  UWU_print_msg(msg, "Debug: Server", "Sends");
-  size_t sent_count =
-      mg_ws_send(conn, msg->data, msg->length, WEBSOCKET_OP_BINARY);
-  if (sent_count < msg->length) {
-    UWU_PANIC("Fatal: Couln't send the complete message! %d != %d.\n",
-              sent_count, msg->length);
+// Returns TRUE if `username` is one of the users of the DM history `key`.
+UWU_Bool chat_has_user(const UWU_String *const key,
+                       const UWU_String *const username) {
+  size_t length = username->length + SEPARATOR.length;
+  if (key->length <= length) {
+    return FALSE;
   }
+  const char *last = &key->data[key->length - length];
+  return (memcmp(key->data, username->data, username->length) == 0 &&
+          memcmp(&key->data[username->length], SEPARATOR.data,
+                 SEPARATOR.length) == 0) ||
+         (memcmp(last, SEPARATOR.data, SEPARATOR.length) == 0 &&
+          memcmp(&last[SEPARATOR.length], username->data,
+                 username->length) == 0);
 }
 
-// Broadcasts an msg to all available connections!
+// Returns TRUE if both users of the DM history saved under `key` are on the
+// active users list.
 // PLEASE lock the active_users before calling this function!
-void broadcast_msg(UWU_String *msg) {
-  for (struct UWU_UserListNode *current = UWU_STATE->active_users.start;
-       current != NULL; current = current->next) {
-    if (current->is_sentinel) {
+UWU_Bool chat_users_connected(const UWU_String *const key) {
+  for (size_t i = 0; i + SEPARATOR.length <= key->length; i++) {
+    if (memcmp(&key->data[i], SEPARATOR.data, SEPARATOR.length) != 0) {
       continue;
     }
 
-    send_msg(current->data.conn, msg);
+    UWU_String first = {.data = key->data, .length = i};
+    UWU_String other = chat_partner(key, &first);
+    return UWU_UserList_findByName(&UWU_STATE->active_users, &first) != NULL &&
+           UWU_UserList_findByName(&UWU_STATE->active_users, &other) != NULL;
   }
+  return FALSE;
 }
 
-UWU_String changed_status_builder(char *buff, UWU_User *info) {
-  UWU_String def = {};
-  size_t msg_length = 0;
-
-  buff[msg_length] = CHANGED_STATUS;
-  msg_length++;
+// Writes the path of the file of `name` inside `dir` into `path`. The name is
+// hex encoded so it's always a valid file name.
+void hex_file_path(char *path, size_t path_size, const char *dir,
+                   const UWU_String *const name) {
+  int length = snprintf(path, path_size, "%s/", dir);
+  for (size_t i = 0;
+       i < name->length && length > 0 && (size_t)length + 3 <= path_size;
+       i++) {
+    length += snprintf(&path[length], path_size - length, "%02x",
+                       (uint8_t)name->data[i]);
+  }
+}
 
-  buff[msg_length] = info->username.length;
-  msg_length++;
+// Reads the whole file at `path`.
+//
+// Success: Returns a buffer with its contents, free it with `free`.
+// Failure: Returns NULL if it can't be read or it's empty.
+char *read_whole_file(const char *path, size_t *length) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return NULL;
+  }
 
-  for (int i = 0; i < info->username.length; i++) {
-    buff[msg_length] = UWU_String_getChar(&info->username, i);
-    msg_length++;
+  struct stat info = {};
+  char *data = NULL;
+  if (fstat(fd, &info) == 0 && info.st_size > 0) {
+    data = malloc(info.st_size);
+  }
+  if (data != NULL && read(fd, data, info.st_size) != info.st_size) {
+    free(data);
+    data = NULL;
   }
+  close(fd);
 
-  buff[msg_length] = info->status;
-  msg_length++;
+  *length = data == NULL ? 0 : info.st_size;
+  return data;
+}
 
-  def.data = buff;
-  def.length = msg_length;
-  return def;
+void update_last_action(UWU_User *info) {
+  info->last_action = time(NULL);
+  if ((time_t)-1 == info->last_action) {
+    UWU_PANIC("Fatal: Failed to obtain current time!\n");
+    return;
+  }
 }
 
-UWU_String create_changed_status_message(UWU_Arena *arena, UWU_User *info) {
-  UWU_Err err = NO_ERROR;
-  int data_length = 2 + info->username.length + 1;
-  char *data = UWU_Arena_alloc(arena, sizeof(char) * data_length, err);
+// Checks if the upgrade request offers permessage-deflate with parameters we
+// can honor. We always compress with the full 32KB window, so offers that
+// restrict the server window are declined.
+UWU_Bool accepts_deflate(struct mg_http_message *hm) {
+  struct mg_str *header = mg_http_get_header(hm, "Sec-WebSocket-Extensions");
+  if (header == NULL) {
+    return FALSE;
+  }
 
-  if (err != NO_ERROR) {
-    UWU_PANIC("Fatal: Failed to allocate space for message `changed_status`\n");
-    UWU_String dummy = {};
-    return dummy;
+  UWU_String extensions = {.data = header->buf, .length = header->len};
+  UWU_String deflate = {.data = "permessage-deflate",
+                        .length = strlen("permessage-deflate")};
+  if (!UWU_String_contains(&extensions, &deflate)) {
+    return FALSE;
   }
 
-  return changed_status_builder(data, info);
+  UWU_String window_bits = {.data = "server_max_window_bits",
+                            .length = strlen("server_max_window_bits")};
+  UWU_String full_window = {.data = "server_max_window_bits=15",
+                            .length = strlen("server_max_window_bits=15")};
+  if (UWU_String_contains(&extensions, &window_bits) &&
+      !UWU_String_contains(&extensions, &full_window)) {
+    return FALSE;
+  }
+
+  return TRUE;
 }
 
-/* *****************************************************************************
-IDLE Detector
-***************************************************************************** */
-static void *idle_detector(void *p) {
-  UWU_Err err = NO_ERROR;
-  UWU_Arena arena = UWU_Arena_init(2 + 1 + 255, err);
-  if (err != NO_ERROR) {
-    UWU_PANIC("Fatal: Failed to initialize idle_detector arena!");
-    return NULL;
+// TRUE while this thread holds its wakeups, check `hold_wakeups`.
+static __thread UWU_Bool UWU_HOLD_WAKEUPS = FALSE;
+// TRUE if this thread skipped a wakeup while holding them.
+static __thread UWU_Bool UWU_HELD_WAKEUP = FALSE;
+
+// Makes the event loop write the data other threads queued on connections.
+//
+// The event loop sleeps until something happens, so every thread that sends
+// something MUST call this. Wakeups are coalesced, at most one is on its way.
+void wake_event_loop() {
+  if (pthread_equal(pthread_self(), UWU_STATE->event_loop)) {
+    return;
   }
+  if (UWU_HOLD_WAKEUPS) {
+    UWU_HELD_WAKEUP = TRUE;
+    return;
+  }
+  if (!__atomic_exchange_n(&UWU_STATE->wakeup_pending, TRUE,
+                           __ATOMIC_ACQ_REL)) {
+    __atomic_fetch_add(&UWU_STATE->stats.wakeups, 1, __ATOMIC_RELAXED);
+    mg_wakeup(&UWU_STATE->manager, UWU_STATE->wakeup_conn_id, "", 0);
+  }
+}
 
-  while (!UWU_STATE->is_shutting_off) {
-    UWU_PanicIf(pthread_mutex_lock(&UWU_STATE->active_users.mx) != 0,
-                "Fatal: Failed to lock active_users lock!");
-    MG_INFO(("[IDLE detector] Checking %d connected users...",
-             (int)UWU_STATE->active_users.length));
-    time_t now = time(NULL);
+// Delays the wakeups of this thread until `release_wakeups`, so the frames it
+// queues meanwhile are sent together.
+void hold_wakeups() { UWU_HOLD_WAKEUPS = TRUE; }
 
-    if ((clock_t)-1 == now) {
-      UWU_PANIC("Fatal: Failed to get current clock time!");
-      UWU_Arena_deinit(arena);
-    } else {
-      for (struct UWU_UserListNode *current = UWU_STATE->active_users.start;
-           current != NULL; current = current->next) {
-        if (current->is_sentinel) {
-          continue;
-        }
+// Wakes the event loop up if this thread queued frames since `hold_wakeups`.
+void release_wakeups() {
+  UWU_HOLD_WAKEUPS = FALSE;
+  if (UWU_HELD_WAKEUP) {
+    UWU_HELD_WAKEUP = FALSE;
+    wake_event_loop();
+  }
+}
 
-        time_t seconds_diff = difftime(now, current->data.last_action);
-        UWU_ConnStatus status = current->data.status;
-        if (seconds_diff >= IDLE_SECONDS_LIMIT && status == ACTIVE) {
-          UWU_Arena_reset(&arena);
-          MG_INFO(("Updating %.*s as INACTIVE!",
-                   (int)current->data.username.length,
-                   current->data.username.data));
-          current->data.status = INACTIVE;
-          UWU_String msg =
-              create_changed_status_message(&arena, &current->data);
-          broadcast_msg(&msg);
-        }
+// Wakes the idle detector after a user became ACTIVE.
+// PLEASE lock the active_users before calling this function!
+void notify_idle_detector() { pthread_cond_signal(&UWU_STATE->idle_cond); }
+
+// Prepares the outbox of a new connection.
+//
+// Success: Returns TRUE.
+// Failure: Returns FALSE if the mutex couldn't be initialized.
+UWU_Bool UWU_Outbox_init(UWU_Outbox *outbox, struct mg_connection *conn) {
+  UWU_Outbox def = {.conn = conn};
+  *outbox = def;
+  return pthread_mutex_init(&outbox->mx, NULL) == 0;
+}
+
+// Sends the frames queued on `outbox`. ONLY the event loop can call this!
+// They're dropped if the outbox has no connection, check `UWU_Peer`.
+//
+// - detached: TRUE if the outbox was just taken off the pending list, so the
+// next push has to schedule it again.
+void UWU_Outbox_flush(UWU_Outbox *outbox, UWU_Bool detached) {
+  UWU_PanicIf(pthread_mutex_lock(&outbox->mx) != 0,
+              "Fatal: Can't lock the outbox mutex!");
+  for (size_t offset = 0; offset < outbox->length;) {
+    int op = (uint8_t)outbox->data[offset];
+    size_t length = UWU_readBigEndian(&outbox->data[offset + 1], 4);
+    if (op == OUTBOX_ZEROCOPY_OP) {
+      UWU_ZeroCopyFrame *frame = outbox_zerocopy_frame(&outbox->data[offset + 5]);
+      if (outbox->conn != NULL &&
+          !mg_send(outbox->conn, frame->data, frame->length)) {
+        mg_error(outbox->conn, "OOM");
       }
+      UWU_ZeroCopyFrame_release(frame);
+    } else if (outbox->conn != NULL) {
+      send_frame(outbox->conn, &outbox->data[offset + 5], length, op);
+    }
+    offset += 5 + length;
+  }
+  outbox->length = 0;
+  if (detached) {
+    outbox->scheduled = FALSE;
+  }
+  UWU_PanicIf(pthread_mutex_unlock(&outbox->mx) != 0,
+              "Fatal: Can't unlock the outbox mutex!");
+}
 
-      UWU_PanicIf(pthread_mutex_unlock(&UWU_STATE->active_users.mx) != 0,
-                  "Fatal: Failed to unlock active_users lock!");
-      nanosleep(&IDLE_CHECK_FREQUENCY, NULL);
+// Queues a frame and makes sure the event loop will send it.
+void UWU_Outbox_push(UWU_Outbox *outbox, const char *data, size_t length,
+                     int op) {
+  UWU_PanicIf(pthread_mutex_lock(&outbox->mx) != 0,
+              "Fatal: Can't lock the outbox mutex!");
+  size_t needed = outbox->length + 5 + length;
+  if (needed > outbox->capacity) {
+    size_t capacity = outbox->capacity == 0 ? 512 : outbox->capacity;
+    while (capacity < needed) {
+      capacity *= 2;
     }
+    outbox->data = realloc(outbox->data, capacity);
+    UWU_PanicIf(outbox->data == NULL, "Fatal: Can't grow the outbox!");
+    __atomic_fetch_add(&UWU_STATE->stats.memory_send_queues,
+                       capacity - outbox->capacity, __ATOMIC_RELAXED);
+    outbox->capacity = capacity;
   }
 
-  UWU_Arena_deinit(arena);
-  return NULL;
+  outbox->data[outbox->length] = (char)op;
+  UWU_writeBigEndian(&outbox->data[outbox->length + 1], length, 4);
+  memcpy(&outbox->data[outbox->length + 5], data, length);
+  outbox->length = needed;
+  __atomic_fetch_add(&UWU_STATE->stats.queued_frames, 1, __ATOMIC_RELAXED);
+
+  UWU_Bool schedule = !outbox->scheduled;
+  outbox->scheduled = TRUE;
+  UWU_PanicIf(pthread_mutex_unlock(&outbox->mx) != 0,
+              "Fatal: Can't unlock the outbox mutex!");
+
+  if (schedule) {
+    UWU_PanicIf(pthread_mutex_lock(&UWU_STATE->pending_outboxes_mx) != 0,
+                "Fatal: Can't lock the pending outboxes mutex!");
+    outbox->next_pending = UWU_STATE->pending_outboxes;
+    UWU_STATE->pending_outboxes = outbox;
+    UWU_PanicIf(pthread_mutex_unlock(&UWU_STATE->pending_outboxes_mx) != 0,
+                "Fatal: Can't unlock the pending outboxes mutex!");
+  }
+  wake_event_loop();
 }
 
-void *message_handler(void *thread_info) {
-  UWU_Err err = NO_ERROR;
+// Sends everything other threads queued. ONLY the event loop can call this!
+void flush_pending_outboxes() {
+  UWU_PanicIf(pthread_mutex_lock(&UWU_STATE->pending_outboxes_mx) != 0,
+              "Fatal: Can't lock the pending outboxes mutex!");
+  UWU_Outbox *pending = UWU_STATE->pending_outboxes;
+  UWU_STATE->pending_outboxes = NULL;
+  UWU_PanicIf(pthread_mutex_unlock(&UWU_STATE->pending_outboxes_mx) != 0,
+              "Fatal: Can't unlock the pending outboxes mutex!");
+
+  while (pending != NULL) {
+    UWU_Outbox *next = pending->next_pending;
+#ifdef __linux__
+    if (!s_io_uring || !UWU_Ring_stageOutbox(&UWU_RING, pending)) {
+      UWU_Outbox_flush(pending, TRUE);
+    }
+#else
+    UWU_Outbox_flush(pending, TRUE);
+#endif
+    pending = next;
+  }
+
+#ifdef __linux__
+  if (s_io_uring) {
+    UWU_Ring_submit(&UWU_RING);
+  }
+#endif
+}
+
+// Sends what other threads queued before waking the event loop up.
+// ONLY the event loop can call this!
+void flush_woken_outboxes() {
+  // Cleared before flushing, so frames queued after the flush send a new
+  // wakeup.
+  __atomic_store_n(&UWU_STATE->wakeup_pending, FALSE, __ATOMIC_SEQ_CST);
+  UWU_STATE->flush_at_ms = 0;
+  flush_pending_outboxes();
+}
+
+// Runs an iteration of the event loop, waiting up to `timeout_ms` (-1 waits
+// forever) for something to happen. ONLY the event loop can call this!
+//
+// The wait is shortened if the queued frames are held, check `s_coalesce_ms`.
+void poll_event_loop(int timeout_ms) {
+  uint64_t flush_at_ms = UWU_STATE->flush_at_ms;
+  if (flush_at_ms != 0) {
+    uint64_t now_ms = mg_millis();
+    int due_ms = now_ms >= flush_at_ms ? 0 : (int)(flush_at_ms - now_ms);
+    if (timeout_ms < 0 || due_ms < timeout_ms) {
+      timeout_ms = due_ms;
+    }
+  }
+
+  mg_mgr_poll(&UWU_STATE->manager, timeout_ms);
+
+  if (UWU_STATE->flush_at_ms != 0 && mg_millis() >= UWU_STATE->flush_at_ms) {
+    flush_woken_outboxes();
+  }
+}
+
+// Takes `outbox` out of the pending list before its connection is freed.
+// ONLY the event loop can call this, once no other thread can push to it!
+void UWU_Outbox_unschedule(UWU_Outbox *outbox) {
+  UWU_PanicIf(pthread_mutex_lock(&UWU_STATE->pending_outboxes_mx) != 0,
+              "Fatal: Can't lock the pending outboxes mutex!");
+  for (UWU_Outbox **current = &UWU_STATE->pending_outboxes; *current != NULL;
+       current = &(*current)->next_pending) {
+    if (*current == outbox) {
+      *current = outbox->next_pending;
+      break;
+    }
+  }
+  UWU_PanicIf(pthread_mutex_unlock(&UWU_STATE->pending_outboxes_mx) != 0,
+              "Fatal: Can't unlock the pending outboxes mutex!");
+}
+
+// Send a message to a specific connection.
+//
+// If the connection negotiated permessage-deflate and the message is big
+// enough it's sent compressed. Other threads queue it on the outbox of the
+// connection instead of touching it, big ones without copying them to mongoose.
+void send_msg(struct mg_connection *conn, const UWU_String *const msg) {
+  UWU_print_msg(msg, "Debug: Server", "Sends");
+
+  const char *data = msg->data;
+  size_t length = msg->length;
+  int op = WEBSOCKET_OP_BINARY;
+  UWU_ZeroCopyFrame *frame = NULL;
+
+  UWU_WSConnInfo *info = conn->fn_data;
+  if (info != NULL && info->deflate && msg->length >= s_deflate_min_size) {
+    UWU_Err err = NO_ERROR;
+    UWU_String compressed = UWU_Deflate_compress(msg, err);
+
+    if (err == NO_ERROR && compressed.data != NULL &&
+        compressed.length < msg->length) {
+      data = compressed.data;
+      length = compressed.length;
+      op = WEBSOCKET_OP_BINARY | UWU_WS_FLAG_COMPRESSED;
+    }
+  }
+
+  if (info == NULL) {
+    send_frame(conn, data, length, op);
+  } else if (pthread_equal(pthread_self(), UWU_STATE->event_loop)) {
+    // Frames queued earlier go first.
+    UWU_Outbox_flush(&info->outbox, FALSE);
+    send_frame(conn, data, length, op);
+  } else if (s_zerocopy_min > 0 && length >= s_zerocopy_min &&
+             (frame = UWU_ZeroCopyFrame_create(data, length, op)) != NULL) {
+    UWU_Outbox_push(&info->outbox, (const char *)&frame, sizeof(frame),
+                    OUTBOX_ZEROCOPY_OP);
+  } else {
+    UWU_Outbox_push(&info->outbox, data, length, op);
+  }
+}
+
+// Broadcasts an msg to all available connections!
+// Users of other nodes don't get it, check `broadcast_presence`.
+// PLEASE lock the active_users before calling this function!
+void broadcast_msg(UWU_String *msg) {
+  for (struct UWU_UserListNode *current = UWU_STATE->active_users.start;
+       current != NULL; current = current->next) {
+    if (current->is_sentinel || current->data.conn == NULL) {
+      continue;
+    }
+
+    send_msg(current->data.conn, msg);
+  }
+}
+
+// Sends a frame to another node of the cluster. It's lost if the link is
+// down, the nodes sync their users again when it comes back.
+void send_to_peer(UWU_Peer *peer, const UWU_String *const msg) {
+  if (pthread_equal(pthread_self(), UWU_STATE->event_loop)) {
+    // Frames queued earlier go first.
+    UWU_Outbox_flush(&peer->outbox, FALSE);
+    if (peer->outbox.conn != NULL) {
+      send_frame(peer->outbox.conn, msg->data, msg->length,
+                 WEBSOCKET_OP_BINARY);
+    }
+  } else {
+    UWU_Outbox_push(&peer->outbox, msg->data, msg->length,
+                    WEBSOCKET_OP_BINARY);
+  }
+}
+
+// Sends a frame to every other node of the cluster.
+void send_to_peers(const UWU_String *const msg) {
+  for (size_t i = 0; i < UWU_STATE->nodes; i++) {
+    if (i != s_node_id) {
+      send_to_peer(&UWU_STATE->peers[i], msg);
+    }
+  }
+}
+
+// TRUE while a follower is linked to this server, so changes have to be
+// replicated to it.
+UWU_Bool has_follower() {
+  return __atomic_load_n(&UWU_REPLICATION.follower_linked, __ATOMIC_ACQUIRE);
+}
+
+// Replicates a change to the follower, if there's one.
+void send_to_follower(const UWU_String *const msg) {
+  if (has_follower()) {
+    send_to_peer(&UWU_REPLICATION.follower, msg);
+  }
+}
+
+// Wraps a REGISTERED_USER or CHANGED_STATUS on a PEER_PRESENCE.
+// `buff` needs space for `1 + msg->length` bytes.
+UWU_String peer_presence_builder(char *buff, const UWU_String *const msg) {
+  buff[0] = PEER_PRESENCE;
+  memcpy(&buff[1], msg->data, msg->length);
+  UWU_String frame = {.data = buff, .length = 1 + msg->length};
+  return frame;
+}
+
+// Tells the other nodes of the cluster and the follower about a
+// REGISTERED_USER or CHANGED_STATUS of a user of this node.
+void send_presence_to_peers(const UWU_String *const msg) {
+  if (UWU_STATE->nodes == 1 && !has_follower()) {
+    return;
+  }
+
+  char buff[1 + 3 + 255];
+  UWU_String frame = peer_presence_builder(buff, msg);
+  send_to_peers(&frame);
+  send_to_follower(&frame);
+}
+
+// Builds a PEER_GROUP_MESSAGE.
+// `buff` needs space for `18 + content->length` bytes.
+UWU_String group_message_builder(char *buff, uint64_t id,
+                                 const UWU_String *const content,
+                                 uint64_t timestamp_ms) {
+  buff[0] = PEER_GROUP_MESSAGE;
+  UWU_writeBigEndian(&buff[1], id, 8);
+  UWU_writeBigEndian(&buff[9], timestamp_ms, 8);
+  buff[17] = content->length;
+  memcpy(&buff[18], content->data, content->length);
+  UWU_String frame = {.data = buff, .length = 18 + content->length};
+  return frame;
+}
+
+// Sends a message to the group chat to the other nodes of the cluster, every
+// node stores it and delivers it to its own users. The follower stores it too.
+void send_group_message_to_peers(uint64_t id, const UWU_String *const content,
+                                 uint64_t timestamp_ms) {
+  if (UWU_STATE->nodes == 1 && !has_follower()) {
+    return;
+  }
+
+  char buff[1 + 8 + 8 + 1 + 255];
+  UWU_String frame = group_message_builder(buff, id, content, timestamp_ms);
+  send_to_peers(&frame);
+  send_to_follower(&frame);
+}
+
+// Builds a PEER_DIRECT_MESSAGE.
+// `buff` needs space for `1 + 8 + 8 + 3 * (1 + 255)` bytes.
+UWU_String direct_message_builder(char *buff, uint64_t id,
+                                  const UWU_String *const from,
+                                  const UWU_String *const to,
+                                  const UWU_String *const content,
+                                  uint64_t timestamp_ms) {
+  size_t length = 0;
+  buff[length++] = PEER_DIRECT_MESSAGE;
+  UWU_writeBigEndian(&buff[length], id, 8);
+  length += 8;
+  UWU_writeBigEndian(&buff[length], timestamp_ms, 8);
+  length += 8;
+
+  const UWU_String *fields[] = {from, to, content};
+  for (size_t i = 0; i < 3; i++) {
+    buff[length++] = fields[i]->length;
+    memcpy(&buff[length], fields[i]->data, fields[i]->length);
+    length += fields[i]->length;
+  }
+
+  UWU_String frame = {.data = buff, .length = length};
+  return frame;
+}
+
+// Sends a DM for a user of another node to that node, which stores it on its
+// own copy of the history and delivers it.
+void send_direct_message_to_peer(uint64_t id, const UWU_String *const from,
+                                 const UWU_String *const to,
+                                 const UWU_String *const content,
+                                 uint64_t timestamp_ms) {
+  char buff[1 + 8 + 8 + 3 * (1 + 255)];
+  UWU_String frame =
+      direct_message_builder(buff, id, from, to, content, timestamp_ms);
+  send_to_peer(&UWU_STATE->peers[UWU_Username_node(to, UWU_STATE->nodes)],
+               &frame);
+}
+
+// Replicates a DM this server stored to the follower, if there's one.
+// PLEASE lock the active_users before calling this function, so the follower
+// gets it after the users it's between!
+void send_direct_message_to_follower(uint64_t id,
+                                     const UWU_String *const from,
+                                     const UWU_String *const to,
+                                     const UWU_String *const content,
+                                     uint64_t timestamp_ms) {
+  if (!has_follower()) {
+    return;
+  }
+
+  char buff[1 + 8 + 8 + 3 * (1 + 255)];
+  UWU_String frame =
+      direct_message_builder(buff, id, from, to, content, timestamp_ms);
+  send_to_follower(&frame);
+}
+
+// Broadcasts a REGISTERED_USER or CHANGED_STATUS of a user of this node to
+// everyone, users of other nodes included.
+// PLEASE lock the active_users before calling this function!
+void broadcast_presence(UWU_String *msg) {
+  broadcast_msg(msg);
+  send_presence_to_peers(msg);
+}
+
+UWU_String changed_status_builder(char *buff, UWU_User *info) {
+  UWU_String def = {};
+  size_t msg_length = 0;
+
+  buff[msg_length] = CHANGED_STATUS;
+  msg_length++;
+
+  UWU_String username = UWU_Username_view(&info->username);
+  buff[msg_length] = username.length;
+  msg_length++;
+
+  memcpy(&buff[msg_length], username.data, username.length);
+  msg_length += username.length;
+
+  buff[msg_length] = info->status;
+  msg_length++;
+
+  def.data = buff;
+  def.length = msg_length;
+  return def;
+}
+
+UWU_String create_changed_status_message(UWU_Arena *arena, UWU_User *info) {
+  UWU_Err err = NO_ERROR;
+  int data_length = 2 + info->username.length + 1;
+  char *data = UWU_Arena_alloc(arena, sizeof(char) * data_length, err);
+
+  if (err != NO_ERROR) {
+    UWU_PANIC("Fatal: Failed to allocate space for message `changed_status`\n");
+    UWU_String dummy = {};
+    return dummy;
+  }
+
+  return changed_status_builder(data, info);
+}
+
+// Current time in microseconds from a monotonic clock.
+uint64_t monotonic_us() {
+  struct timespec now = {};
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+// Atomically raises `*max` to `value` if it's bigger.
+void stats_update_max(uint64_t *max, uint64_t value) {
+  uint64_t current = __atomic_load_n(max, __ATOMIC_RELAXED);
+  while (value > current &&
+         !__atomic_compare_exchange_n(max, &current, value, TRUE,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+// Memory in use, by what uses it.
+typedef struct {
+  size_t users;
+  size_t histories;
+  size_t arenas;
+  size_t send_queues;
+  size_t mailboxes;
+} UWU_MemoryUsage;
+
+size_t UWU_MemoryUsage_total(const UWU_MemoryUsage *usage) {
+  return usage->users + usage->histories + usage->arenas + usage->send_queues +
+         usage->mailboxes;
+}
+
+UWU_MemoryUsage memory_usage() {
+  UWU_ServerStats *stats = &UWU_STATE->stats;
+  UWU_MemoryUsage usage = {
+      .users = __atomic_load_n(&UWU_STATE->active_users.length,
+                               __ATOMIC_RELAXED) *
+               sizeof(struct UWU_UserListNode),
+      .histories = __atomic_load_n(&stats->memory_histories, __ATOMIC_RELAXED),
+      .arenas = __atomic_load_n(&UWU_ARENA_BYTES, __ATOMIC_RELAXED),
+      .send_queues =
+          __atomic_load_n(&stats->memory_send_queues, __ATOMIC_RELAXED),
+      .mailboxes = __atomic_load_n(&stats->mailbox_bytes, __ATOMIC_RELAXED),
+  };
+  return usage;
+}
+
+// Writes all the server stats as a JSON object into `buff`.
+UWU_String stats_to_json(char *buff, size_t buff_size) {
+  UWU_ServerStats *stats = &UWU_STATE->stats;
+  UWU_MemoryUsage memory = memory_usage();
+  int length = snprintf(
+      buff, buff_size,
+      "{\"tls_handshakes\":%llu,\"tls_resumed_handshakes\":%llu,"
+      "\"tls_handshake_us_total\":%llu,\"tls_handshake_us_max\":%llu,"
+      "\"tls_reloads\":%llu,\"history_read_retries\":%llu,"
+      "\"history_read_fallbacks\":%llu,\"ring_submits\":%llu,"
+      "\"ring_writes\":%llu,\"ring_fallbacks\":%llu,"
+      "\"zerocopy_frames\":%llu,\"zerocopy_copied\":%llu,"
+      "\"queued_frames\":%llu,\"wakeups\":%llu,"
+      "\"replicated_frames\":%llu,\"replicated_messages\":%llu,"
+      "\"replication_lag_ms_total\":%llu,\"replication_lag_ms_max\":%llu,"
+      "\"failover_ms\":%llu,\"mailbox_queued\":%llu,"
+      "\"mailbox_spilled\":%llu,\"mailbox_delivered\":%llu,"
+      "\"mailbox_rejected\":%llu,\"mailbox_bytes\":%llu,"
+      "\"memory_users\":%llu,\"memory_histories\":%llu,"
+      "\"memory_arenas\":%llu,\"memory_send_queues\":%llu,"
+      "\"memory_total\":%llu,\"memory_budget\":%llu,"
+      "\"evicted_histories\":%llu,\"restored_histories\":%llu,"
+      "\"dropped_histories\":%llu,\"sealed_segments\":%llu,"
+      "\"lost_segments\":%llu,\"cold_pages\":%llu,"
+      "\"cold_page_us_total\":%llu,\"cold_page_us_max\":%llu,"
+      "\"searches\":%llu,\"search_us_total\":%llu,"
+      "\"search_us_max\":%llu,\"search_index_bytes\":%llu,"
+      "\"search_index_terms\":%llu,\"search_index_messages\":%llu,"
+      "\"invalid_requests\":%llu,"
+      "\"rate_limited_replies\":%llu,\"rate_limited\":[",
+      (unsigned long long)__atomic_load_n(&stats->tls_handshakes,
+                                          __ATOMIC_RELAXED),
+      (unsigned long long)__atomic_load_n(&stats->tls_resumed_handshakes,
+                                          __ATOMIC_RELAXED),
+      (unsigned long long)__atomic_load_n(&stats->tls_handshake_us_total,
+                                          __ATOMIC_RELAXED),
+      (unsigned long long)__atomic_load_n(&stats->tls_handshake_us_max,
+                                          __ATOMIC_RELAXED),
+      (unsigned long long)__atomic_load_n(&stats->tls_reloads,
+                                          __ATOMIC_RELAXED),
+      (unsigned long long)__atomic_load_n(&stats->history_read_retries,
+                                          __ATOMIC_RELAXED),
+      (unsigned long long)__atomic_load_n(&stats->history_read_fallbacks,
+                                          __ATOMIC_RELAXED),
+      (unsigned long long)__atomic_load_n(&stats->ring_submits,
+                                          __ATOMIC_RELAXED),
+      (unsigned long long)__atomic_load_n(&stats->ring_writes,
+                                          __ATOMIC_RELAXED),
+      (unsigned long long)__atomic_load_n(&stats->ring_fallbacks,
+                                          __ATOMIC_RELAXED),
+      (unsigned long long)__atomic_load_n(&stats->zerocopy_frames,
+                                          __ATOMIC_RELAXED),
+      (unsigned long long)__atomic_load_n(&stats->zerocopy_copied,
+                                          __ATOMIC_RELAXED),
+      (unsigned long long)__atomic_load_n(&stats->queued_frames,
+                                          __ATOMIC_RELAXED),
+      (unsigned long long)__atomic_load_n(&stats->wakeups, __ATOMIC_RELAXED),
+      (unsigned long long)__atomic_load_n(&stats->replicated_frames,
+                                          __ATOMIC_RELAXED),
+      (unsigned long long)__atomic_load_n(&stats->replicated_messages,
+                                          __ATOMIC_RELAXED),
+      (unsigned long long)__atomic_load_n(&stats->replication_lag_ms_total,
+                                          __ATOMIC_RELAXED),
+      (unsigned long long)__atomic_load_n(&stats->replication_lag_ms_max,
+                                          __ATOMIC_RELAXED),
+      (unsigned long long)__atomic_load_n(&stats->failover_ms,
+                                          __ATOMIC_RELAXED),
+      (unsigned long long)__atomic_load_n(&stats->mailbox_queued,
+                                          __ATOMIC_RELAXED),
+      (unsigned long long)__atomic_load_n(&stats->mailbox_spilled,
+                                          __ATOMIC_RELAXED),
+      (unsigned long long)__atomic_load_n(&stats->mailbox_delivered,
+                                          __ATOMIC_RELAXED),
+      (unsigned long long)__atomic_load_n(&stats->mailbox_rejected,
+                                          __ATOMIC_RELAXED),
+      (unsigned long long)__atomic_load_n(&stats->mailbox_bytes,
+                                          __ATOMIC_RELAXED),
+      (unsigned long long)memory.users, (unsigned long long)memory.histories,
+      (unsigned long long)memory.arenas,
+      (unsigned long long)memory.send_queues,
+      (unsigned long long)UWU_MemoryUsage_total(&memory),
+      (unsigned long long)s_memory_budget,
+      (unsigned long long)__atomic_load_n(&stats->evicted_histories,
+                                          __ATOMIC_RELAXED),
+      (unsigned long long)__atomic_load_n(&stats->restored_histories,
+                                          __ATOMIC_RELAXED),
+      (unsigned long long)__atomic_load_n(&stats->dropped_histories,
+                                          __ATOMIC_RELAXED),
+      (unsigned long long)__atomic_load_n(&stats->sealed_segments,
+                                          __ATOMIC_RELAXED),
+      (unsigned long long)__atomic_load_n(&stats->lost_segments,
+                                          __ATOMIC_RELAXED),
+      (unsigned long long)__atomic_load_n(&stats->cold_pages,
+                                          __ATOMIC_RELAXED),
+      (unsigned long long)__atomic_load_n(&stats->cold_page_us_total,
+                                          __ATOMIC_RELAXED),
+      (unsigned long long)__atomic_load_n(&stats->cold_page_us_max,
+                                          __ATOMIC_RELAXED),
+      (unsigned long long)__atomic_load_n(&stats->searches, __ATOMIC_RELAXED),
+      (unsigned long long)__atomic_load_n(&stats->search_us_total,
+                                          __ATOMIC_RELAXED),
+      (unsigned long long)__atomic_load_n(&stats->search_us_max,
+                                          __ATOMIC_RELAXED),
+      (unsigned long long)__atomic_load_n(&stats->search_index_bytes,
+                                          __ATOMIC_RELAXED),
+      (unsigned long long)__atomic_load_n(&stats->search_index_terms,
+                                          __ATOMIC_RELAXED),
+      (unsigned long long)__atomic_load_n(&stats->search_index_messages,
+                                          __ATOMIC_RELAXED),
+      (unsigned long long)__atomic_load_n(&stats->invalid_requests,
+                                          __ATOMIC_RELAXED),
+      (unsigned long long)__atomic_load_n(&stats->rate_limited_replies,
+                                          __ATOMIC_RELAXED));
+
+  // Dropped frames by type.
+  for (size_t i = 0; i < UWU_SERVER_MESSAGE_TYPES && length > 0 &&
+                     (size_t)length < buff_size;
+       i++) {
+    int written = snprintf(
+        buff + length, buff_size - length, "%s%llu", i == 0 ? "" : ",",
+        (unsigned long long)__atomic_load_n(&stats->rate_limited[i],
+                                            __ATOMIC_RELAXED));
+    length = written < 0 ? written : length + written;
+  }
+  if (length > 0 && (size_t)length < buff_size) {
+    int written =
+        snprintf(buff + length, buff_size - length, "],\"chats_stripes\":[");
+    length = written < 0 ? written : length + written;
+  }
+
+  // Contention of every stripe of the chats index.
+  for (size_t i = 0; i < UWU_STRIPED_MAP_STRIPES && length > 0 &&
+                     (size_t)length < buff_size;
+       i++) {
+    UWU_MapStripe *stripe = &UWU_STATE->chats.stripes[i];
+    int written = snprintf(
+        buff + length, buff_size - length,
+        "%s{\"locks\":%llu,\"contended\":%llu,\"read_retries\":%llu,"
+        "\"read_fallbacks\":%llu}",
+        i == 0 ? "" : ",",
+        (unsigned long long)__atomic_load_n(&stripe->locks, __ATOMIC_RELAXED),
+        (unsigned long long)__atomic_load_n(&stripe->contended,
+                                            __ATOMIC_RELAXED),
+        (unsigned long long)__atomic_load_n(&stripe->read_retries,
+                                            __ATOMIC_RELAXED),
+        (unsigned long long)__atomic_load_n(&stripe->read_fallbacks,
+                                            __ATOMIC_RELAXED));
+    length = written < 0 ? written : length + written;
+  }
+  if (length > 0 && (size_t)length < buff_size) {
+    int written = snprintf(buff + length, buff_size - length, "]}\n");
+    length = written < 0 ? written : length + written;
+  }
+
+  UWU_String json = {.data = buff, .length = 0};
+  if (length > 0) {
+    json.length = (size_t)length < buff_size ? (size_t)length : buff_size - 1;
+  }
+  return json;
+}
+
+/* *****************************************************************************
+TLS
+***************************************************************************** */
+
+// TLS material shared by every accepted connection.
+//
+// It's read from disk once at startup and only reloaded on SIGHUP or when one
+// of the files changes. ONLY THE MAIN thread should touch it!
+typedef struct {
+  struct mg_str ca;
+  struct mg_str cert;
+  struct mg_str key;
+  // Modification times of the files the current material was read from.
+  time_t ca_mtime;
+  time_t cert_mtime;
+  time_t key_mtime;
+#if MG_TLS == MG_TLS_OPENSSL
+  // Already parsed versions of the PEM files above, so handshakes don't need
+  // to parse them again.
+  X509_STORE *ca_store;
+  X509 *cert_x509;
+  EVP_PKEY *key_pkey;
+  // Mongoose creates one SSL_CTX per connection. Sharing the ticket keys
+  // between all of them lets any connection resume a session created by
+  // another one.
+  unsigned char ticket_keys[80];
+#endif
+} UWU_TLSCredentials;
+
+static UWU_TLSCredentials UWU_TLS = {};
+
+// Set by the SIGHUP handler, the main loop reloads the credentials.
+static volatile sig_atomic_t TLS_RELOAD_REQUESTED = 0;
+
+// Returns the modification time of `path`, 0 if it can't be read.
+time_t file_mtime(const char *path) {
+  size_t size = 0;
+  time_t mtime = 0;
+  if (!mg_fs_posix.st(path, &size, &mtime)) {
+    return 0;
+  }
+  return mtime;
+}
+
+void tls_credentials_free(UWU_TLSCredentials *creds) {
+  free((void *)creds->ca.buf);
+  free((void *)creds->cert.buf);
+  free((void *)creds->key.buf);
+#if MG_TLS == MG_TLS_OPENSSL
+  X509_STORE_free(creds->ca_store);
+  X509_free(creds->cert_x509);
+  EVP_PKEY_free(creds->key_pkey);
+#endif
+}
+
+#if MG_TLS == MG_TLS_OPENSSL
+// Parses all the PEM files inside `creds`.
+UWU_Bool tls_credentials_parse(UWU_TLSCredentials *creds) {
+  if (creds->ca.len > 0) {
+    creds->ca_store = X509_STORE_new();
+    BIO *bio = BIO_new_mem_buf(creds->ca.buf, (int)creds->ca.len);
+    STACK_OF(X509_INFO) *certs =
+        bio ? PEM_X509_INFO_read_bio(bio, NULL, NULL, NULL) : NULL;
+    BIO_free(bio);
+    if (creds->ca_store == NULL || certs == NULL) {
+      sk_X509_INFO_pop_free(certs, X509_INFO_free);
+      return FALSE;
+    }
+    for (int i = 0; i < sk_X509_INFO_num(certs); i++) {
+      X509_INFO *info = sk_X509_INFO_value(certs, i);
+      if (info->x509 && !X509_STORE_add_cert(creds->ca_store, info->x509)) {
+        sk_X509_INFO_pop_free(certs, X509_INFO_free);
+        return FALSE;
+      }
+    }
+    sk_X509_INFO_pop_free(certs, X509_INFO_free);
+  }
+
+  if (creds->cert.len > 0) {
+    BIO *bio = BIO_new_mem_buf(creds->cert.buf, (int)creds->cert.len);
+    creds->cert_x509 = bio ? PEM_read_bio_X509(bio, NULL, NULL, NULL) : NULL;
+    BIO_free(bio);
+    if (creds->cert_x509 == NULL) {
+      return FALSE;
+    }
+  }
+
+  if (creds->key.len > 0) {
+    BIO *bio = BIO_new_mem_buf(creds->key.buf, (int)creds->key.len);
+    creds->key_pkey = bio ? PEM_read_bio_PrivateKey(bio, NULL, NULL, NULL) : NULL;
+    BIO_free(bio);
+    if (creds->key_pkey == NULL) {
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+#endif
+
+// Reads the CA, certificate and key from disk.
+//
+// If `force` is FALSE the files are only read when one of them changed.
+// If the new files can't be parsed the old credentials are kept.
+void tls_credentials_reload(UWU_Bool force) {
+  time_t ca_mtime = file_mtime(s_ca_path);
+  time_t cert_mtime = file_mtime(s_cert_path);
+  time_t key_mtime = file_mtime(s_key_path);
+
+  UWU_Bool changed = ca_mtime != UWU_TLS.ca_mtime ||
+                     cert_mtime != UWU_TLS.cert_mtime ||
+                     key_mtime != UWU_TLS.key_mtime;
+  if (!force && !changed) {
+    return;
+  }
+
+  UWU_TLSCredentials creds = {
+      .ca = mg_file_read(&mg_fs_posix, s_ca_path),
+      .cert = mg_file_read(&mg_fs_posix, s_cert_path),
+      .key = mg_file_read(&mg_fs_posix, s_key_path),
+      .ca_mtime = ca_mtime,
+      .cert_mtime = cert_mtime,
+      .key_mtime = key_mtime,
+  };
+
+#if MG_TLS == MG_TLS_OPENSSL
+  if (!tls_credentials_parse(&creds)) {
+    MG_ERROR(("Failed to parse TLS credentials, keeping the old ones!"));
+    tls_credentials_free(&creds);
+    return;
+  }
+  memcpy(creds.ticket_keys, UWU_TLS.ticket_keys, sizeof(creds.ticket_keys));
+#endif
+
+  tls_credentials_free(&UWU_TLS);
+  UWU_TLS = creds;
+  __atomic_fetch_add(&UWU_STATE->stats.tls_reloads, 1, __ATOMIC_RELAXED);
+  MG_INFO(("TLS credentials loaded!"));
+}
+
+// Timer callback that picks up SIGHUP requests and changed files.
+void tls_reload_timer(void *arg) {
+  UWU_Bool force = TLS_RELOAD_REQUESTED;
+  TLS_RELOAD_REQUESTED = 0;
+  tls_credentials_reload(force);
+}
+
+void request_tls_reload(int signal) { TLS_RELOAD_REQUESTED = 1; }
+
+// Starts TLS on an accepted connection using the cached credentials.
+void tls_accept(struct mg_connection *c) {
+  // Remember when we accepted the connection to measure the handshake.
+  uint64_t accepted_at = monotonic_us();
+  memcpy(c->data, &accepted_at, sizeof(accepted_at));
+
+#if MG_TLS == MG_TLS_OPENSSL
+  // Parsed material is installed directly on the SSL object below.
+  struct mg_tls_opts opts = {};
+  mg_tls_init(c, &opts);
+
+  struct mg_tls *tls = (struct mg_tls *)c->tls;
+  if (tls == NULL) {
+    return;
+  }
+
+  if (UWU_TLS.ca_store != NULL) {
+    SSL_set_verify(tls->ssl, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT,
+                   NULL);
+    SSL_CTX_set1_cert_store(tls->ctx, UWU_TLS.ca_store);
+  }
+  if (UWU_TLS.cert_x509 != NULL &&
+      SSL_use_certificate(tls->ssl, UWU_TLS.cert_x509) != 1) {
+    mg_error(c, "CERT err");
+    return;
+  }
+  if (UWU_TLS.key_pkey != NULL &&
+      SSL_use_PrivateKey(tls->ssl, UWU_TLS.key_pkey) != 1) {
+    mg_error(c, "KEY err");
+    return;
+  }
+  SSL_CTX_set_tlsext_ticket_keys(tls->ctx, UWU_TLS.ticket_keys,
+                                 sizeof(UWU_TLS.ticket_keys));
+#else
+  struct mg_tls_opts opts = {
+      .ca = UWU_TLS.ca, .cert = UWU_TLS.cert, .key = UWU_TLS.key};
+  mg_tls_init(c, &opts);
+#endif
+}
+
+// Records the handshake latency of a connection.
+void tls_handshake_done(struct mg_connection *c) {
+  uint64_t accepted_at = 0;
+  memcpy(&accepted_at, c->data, sizeof(accepted_at));
+  uint64_t elapsed = monotonic_us() - accepted_at;
+
+  UWU_ServerStats *stats = &UWU_STATE->stats;
+  __atomic_fetch_add(&stats->tls_handshakes, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&stats->tls_handshake_us_total, elapsed,
+                     __ATOMIC_RELAXED);
+  stats_update_max(&stats->tls_handshake_us_max, elapsed);
+
+#if MG_TLS == MG_TLS_OPENSSL
+  struct mg_tls *tls = (struct mg_tls *)c->tls;
+  if (tls != NULL && SSL_session_reused(tls->ssl)) {
+    __atomic_fetch_add(&stats->tls_resumed_handshakes, 1, __ATOMIC_RELAXED);
+  }
+#endif
+}
+
+/* *****************************************************************************
+History Tiers
+***************************************************************************** */
+
+// Chats keep their newest messages in memory and seal the older ones into
+// segment files inside `s_history_dir`, check `History Segments` on lib.
+// Segment `n` of a chat holds the IDs `[n * HISTORY_SEGMENT_MESSAGES + 1,
+// (n + 1) * HISTORY_SEGMENT_MESSAGES]` and lives on `<hex chat key>.<n>`, so
+// which segments a chat has follows from its last ID.
+//
+// DM histories seal a segment as soon as its last message is stored. The
+// group chat is written without locks, so a segment is sealed once the next
+// one is complete too, by then the writers of its messages are done.
+//
+// A single thread writes the segments and reads them back to answer the
+// OLDER_MESSAGES that go past what's in memory, so handler threads never wait
+// on the disk. Its jobs run in order, a page that needs a segment always finds
+// it written. Segments are deleted with their chat and don't survive a
+// restart.
+//
+// The same thread owns the search index, check `Search Index` on lib. Every
+// segment is indexed once it's written, so a SEARCH looks for the messages
+// still in memory itself and the thread finishes it with the index. It also
+// writes the offline mailboxes that go over their budget, check `Offline
+// Mailboxes`.
+
+typedef enum {
+  // Writes a segment.
+  TIER_SEAL,
+  // Deletes the segments `[segment, count)` of a chat.
+  TIER_DROP,
+  // Answers an OLDER_MESSAGES that reads segments.
+  TIER_PAGE,
+  // Answers a SEARCH with the index.
+  TIER_SEARCH,
+  // Appends the DMs waiting on an offline mailbox to its segment.
+  TIER_SPILL,
+  // Sends every segment written so far to the follower.
+  TIER_REPLICATE,
+} UWU_TierJobType;
+
+typedef struct UWU_TierJob {
+  struct UWU_TierJob *next;
+  UWU_TierJobType type;
+  // The key of the chat on `chats`, or the name of the group chat.
+  // TIER_SEARCH and TIER_SPILL: The user that searches or owns the mailbox.
+  // TIER_REPLICATE: Empty.
+  UWU_String key;
+  // TIER_SEAL: The records of the segment.
+  // TIER_PAGE: The OLDER_MESSAGES header followed by the records that were in
+  // memory, the ones read from the segments go between them.
+  char *data;
+  size_t length;
+  // TIER_SEAL and TIER_PAGE: Records on `data`.
+  // TIER_DROP: The segment after the last one to delete.
+  size_t count;
+  // TIER_SEAL: The segment to write.
+  // TIER_DROP: The first segment to delete.
+  uint64_t segment;
+  // TIER_PAGE: The IDs `[cold_start, cold_end)` are read from segments.
+  uint64_t cold_start;
+  uint64_t cold_end;
+  // TIER_PAGE and TIER_SEARCH: The connection that asked.
+  struct mg_connection *conn;
+  // TIER_PAGE and TIER_SEARCH: The answers its handler is waiting for, check
+  // `wait_tier_answers`.
+  size_t *pending;
+  // TIER_PAGE and TIER_SEARCH: When the request was read.
+  uint64_t received_us;
+  // TIER_SEARCH: The query and the results found in memory.
+  struct UWU_Search *search;
+} UWU_TierJob;
+
+typedef struct {
+  UWU_TierJob *first;
+  UWU_TierJob *last;
+  // Guards the queue and the `pending` counters of the handlers. Nothing is
+  // locked after it.
+  pthread_mutex_t mx;
+  // Signaled when a job is queued or the server shuts down.
+  pthread_cond_t cond;
+  // Broadcasted every time a page or search is answered.
+  pthread_cond_t answered;
+  // TRUE once the thread should exit, after running the jobs left.
+  UWU_Bool stopping;
+  pthread_t thread;
+  // Indexes every segment written. ONLY the tiers thread can touch it!
+  UWU_SearchIndex index;
+} UWU_HistoryTiers;
+
+static UWU_HistoryTiers UWU_TIERS = {};
+
+// Writes the path of segment `segment` of the chat `key` into `path`.
+void segment_path(char *path, size_t path_size, const UWU_String *const key,
+                  uint64_t segment) {
+  hex_file_path(path, path_size, s_history_dir, key);
+  size_t length = strlen(path);
+  snprintf(&path[length], path_size - length, ".%lu", (unsigned long)segment);
+}
+
+// What a SEARCH found so far, newest first.
+typedef struct {
+  uint64_t timestamp_ms;
+  uint64_t id;
+  size_t length;
+  // The message like SEARCH_RESULTS carries it.
+  char data[UWU_SEARCH_RESULT_SIZE];
+} UWU_SearchResult;
+
+// A chat whose messages in memory a SEARCH already looked at.
+typedef struct {
+  // The key of the chat on `chats`, or the name of the group chat.
+  UWU_String key;
+  // The oldest ID that was in memory, the index only has to find older ones.
+  uint64_t first_id;
+} UWU_SearchedChat;
+
+typedef struct UWU_Search {
+  UWU_SearchTerms terms;
+  UWU_SearchResult results[MAX_SEARCH_RESULTS];
+  size_t count;
+  UWU_SearchedChat *searched;
+  size_t searched_count;
+  size_t searched_capacity;
+} UWU_Search;
+
+void UWU_Search_free(UWU_Search *search) {
+  if (search == NULL) {
+    return;
+  }
+  for (size_t i = 0; i < search->searched_count; i++) {
+    UWU_String_freeWithMalloc(&search->searched[i].key);
+  }
+  free(search->searched);
+  free(search);
+}
+
+// Keeps `record` of `chat` if it's one of the newest `MAX_SEARCH_RESULTS`
+// found so far.
+void UWU_Search_add(UWU_Search *search, const UWU_String *const chat,
+                    const UWU_SegmentRecord *record) {
+  size_t pos = search->count;
+  while (pos > 0 &&
+         (search->results[pos - 1].timestamp_ms < record->timestamp_ms ||
+          (search->results[pos - 1].timestamp_ms == record->timestamp_ms &&
+           search->results[pos - 1].id < record->id))) {
+    pos--;
+  }
+  if (pos == MAX_SEARCH_RESULTS) {
+    return;
+  }
+
+  size_t moved = search->count < MAX_SEARCH_RESULTS ? search->count - pos
+                                                    : search->count - pos - 1;
+  memmove(&search->results[pos + 1], &search->results[pos],
+          moved * sizeof(UWU_SearchResult));
+  if (search->count < MAX_SEARCH_RESULTS) {
+    search->count++;
+  }
+
+  UWU_SearchResult *result = &search->results[pos];
+  size_t chat_length = chat->length < 255 ? chat->length : 255;
+  result->timestamp_ms = record->timestamp_ms;
+  result->id = record->id;
+  result->data[0] = chat_length;
+  memcpy(&result->data[1], chat->data, chat_length);
+  result->length =
+      1 + chat_length +
+      UWU_SegmentRecord_write(&result->data[1 + chat_length], record);
+}
+
+// Returns TRUE if every message older than `newest_ms` can be ignored.
+UWU_Bool UWU_Search_isFull(const UWU_Search *search, uint64_t newest_ms) {
+  return search->count == MAX_SEARCH_RESULTS &&
+         search->results[search->count - 1].timestamp_ms >= newest_ms;
+}
+
+// Remembers that the messages of the chat `key` from `first_id` on were
+// already searched.
+//
+// Returns FALSE if there's no memory, the chat shouldn't be searched then.
+UWU_Bool UWU_Search_remember(UWU_Search *search, const UWU_String *const key,
+                             uint64_t first_id) {
+  if (search->searched_count == search->searched_capacity) {
+    size_t capacity =
+        search->searched_capacity == 0 ? 8 : 2 * search->searched_capacity;
+    UWU_SearchedChat *searched =
+        realloc(search->searched, capacity * sizeof(UWU_SearchedChat));
+    if (searched == NULL) {
+      return FALSE;
+    }
+    search->searched = searched;
+    search->searched_capacity = capacity;
+  }
+
+  UWU_Err err = NO_ERROR;
+  UWU_SearchedChat chat = {.key = UWU_String_copy(key, err),
+                           .first_id = first_id};
+  if (chat.key.data == NULL) {
+    return FALSE;
+  }
+  search->searched[search->searched_count++] = chat;
+  return TRUE;
+}
+
+// The oldest ID of the chat `key` that was searched in memory, `UINT64_MAX`
+// if none was.
+uint64_t UWU_Search_firstSearched(const UWU_Search *search,
+                                  const UWU_String *const key) {
+  for (size_t i = 0; i < search->searched_count; i++) {
+    if (UWU_String_equal(&search->searched[i].key, key)) {
+      return search->searched[i].first_id;
+    }
+  }
+  return UINT64_MAX;
+}
+
+void UWU_TierJob_free(UWU_TierJob *job) {
+  UWU_String_freeWithMalloc(&job->key);
+  free(job->data);
+  UWU_Search_free(job->search);
+  free(job);
+}
+
+// Creates a job for the chat `key`.
+//
+// Success: Returns the job, with everything else zeroed.
+// Failure: Returns NULL if there's no memory.
+UWU_TierJob *tier_job(UWU_TierJobType type, const UWU_String *const key) {
+  UWU_Err err = NO_ERROR;
+  UWU_TierJob *job = calloc(1, sizeof(UWU_TierJob));
+  if (job == NULL) {
+    return NULL;
+  }
+  job->type = type;
+  job->key = UWU_String_copy(key, err);
+  if (job->key.data == NULL) {
+    free(job);
+    return NULL;
+  }
+  return job;
+}
+
+// Queues `job` for the tiers thread, which frees it.
+void tier_queue(UWU_TierJob *job) {
+  UWU_PanicIf(pthread_mutex_lock(&UWU_TIERS.mx) != 0,
+              "Fatal: Can't lock the history tiers mutex!");
+  if (job->type == TIER_PAGE || job->type == TIER_SEARCH) {
+    *job->pending += 1;
+  }
+  if (UWU_TIERS.last == NULL) {
+    UWU_TIERS.first = job;
+  } else {
+    UWU_TIERS.last->next = job;
+  }
+  UWU_TIERS.last = job;
+  pthread_cond_signal(&UWU_TIERS.cond);
+  UWU_PanicIf(pthread_mutex_unlock(&UWU_TIERS.mx) != 0,
+              "Fatal: Can't unlock the history tiers mutex!");
+}
+
+// Queues the segment `segment` of the chat `key` to be written. Takes
+// `records`, which must come from `malloc`.
+void seal_segment(const UWU_String *const key, uint64_t segment,
+                  char *records, size_t length, size_t count) {
+  UWU_TierJob *job = tier_job(TIER_SEAL, key);
+  if (job == NULL) {
+    free(records);
+    __atomic_fetch_add(&UWU_STATE->stats.lost_segments, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  job->segment = segment;
+  job->data = records;
+  job->length = length;
+  job->count = count;
+  tier_queue(job);
+}
+
+// Seals the last `HISTORY_SEGMENT_MESSAGES` messages of a DM history if they
+// complete a segment.
+// PLEASE lock the history before calling this function!
+void seal_history_segment(UWU_ChatHistory *history) {
+  if (history->next_idx % HISTORY_SEGMENT_MESSAGES != 0 ||
+      history->count < HISTORY_SEGMENT_MESSAGES) {
+    return;
+  }
+
+  char *records =
+      malloc(HISTORY_SEGMENT_MESSAGES * UWU_SEGMENT_MAX_RECORD_SIZE);
+  if (records == NULL) {
+    __atomic_fetch_add(&UWU_STATE->stats.lost_segments, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  size_t length = 0;
+  for (size_t i = history->next_idx - HISTORY_SEGMENT_MESSAGES;
+       i < history->next_idx; i++) {
+    UWU_ChatEntry entry = UWU_ChatHistory_get(history, i % history->capacity);
+    UWU_SegmentRecord record = {
+        .id = entry.id,
+        .timestamp_ms = entry.timestamp_ms,
+        .from = UWU_Username_view(&entry.origin_username),
+        .content = entry.content,
+    };
+    length += UWU_SegmentRecord_write(&records[length], &record);
+  }
+
+  seal_segment(&history->channel_name,
+               history->next_idx / HISTORY_SEGMENT_MESSAGES - 1, records,
+               length, HISTORY_SEGMENT_MESSAGES);
+}
+
+// Copies the message at `pos` of the group chat as a record into `dest`.
+//
+// Returns the bytes written, 0 if it was overwritten or it's still being
+// written.
+size_t copy_group_record(uint64_t pos, char *dest, size_t dest_size) {
+  if (dest_size < 16) {
+    return 0;
+  }
+  // The record ends like `UWU_ChannelHistory_copyMessage` writes messages.
+  uint64_t timestamp_ms = 0;
+  size_t copied = UWU_ChannelHistory_copyMessage(
+      &UWU_STATE->group_chat, pos, &dest[16], dest_size - 16, &timestamp_ms);
+  if (copied == 0) {
+    return 0;
+  }
+  UWU_writeBigEndian(dest, pos + 1, 8);
+  UWU_writeBigEndian(&dest[8], timestamp_ms, 8);
+  return 16 + copied;
+}
+
+// Seals the segment `segment` of the group chat. If `whole` is TRUE it's only
+// sealed if it has all its messages.
+void seal_group_segment(uint64_t segment, UWU_Bool whole) {
+  UWU_ChannelHistory *group_chat = &UWU_STATE->group_chat;
+  size_t size = HISTORY_SEGMENT_MESSAGES * UWU_SEGMENT_MAX_RECORD_SIZE;
+  char *records = malloc(size);
+  if (records == NULL) {
+    __atomic_fetch_add(&UWU_STATE->stats.lost_segments, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  size_t length = 0;
+  size_t count = 0;
+  for (uint64_t pos = segment * HISTORY_SEGMENT_MESSAGES;
+       pos < (segment + 1) * HISTORY_SEGMENT_MESSAGES; pos++) {
+    // Messages overwritten before the segment is sealed are lost.
+    size_t copied = 0;
+    if (UWU_ChannelHistory_waitPublished(group_chat, pos)) {
+      copied = copy_group_record(pos, &records[length], size - length);
+    }
+    if (copied > 0) {
+      length += copied;
+      count++;
+    }
+  }
+
+  if (whole && count < HISTORY_SEGMENT_MESSAGES) {
+    free(records);
+    return;
+  }
+  seal_segment(&GROUP_CHAT_CHANNEL, segment, records, length, count);
+}
+
+// Appends a message to the group chat and seals the segment before the
+// previous one if it just completed.
+//
+// Returns the ID assigned to the message.
+uint64_t append_group_message(const UWU_String *const username,
+                              const UWU_String *const content,
+                              uint64_t timestamp_ms) {
+  uint64_t id = UWU_ChannelHistory_append(&UWU_STATE->group_chat, username,
+                                          content, timestamp_ms);
+  if (id % HISTORY_SEGMENT_MESSAGES == 0 &&
+      id >= 2 * HISTORY_SEGMENT_MESSAGES) {
+    seal_group_segment(id / HISTORY_SEGMENT_MESSAGES - 2, FALSE);
+  }
+  return id;
+}
+
+// Stores a message of the group chat the primary replicated, with the ID it
+// got there, check `UWU_ChannelHistory_store`. Segments are sealed like
+// `append_group_message` does, but only whole: the primary sends the ones it
+// wrote before the follower linked, check `follower_sync`.
+// ONLY the event loop can call this, while following a primary!
+//
+// Returns FALSE if the group chat already has the message or it's too old.
+UWU_Bool store_group_message(uint64_t id, const UWU_String *const content,
+                             uint64_t timestamp_ms) {
+  UWU_ChannelHistory *group_chat = &UWU_STATE->group_chat;
+  uint64_t head = UWU_ChannelHistory_range(group_chat).end;
+  if (!UWU_ChannelHistory_store(group_chat, id, &GROUP_CHAT_CHANNEL, content,
+                                timestamp_ms)) {
+    return FALSE;
+  }
+
+  uint64_t segment = (id - 1) / HISTORY_SEGMENT_MESSAGES;
+  if (id <= head) {
+    // It came late, the segment may have been waiting for it.
+    if (head >= (segment + 2) * HISTORY_SEGMENT_MESSAGES) {
+      seal_group_segment(segment, TRUE);
+    }
+    return TRUE;
+  }
+
+  // The segments before the ring can't be whole.
+  uint64_t oldest = id > group_chat->capacity
+                        ? (id - group_chat->capacity) / HISTORY_SEGMENT_MESSAGES
+                        : 0;
+  uint64_t due = head / HISTORY_SEGMENT_MESSAGES + 1;
+  if (due < oldest + 2) {
+    due = oldest + 2;
+  }
+  for (; due * HISTORY_SEGMENT_MESSAGES <= id; due++) {
+    seal_group_segment(due - 2, TRUE);
+  }
+  return TRUE;
+}
+
+// Where the IDs of a DM history that was dropped left off.
+typedef struct {
+  // The key of the history. Owned by the floor.
+  UWU_String key;
+  // The next history with the same key assigns IDs after it. Always a
+  // multiple of `HISTORY_SEGMENT_MESSAGES`, so it starts on a new segment.
+  uint64_t next_idx;
+} UWU_ChatFloor;
+
+typedef struct {
+  // Key: The key of a DM history. Value: An UWU_ChatFloor.
+  UWU_FlatMap map;
+  // Guards the map. Nothing is locked after it.
+  pthread_mutex_t mx;
+} UWU_ChatFloors;
+
+// DM histories are dropped when one of their users leaves and created again
+// when they talk. The floors keep the IDs of the new history after the ones
+// clients already saw, so an ID is never reused while the server runs.
+static UWU_ChatFloors UWU_CHAT_FLOORS = {};
+
+// Returns the ID the DM history `key` assigns its messages after, 0 if it was
+// never dropped.
+uint64_t chat_floor(const UWU_String *const key) {
+  UWU_PanicIf(pthread_mutex_lock(&UWU_CHAT_FLOORS.mx) != 0,
+              "Fatal: Can't lock the chat floors mutex!");
+  UWU_ChatFloor *floor = UWU_FlatMap_get(&UWU_CHAT_FLOORS.map, key);
+  uint64_t next_idx = floor != NULL ? floor->next_idx : 0;
+  UWU_PanicIf(pthread_mutex_unlock(&UWU_CHAT_FLOORS.mx) != 0,
+              "Fatal: Can't unlock the chat floors mutex!");
+  return next_idx;
+}
+
+// Raises the floor of the DM history `key`, which assigned IDs up to
+// `next_idx`.
+//
+// Returns the previous floor, the segments before it were already deleted.
+uint64_t chat_floor_raise(const UWU_String *const key, uint64_t next_idx) {
+  uint64_t raised = (next_idx + HISTORY_SEGMENT_MESSAGES - 1) /
+                    HISTORY_SEGMENT_MESSAGES * HISTORY_SEGMENT_MESSAGES;
+  UWU_Err err = NO_ERROR;
+  UWU_PanicIf(pthread_mutex_lock(&UWU_CHAT_FLOORS.mx) != 0,
+              "Fatal: Can't lock the chat floors mutex!");
+  UWU_ChatFloor *floor = UWU_FlatMap_get(&UWU_CHAT_FLOORS.map, key);
+  uint64_t previous = floor != NULL ? floor->next_idx : 0;
+  if (floor == NULL && raised > 0) {
+    floor = calloc(1, sizeof(UWU_ChatFloor));
+    if (floor != NULL) {
+      floor->key = UWU_String_copy(key, err);
+    }
+    if (floor == NULL || floor->key.data == NULL ||
+        !UWU_FlatMap_put(&UWU_CHAT_FLOORS.map, &floor->key, floor, err)) {
+      MG_ERROR(("Can't keep the floor of `%.*s`, its IDs start over!",
+                (int)key->length, key->data));
+      if (floor != NULL) {
+        UWU_String_freeWithMalloc(&floor->key);
+      }
+      free(floor);
+      floor = NULL;
+    }
+  }
+  if (floor != NULL && raised > floor->next_idx) {
+    floor->next_idx = raised;
+  }
+  UWU_PanicIf(pthread_mutex_unlock(&UWU_CHAT_FLOORS.mx) != 0,
+              "Fatal: Can't unlock the chat floors mutex!");
+  return previous;
+}
+
+// Returns TRUE for every floor and frees it.
+UWU_Bool chat_floor_always(void *context, UWU_String key, void *value) {
+  UWU_ChatFloor *floor = value;
+  UWU_String_freeWithMalloc(&floor->key);
+  free(floor);
+  return TRUE;
+}
+
+// Deletes the segments of the DM history `key`, which assigned IDs up to
+// `next_idx`, and raises its floor.
+void drop_chat_segments(const UWU_String *const key, size_t next_idx) {
+  uint64_t first = chat_floor_raise(key, next_idx) / HISTORY_SEGMENT_MESSAGES;
+  size_t count = next_idx / HISTORY_SEGMENT_MESSAGES;
+  if (count <= first) {
+    return;
+  }
+  UWU_TierJob *job = tier_job(TIER_DROP, key);
+  if (job == NULL) {
+    MG_ERROR(("Can't delete the segments of `%.*s`!", (int)key->length,
+              key->data));
+    return;
+  }
+  job->segment = first;
+  job->count = count;
+  tier_queue(job);
+}
+
+// Exports the size of the search index on `/stats`.
+void search_index_stats() {
+  UWU_SearchIndex *index = &UWU_TIERS.index;
+  __atomic_store_n(&UWU_STATE->stats.search_index_bytes,
+                   UWU_SearchIndex_bytesUsed(index), __ATOMIC_RELAXED);
+  __atomic_store_n(&UWU_STATE->stats.search_index_terms, index->terms.count,
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&UWU_STATE->stats.search_index_messages, index->live_docs,
+                   __ATOMIC_RELAXED);
+}
+
+// Compresses and writes a segment. It's written to a temporary file first,
+// so a segment on disk is always complete.
+void write_segment(UWU_TierJob *job) {
+  char path[1024];
+  char tmp_path[1024 + 4];
+  segment_path(path, sizeof(path), &job->key, job->segment);
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+  // A follower may seal a segment its primary sends it too, the one written
+  // first is kept.
+  if (access(path, F_OK) == 0) {
+    return;
+  }
+
+  UWU_Err err = NO_ERROR;
+  UWU_String records = {.data = job->data, .length = job->length};
+  UWU_String compressed = UWU_Deflate_compress(&records, err);
+  char header[UWU_SEGMENT_HEADER_SIZE];
+  UWU_Segment_writeHeader(header,
+                          job->segment * HISTORY_SEGMENT_MESSAGES + 1,
+                          job->count);
+
+  int fd = -1;
+  if (compressed.data != NULL) {
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  }
+  UWU_Bool written =
+      fd != -1 &&
+      write(fd, header, sizeof(header)) == (ssize_t)sizeof(header) &&
+      write(fd, compressed.data, compressed.length) ==
+          (ssize_t)compressed.length;
+  if (fd != -1) {
+    close(fd);
+  }
+  if (written) {
+    written = rename(tmp_path, path) == 0;
+  }
+
+  if (!written) {
+    MG_ERROR(("Can't write the history segment %s!", path));
+    unlink(tmp_path);
+    __atomic_fetch_add(&UWU_STATE->stats.lost_segments, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  __atomic_fetch_add(&UWU_STATE->stats.sealed_segments, 1, __ATOMIC_RELAXED);
+
+  if (!UWU_SearchIndex_addSegment(&UWU_TIERS.index, &job->key, job->segment,
+                                  &records)) {
+    MG_ERROR(("Can't index the history segment %s!", path));
+  }
+  search_index_stats();
+}
+
+// Deletes the segments of a chat.
+void drop_segments(UWU_TierJob *job) {
+  for (uint64_t segment = job->segment; segment < job->count; segment++) {
+    char path[1024];
+    segment_path(path, sizeof(path), &job->key, segment);
+    unlink(path);
+  }
+  UWU_SearchIndex_dropChat(&UWU_TIERS.index, &job->key);
+  search_index_stats();
+}
+
+// Reads the records of the segment `segment` of the chat `key`, check
+// `UWU_Segment_records` for how long they're valid.
+//
+// Returns an empty string if the segment is missing or can't be read.
+UWU_String load_segment(const UWU_String *const key, uint64_t segment) {
+  UWU_String records = {};
+  char path[1024];
+  segment_path(path, sizeof(path), key, segment);
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return records;
+  }
+
+  struct stat info = {};
+  char *mapped = MAP_FAILED;
+  if (fstat(fd, &info) == 0 && info.st_size > 0) {
+    mapped = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    return records;
+  }
+
+  UWU_Err err = NO_ERROR;
+  UWU_String file = {.data = mapped, .length = info.st_size};
+  records = UWU_Segment_records(&file, HISTORY_SEGMENT_MESSAGES, err);
+  munmap(mapped, info.st_size);
+  if (records.data == NULL) {
+    MG_ERROR(("The history segment %s is corrupt!", path));
+  }
+  return records;
+}
+
+// Appends the records of the segment of the chat `key` with IDs
+// `[start, end)` to `dest`, which has space for all of them.
+//
+// Returns how many were appended. A segment that's missing or can't be read
+// appends nothing.
+size_t read_segment(const UWU_String *const key, uint64_t segment,
+                    uint64_t start, uint64_t end, char *dest,
+                    size_t *length) {
+  UWU_String records = load_segment(key, segment);
+  size_t count = 0;
+  UWU_SegmentRecord record = {};
+  for (size_t offset = 0; UWU_SegmentRecord_next(&records, &offset, &record);) {
+    if (record.id >= start && record.id < end) {
+      *length += UWU_SegmentRecord_write(&dest[*length], &record);
+      count++;
+    }
+  }
+  return count;
+}
+
+// Answers an OLDER_MESSAGES with the records of the segments, followed by the
+// ones that were in memory.
+void answer_older_messages(UWU_TierJob *job) {
+  size_t header_length = 3 + (uint8_t)job->data[1];
+  size_t size = job->length + MAX_PAGE_MESSAGES * UWU_SEGMENT_MAX_RECORD_SIZE;
+  char *data = malloc(size);
+  if (data == NULL) {
+    MG_ERROR(("Can't allocate an OLDER_MESSAGES, it's dropped!"));
+    return;
+  }
+
+  memcpy(data, job->data, header_length);
+  size_t length = header_length;
+  size_t count = 0;
+  for (uint64_t segment = (job->cold_start - 1) / HISTORY_SEGMENT_MESSAGES;
+       segment * HISTORY_SEGMENT_MESSAGES + 1 < job->cold_end; segment++) {
+    count += read_segment(&job->key, segment, job->cold_start, job->cold_end,
+                          data, &length);
+  }
+  memcpy(&data[length], &job->data[header_length],
+         job->length - header_length);
+  length += job->length - header_length;
+  data[header_length - 1] = count + job->count;
+
+  UWU_String response = {.data = data, .length = length};
+  send_msg(job->conn, &response);
+  free(data);
+
+  uint64_t elapsed_us = monotonic_us() - job->received_us;
+  __atomic_fetch_add(&UWU_STATE->stats.cold_pages, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&UWU_STATE->stats.cold_page_us_total, elapsed_us,
+                     __ATOMIC_RELAXED);
+  stats_update_max(&UWU_STATE->stats.cold_page_us_max, elapsed_us);
+}
+
+// The name a SEARCH_RESULTS gives to the chat `key` when `username` searches:
+// the group chat or the other user of a DM. Returns an empty string if the
+// user can't see the chat.
+UWU_String search_chat_name(const UWU_String *const key,
+                            const UWU_String *const username) {
+  UWU_String name = {};
+  if (UWU_String_equal(key, &GROUP_CHAT_CHANNEL)) {
+    name = GROUP_CHAT_CHANNEL;
+  } else if (chat_has_user(key, username)) {
+    name = chat_partner(key, username);
+  }
+  return name;
+}
+
+// Returns TRUE if the user given as context can see the chat `chat` of the
+// index.
+UWU_Bool search_chat_visible(void *context, uint32_t chat) {
+  UWU_String key = UWU_SearchIndex_chatKey(&UWU_TIERS.index, chat);
+  return search_chat_name(&key, context).data != NULL;
+}
+
+// Finishes a SEARCH with the segments on the index and sends its results.
+//
+// Hits come newest segment first and stop once no older one can beat the
+// results. Consecutive hits tend to share a segment, so the last one read
+// is kept.
+void answer_search(UWU_TierJob *job) {
+  UWU_Search *search = job->search;
+  // Too big to copy around, but the stack of the thread has plenty.
+  UWU_SearchQuery query;
+  UWU_SearchQuery_init(&query, &UWU_TIERS.index, &search->terms,
+                       search_chat_visible, &job->key);
+
+  UWU_String records = {};
+  uint32_t loaded_chat = UINT32_MAX;
+  uint64_t loaded_segment = 0;
+  UWU_SearchHit hit = {};
+  for (size_t hits = 0; hits < MAX_SEARCH_HITS &&
+                        UWU_SearchQuery_next(&query, &hit) &&
+                        !UWU_Search_isFull(search, hit.newest_ms);
+       hits++) {
+    UWU_String key = UWU_SearchIndex_chatKey(&UWU_TIERS.index, hit.chat);
+    UWU_String name = search_chat_name(&key, &job->key);
+    if (hit.id >= UWU_Search_firstSearched(search, &key)) {
+      continue;
+    }
+
+    if (hit.chat != loaded_chat || hit.segment != loaded_segment) {
+      records = load_segment(&key, hit.segment);
+      loaded_chat = hit.chat;
+      loaded_segment = hit.segment;
+    }
+    UWU_SegmentRecord record = {};
+    for (size_t offset = 0;
+         UWU_SegmentRecord_next(&records, &offset, &record);) {
+      if (record.id == hit.id) {
+        UWU_Search_add(search, &name, &record);
+        break;
+      }
+    }
+  }
+
+  char data[2 + MAX_SEARCH_RESULTS * UWU_SEARCH_RESULT_SIZE];
+  data[0] = SEARCH_RESULTS;
+  data[1] = search->count;
+  size_t length = 2;
+  for (size_t i = 0; i < search->count; i++) {
+    memcpy(&data[length], search->results[i].data, search->results[i].length);
+    length += search->results[i].length;
+  }
+  UWU_String response = {.data = data, .length = length};
+  send_msg(job->conn, &response);
+
+  uint64_t elapsed_us = monotonic_us() - job->received_us;
+  __atomic_fetch_add(&UWU_STATE->stats.searches, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&UWU_STATE->stats.search_us_total, elapsed_us,
+                     __ATOMIC_RELAXED);
+  stats_update_max(&UWU_STATE->stats.search_us_max, elapsed_us);
+}
+
+void spill_mailbox(UWU_TierJob *job);
+void send_segments_to_follower();
+
+// Runs the jobs of the history tiers in order until the server shuts down
+// and there are none left.
+static void *history_tiers(void *p) {
+  UWU_PanicIf(pthread_mutex_lock(&UWU_TIERS.mx) != 0,
+              "Fatal: Can't lock the history tiers mutex!");
+  for (;;) {
+    while (UWU_TIERS.first == NULL && !UWU_TIERS.stopping) {
+      pthread_cond_wait(&UWU_TIERS.cond, &UWU_TIERS.mx);
+    }
+    UWU_TierJob *job = UWU_TIERS.first;
+    if (job == NULL) {
+      break;
+    }
+    UWU_TIERS.first = job->next;
+    if (UWU_TIERS.first == NULL) {
+      UWU_TIERS.last = NULL;
+    }
+    UWU_PanicIf(pthread_mutex_unlock(&UWU_TIERS.mx) != 0,
+                "Fatal: Can't unlock the history tiers mutex!");
+
+    switch (job->type) {
+    case TIER_SEAL:
+      write_segment(job);
+      break;
+    case TIER_DROP:
+      drop_segments(job);
+      break;
+    case TIER_PAGE:
+      answer_older_messages(job);
+      break;
+    case TIER_SEARCH:
+      answer_search(job);
+      break;
+    case TIER_SPILL:
+      spill_mailbox(job);
+      break;
+    case TIER_REPLICATE:
+      send_segments_to_follower();
+      break;
+    }
+
+    UWU_PanicIf(pthread_mutex_lock(&UWU_TIERS.mx) != 0,
+                "Fatal: Can't lock the history tiers mutex!");
+    if (job->type == TIER_PAGE || job->type == TIER_SEARCH) {
+      *job->pending -= 1;
+      pthread_cond_broadcast(&UWU_TIERS.answered);
+    }
+    UWU_TierJob_free(job);
+  }
+  UWU_PanicIf(pthread_mutex_unlock(&UWU_TIERS.mx) != 0,
+              "Fatal: Can't unlock the history tiers mutex!");
+
+  UWU_Deflate_releaseThreadCtx();
+  UWU_Pools_releaseThreadCaches();
+  return NULL;
+}
+
+// Waits until the OLDER_MESSAGES and SEARCHes a handler queued are answered.
+// Handlers call it before they exit, since their connection is freed once
+// they do.
+void wait_tier_answers(size_t *pending) {
+  UWU_PanicIf(pthread_mutex_lock(&UWU_TIERS.mx) != 0,
+              "Fatal: Can't lock the history tiers mutex!");
+  while (*pending > 0) {
+    pthread_cond_wait(&UWU_TIERS.answered, &UWU_TIERS.mx);
+  }
+  UWU_PanicIf(pthread_mutex_unlock(&UWU_TIERS.mx) != 0,
+              "Fatal: Can't unlock the history tiers mutex!");
+}
+
+// Returns TRUE for the file names `segment_path` gives, temporary ones too.
+UWU_Bool is_segment_name(const char *name) {
+  size_t hex = strspn(name, "0123456789abcdef");
+  if (hex == 0 || name[hex] != '.') {
+    return FALSE;
+  }
+  size_t digits = strspn(&name[hex + 1], "0123456789");
+  const char *rest = &name[hex + 1 + digits];
+  return digits > 0 && (*rest == '\0' || strcmp(rest, ".tmp") == 0);
+}
+
+// Reads the chat key and the segment of a file name `segment_path` gives,
+// temporary ones aren't.
+//
+// Success: Returns TRUE and writes the key into `key`, which has space for
+// `key_size` bytes.
+// Failure: Returns FALSE if it isn't the name of a segment.
+UWU_Bool segment_name_parse(const char *name, char *key, size_t key_size,
+                            size_t *key_length, uint64_t *segment) {
+  size_t hex = strspn(name, "0123456789abcdef");
+  size_t digits = strspn(&name[hex + (name[hex] == '.')], "0123456789");
+  if (hex == 0 || hex % 2 != 0 || hex / 2 > key_size || name[hex] != '.' ||
+      digits == 0 || name[hex + 1 + digits] != '\0') {
+    return FALSE;
+  }
+
+  for (size_t i = 0; i < hex / 2; i++) {
+    char byte[3] = {name[2 * i], name[2 * i + 1], '\0'};
+    key[i] = (char)strtoul(byte, NULL, 16);
+  }
+  *key_length = hex / 2;
+  *segment = strtoull(&name[hex + 1], NULL, 10);
+  return TRUE;
+}
+
+// Sends the segments on disk to the follower that just linked, check
+// `follower_sync`. Jobs run in order, so the ones sealed before it was queued
+// are all there.
+void send_segments_to_follower() {
+  DIR *dir = opendir(s_history_dir);
+  if (dir == NULL) {
+    return;
+  }
+
+  size_t sent = 0;
+  for (struct dirent *entry = readdir(dir); entry != NULL && has_follower();
+       entry = readdir(dir)) {
+    char key_data[255];
+    UWU_String key = {.data = key_data};
+    uint64_t segment = 0;
+    if (!segment_name_parse(entry->d_name, key_data, sizeof(key_data),
+                            &key.length, &segment)) {
+      continue;
+    }
+
+    char path[1024];
+    segment_path(path, sizeof(path), &key, segment);
+    size_t length = 0;
+    char *file = read_whole_file(path, &length);
+    char *data = NULL;
+    if (file != NULL) {
+      data = malloc(11 + key.length + length);
+    }
+    if (data == NULL) {
+      MG_ERROR(("Can't send the history segment %s to the follower!", path));
+      free(file);
+      continue;
+    }
+
+    data[0] = PEER_SEGMENT;
+    UWU_writeBigEndian(&data[1], segment, 8);
+    UWU_writeBigEndian(&data[9], key.length, 2);
+    memcpy(&data[11], key.data, key.length);
+    memcpy(&data[11 + key.length], file, length);
+    UWU_String frame = {.data = data, .length = 11 + key.length + length};
+    send_to_follower(&frame);
+    free(data);
+    free(file);
+    sent++;
+  }
+  closedir(dir);
+
+  MG_INFO(("Sent %lu history segments to the follower", (unsigned long)sent));
+}
+
+// Deletes the segments left on `s_history_dir`, by a previous run too.
+// Whatever else is there stays.
+void sweep_segments() {
+  DIR *dir = opendir(s_history_dir);
+  if (dir == NULL) {
+    return;
+  }
+  for (struct dirent *entry = readdir(dir); entry != NULL;
+       entry = readdir(dir)) {
+    if (!is_segment_name(entry->d_name)) {
+      continue;
+    }
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s", s_history_dir, entry->d_name);
+    unlink(path);
+  }
+  closedir(dir);
+}
+
+// Success: Returns TRUE, the tiers thread is running.
+// Failure: Returns FALSE if it couldn't be started.
+UWU_Bool history_tiers_init() {
+  // Creates the directory the first time, it may already be there.
+  mkdir(s_history_dir, 0700);
+  sweep_segments();
+  UWU_Err err = NO_ERROR;
+  UWU_TIERS.index = UWU_SearchIndex_init(HISTORY_SEGMENT_MESSAGES, err);
+  UWU_CHAT_FLOORS.map = UWU_FlatMap_init(64, err);
+  return UWU_TIERS.index.terms.table.capacity != 0 &&
+         UWU_CHAT_FLOORS.map.table.capacity != 0 &&
+         pthread_mutex_init(&UWU_CHAT_FLOORS.mx, NULL) == 0 &&
+         pthread_mutex_init(&UWU_TIERS.mx, NULL) == 0 &&
+         pthread_cond_init(&UWU_TIERS.cond, NULL) == 0 &&
+         pthread_cond_init(&UWU_TIERS.answered, NULL) == 0 &&
+         pthread_create(&UWU_TIERS.thread, NULL, history_tiers, NULL) == 0;
+}
+
+// Runs the jobs left and deletes the segments. Call it once the handlers
+// stopped.
+void history_tiers_deinit() {
+  UWU_PanicIf(pthread_mutex_lock(&UWU_TIERS.mx) != 0,
+              "Fatal: Can't lock the history tiers mutex!");
+  UWU_TIERS.stopping = TRUE;
+  pthread_cond_signal(&UWU_TIERS.cond);
+  UWU_PanicIf(pthread_mutex_unlock(&UWU_TIERS.mx) != 0,
+              "Fatal: Can't unlock the history tiers mutex!");
+  pthread_join(UWU_TIERS.thread, NULL);
+
+  sweep_segments();
+  rmdir(s_history_dir);
+  UWU_SearchIndex_deinit(&UWU_TIERS.index);
+  UWU_FlatMap_removeIf(&UWU_CHAT_FLOORS.map, chat_floor_always, NULL);
+  UWU_FlatMap_deinit(&UWU_CHAT_FLOORS.map);
+  pthread_mutex_destroy(&UWU_CHAT_FLOORS.mx);
+  pthread_cond_destroy(&UWU_TIERS.answered);
+  pthread_cond_destroy(&UWU_TIERS.cond);
+  pthread_mutex_destroy(&UWU_TIERS.mx);
+}
+
+/* *****************************************************************************
+Memory Budget
+***************************************************************************** */
+
+// Keeps the memory in use under `s_memory_budget`.
+//
+// Users, arenas, outboxes and mailboxes are only counted, DM histories are the
+// only thing that can be given back. When the budget is exceeded the least
+// recently used ones are evicted: they're compressed and written to
+// `s_evict_dir`, and loaded back once their chat is used again. Evicted
+// histories follow the same rules as the others, they're dropped when one of
+// their users leaves.
+
+// A DM history that was evicted.
+//
+// Stored as:
+// | next idx (8 bytes) | messages |
+// Every message is:
+// | timestamp ms (8 bytes) | length from | from | length msg | msg |
+// And the whole thing is compressed.
+typedef struct {
+  // The key of the history on `chats`, it's the key on the map too. Owned by
+  // the evicted history.
+  UWU_String key;
+  // The compressed history until it's written to disk, then NULL.
+  char *data;
+  size_t length;
+  // The `next_idx` of the history, its segments stay on disk.
+  size_t next_idx;
+  // Whether the evictor is writing `data` without holding the lock. Whoever
+  // removes the history from the map meanwhile sets `abandoned` instead of
+  // freeing it, and the evictor frees it once it's done.
+  UWU_Bool writing;
+  UWU_Bool abandoned;
+} UWU_EvictedChat;
+
+typedef struct {
+  // Key: The key of the history on `chats`. Value: An UWU_EvictedChat.
+  UWU_FlatMap evicted;
+  // Guards `evicted`. Lock it after `active_users.mx`!
+  pthread_mutex_t mx;
+  // Signaled when the memory in use goes over the budget or the server shuts
+  // down.
+  pthread_cond_t cond;
+} UWU_MemoryBudget;
+
+static UWU_MemoryBudget UWU_MEMORY = {};
+
+// Frees the evicted history and deletes its file.
+void UWU_EvictedChat_free(UWU_EvictedChat *chat) {
+  if (chat->data == NULL) {
+    char path[1024];
+    hex_file_path(path, sizeof(path), s_evict_dir, &chat->key);
+    unlink(path);
+  }
+  free(chat->data);
+  UWU_String_freeWithMalloc(&chat->key);
+  free(chat);
+}
+
+// Frees an evicted history that was removed from the map, unless the evictor
+// is writing it.
+// PLEASE lock the memory budget before calling this function!
+void discard_evicted_chat(UWU_EvictedChat *chat) {
+  if (chat->writing) {
+    chat->abandoned = TRUE;
+  } else {
+    UWU_EvictedChat_free(chat);
+  }
+}
+
+// Returns TRUE for every evicted history and frees it.
+UWU_Bool evicted_chat_always(void *context, UWU_String key, void *value) {
+  UWU_EvictedChat_free(value);
+  return TRUE;
+}
+
+// Success: Returns TRUE.
+// Failure: Returns FALSE if the map or its lock couldn't be created.
+UWU_Bool memory_budget_init() {
+  UWU_Err err = NO_ERROR;
+  UWU_MEMORY.evicted = UWU_FlatMap_init(64, err);
+  return UWU_MEMORY.evicted.table.capacity != 0 &&
+         pthread_mutex_init(&UWU_MEMORY.mx, NULL) == 0 &&
+         pthread_cond_init(&UWU_MEMORY.cond, NULL) == 0;
+}
+
+// Frees the evicted histories. Like the others they only live while the
+// server runs, so their files are deleted too.
+void memory_budget_deinit() {
+  UWU_FlatMap_removeIf(&UWU_MEMORY.evicted, evicted_chat_always, NULL);
+  UWU_FlatMap_deinit(&UWU_MEMORY.evicted);
+  pthread_cond_destroy(&UWU_MEMORY.cond);
+  pthread_mutex_destroy(&UWU_MEMORY.mx);
+}
+
+// Wakes the evictor up if the memory in use is over the budget.
+void check_memory_budget() {
+  if (s_memory_budget == 0) {
+    return;
+  }
+  UWU_MemoryUsage usage = memory_usage();
+  if (UWU_MemoryUsage_total(&usage) > s_memory_budget) {
+    pthread_cond_signal(&UWU_MEMORY.cond);
+  }
+}
+
+// Adds a message to a DM history, counts the memory it takes and seals the
+// segment it completes.
+// PLEASE lock the active_users before calling this function, so the history
+// can't be evicted meanwhile!
+//
+// Returns the ID assigned to the message.
+uint64_t add_chat_message(UWU_ChatHistory *history, UWU_ChatEntry *entry) {
+  UWU_PanicIf(pthread_mutex_lock(&history->mx) != 0,
+              "Fatal: Can't lock the chat history mutex for `%.*s`!",
+              (int)history->channel_name.length, history->channel_name.data);
+  size_t bytes = history->bytes;
+  uint64_t id = UWU_ChatHistory_addMessage(history, entry);
+  // The message may be smaller than the one it overwrote, unsigned overflow
+  // takes care of it.
+  __atomic_fetch_add(&UWU_STATE->stats.memory_histories,
+                     history->bytes - bytes, __ATOMIC_RELAXED);
+  __atomic_store_n(&history->used_ms, UWU_nowMs(), __ATOMIC_RELAXED);
+  seal_history_segment(history);
+  UWU_PanicIf(pthread_mutex_unlock(&history->mx) != 0,
+              "Fatal: Can't unlock the chat history mutex for `%.*s`!",
+              (int)history->channel_name.length, history->channel_name.data);
+
+  check_memory_budget();
+  return id;
+}
+
+// Adds a message the primary replicated with the ID it got there, check
+// `add_chat_message`. If the history missed the messages before it they're
+// dropped, so its IDs stay consecutive.
+// PLEASE lock the active_users before calling this function!
+//
+// Returns FALSE if the history already has the message.
+UWU_Bool add_chat_message_at(UWU_ChatHistory *history, UWU_ChatEntry *entry,
+                             uint64_t id) {
+  UWU_PanicIf(pthread_mutex_lock(&history->mx) != 0,
+              "Fatal: Can't lock the chat history mutex for `%.*s`!",
+              (int)history->channel_name.length, history->channel_name.data);
+  UWU_Bool missing = id > history->next_idx;
+  if (id > history->next_idx + 1) {
+    size_t bytes = history->bytes;
+    UWU_ChatHistory_clear(history);
+    UWU_ChatHistory_writeBegin(history);
+    history->next_idx = id - 1;
+    UWU_ChatHistory_writeEnd(history);
+    __atomic_fetch_sub(&UWU_STATE->stats.memory_histories,
+                       bytes - history->bytes, __ATOMIC_RELAXED);
+  }
+  UWU_PanicIf(pthread_mutex_unlock(&history->mx) != 0,
+              "Fatal: Can't unlock the chat history mutex for `%.*s`!",
+              (int)history->channel_name.length, history->channel_name.data);
+
+  if (missing) {
+    add_chat_message(history, entry);
+  }
+  return missing;
+}
+
+// Compresses the messages of `history`, check `UWU_EvictedChat`.
+// PLEASE lock the history before calling this function!
+//
+// Success: Returns the compressed history, free it with `free`.
+// Failure: Returns NULL if there's no memory or it can't be compressed.
+char *compress_chat(UWU_ChatHistory *history, size_t *length) {
+  char *raw = malloc(8 + history->count * (8 + 2 + 255 + 255));
+  if (raw == NULL) {
+    return NULL;
+  }
+
+  size_t raw_length = 0;
+  UWU_writeBigEndian(raw, history->next_idx, 8);
+  raw_length += 8;
+  UWU_ChatHistory_Iterator iter = UWU_ChatHistory_iter(history);
+  for (size_t i = iter.start; i < iter.end; i++) {
+    UWU_ChatEntry entry = UWU_ChatHistory_get(history, i % history->capacity);
+    UWU_String from = UWU_Username_view(&entry.origin_username);
+    UWU_writeBigEndian(&raw[raw_length], entry.timestamp_ms, 8);
+    raw_length += 8;
+    raw[raw_length++] = from.length;
+    memcpy(&raw[raw_length], from.data, from.length);
+    raw_length += from.length;
+    raw[raw_length++] = entry.content.length;
+    memcpy(&raw[raw_length], entry.content.data, entry.content.length);
+    raw_length += entry.content.length;
+  }
+
+  UWU_Err err = NO_ERROR;
+  UWU_String src = {.data = raw, .length = raw_length};
+  UWU_String compressed = UWU_Deflate_compress(&src, err);
+  free(raw);
+  if (compressed.data == NULL) {
+    return NULL;
+  }
+
+  // The compressed history lives on a buffer of the thread.
+  char *data = malloc(compressed.length);
+  if (data != NULL) {
+    memcpy(data, compressed.data, compressed.length);
+    *length = compressed.length;
+  }
+  return data;
+}
+
+// Evicts the DM history saved under `key`.
+// PLEASE lock the active_users before calling this function!
+//
+// Returns TRUE if it was evicted.
+UWU_Bool evict_chat(const UWU_String *const key) {
+  // A user is leaving and the history goes with it.
+  if (!chat_users_connected(key)) {
+    return FALSE;
+  }
+
+  UWU_MapStripe *stripe = NULL;
+  UWU_ChatHistory *history =
+      UWU_StripedMap_getPinned(&UWU_STATE->chats, key, &stripe);
+  char *data = NULL;
+  size_t length = 0;
+  // Nobody can add messages while the active_users are locked.
+  size_t next_idx = history != NULL ? history->next_idx : 0;
+  if (history != NULL && !s_evict_drop) {
+    UWU_PanicIf(pthread_mutex_lock(&history->mx) != 0,
+                "Fatal: Can't lock the chat history mutex!");
+    data = compress_chat(history, &length);
+    UWU_PanicIf(pthread_mutex_unlock(&history->mx) != 0,
+                "Fatal: Can't unlock the chat history mutex!");
+  }
+  UWU_StripedMap_unpin(stripe);
+  if (history == NULL) {
+    return FALSE;
+  }
+
+  UWU_Err err = NO_ERROR;
+  UWU_EvictedChat *evicted = NULL;
+  if (data != NULL) {
+    evicted = calloc(1, sizeof(UWU_EvictedChat));
+  }
+  if (evicted != NULL) {
+    evicted->key = UWU_String_copy(key, err);
+    evicted->data = data;
+    evicted->length = length;
+    evicted->next_idx = next_idx;
+  }
+
+  UWU_PanicIf(pthread_mutex_lock(&UWU_MEMORY.mx) != 0,
+              "Fatal: Can't lock the memory budget mutex!");
+  UWU_Bool kept =
+      evicted != NULL && evicted->key.data != NULL &&
+      UWU_FlatMap_put(&UWU_MEMORY.evicted, &evicted->key, evicted, err);
+  UWU_PanicIf(pthread_mutex_unlock(&UWU_MEMORY.mx) != 0,
+              "Fatal: Can't unlock the memory budget mutex!");
+  // Removed once it's evicted, so readers that don't lock the active_users
+  // always find one of them.
+  UWU_StripedMap_remove(&UWU_STATE->chats, key);
+
+  if (kept) {
+    __atomic_fetch_add(&UWU_STATE->stats.evicted_histories, 1,
+                       __ATOMIC_RELAXED);
+  } else {
+    if (evicted != NULL) {
+      UWU_EvictedChat_free(evicted);
+    } else {
+      free(data);
+    }
+    drop_chat_segments(key, next_idx);
+    __atomic_fetch_add(&UWU_STATE->stats.dropped_histories, 1,
+                       __ATOMIC_RELAXED);
+  }
+  return TRUE;
+}
+
+typedef struct {
+  UWU_EvictedChat *chat;
+  UWU_Bool written;
+} UWU_UnwrittenChat;
+
+typedef struct {
+  UWU_UnwrittenChat *items;
+  size_t count;
+  size_t capacity;
+} UWU_UnwrittenChats;
+
+// Adds an evicted history that's still in memory to the `UWU_UnwrittenChats`
+// given as context and marks it as being written.
+// PLEASE lock the memory budget before calling this function!
+void collect_unwritten_chat(void *context, UWU_String key, void *value) {
+  UWU_UnwrittenChats *unwritten = context;
+  UWU_EvictedChat *chat = value;
+  if (chat->data == NULL || chat->writing) {
+    return;
+  }
+  if (unwritten->count == unwritten->capacity) {
+    size_t capacity = unwritten->capacity == 0 ? 16 : 2 * unwritten->capacity;
+    UWU_UnwrittenChat *items =
+        realloc(unwritten->items, sizeof(UWU_UnwrittenChat) * capacity);
+    if (items == NULL) {
+      // Stays in memory until the next eviction.
+      return;
+    }
+    unwritten->items = items;
+    unwritten->capacity = capacity;
+  }
+
+  chat->writing = TRUE;
+  UWU_UnwrittenChat item = {.chat = chat, .written = FALSE};
+  unwritten->items[unwritten->count++] = item;
+}
+
+// Writes an evicted history to disk. Its `data` and `key` can be read without
+// the lock while it's `writing`, nobody else changes or frees them.
+//
+// Returns TRUE if it was written.
+UWU_Bool write_evicted_chat(UWU_EvictedChat *chat) {
+  char path[1024];
+  hex_file_path(path, sizeof(path), s_evict_dir, &chat->key);
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  UWU_Bool written =
+      fd != -1 && write(fd, chat->data, chat->length) == (ssize_t)chat->length;
+  if (fd != -1) {
+    close(fd);
+  }
+  if (!written) {
+    MG_ERROR(("Can't write the evicted history %s, it's dropped!", path));
+    unlink(path);
+  }
+  return written;
+}
+
+// Frees the memory of an evicted history that was written, or drops it if it
+// couldn't be. Frees it if it was restored or forgotten meanwhile.
+// PLEASE lock the memory budget before calling this function!
+void publish_evicted_chat(UWU_EvictedChat *chat, UWU_Bool written) {
+  chat->writing = FALSE;
+  if (chat->abandoned) {
+    char path[1024];
+    hex_file_path(path, sizeof(path), s_evict_dir, &chat->key);
+    unlink(path);
+    free(chat->data);
+    UWU_String_freeWithMalloc(&chat->key);
+    free(chat);
+    return;
+  }
+
+  if (!written) {
+    UWU_FlatMap_remove(&UWU_MEMORY.evicted, &chat->key);
+    // Like a history that couldn't be evicted, its segments go with it.
+    drop_chat_segments(&chat->key, chat->next_idx);
+    __atomic_fetch_sub(&UWU_STATE->stats.evicted_histories, 1,
+                       __ATOMIC_RELAXED);
+    __atomic_fetch_add(&UWU_STATE->stats.dropped_histories, 1,
+                       __ATOMIC_RELAXED);
+    // The file wasn't written, so `free` must not look for it.
+    UWU_String_freeWithMalloc(&chat->key);
+    free(chat->data);
+    free(chat);
+    return;
+  }
+
+  free(chat->data);
+  chat->data = NULL;
+}
+
+// Writes the evicted histories that are still in memory to disk. The lock is
+// only held to take them and to publish the result, so restores and users
+// leaving don't wait for the disk.
+void write_evicted_chats() {
+  UWU_UnwrittenChats unwritten = {};
+  UWU_PanicIf(pthread_mutex_lock(&UWU_MEMORY.mx) != 0,
+              "Fatal: Can't lock the memory budget mutex!");
+  UWU_FlatMap_forEach(&UWU_MEMORY.evicted, collect_unwritten_chat, &unwritten);
+  UWU_PanicIf(pthread_mutex_unlock(&UWU_MEMORY.mx) != 0,
+              "Fatal: Can't unlock the memory budget mutex!");
+  if (unwritten.count == 0) {
+    free(unwritten.items);
+    return;
+  }
+
+  for (size_t i = 0; i < unwritten.count; i++) {
+    unwritten.items[i].written = write_evicted_chat(unwritten.items[i].chat);
+  }
+
+  UWU_PanicIf(pthread_mutex_lock(&UWU_MEMORY.mx) != 0,
+              "Fatal: Can't lock the memory budget mutex!");
+  for (size_t i = 0; i < unwritten.count; i++) {
+    publish_evicted_chat(unwritten.items[i].chat, unwritten.items[i].written);
+  }
+  UWU_PanicIf(pthread_mutex_unlock(&UWU_MEMORY.mx) != 0,
+              "Fatal: Can't unlock the memory budget mutex!");
+  free(unwritten.items);
+}
+
+typedef struct {
+  UWU_String key;
+  uint64_t used_ms;
+  size_t bytes;
+} UWU_EvictionCandidate;
+
+typedef struct {
+  UWU_EvictionCandidate *items;
+  size_t count;
+  size_t capacity;
+} UWU_EvictionCandidates;
+
+// Adds a DM history to the `UWU_EvictionCandidates` given as context.
+void collect_eviction_candidate(void *context, UWU_String key, void *value) {
+  UWU_EvictionCandidates *candidates = context;
+  UWU_ChatHistory *history = value;
+  if (candidates->count == candidates->capacity) {
+    size_t capacity =
+        candidates->capacity == 0 ? 64 : 2 * candidates->capacity;
+    UWU_EvictionCandidate *items =
+        realloc(candidates->items, sizeof(UWU_EvictionCandidate) * capacity);
+    if (items == NULL) {
+      return;
+    }
+    candidates->items = items;
+    candidates->capacity = capacity;
+  }
+
+  // The history may be freed once its stripe is unlocked, the key is copied.
+  UWU_Err err = NO_ERROR;
+  UWU_EvictionCandidate candidate = {
+      .key = UWU_String_copy(&key, err),
+      .used_ms = __atomic_load_n(&history->used_ms, __ATOMIC_RELAXED),
+      .bytes = history->bytes,
+  };
+  if (candidate.key.data != NULL) {
+    candidates->items[candidates->count++] = candidate;
+  }
+}
+
+int compare_eviction_candidates(const void *a, const void *b) {
+  uint64_t a_used = ((const UWU_EvictionCandidate *)a)->used_ms;
+  uint64_t b_used = ((const UWU_EvictionCandidate *)b)->used_ms;
+  return a_used < b_used ? -1 : a_used > b_used;
+}
+
+// Evicts the least recently used DM histories until the memory in use is
+// under `MEMORY_EVICT_TARGET_PERCENT` of the budget, or there's nothing left
+// to evict.
+void evict_histories() {
+  UWU_MemoryUsage usage = memory_usage();
+  size_t total = UWU_MemoryUsage_total(&usage);
+  if (s_memory_budget == 0 || total <= s_memory_budget) {
+    return;
+  }
+  size_t target = s_memory_budget / 100 * MEMORY_EVICT_TARGET_PERCENT;
+  uint64_t start_ms = UWU_nowMs();
+
+  if (!s_evict_drop) {
+    // Creates the directory the first time, it may already be there.
+    mkdir(s_evict_dir, 0700);
+  }
+
+  UWU_EvictionCandidates candidates = {};
+  size_t freed = 0;
+  size_t evicted = 0;
+  UWU_PanicIf(pthread_mutex_lock(&UWU_STATE->active_users.mx) != 0,
+              "Fatal: Can't lock the active_users mutex!");
+  UWU_StripedMap_forEach(&UWU_STATE->chats, collect_eviction_candidate,
+                         &candidates);
+  if (candidates.count > 0) {
+    qsort(candidates.items, candidates.count, sizeof(UWU_EvictionCandidate),
+          compare_eviction_candidates);
+  }
+  for (size_t i = 0; i < candidates.count && total - freed > target; i++) {
+    if (evict_chat(&candidates.items[i].key)) {
+      freed += candidates.items[i].bytes;
+      evicted++;
+    }
+  }
+  UWU_PanicIf(pthread_mutex_unlock(&UWU_STATE->active_users.mx) != 0,
+              "Fatal: Can't unlock the active_users mutex!");
+
+  for (size_t i = 0; i < candidates.count; i++) {
+    UWU_String_freeWithMalloc(&candidates.items[i].key);
+  }
+  free(candidates.items);
+
+  write_evicted_chats();
+
+  if (evicted == 0) {
+    return;
+  }
+  MG_INFO(("Evicted %lu DM histories (%lu bytes) in %lu ms, %lu bytes over "
+           "the budget",
+           (unsigned long)evicted, (unsigned long)freed,
+           (unsigned long)(UWU_nowMs() - start_ms),
+           (unsigned long)(total - s_memory_budget)));
+}
+
+// Evicts DM histories whenever the memory in use goes over the budget.
+static void *history_evictor(void *p) {
+  UWU_PanicIf(pthread_mutex_lock(&UWU_MEMORY.mx) != 0,
+              "Fatal: Can't lock the memory budget mutex!");
+  while (!UWU_STATE->is_shutting_off) {
+    uint64_t wake_at_ms = UWU_nowMs() + MEMORY_CHECK_MS;
+    struct timespec deadline = {.tv_sec = wake_at_ms / 1000,
+                                .tv_nsec = (wake_at_ms % 1000) * 1000000};
+    pthread_cond_timedwait(&UWU_MEMORY.cond, &UWU_MEMORY.mx, &deadline);
+    if (UWU_STATE->is_shutting_off) {
+      break;
+    }
+
+    UWU_PanicIf(pthread_mutex_unlock(&UWU_MEMORY.mx) != 0,
+                "Fatal: Can't unlock the memory budget mutex!");
+    evict_histories();
+    UWU_PanicIf(pthread_mutex_lock(&UWU_MEMORY.mx) != 0,
+                "Fatal: Can't lock the memory budget mutex!");
+  }
+  UWU_PanicIf(pthread_mutex_unlock(&UWU_MEMORY.mx) != 0,
+              "Fatal: Can't unlock the memory budget mutex!");
+
+  UWU_Deflate_releaseThreadCtx();
+  UWU_Pools_releaseThreadCaches();
+  return NULL;
+}
+
+// Reads the message of an evicted history at `*offset` into `entry`, which
+// points inside `raw`, and moves `offset` to the next one.
+//
+// Returns FALSE once there are no more messages.
+UWU_Bool next_evicted_message(const UWU_String *raw, size_t *offset,
+                              UWU_ChatEntry *entry) {
+  if (*offset + 10 > raw->length) {
+    return FALSE;
+  }
+  const char *record = &raw->data[*offset];
+  UWU_String from = {.data = (char *)&record[9], .length = (uint8_t)record[8]};
+  if (*offset + 10 + from.length > raw->length) {
+    return FALSE;
+  }
+  UWU_String content = {.data = (char *)&record[10 + from.length],
+                        .length = (uint8_t)record[9 + from.length]};
+  if (*offset + 10 + from.length + content.length > raw->length) {
+    return FALSE;
+  }
+  *offset += 10 + from.length + content.length;
+
+  UWU_ChatEntry def = {.content = content,
+                       .origin_username = UWU_Username_borrow(&from),
+                       .timestamp_ms = UWU_readBigEndian(record, 8)};
+  *entry = def;
+  return TRUE;
+}
+
+// Loads the evicted messages of a DM history that was just created back into
+// it, before it's put on `chats`. The evicted history is kept until the
+// restored one is put there, call `forget_restored_chat` then, so readers
+// that don't lock the active_users always find one of them.
+// PLEASE lock the active_users before calling this function!
+//
+// Returns TRUE if it was evicted, even if its messages were lost.
+UWU_Bool restore_chat(UWU_ChatHistory *history) {
+  UWU_String compressed = {};
+  char *data = NULL;
+  UWU_PanicIf(pthread_mutex_lock(&UWU_MEMORY.mx) != 0,
+              "Fatal: Can't lock the memory budget mutex!");
+  UWU_EvictedChat *evicted =
+      UWU_FlatMap_get(&UWU_MEMORY.evicted, &history->channel_name);
+  UWU_Bool found = evicted != NULL;
+  UWU_Bool on_disk = found && evicted->data == NULL;
+  if (found && !on_disk) {
+    // The evictor frees it once it's written.
+    data = malloc(evicted->length);
+    if (data != NULL) {
+      memcpy(data, evicted->data, evicted->length);
+      compressed.length = evicted->length;
+    }
+  }
+  UWU_PanicIf(pthread_mutex_unlock(&UWU_MEMORY.mx) != 0,
+              "Fatal: Can't unlock the memory budget mutex!");
+  if (!found) {
+    return FALSE;
+  }
+
+  if (on_disk) {
+    // Nobody deletes the file while the active_users are locked.
+    char path[1024];
+    hex_file_path(path, sizeof(path), s_evict_dir, &history->channel_name);
+    data = read_whole_file(path, &compressed.length);
+  }
+  compressed.data = data;
+
+  UWU_Err err = NO_ERROR;
+  UWU_String raw = {};
+  if (compressed.data != NULL) {
+    raw = UWU_Deflate_inflate(
+        &compressed, 8 + history->capacity * (8 + 2 + 255 + 255), err);
+  }
+  if (raw.data == NULL || raw.length < 8) {
+    MG_ERROR(("Lost the evicted history `%.*s`!",
+              (int)history->channel_name.length, history->channel_name.data));
+    free(data);
+    return TRUE;
+  }
+
+  // The history was just created, the IDs continue where they were.
+  size_t count = 0;
+  UWU_ChatEntry entry = {};
+  for (size_t offset = 8; next_evicted_message(&raw, &offset, &entry);) {
+    count++;
+  }
+  // Their segments were sealed before the history was evicted, and nobody
+  // else can reach the history yet, so the messages are added without
+  // `add_chat_message`. `get_or_create_chat` counts their memory.
+  history->next_idx = UWU_readBigEndian(raw.data, 8) - count;
+  for (size_t offset = 8; next_evicted_message(&raw, &offset, &entry);) {
+    UWU_ChatHistory_addMessage(history, &entry);
+  }
+
+  __atomic_fetch_add(&UWU_STATE->stats.restored_histories, 1,
+                     __ATOMIC_RELAXED);
+  free(data);
+  return TRUE;
+}
+
+// Frees the evicted history saved under `key` once its restored history is on
+// `chats`.
+// PLEASE lock the active_users before calling this function!
+void forget_restored_chat(const UWU_String *const key) {
+  UWU_PanicIf(pthread_mutex_lock(&UWU_MEMORY.mx) != 0,
+              "Fatal: Can't lock the memory budget mutex!");
+  UWU_EvictedChat *evicted = UWU_FlatMap_remove(&UWU_MEMORY.evicted, key);
+  if (evicted != NULL) {
+    discard_evicted_chat(evicted);
+  }
+  UWU_PanicIf(pthread_mutex_unlock(&UWU_MEMORY.mx) != 0,
+              "Fatal: Can't unlock the memory budget mutex!");
+}
+
+// Returns TRUE if the DM history saved under `key` was evicted.
+UWU_Bool chat_is_evicted(const UWU_String *const key) {
+  UWU_PanicIf(pthread_mutex_lock(&UWU_MEMORY.mx) != 0,
+              "Fatal: Can't lock the memory budget mutex!");
+  UWU_Bool evicted = UWU_FlatMap_get(&UWU_MEMORY.evicted, key) != NULL;
+  UWU_PanicIf(pthread_mutex_unlock(&UWU_MEMORY.mx) != 0,
+              "Fatal: Can't unlock the memory budget mutex!");
+  return evicted;
+}
+
+typedef struct {
+  UWU_FlatMap_Predicate predicate;
+  void *context;
+} UWU_EvictedFilter;
+
+// Frees the evicted histories the `UWU_EvictedFilter` given as context
+// matches.
+UWU_Bool forget_evicted_if(void *context, UWU_String key, void *value) {
+  UWU_EvictedFilter *filter = context;
+  if (!filter->predicate(filter->context, key, value)) {
+    return FALSE;
+  }
+
+  drop_chat_segments(&key, ((UWU_EvictedChat *)value)->next_idx);
+  discard_evicted_chat(value);
+  return TRUE;
+}
+
+// Drops the evicted histories `predicate` matches, like the ones of a user
+// that left.
+void forget_evicted_chats(UWU_FlatMap_Predicate predicate, void *context) {
+  UWU_EvictedFilter filter = {.predicate = predicate, .context = context};
+  UWU_PanicIf(pthread_mutex_lock(&UWU_MEMORY.mx) != 0,
+              "Fatal: Can't lock the memory budget mutex!");
+  UWU_FlatMap_removeIf(&UWU_MEMORY.evicted, forget_evicted_if, &filter);
+  UWU_PanicIf(pthread_mutex_unlock(&UWU_MEMORY.mx) != 0,
+              "Fatal: Can't unlock the memory budget mutex!");
+}
+
+// Matches the DM histories the `UWU_EvictedFilter` given as context matches,
+// and deletes their segments.
+UWU_Bool forget_chat_if(void *context, UWU_String key, void *value) {
+  UWU_EvictedFilter *filter = context;
+  if (!filter->predicate(filter->context, key, value)) {
+    return FALSE;
+  }
+
+  drop_chat_segments(&key, ((UWU_ChatHistory *)value)->next_idx);
+  return TRUE;
+}
+
+// Drops the DM histories `predicate` matches, like the ones of a user that
+// left, evicted or not, with their segments.
+//
+// Returns how many were in memory.
+size_t forget_chats(UWU_FlatMap_Predicate predicate, void *context) {
+  UWU_EvictedFilter filter = {.predicate = predicate, .context = context};
+  size_t removed =
+      UWU_StripedMap_removeIf(&UWU_STATE->chats, forget_chat_if, &filter);
+  forget_evicted_chats(predicate, context);
+  return removed;
+}
+
+/* *****************************************************************************
+Sent ACKs
+***************************************************************************** */
+
+// An ACK already sent to a user.
+typedef struct {
+  uint32_t nonce;
+  uint64_t id;
+  uint64_t timestamp_ms;
+} UWU_SentAck;
+
+// The last ACKs sent to a user, so a retransmitted SEND_MESSAGE gets the same
+// answer instead of being stored again. Its handler keeps them while it's
+// connected and they wait on its mailbox while it's gone, so a retransmission
+// after reconnecting is also caught.
+typedef struct {
+  UWU_SentAck items[MAX_REMEMBERED_ACKS];
+  size_t count;
+  size_t next;
+} UWU_SentAcks;
+
+// Success: Returns the ACK sent for `nonce`.
+// Failure: Returns NULL if the nonce wasn't seen recently.
+UWU_SentAck *UWU_SentAcks_find(UWU_SentAcks *acks, uint32_t nonce) {
+  for (size_t i = 0; i < acks->count; i++) {
+    if (acks->items[i].nonce == nonce) {
+      return &acks->items[i];
+    }
+  }
+  return NULL;
+}
+
+// Remembers `ack`, forgetting the oldest one if the list is full.
+void UWU_SentAcks_remember(UWU_SentAcks *acks, UWU_SentAck ack) {
+  acks->items[acks->next] = ack;
+  acks->next = (acks->next + 1) % MAX_REMEMBERED_ACKS;
+  if (acks->count < MAX_REMEMBERED_ACKS) {
+    acks->count++;
+  }
+}
+
+/* *****************************************************************************
+Offline Mailboxes
+***************************************************************************** */
+
+// DMs for a user that left, delivered on a single OFFLINE_MESSAGES frame when
+// it connects again. Mailboxes are opened when their user disconnects, so a
+// DM to a user that was never here is still USER_NOT_FOUND.
+//
+// Every DM is stored as:
+// | timestamp ms (8 bytes) | length from | from | length msg | msg |
+//
+// All mailboxes share `s_mailbox_budget` bytes of memory. The DMs that don't
+// fit go to a segment file on `s_mailbox_dir`, once a mailbox has DMs there
+// the next ones go there too so they're delivered in order. They're queued on
+// `unwritten` and the tiers thread appends them, so senders never wait on the
+// disk while they hold the active_users.
+typedef struct {
+  // The user it belongs to, it's the key on the map. Owned by the mailbox.
+  UWU_String username;
+  // DMs kept in memory.
+  char *data;
+  size_t length;
+  size_t capacity;
+  // DMs over the budget the tiers thread didn't write yet. They aren't
+  // counted on the budget, they only wait for the disk.
+  char *unwritten;
+  size_t unwritten_length;
+  size_t unwritten_capacity;
+  // DMs in memory plus the ones on the segment or on their way to it.
+  size_t count;
+  // DMs on the segment or on their way to it.
+  size_t spilled;
+  // Whether the segment file was created.
+  UWU_Bool has_segment;
+  // Whether a TIER_SPILL job for it is queued.
+  UWU_Bool spill_queued;
+  // Whether the tiers thread is writing it without the lock. It can't be
+  // freed and its segment can't be read meanwhile.
+  UWU_Bool writing;
+  // Whether the segment couldn't be written, the next DMs stay on
+  // `unwritten`.
+  UWU_Bool unwritable;
+  // The last ACKs its user got before it left, NULL if there were none.
+  UWU_SentAcks *acks;
+  // When its user left.
+  time_t opened_at;
+} UWU_Mailbox;
+
+typedef struct {
+  // Key: The username. Value: An UWU_Mailbox.
+  UWU_FlatMap map;
+  // Guards everything here. Lock it after `active_users.mx`!
+  pthread_mutex_t mx;
+  // Broadcasted every time the tiers thread is done writing a mailbox.
+  pthread_cond_t written;
+  // Bytes of memory all the mailboxes use, DMs and bookkeeping.
+  size_t bytes;
+  // When expired mailboxes were last looked for.
+  time_t swept_at;
+} UWU_Mailboxes;
+
+static UWU_Mailboxes UWU_MAILBOXES = {};
+
+UWU_ChatHistory *get_or_create_chat(const UWU_String *key, UWU_Err err);
+
+// Bytes of memory a mailbox uses besides its DMs.
+size_t UWU_Mailbox_overhead(UWU_Mailbox *box) {
+  return sizeof(UWU_Mailbox) + box->username.length +
+         (box->acks != NULL ? sizeof(UWU_SentAcks) : 0);
+}
+
+// Frees the mailbox and deletes its segment.
+void UWU_Mailbox_free(UWU_Mailbox *box) {
+  if (box->has_segment) {
+    char path[1024];
+    hex_file_path(path, sizeof(path), s_mailbox_dir, &box->username);
+    unlink(path);
+  }
+  UWU_String_freeWithMalloc(&box->username);
+  free(box->data);
+  free(box->unwritten);
+  free(box->acks);
+  free(box);
+}
+
+// Forgets a mailbox that was removed from the map.
+// PLEASE lock the mailboxes before calling this function!
+void mailboxes_release(UWU_Mailbox *box) {
+  UWU_MAILBOXES.bytes -= UWU_Mailbox_overhead(box) + box->capacity;
+  __atomic_store_n(&UWU_STATE->stats.mailbox_bytes, UWU_MAILBOXES.bytes,
+                   __ATOMIC_RELAXED);
+  UWU_Mailbox_free(box);
+}
+
+// Returns TRUE for the mailboxes whose users didn't come back in time and
+// frees them.
+UWU_Bool mailbox_expired(void *context, UWU_String key, void *value) {
+  time_t now = *(time_t *)context;
+  UWU_Mailbox *box = value;
+  if (now - box->opened_at < MAILBOX_TTL_SECONDS || box->writing) {
+    return FALSE;
+  }
+
+  mailboxes_release(box);
+  return TRUE;
+}
+
+// Returns TRUE for every mailbox and frees it.
+UWU_Bool mailbox_always(void *context, UWU_String key, void *value) {
+  mailboxes_release(value);
+  return TRUE;
+}
+
+// Success: Returns TRUE.
+// Failure: Returns FALSE if the map or its lock couldn't be created.
+UWU_Bool mailboxes_init() {
+  UWU_Err err = NO_ERROR;
+  UWU_MAILBOXES.map = UWU_FlatMap_init(64, err);
+  return UWU_MAILBOXES.map.table.capacity != 0 &&
+         pthread_mutex_init(&UWU_MAILBOXES.mx, NULL) == 0 &&
+         pthread_cond_init(&UWU_MAILBOXES.written, NULL) == 0;
+}
+
+// Frees every mailbox. Mailboxes only live in memory, so their segments are
+// deleted too. Call it once the tiers thread stopped.
+void mailboxes_deinit() {
+  UWU_FlatMap_removeIf(&UWU_MAILBOXES.map, mailbox_always, NULL);
+  UWU_FlatMap_deinit(&UWU_MAILBOXES.map);
+  pthread_cond_destroy(&UWU_MAILBOXES.written);
+  pthread_mutex_destroy(&UWU_MAILBOXES.mx);
+}
+
+// Opens the mailbox of a user that just left. Mailboxes that expired are
+// dropped meanwhile.
+void mailbox_open(const UWU_String *const username) {
+  time_t now = time(NULL);
+
+  UWU_PanicIf(pthread_mutex_lock(&UWU_MAILBOXES.mx) != 0,
+              "Fatal: Can't lock the mailboxes mutex!");
+  if (now - UWU_MAILBOXES.swept_at >= MAILBOX_SWEEP_SECONDS) {
+    UWU_MAILBOXES.swept_at = now;
+    UWU_FlatMap_removeIf(&UWU_MAILBOXES.map, mailbox_expired, &now);
+  }
+
+  UWU_Mailbox *box = UWU_FlatMap_get(&UWU_MAILBOXES.map, username);
+  if (box != NULL) {
+    // It left before its DMs were delivered, they stay.
+    box->opened_at = now;
+  } else {
+    UWU_Err err = NO_ERROR;
+    box = calloc(1, sizeof(UWU_Mailbox));
+    if (box != NULL) {
+      box->username = UWU_String_copy(username, err);
+    }
+    if (box == NULL || box->username.data == NULL) {
+      MG_ERROR(("Can't open the mailbox of `%.*s`!", (int)username->length,
+                username->data));
+      free(box);
+    } else if (!UWU_FlatMap_put(&UWU_MAILBOXES.map, &box->username, box,
+                                err)) {
+      MG_ERROR(("Can't add the mailbox of `%.*s`!", (int)username->length,
+                username->data));
+      UWU_Mailbox_free(box);
+    } else {
+      box->opened_at = now;
+      UWU_MAILBOXES.bytes += UWU_Mailbox_overhead(box);
+      __atomic_store_n(&UWU_STATE->stats.mailbox_bytes, UWU_MAILBOXES.bytes,
+                       __ATOMIC_RELAXED);
+    }
+  }
+  UWU_PanicIf(pthread_mutex_unlock(&UWU_MAILBOXES.mx) != 0,
+              "Fatal: Can't unlock the mailboxes mutex!");
+}
+
+// Keeps the last ACKs of a user that just left on its mailbox, they're given
+// back to its next connection by `deliver_mailbox`.
+void mailbox_keep_acks(const UWU_String *const username,
+                       const UWU_SentAcks *const acks) {
+  if (acks->count == 0) {
+    return;
+  }
+
+  UWU_PanicIf(pthread_mutex_lock(&UWU_MAILBOXES.mx) != 0,
+              "Fatal: Can't lock the mailboxes mutex!");
+  UWU_Mailbox *box = UWU_FlatMap_get(&UWU_MAILBOXES.map, username);
+  if (box != NULL && box->acks == NULL) {
+    box->acks = malloc(sizeof(UWU_SentAcks));
+    if (box->acks != NULL) {
+      UWU_MAILBOXES.bytes += sizeof(UWU_SentAcks);
+      __atomic_store_n(&UWU_STATE->stats.mailbox_bytes, UWU_MAILBOXES.bytes,
+                       __ATOMIC_RELAXED);
+    }
+  }
+  if (box != NULL && box->acks != NULL) {
+    *box->acks = *acks;
+  }
+  UWU_PanicIf(pthread_mutex_unlock(&UWU_MAILBOXES.mx) != 0,
+              "Fatal: Can't unlock the mailboxes mutex!");
+}
+
+// Queues a DM for the tiers thread to append to the segment of `box`.
+// PLEASE lock the mailboxes before calling this function!
+//
+// Returns FALSE if there's no memory for it.
+UWU_Bool UWU_Mailbox_queueSpill(UWU_Mailbox *box, const char *record,
+                                size_t length) {
+  if (box->unwritten_length + length > box->unwritten_capacity) {
+    size_t capacity =
+        box->unwritten_capacity == 0 ? 1024 : 2 * box->unwritten_capacity;
+    while (capacity < box->unwritten_length + length) {
+      capacity *= 2;
+    }
+    char *unwritten = realloc(box->unwritten, capacity);
+    if (unwritten == NULL) {
+      return FALSE;
+    }
+    box->unwritten = unwritten;
+    box->unwritten_capacity = capacity;
+  }
+  memcpy(&box->unwritten[box->unwritten_length], record, length);
+  box->unwritten_length += length;
+  return TRUE;
+}
+
+// Appends the DMs waiting on the mailbox `job->key` to its segment, for the
+// tiers thread. The lock is only held to take them. If the segment can't be
+// written they're put back and the mailbox keeps its DMs in memory from then
+// on.
+void spill_mailbox(UWU_TierJob *job) {
+  UWU_PanicIf(pthread_mutex_lock(&UWU_MAILBOXES.mx) != 0,
+              "Fatal: Can't lock the mailboxes mutex!");
+  UWU_Mailbox *box = UWU_FlatMap_get(&UWU_MAILBOXES.map, &job->key);
+  if (box != NULL) {
+    box->spill_queued = FALSE;
+  }
+  // It was delivered, or an earlier job already wrote its DMs.
+  if (box == NULL || box->unwritable || box->unwritten_length == 0) {
+    UWU_PanicIf(pthread_mutex_unlock(&UWU_MAILBOXES.mx) != 0,
+                "Fatal: Can't unlock the mailboxes mutex!");
+    return;
+  }
+  char *records = box->unwritten;
+  size_t length = box->unwritten_length;
+  box->unwritten = NULL;
+  box->unwritten_length = 0;
+  box->unwritten_capacity = 0;
+  // A segment left by a previous run belongs to nobody.
+  int flags = O_WRONLY | O_CREAT | O_APPEND | (box->has_segment ? 0 : O_TRUNC);
+  box->writing = TRUE;
+  UWU_PanicIf(pthread_mutex_unlock(&UWU_MAILBOXES.mx) != 0,
+              "Fatal: Can't unlock the mailboxes mutex!");
+
+  // Creates the directory the first time, it may already be there.
+  mkdir(s_mailbox_dir, 0700);
+  char path[1024];
+  hex_file_path(path, sizeof(path), s_mailbox_dir, &job->key);
+  int fd = open(path, flags, 0600);
+  UWU_Bool written = FALSE;
+  if (fd != -1) {
+    off_t end = lseek(fd, 0, SEEK_END);
+    written = write(fd, records, length) == (ssize_t)length;
+    // Half a DM would be delivered twice.
+    if (!written && end != -1 && ftruncate(fd, end) != 0) {
+      MG_ERROR(("Can't cut %s back, it may have a broken DM!", path));
+    }
+    close(fd);
+  }
+
+  UWU_PanicIf(pthread_mutex_lock(&UWU_MAILBOXES.mx) != 0,
+              "Fatal: Can't lock the mailboxes mutex!");
+  // Nobody frees it while it's written, even if it was delivered meanwhile.
+  if (written) {
+    box->has_segment = TRUE;
+    free(records);
+  } else {
+    MG_ERROR(("Can't write to the mailbox segment of `%.*s`, its DMs stay in "
+              "memory!",
+              (int)job->key.length, job->key.data));
+    box->has_segment = box->has_segment || fd != -1;
+    box->unwritable = TRUE;
+    // They go before the DMs queued meanwhile.
+    char *merged = realloc(records, length + box->unwritten_length);
+    if (merged == NULL) {
+      MG_ERROR(("Lost the DMs of `%.*s` that didn't fit on memory!",
+                (int)job->key.length, job->key.data));
+      free(records);
+    } else {
+      memcpy(&merged[length], box->unwritten, box->unwritten_length);
+      free(box->unwritten);
+      box->unwritten = merged;
+      box->unwritten_length += length;
+      box->unwritten_capacity = box->unwritten_length;
+    }
+  }
+  box->writing = FALSE;
+  pthread_cond_broadcast(&UWU_MAILBOXES.written);
+  UWU_PanicIf(pthread_mutex_unlock(&UWU_MAILBOXES.mx) != 0,
+              "Fatal: Can't unlock the mailboxes mutex!");
+}
+
+// Queues a DM for a disconnected user. The DMs over the budget are written
+// by the tiers thread, so it never waits on the disk.
+// PLEASE lock the active_users before calling this function, so the user
+// can't connect meanwhile!
+//
+// Success: Returns TRUE.
+// Failure: Returns FALSE and sets `error` to USER_NOT_FOUND if the user has no
+// mailbox, or MAILBOX_FULL if it can't take more DMs.
+UWU_Bool mailbox_push(const UWU_String *const to, const UWU_String *const from,
+                      const UWU_String *const content, uint64_t timestamp_ms,
+                      UWU_Errors *error) {
+  char record[8 + 1 + 255 + 1 + 255];
+  size_t length = 0;
+  UWU_writeBigEndian(record, timestamp_ms, 8);
+  length += 8;
+  record[length++] = from->length;
+  memcpy(&record[length], from->data, from->length);
+  length += from->length;
+  record[length++] = content->length;
+  memcpy(&record[length], content->data, content->length);
+  length += content->length;
+
+  UWU_Bool queued = FALSE;
+  UWU_Bool spill = FALSE;
+  UWU_PanicIf(pthread_mutex_lock(&UWU_MAILBOXES.mx) != 0,
+              "Fatal: Can't lock the mailboxes mutex!");
+  UWU_Mailbox *box = UWU_FlatMap_get(&UWU_MAILBOXES.map, to);
+  if (box == NULL) {
+    *error = USER_NOT_FOUND;
+  } else if (box->count >= MAX_MAILBOX_MESSAGES) {
+    *error = MAILBOX_FULL;
+  } else {
+    size_t capacity = box->capacity;
+    while (capacity < box->length + length) {
+      capacity = capacity == 0 ? 1024 : 2 * capacity;
+    }
+
+    UWU_Bool fits = box->spilled == 0 &&
+                    UWU_MAILBOXES.bytes + capacity - box->capacity <=
+                        s_mailbox_budget;
+    if (fits && capacity != box->capacity) {
+      char *data = realloc(box->data, capacity);
+      if (data == NULL) {
+        fits = FALSE;
+      } else {
+        UWU_MAILBOXES.bytes += capacity - box->capacity;
+        box->data = data;
+        box->capacity = capacity;
+      }
+    }
+
+    if (fits) {
+      memcpy(&box->data[box->length], record, length);
+      box->length += length;
+      box->count++;
+      queued = TRUE;
+    } else if (UWU_Mailbox_queueSpill(box, record, length)) {
+      box->spilled++;
+      box->count++;
+      queued = TRUE;
+      spill = !box->spill_queued && !box->unwritable;
+      box->spill_queued = box->spill_queued || spill;
+      __atomic_fetch_add(&UWU_STATE->stats.mailbox_spilled, 1,
+                         __ATOMIC_RELAXED);
+    } else {
+      MG_ERROR(("Can't queue a DM on the mailbox segment of `%.*s`!",
+                (int)to->length, to->data));
+      *error = MAILBOX_FULL;
+    }
+    __atomic_store_n(&UWU_STATE->stats.mailbox_bytes, UWU_MAILBOXES.bytes,
+                     __ATOMIC_RELAXED);
+  }
+  UWU_PanicIf(pthread_mutex_unlock(&UWU_MAILBOXES.mx) != 0,
+              "Fatal: Can't unlock the mailboxes mutex!");
+
+  if (spill) {
+    UWU_TierJob *job = tier_job(TIER_SPILL, to);
+    if (job != NULL) {
+      tier_queue(job);
+    } else {
+      // The DMs wait in memory for the next one.
+      MG_ERROR(("Can't allocate a mailbox spill for `%.*s`!", (int)to->length,
+                to->data));
+      UWU_PanicIf(pthread_mutex_lock(&UWU_MAILBOXES.mx) != 0,
+                  "Fatal: Can't lock the mailboxes mutex!");
+      box = UWU_FlatMap_get(&UWU_MAILBOXES.map, to);
+      if (box != NULL) {
+        box->spill_queued = FALSE;
+      }
+      UWU_PanicIf(pthread_mutex_unlock(&UWU_MAILBOXES.mx) != 0,
+                  "Fatal: Can't unlock the mailboxes mutex!");
+    }
+  }
+
+  if (queued) {
+    __atomic_fetch_add(&UWU_STATE->stats.mailbox_queued, 1, __ATOMIC_RELAXED);
+  } else if (*error == MAILBOX_FULL) {
+    __atomic_fetch_add(&UWU_STATE->stats.mailbox_rejected, 1,
+                       __ATOMIC_RELAXED);
+  }
+  return queued;
+}
+
+// Puts back the mailbox `deliver_mailbox` took when its user left before it
+// was delivered. The mailbox opened when it left is dropped if it's still
+// empty.
+// PLEASE lock the active_users before calling this function!
+//
+// Returns FALSE if the DMs couldn't be put back and are lost.
+UWU_Bool mailbox_put_back(UWU_Mailbox *box) {
+  UWU_Err err = NO_ERROR;
+  UWU_PanicIf(pthread_mutex_lock(&UWU_MAILBOXES.mx) != 0,
+              "Fatal: Can't lock the mailboxes mutex!");
+  UWU_Mailbox *opened = UWU_FlatMap_get(&UWU_MAILBOXES.map, &box->username);
+  // DMs sent after it left would go before the old ones.
+  UWU_Bool put = opened == NULL || (opened->count == 0 && !opened->writing);
+  if (put && opened != NULL) {
+    box->opened_at = opened->opened_at;
+    UWU_FlatMap_remove(&UWU_MAILBOXES.map, &box->username);
+    mailboxes_release(opened);
+  }
+  put = put && UWU_FlatMap_put(&UWU_MAILBOXES.map, &box->username, box, err);
+  if (put) {
+    // A job queued for it may have run while it was out of the map.
+    box->spill_queued = FALSE;
+    UWU_MAILBOXES.bytes += UWU_Mailbox_overhead(box) + box->capacity;
+    __atomic_store_n(&UWU_STATE->stats.mailbox_bytes, UWU_MAILBOXES.bytes,
+                     __ATOMIC_RELAXED);
+  }
+  UWU_PanicIf(pthread_mutex_unlock(&UWU_MAILBOXES.mx) != 0,
+              "Fatal: Can't unlock the mailboxes mutex!");
+  return put;
+}
+
+// Delivers the mailbox of a user that just connected on a single
+// OFFLINE_MESSAGES frame. The DMs whose senders are still connected are
+// stored on their DM histories too.
+//
+// Like `announce_registered_user`, nothing is delivered if the user already
+// left, its DMs keep waiting for it.
+//
+// - acks: Gets the ACKs its user was sent before it left.
+void deliver_mailbox(struct mg_connection *c, UWU_String *username,
+                     UWU_SentAcks *acks) {
+  UWU_Mailbox *box = NULL;
+  UWU_PanicIf(pthread_mutex_lock(&UWU_STATE->active_users.mx) != 0,
+              "Fatal: Can't lock the active_users mutex!");
+  UWU_User *joined =
+      UWU_UserList_findByName(&UWU_STATE->active_users, username);
+  if (joined != NULL && joined->conn == c) {
+    UWU_PanicIf(pthread_mutex_lock(&UWU_MAILBOXES.mx) != 0,
+                "Fatal: Can't lock the mailboxes mutex!");
+    box = UWU_FlatMap_remove(&UWU_MAILBOXES.map, username);
+    if (box != NULL && box->acks != NULL) {
+      *acks = *box->acks;
+    }
+    if (box != NULL) {
+      UWU_MAILBOXES.bytes -= UWU_Mailbox_overhead(box) + box->capacity;
+      __atomic_store_n(&UWU_STATE->stats.mailbox_bytes, UWU_MAILBOXES.bytes,
+                       __ATOMIC_RELAXED);
+    }
+    UWU_PanicIf(pthread_mutex_unlock(&UWU_MAILBOXES.mx) != 0,
+                "Fatal: Can't unlock the mailboxes mutex!");
+  }
+  UWU_PanicIf(pthread_mutex_unlock(&UWU_STATE->active_users.mx) != 0,
+              "Fatal: Can't unlock the active_users mutex!");
+  if (box == NULL) {
+    return;
+  }
+
+  // Nobody else can reach the mailbox now, once the tiers thread is done
+  // with it the disk is read without locks.
+  UWU_PanicIf(pthread_mutex_lock(&UWU_MAILBOXES.mx) != 0,
+              "Fatal: Can't lock the mailboxes mutex!");
+  while (box->writing) {
+    pthread_cond_wait(&UWU_MAILBOXES.written, &UWU_MAILBOXES.mx);
+  }
+  UWU_PanicIf(pthread_mutex_unlock(&UWU_MAILBOXES.mx) != 0,
+              "Fatal: Can't unlock the mailboxes mutex!");
+
+  size_t spilled_length = 0;
+  char *spilled = NULL;
+  if (box->has_segment) {
+    char path[1024];
+    hex_file_path(path, sizeof(path), s_mailbox_dir, &box->username);
+    spilled = read_whole_file(path, &spilled_length);
+    if (spilled == NULL) {
+      MG_ERROR(("Lost the DMs `%.*s` got on disk!", (int)username->length,
+                username->data));
+    }
+  }
+
+  // The records become `| length from | from | length msg | msg |`, without
+  // their timestamp, so the frame is never bigger than them.
+  char *frame =
+      malloc(2 + box->length + spilled_length + box->unwritten_length);
+  UWU_PanicIf(frame == NULL,
+              "Fatal: Can't allocate the OFFLINE_MESSAGES of `%.*s`!",
+              (int)username->length, username->data);
+  frame[0] = OFFLINE_MESSAGES;
+  uint8_t count = 0;
+  size_t frame_length = 2;
+
+  UWU_PanicIf(pthread_mutex_lock(&UWU_STATE->active_users.mx) != 0,
+              "Fatal: Can't lock the active_users mutex!");
+  joined = UWU_UserList_findByName(&UWU_STATE->active_users, username);
+  if (joined == NULL || joined->conn != c) {
+    // It left while the segment was read.
+    if (mailbox_put_back(box)) {
+      box = NULL;
+    } else {
+      MG_ERROR(("Lost the offline DMs of `%.*s`, it left while they were "
+                "delivered!",
+                (int)username->length, username->data));
+    }
+    UWU_PanicIf(pthread_mutex_unlock(&UWU_STATE->active_users.mx) != 0,
+                "Fatal: Can't unlock the active_users mutex!");
+    free(frame);
+    free(spilled);
+    if (box != NULL) {
+      UWU_Mailbox_free(box);
+    }
+    return;
+  }
+
+  // Memory first, the segment and the DMs not written yet came after them.
+  const char *records[] = {box->data, spilled, box->unwritten};
+  size_t lengths[] = {box->length, spilled_length, box->unwritten_length};
+  for (size_t r = 0; r < 3; r++) {
+    for (size_t offset = 0; offset + 10 <= lengths[r];) {
+      const char *record = &records[r][offset];
+      uint64_t timestamp_ms = UWU_readBigEndian(record, 8);
+      UWU_String from = {.data = (char *)&record[9],
+                         .length = (uint8_t)record[8]};
+      if (offset + 10 + from.length > lengths[r]) {
+        break;
+      }
+      UWU_String content = {.data = (char *)&record[10 + from.length],
+                            .length = (uint8_t)record[9 + from.length]};
+      size_t record_length = 10 + from.length + content.length;
+      if (offset + record_length > lengths[r]) {
+        break;
+      }
+      offset += record_length;
+
+      memcpy(&frame[frame_length], &record[8], record_length - 8);
+      frame_length += record_length - 8;
+      count++;
+
+      // Histories are only kept while both users are connected.
+      UWU_User *sender =
+          UWU_UserList_findByName(&UWU_STATE->active_users, &from);
+      if (sender == NULL) {
+        continue;
+      }
+      UWU_String key = direct_chat_key(&from, username);
+      UWU_Err err = NO_ERROR;
+      UWU_ChatHistory *history = get_or_create_chat(&key, err);
+      UWU_String_freeWithMalloc(&key);
+      if (history != NULL) {
+        UWU_ChatEntry entry = {.content = content,
+                               .origin_username = UWU_Username_borrow(&from),
+                               .timestamp_ms = timestamp_ms};
+        uint64_t id = add_chat_message(history, &entry);
+        send_direct_message_to_follower(id, &from, username, &content,
+                                        timestamp_ms);
+      }
+    }
+  }
+  frame[1] = count;
+
+  UWU_String response = {.data = frame, .length = frame_length};
+  send_msg(c, &response);
+  UWU_PanicIf(pthread_mutex_unlock(&UWU_STATE->active_users.mx) != 0,
+              "Fatal: Can't unlock the active_users mutex!");
+
+  MG_INFO(("Delivered %lu offline DMs to `%.*s`", (unsigned long)count,
+           (int)username->length, username->data));
+  __atomic_fetch_add(&UWU_STATE->stats.mailbox_delivered, count,
+                     __ATOMIC_RELAXED);
+  free(frame);
+  free(spilled);
+  UWU_Mailbox_free(box);
+}
+
+/* *****************************************************************************
+IDLE Detector
+***************************************************************************** */
+// Marks users that didn't do anything for `IDLE_SECONDS_LIMIT` as INACTIVE.
+//
+// Instead of checking every few seconds it sleeps until the next ACTIVE user
+// could become idle. With no ACTIVE users it sleeps until one appears.
+static void *idle_detector(void *p) {
+  UWU_Err err = NO_ERROR;
+  UWU_Arena arena = UWU_Arena_init(2 + 1 + 255, err);
+  if (err != NO_ERROR) {
+    UWU_PANIC("Fatal: Failed to initialize idle_detector arena!");
+    return NULL;
+  }
+
+  UWU_PanicIf(pthread_mutex_lock(&UWU_STATE->active_users.mx) != 0,
+              "Fatal: Failed to lock active_users lock!");
+  while (!UWU_STATE->is_shutting_off) {
+    MG_INFO(("[IDLE detector] Checking %d connected users...",
+             (int)UWU_STATE->active_users.length));
+    time_t now = time(NULL);
+
+    if ((clock_t)-1 == now) {
+      UWU_PANIC("Fatal: Failed to get current clock time!");
+      break;
+    }
+
+    // When the next ACTIVE user becomes idle, 0 if there are none.
+    time_t next_check = 0;
+    for (struct UWU_UserListNode *current = UWU_STATE->active_users.start;
+         current != NULL; current = current->next) {
+      // Users of other nodes are tracked by their own node.
+      if (current->is_sentinel || current->data.status != ACTIVE ||
+          current->data.conn == NULL) {
+        continue;
+      }
+
+      time_t seconds_diff = difftime(now, current->data.last_action);
+      if (seconds_diff >= IDLE_SECONDS_LIMIT) {
+        UWU_Arena_reset(&arena);
+        UWU_String username = UWU_Username_view(&current->data.username);
+        MG_INFO(
+            ("Updating %.*s as INACTIVE!", (int)username.length, username.data));
+        current->data.status = INACTIVE;
+        UWU_String msg = create_changed_status_message(&arena, &current->data);
+        broadcast_presence(&msg);
+      } else {
+        time_t idle_at = current->data.last_action + IDLE_SECONDS_LIMIT;
+        if (next_check == 0 || idle_at < next_check) {
+          next_check = idle_at;
+        }
+      }
+    }
+
+    if (next_check == 0) {
+      pthread_cond_wait(&UWU_STATE->idle_cond, &UWU_STATE->active_users.mx);
+    } else {
+      struct timespec deadline = {.tv_sec = next_check, .tv_nsec = 0};
+      pthread_cond_timedwait(&UWU_STATE->idle_cond,
+                             &UWU_STATE->active_users.mx, &deadline);
+    }
+  }
+  UWU_PanicIf(pthread_mutex_unlock(&UWU_STATE->active_users.mx) != 0,
+              "Fatal: Failed to unlock active_users lock!");
+
+  UWU_Arena_deinit(arena);
+  UWU_Arena_releaseThreadBlocks();
+  UWU_Pools_releaseThreadCaches();
+  return NULL;
+}
+
+// Builds the GOT_MESSAGES response of a DM history.
+//
+// The history is copied without locking it, so new messages never wait for
+// the copy. If writers overlap `MAX_OPTIMISTIC_HISTORY_READS` times in a row
+// the history is locked instead.
+//
+// Success: Returns the response, allocated on `arena`.
+// Failure: Returns an empty string if the arena ran out of memory.
+UWU_String got_messages_response(UWU_Arena *arena, UWU_ChatHistory *history,
+                                 UWU_Err err) {
+  UWU_String response = {};
+  char *data = NULL;
+  size_t data_size = 0;
+  size_t data_length = 0;
+  size_t count = 0;
+
+  for (size_t i = 0; i < MAX_OPTIMISTIC_HISTORY_READS; i++) {
+    uint32_t seq = UWU_ChatHistory_readBegin(history);
+    size_t msg_size = 2 + UWU_ChatHistory_serializedSize(history);
+    if (msg_size > data_size) {
+      data = UWU_Arena_alloc(arena, msg_size, err);
+      if (data == NULL) {
+        return response;
+      }
+      data_size = msg_size;
+    }
+
+    if (UWU_ChatHistory_serialize(history, seq, &data[2], data_size - 2,
+                                  &data_length, &count)) {
+      data[0] = GOT_MESSAGES;
+      data[1] = count;
+      response.data = data;
+      response.length = 2 + data_length;
+      return response;
+    }
+    __atomic_fetch_add(&UWU_STATE->stats.history_read_retries, 1,
+                       __ATOMIC_RELAXED);
+  }
+
+  __atomic_fetch_add(&UWU_STATE->stats.history_read_fallbacks, 1,
+                     __ATOMIC_RELAXED);
+  UWU_PanicIf(pthread_mutex_lock(&history->mx) != 0,
+              "Fatal: Can't lock the chat history mutex!");
+  size_t msg_size = 2 + UWU_ChatHistory_serializedSize(history);
+  if (msg_size > data_size) {
+    data = UWU_Arena_alloc(arena, msg_size, err);
+  }
+  // Writers hold the lock, so the read can't fail.
+  if (data != NULL &&
+      UWU_ChatHistory_serialize(history, UWU_ChatHistory_readBegin(history),
+                                &data[2], msg_size - 2, &data_length, &count)) {
+    data[0] = GOT_MESSAGES;
+    data[1] = count;
+    response.data = data;
+    response.length = 2 + data_length;
+  }
+  UWU_PanicIf(pthread_mutex_unlock(&history->mx) != 0,
+              "Fatal: Can't unlock the chat history mutex!");
+
+  return response;
+}
+
+// Gets the DM history saved under `key`, creating it on its first use.
+//
+// The caller MUST hold `active_users.mx` and have checked that both users are
+// connected, otherwise a disconnection could miss the new history.
+//
+// Success: Returns the history.
+// Failure: Returns NULL if it couldn't be allocated.
+UWU_ChatHistory *get_or_create_chat(const UWU_String *key, UWU_Err err) {
+  UWU_ChatHistory *history = UWU_StripedMap_get(&UWU_STATE->chats, key);
+  if (history != NULL) {
+    return history;
+  }
+
+  UWU_String channel_name = UWU_String_copy(key, err);
+  if (channel_name.data == NULL) {
+    return NULL;
+  }
+  UWU_ChatHistory *created =
+      UWU_ChatHistory_new(MAX_MESSAGES_PER_CHAT, channel_name, err);
+  if (created == NULL) {
+    UWU_String_freeWithMalloc(&channel_name);
+    return NULL;
+  }
+
+  created->used_ms = UWU_nowMs();
+  // A history that was dropped before goes on after its IDs.
+  created->next_idx = chat_floor(key);
+  // Restored before it's put on the map, readers that don't lock the
+  // active_users can't see it empty.
+  UWU_Bool restored = restore_chat(created);
+
+  history = UWU_StripedMap_putIfAbsent(&UWU_STATE->chats,
+                                       &created->channel_name, created, err);
+  if (history != created) {
+    // The other user created it first or the map couldn't grow.
+    UWU_ChatHistory_free(created);
+  } else {
+    __atomic_fetch_add(&UWU_STATE->stats.memory_histories, created->bytes,
+                       __ATOMIC_RELAXED);
+    if (restored) {
+      forget_restored_chat(key);
+      check_memory_budget();
+    }
+  }
+  return history;
+}
+
+// Pins the DM history saved under `key` so it isn't freed while it's read,
+// even if it's evicted or one of its users leaves meanwhile. An evicted one is
+// loaded back first.
+//
+// Returns the history, or NULL if it doesn't exist. ALWAYS unpin `stripe`
+// afterwards, even if it's NULL.
+UWU_ChatHistory *pin_direct_chat(const UWU_String *const key,
+                                 UWU_MapStripe **stripe) {
+  UWU_ChatHistory *chat = UWU_StripedMap_getPinned(&UWU_STATE->chats, key,
+                                                   stripe);
+  if (NULL == chat && !chat_is_evicted(key)) {
+    // It may have been restored after the first look.
+    UWU_StripedMap_unpin(*stripe);
+    chat = UWU_StripedMap_getPinned(&UWU_STATE->chats, key, stripe);
+  } else if (NULL == chat) {
+    // Loaded back and pinned before it can be evicted again.
+    UWU_StripedMap_unpin(*stripe);
+    UWU_PanicIf(pthread_mutex_lock(&UWU_STATE->active_users.mx) != 0,
+                "Fatal: Can't lock the active_users mutex!");
+    if (chat_users_connected(key)) {
+      UWU_Err err = NO_ERROR;
+      get_or_create_chat(key, err);
+    }
+    chat = UWU_StripedMap_getPinned(&UWU_STATE->chats, key, stripe);
+    UWU_PanicIf(pthread_mutex_unlock(&UWU_STATE->active_users.mx) != 0,
+                "Fatal: Can't unlock the active_users mutex!");
+  }
+  return chat;
+}
+
+// The first ID of the page that ends before `end`.
+uint64_t page_start(uint64_t end) {
+  return end > MAX_PAGE_MESSAGES ? end - MAX_PAGE_MESSAGES : 1;
+}
+
+// Copies the messages of a DM history before `end` that go on a page as
+// records into `dest`. `end` is moved to the ID after the newest message if
+// it's 0 or past it.
+//
+// Returns how many were copied, and sets `first_id` to the oldest ID the
+// history holds.
+size_t copy_history_page(UWU_ChatHistory *history, uint64_t *end,
+                         uint64_t *first_id, char *dest, size_t *length) {
+  UWU_PanicIf(pthread_mutex_lock(&history->mx) != 0,
+              "Fatal: Can't lock the chat history mutex!");
+  if (*end == 0 || *end > history->next_idx + 1) {
+    *end = history->next_idx + 1;
+  }
+  *first_id = history->next_idx + 1 - history->count;
+  uint64_t start = page_start(*end);
+
+  size_t count = 0;
+  UWU_ChatHistory_Iterator iter = UWU_ChatHistory_iter(history);
+  for (size_t i = iter.start; i < iter.end; i++) {
+    UWU_ChatEntry entry = UWU_ChatHistory_get(history, i % history->capacity);
+    if (entry.id < start || entry.id >= *end) {
+      continue;
+    }
+    UWU_SegmentRecord record = {
+        .id = entry.id,
+        .timestamp_ms = entry.timestamp_ms,
+        .from = UWU_Username_view(&entry.origin_username),
+        .content = entry.content,
+    };
+    *length += UWU_SegmentRecord_write(&dest[*length], &record);
+    count++;
+  }
+  UWU_PanicIf(pthread_mutex_unlock(&history->mx) != 0,
+              "Fatal: Can't unlock the chat history mutex!");
+  return count;
+}
+
+// Answers a GET_MESSAGES of `chat` that carried the ID to page before, check
+// `UWU_PAGE_BEFORE_SIZE`.
+//
+// The messages still in memory are copied right away. If the page needs
+// older ones it's finished by the tiers thread, which reads them from the
+// segments. `pending` counts the pages of the handler that are left.
+//
+// - key: The key of the DM history on `chats`, or the name of the group chat.
+void send_older_messages(struct mg_connection *c, size_t *pending,
+                         const UWU_String *const chat,
+                         const UWU_String *const key, uint64_t before,
+                         uint64_t received_us) {
+  size_t header_length = 3 + chat->length;
+  size_t size =
+      header_length + MAX_PAGE_MESSAGES * UWU_SEGMENT_MAX_RECORD_SIZE;
+  char *data = malloc(size);
+  if (data == NULL) {
+    MG_ERROR(("Can't allocate an OLDER_MESSAGES, it's dropped!"));
+    return;
+  }
+  data[0] = OLDER_MESSAGES;
+  data[1] = chat->length;
+  memcpy(&data[2], chat->data, chat->length);
+
+  uint64_t end = before;
+  // IDs start at 1, a page of an empty chat has nothing in memory or on disk.
+  uint64_t first_id = 1;
+  size_t length = header_length;
+  size_t count = 0;
+  if (UWU_String_equal(key, &GROUP_CHAT_CHANNEL)) {
+    UWU_ChannelHistory_Range range =
+        UWU_ChannelHistory_range(&UWU_STATE->group_chat);
+    if (end == 0 || end > range.end + 1) {
+      end = range.end + 1;
+    }
+    first_id = range.start + 1;
+    uint64_t start = page_start(end);
+    for (uint64_t pos = (start > first_id ? start : first_id) - 1;
+         pos + 1 < end; pos++) {
+      size_t copied = copy_group_record(pos, &data[length], size - length);
+      if (copied > 0) {
+        length += copied;
+        count++;
+      }
+    }
+  } else {
+    UWU_MapStripe *stripe = NULL;
+    UWU_ChatHistory *history = pin_direct_chat(key, &stripe);
+    if (history != NULL) {
+      __atomic_store_n(&history->used_ms, UWU_nowMs(), __ATOMIC_RELAXED);
+      count = copy_history_page(history, &end, &first_id, data, &length);
+    } else {
+      end = 1;
+    }
+    UWU_StripedMap_unpin(stripe);
+  }
+
+  uint64_t start = page_start(end);
+  uint64_t cold_end = end < first_id ? end : first_id;
+  if (start >= cold_end) {
+    // Everything on the page was in memory.
+    data[header_length - 1] = count;
+    UWU_String response = {.data = data, .length = length};
+    send_msg(c, &response);
+    free(data);
+    return;
+  }
+
+  UWU_TierJob *job = tier_job(TIER_PAGE, key);
+  if (job == NULL) {
+    MG_ERROR(("Can't allocate an OLDER_MESSAGES, it's dropped!"));
+    free(data);
+    return;
+  }
+  job->data = data;
+  job->length = length;
+  job->count = count;
+  job->cold_start = start;
+  job->cold_end = cold_end;
+  job->conn = c;
+  job->pending = pending;
+  job->received_us = received_us;
+  tier_queue(job);
+}
+
+// Looks for the messages of the group chat still in memory that match.
+void search_group_chat(UWU_Search *search) {
+  UWU_ChannelHistory_Range range =
+      UWU_ChannelHistory_range(&UWU_STATE->group_chat);
+  uint64_t first_id = range.end + 1;
+  for (uint64_t pos = range.start; pos < range.end; pos++) {
+    char data[UWU_SEGMENT_MAX_RECORD_SIZE];
+    size_t copied = copy_group_record(pos, data, sizeof(data));
+    UWU_String raw = {.data = data, .length = copied};
+    size_t offset = 0;
+    UWU_SegmentRecord record = {};
+    if (!UWU_SegmentRecord_next(&raw, &offset, &record)) {
+      continue;
+    }
+    // Anything older was overwritten, so it's on the segments.
+    if (first_id > range.end) {
+      first_id = record.id;
+    }
+    if (UWU_SearchTerms_match(&search->terms, &record.content)) {
+      UWU_Search_add(search, &GROUP_CHAT_CHANNEL, &record);
+    }
+  }
+  UWU_Search_remember(search, &GROUP_CHAT_CHANNEL, first_id);
+}
+
+typedef struct {
+  UWU_Search *search;
+  const UWU_String *username;
+} UWU_DirectSearch;
+
+// Looks for the messages in memory of the DM history `value` that match, if
+// it's one of the user that searches.
+void search_direct_chat(void *context, UWU_String key, void *value) {
+  UWU_DirectSearch *direct = context;
+  UWU_ChatHistory *history = value;
+  if (!chat_has_user(&key, direct->username)) {
+    return;
+  }
+
+  UWU_String partner = chat_partner(&key, direct->username);
+  UWU_PanicIf(pthread_mutex_lock(&history->mx) != 0,
+              "Fatal: Can't lock the chat history mutex!");
+  if (UWU_Search_remember(direct->search, &key,
+                          history->next_idx + 1 - history->count)) {
+    UWU_ChatHistory_Iterator iter = UWU_ChatHistory_iter(history);
+    for (size_t i = iter.start; i < iter.end; i++) {
+      UWU_ChatEntry entry =
+          UWU_ChatHistory_get(history, i % history->capacity);
+      if (!UWU_SearchTerms_match(&direct->search->terms, &entry.content)) {
+        continue;
+      }
+      UWU_SegmentRecord record = {
+          .id = entry.id,
+          .timestamp_ms = entry.timestamp_ms,
+          .from = UWU_Username_view(&entry.origin_username),
+          .content = entry.content,
+      };
+      UWU_Search_add(direct->search, &partner, &record);
+    }
+  }
+  UWU_PanicIf(pthread_mutex_unlock(&history->mx) != 0,
+              "Fatal: Can't unlock the chat history mutex!");
+}
+
+// Answers a SEARCH of `username`, check `UWU_SEARCH_RESULT_SIZE`.
+//
+// The messages still in memory are searched right away, then the tiers thread
+// adds the ones on the segments and sends the results. `pending` counts the
+// answers of the handler that are left.
+void search_messages(struct mg_connection *c, size_t *pending,
+                     const UWU_String *const username,
+                     const UWU_String *const query, uint64_t received_us) {
+  UWU_Search *search = calloc(1, sizeof(UWU_Search));
+  if (search == NULL) {
+    MG_ERROR(("Can't allocate a SEARCH, it's dropped!"));
+    return;
+  }
+  search->terms = UWU_SearchTerms_parse(query);
+  if (search->terms.count == 0) {
+    // Nothing matches a query without terms.
+    char empty[] = {SEARCH_RESULTS, 0};
+    UWU_String response = {.data = empty, .length = sizeof(empty)};
+    send_msg(c, &response);
+    UWU_Search_free(search);
+    return;
+  }
+
+  search_group_chat(search);
+  // Evicted DM histories aren't on the map, only their segments are found.
+  UWU_DirectSearch direct = {.search = search, .username = username};
+  UWU_StripedMap_forEach(&UWU_STATE->chats, search_direct_chat, &direct);
+
+  UWU_TierJob *job = tier_job(TIER_SEARCH, username);
+  if (job == NULL) {
+    MG_ERROR(("Can't allocate a SEARCH, it's dropped!"));
+    UWU_Search_free(search);
+    return;
+  }
+  job->search = search;
+  job->conn = c;
+  job->pending = pending;
+  job->received_us = received_us;
+  tier_queue(job);
+}
+
+// Tells all other users that `username` just joined.
+//
+// The handler of the new connection calls it, so the join itself doesn't go
+// through every user. If the user already left nothing is sent, otherwise
+// the others would see it join after it left.
+void announce_registered_user(struct mg_connection *c, UWU_String *username) {
+  UWU_User user = {.username = UWU_Username_borrow(username),
+                   .status = ACTIVE};
+  char buff[3 + 255];
+  UWU_String msg = changed_status_builder(buff, &user);
+  msg.data[0] = REGISTERED_USER;
+
+  UWU_PanicIf(pthread_mutex_lock(&UWU_STATE->active_users.mx) != 0,
+              "Fatal: Can't lock the active_users mutex!");
+  UWU_User *joined =
+      UWU_UserList_findByName(&UWU_STATE->active_users, username);
+  if (joined != NULL && joined->conn == c) {
+    for (struct UWU_UserListNode *current = UWU_STATE->active_users.start;
+         current != NULL; current = current->next) {
+
+      if (current->is_sentinel || current->data.conn == NULL ||
+          UWU_Username_equal(&current->data.username, &user.username)) {
+        continue;
+      }
+
+      UWU_String current_username =
+          UWU_Username_view(&current->data.username);
+      MG_INFO(("Sending welcome of `%.*s` to `%.*s`", (int)username->length,
+               username->data, (int)current_username.length,
+               current_username.data));
+
+      send_msg(current->data.conn, &msg);
+    }
+    send_presence_to_peers(&msg);
+  }
+  UWU_PanicIf(pthread_mutex_unlock(&UWU_STATE->active_users.mx) != 0,
+              "Fatal: Can't unlock the active_users mutex!");
+}
+
+// Sends an ACKED_MESSAGE to `conn`.
+void send_ack(struct mg_connection *conn, const UWU_SentAck *ack) {
+  char data[UWU_ACK_SIZE];
+  data[0] = ACKED_MESSAGE;
+  UWU_writeBigEndian(&data[1], ack->nonce, UWU_NONCE_SIZE);
+  UWU_writeBigEndian(&data[1 + UWU_NONCE_SIZE], ack->id, 8);
+  UWU_writeBigEndian(&data[1 + UWU_NONCE_SIZE + 8], ack->timestamp_ms, 8);
+
+  UWU_String response = {.data = data, .length = UWU_ACK_SIZE};
+  send_msg(conn, &response);
+}
+
+// Writes the ID and timestamp a GOT_MESSAGE ends with into `dest`, check
+// `UWU_MESSAGE_STAMP_SIZE`.
+//
+// Returns the bytes written.
+size_t write_message_stamp(char *dest, uint64_t id, uint64_t timestamp_ms) {
+  UWU_writeBigEndian(dest, id, 8);
+  UWU_writeBigEndian(&dest[8], timestamp_ms, 8);
+  return UWU_MESSAGE_STAMP_SIZE;
+}
+
+void *message_handler(void *thread_info) {
+  UWU_Err err = NO_ERROR;
+
+  UWU_ThreadConnInfo *param = thread_info;
+  UWU_String conn_username = param->username;
+  // Used to find the user of this connection on the active users list.
+  uint32_t conn_username_hash = UWU_String_hash(&conn_username);
+  int req_reader_fd = param->reader;
+  struct mg_connection *c = param->c;
+  UWU_Pool_free(&UWU_THREAD_INFO_POOL, param);
+  UWU_SentAcks sent_acks = {};
+  // OLDER_MESSAGES and SEARCHes the tiers thread still has to answer.
+  size_t pending_answers = 0;
+
+  announce_registered_user(c, &conn_username);
+  deliver_mailbox(c, &conn_username, &sent_acks);
+
+  UWU_Arena resp_arena = UWU_Arena_init(RESP_ARENA_BLOCK_SIZE, err);
+  if (err != NO_ERROR) {
+    UWU_PANIC("Fatal: Can't initialize response arena for message handler! "
+              "Connection of: %.*s",
+              conn_username.length, conn_username.data);
+  } else {
+    // Arena that will hold the request data after reading it from the pipe.
+    // Check `REQ_PIPE_HEADER_SIZE` for the extra bytes.
+    const size_t chunk_size = REQ_PIPE_HEADER_SIZE + REQ_ARENA_MAX_SIZE;
+    UWU_Arena req_arena = UWU_Arena_init(chunk_size, err);
+    if (err != NO_ERROR) {
+      UWU_PANIC("Fatal: Can't initialize request arena for message handler! "
+                "Connection of: %.*s",
+                conn_username.length, conn_username.data);
+    } else {
+
+      struct pollfd wrapper = {
+          .fd = req_reader_fd,
+          .events = POLLIN,
+          .revents = 0,
+      };
+      struct pollfd fds[] = {wrapper};
+      // The thread sleeps until a request arrives. It stops when the
+      // connection closes, which also happens for every connection on
+      // shutdown, so the requests already sent are still answered.
+      //
+      // The frames of every request are sent together when it's done.
+      for (int rt = poll(fds, 1, -1); rt >= 0 || errno == EINTR;
+           release_wakeups(), rt = poll(fds, 1, -1)) {
+        if (rt < 0) {
+          // A signal arrived while waiting.
+          continue;
+        }
+        hold_wakeups();
+        UWU_Arena_reset(&req_arena);
+        UWU_Arena_reset(&resp_arena);
 
-  UWU_ThreadConnInfo *param = thread_info;
-  UWU_String conn_username = param->username;
-  int req_reader_fd = param->reader;
-  struct mg_connection *c = param->c;
+        char *buff = UWU_Arena_alloc(&req_arena, chunk_size, err);
+        if (err != NO_ERROR) {
+          UWU_PANIC(
+              "Fatal: Can't allocate enough memory for the request inside! "
+              "Did you forget to reset the arena?");
+        } else {
+
+          int read_result = read(req_reader_fd, buff, chunk_size);
+          if (read_result == -1) {
+            UWU_PANIC("Fatal: An error ocurred while reading from pipe!");
+          } else if (read_result == 0) {
+            // EOF reached should close thread...
+            break;
+          } else {
+
+            int terminate_thread = buff[0] == 0;
+            if (terminate_thread) {
+              break;
+            }
+
+            size_t msg_length = UWU_readBigEndian(&buff[1], 2);
+            char *msg_data = buff + REQ_PIPE_HEADER_SIZE;
+
+            // Every case reads the frame through `request`, which was checked
+            // against the length of the frame.
+            UWU_Request request;
+            if (!UWU_Request_decode(msg_data, msg_length, &request)) {
+              __atomic_fetch_add(&UWU_STATE->stats.invalid_requests, 1,
+                                 __ATOMIC_RELAXED);
+              MG_ERROR(("Ignoring an invalid request of type %d and %lu "
+                        "bytes from `%.*s`!",
+                        (uint8_t)msg_data[0], (unsigned long)msg_length,
+                        (int)conn_username.length, conn_username.data));
+              continue;
+            }
+
+            switch (request.type) {
+            case GET_USER: {
+              UWU_String user_to_get = request.get_user.username;
+
+              UWU_PanicIf(pthread_mutex_lock(&UWU_STATE->active_users.mx) != 0,
+                          "Fatal: Can't lock the active_users mutex!");
+              UWU_User *user = UWU_UserList_findByName(&UWU_STATE->active_users,
+                                                       &user_to_get);
+
+              if (user == NULL) {
+                MG_ERROR(("Error: User not found!"));
+              } else {
+                UWU_String username = UWU_Username_view(&user->username);
+                printf("Username: %.*s\n", (int)username.length,
+                       username.data);
+                printf("Status: %d\n", user->status);
+
+                size_t response_size = username.length + 2;
+
+                char *data = UWU_Arena_alloc(&resp_arena, response_size, err);
+                if (err != NO_ERROR) {
+                  MG_ERROR(("Error: Memory allocation failed!"));
+                } else {
+                  data[0] = GOT_USER;
+                  memcpy(data + 1, username.data, username.length);
+                  data[username.length + 1] = (char)user->status;
+
+                  UWU_String response = {.data = data, .length = response_size};
+                  send_msg(c, &response);
+                }
+              }
+              UWU_PanicIf(pthread_mutex_unlock(&UWU_STATE->active_users.mx) !=
+                              0,
+                          "Fatal: Can't unlock the active_users mutex!");
+
+            } break;
+            case LIST_USERS: {
+              UWU_PanicIf(pthread_mutex_lock(&UWU_STATE->active_users.mx) != 0,
+                          "Fatal: Can't lock the active_users mutex!");
+              char *data = UWU_Arena_alloc(
+                  &resp_arena, 2 + (255 + 1) * UWU_STATE->active_users.length,
+                  err);
+              if (err != NO_ERROR) {
+                UWU_PANIC("Fatal: Allocation of memory for response failed!");
+
+              } else {
+                data[0] = LISTED_USERS;
+                data[1] = UWU_STATE->active_users.length;
+
+                size_t data_length = 2;
+                for (struct UWU_UserListNode *current =
+                         UWU_STATE->active_users.start;
+                     current != NULL; current = current->next) {
+
+                  if (current->is_sentinel) {
+                    continue;
+                  }
+
+                  if (UWU_Username_equalString(&current->data.username,
+                                               &conn_username,
+                                               conn_username_hash)) {
+                    update_last_action(&current->data);
+                  }
+
+                  UWU_String username =
+                      UWU_Username_view(&current->data.username);
+                  size_t username_length = username.length;
+                  data[data_length] = username_length;
+                  data_length++;
+
+                  memcpy(data + data_length, username.data, username_length);
+                  data_length += username_length;
+
+                  data[data_length] = current->data.status;
+                  data_length++;
+                }
+
+                UWU_String response = {.data = data, .length = data_length};
+                send_msg(c, &response);
+              }
+              UWU_PanicIf(pthread_mutex_unlock(&UWU_STATE->active_users.mx) !=
+                              0,
+                          "Fatal: Can't unlock the active_users mutex!");
+            } break;
+            case CHANGE_STATUS: {
+              UWU_String req_username = request.change_status.username;
+              if (req_username.length == 0) {
+                MG_ERROR(("The username is too short!"));
+              } else {
+
+                if (!UWU_String_equal(&req_username, &conn_username)) {
+                  MG_ERROR(("Another username can't change the status of the "
+                            "current username!"));
+                } else {
+
+                  UWU_PanicIf(pthread_mutex_lock(&UWU_STATE->active_users.mx) !=
+                                  0,
+                              "Fatal: Can't lock the active_users mutex!");
+                  UWU_User *old_user = UWU_UserList_findByName(
+                      &UWU_STATE->active_users, &req_username);
+                  if (NULL == old_user) {
+                    UWU_PANIC(
+                        "Fatal: No active user with the given username found!");
+                  } else {
+
+                    UWU_User new_user = {
+                        .username = UWU_Username_borrow(&req_username),
+                        .status = (UWU_ConnStatus)request.change_status.status,
+                    };
+
+                    if (old_user->status == new_user.status) {
+                      MG_INFO(("Can't change status to the same status!"));
+                    } else {
+
+                      UWU_Bool transition_matrix[4][4] = {};
+                      transition_matrix[DISCONNETED][DISCONNETED] = TRUE;
+
+                      transition_matrix[ACTIVE][BUSY] = TRUE;
+                      transition_matrix[BUSY][ACTIVE] = TRUE;
+
+                      transition_matrix[INACTIVE][ACTIVE] = TRUE;
+                      transition_matrix[INACTIVE][BUSY] = TRUE;
+
+                      // The status comes from the client, it may be anything.
+                      UWU_Bool valid_transition =
+                          request.change_status.status <= INACTIVE &&
+                          transition_matrix[old_user->status][new_user.status];
+                      if (!valid_transition) {
+                        MG_ERROR(("Invalid transition of user state!"));
+                        char err_data[] = {(char)ERROR, (char)INVALID_STATUS};
+
+                        UWU_String err_response = {.data = err_data,
+                                                   .length = 2};
+                        send_msg(c, &err_response);
+
+                      } else {
+                        MG_INFO(("Changing status %.*s to %d",
+                                 (int)req_username.length, req_username.data,
+                                 new_user.status));
+
+                        old_user->status = new_user.status;
+                        update_last_action(old_user);
+                        if (new_user.status == ACTIVE) {
+                          notify_idle_detector();
+                        }
+
+                        UWU_String response = create_changed_status_message(
+                            &resp_arena, &new_user);
+                        broadcast_presence(&response);
+                      }
+                    }
+                  }
+                  UWU_PanicIf(
+                      pthread_mutex_unlock(&UWU_STATE->active_users.mx) != 0,
+                      "Fatal: Can't lock the active_users mutex!");
+                }
+              }
+            } break;
+            case SEND_MESSAGE: {
+              UWU_String msg_username = request.send_message.username;
+              UWU_String content = request.send_message.content;
+              size_t message_length = content.length;
+              UWU_Bool has_nonce = request.send_message.has_nonce;
+              uint32_t nonce = request.send_message.nonce;
+
+              // Message is empty
+              if (message_length == 0) {
+                char error[2];
+                error[0] = ERROR;
+                error[1] = EMPTY_MESSAGE;
+
+                UWU_String response = {.data = error, .length = 2};
+                send_msg(c, &response);
+              } else if (msg_username.length == 0) {
+
+                char error[2];
+                error[0] = ERROR;
+                error[1] = USER_NOT_FOUND;
+
+                UWU_String response = {.data = error, .length = 2};
+                send_msg(c, &response);
+              } else if (has_nonce &&
+                         UWU_SentAcks_find(&sent_acks, nonce) != NULL) {
+                // A retransmission, the message was already stored.
+                send_ack(c, UWU_SentAcks_find(&sent_acks, nonce));
+              } else {
+
+                uint64_t timestamp_ms = UWU_nowMs();
+                uint64_t message_id = 0;
+                // Waits on a mailbox, check `UWU_MAILBOX_MESSAGE_ID`.
+                UWU_Bool queued = FALSE;
+
+                if (UWU_String_equal(&msg_username, &GROUP_CHAT_CHANNEL)) {
+                  MG_INFO(("Sending message to general chat..."));
+                  message_id = append_group_message(&GROUP_CHAT_CHANNEL,
+                                                    &content, timestamp_ms);
+
+                  size_t data_length =
+                      3 + 1 + message_length + UWU_MESSAGE_STAMP_SIZE;
+                  char *data = UWU_Arena_alloc(&resp_arena, data_length, err);
+                  if (err != NO_ERROR) {
+                    UWU_PANIC(
+                        "Fatal: Failed to allocate memory for GOT_MESSAGE "
+                        "response!");
+                  } else {
+                    data[0] = GOT_MESSAGE;
+                    data[1] = 1;
+                    data[2] = '~';
+                    data[3] = message_length;
+                    memcpy(&data[4], content.data, message_length);
+                    write_message_stamp(&data[4 + message_length], message_id,
+                                        timestamp_ms);
+
+                    UWU_String response = {.data = data, .length = data_length};
+
+                    UWU_PanicIf(
+                        pthread_mutex_lock(&UWU_STATE->active_users.mx) != 0,
+                        "Fatal: Can't lock the active_users mutex!");
+                    broadcast_msg(&response);
+                    send_group_message_to_peers(message_id, &content,
+                                                timestamp_ms);
+
+                    for (struct UWU_UserListNode *current =
+                             UWU_STATE->active_users.start;
+                         current != NULL; current = current->next) {
+
+                      if (current->is_sentinel) {
+                        continue;
+                      }
+
+                      if (UWU_Username_equalString(&current->data.username,
+                                                   &conn_username,
+                                                   conn_username_hash)) {
+                        update_last_action(&current->data);
+
+                        if (current->data.status == INACTIVE) {
+                          current->data.status = ACTIVE;
+                          notify_idle_detector();
+                          UWU_String response = create_changed_status_message(
+                              &resp_arena, &current->data);
+                          broadcast_presence(&response);
+                        }
+                      }
+                    }
+
+                    UWU_PanicIf(
+                        pthread_mutex_unlock(&UWU_STATE->active_users.mx) != 0,
+                        "Fatal: Can't unlock the active_users mutex!");
+                  }
+                } else {
+
+                  UWU_PanicIf(pthread_mutex_lock(&UWU_STATE->active_users.mx) !=
+                                  0,
+                              "Fatal: Can't lock the active_users mutex!");
+                  UWU_Bool msg_username_exists =
+                      UWU_UserList_findByName(&UWU_STATE->active_users,
+                                              &msg_username) != NULL;
+                  if (!msg_username_exists) {
+                    // It may have left, then the DM waits on its mailbox.
+                    UWU_Errors mailbox_error = USER_NOT_FOUND;
+                    queued = mailbox_push(&msg_username, &conn_username,
+                                          &content, timestamp_ms,
+                                          &mailbox_error);
+                    message_id = UWU_MAILBOX_MESSAGE_ID;
+                    if (!queued) {
+                      char error[2];
+                      error[0] = ERROR;
+                      error[1] = mailbox_error;
+
+                      UWU_String response = {.data = error, .length = 2};
+                      send_msg(c, &response);
+                    }
+                  } else {
+
+                    UWU_String *first = &conn_username;
+                    UWU_String *other = &msg_username;
+
+                    if (!UWU_String_firstGoesFirst(first, other)) {
+                      first = &msg_username;
+                      other = &conn_username;
+                    }
+
+                    UWU_String tmp =
+                        UWU_String_combineWithOther(first, &SEPARATOR);
+                    UWU_String combined =
+                        UWU_String_combineWithOther(&tmp, other);
+                    UWU_String_freeWithMalloc(&tmp);
+
+                    // Both users are connected and we hold the active
+                    // users, so the history can be created here.
+                    UWU_ChatHistory *history =
+                        get_or_create_chat(&combined, err);
+                    if (history == NULL) {
+                      UWU_PANIC("Fatal: Can't create the chat history for "
+                                "key: %.*s",
+                                combined.length, combined.data);
+                    }
+                    UWU_String_freeWithMalloc(&combined);
 
-  UWU_Arena resp_arena = UWU_Arena_init(RESP_ARENA_MAX_SIZE, err);
-  if (err != NO_ERROR) {
-    UWU_PANIC("Fatal: Can't initialize response arena for message handler! "
-              "Connection of: %.*s",
-              conn_username.length, conn_username.data);
-  } else {
-    // Arena that will hold the request data after reading it from the pipe.
-    // We add 2 bytes because we need some extra information:
-    // - buff[0]: 1 if the message is from the protocol, 0 if the thread should
-    // stop processing messages.
-    // - buff[1]: The length of the message.
-    const size_t chunk_size = 2 + REQ_ARENA_MAX_SIZE;
-    UWU_Arena req_arena = UWU_Arena_init(chunk_size, err);
-    if (err != NO_ERROR) {
-      UWU_PANIC("Fatal: Can't initialize request arena for message handler! "
-                "Connection of: %.*s",
-                conn_username.length, conn_username.data);
-    } else {
+                    if (history != NULL) {
 
-      struct pollfd wrapper = {
-          .fd = req_reader_fd,
-          .events = POLLIN,
-          .revents = 0,
-      };
-      struct pollfd fds[] = {wrapper};
-      size_t ms_wait_time = 1000;
-      for (int rt = poll(fds, 1, ms_wait_time); rt >= 0;
-           rt = poll(fds, 1, ms_wait_time)) {
-        if (UWU_STATE->is_shutting_off) {
-          break;
-        }
-        UWU_Arena_reset(&req_arena);
-        UWU_Arena_reset(&resp_arena);
+                      UWU_ChatEntry entry = {
+                          .content = content,
+                          .origin_username =
+                              UWU_Username_borrow(&conn_username),
+                          .timestamp_ms = timestamp_ms};
 
-        char *buff = UWU_Arena_allocRemaining(&req_arena, err);
-        if (err != NO_ERROR) {
-          UWU_PANIC(
-              "Fatal: Can't allocate enough memory for the request inside! "
-              "Did you forget to reset the arena?");
-        } else {
+                      message_id = add_chat_message(history, &entry);
+                      send_direct_message_to_follower(
+                          message_id, &conn_username, &msg_username, &content,
+                          timestamp_ms);
 
-          int read_result = read(req_reader_fd, buff, chunk_size);
-          if (read_result == -1) {
-            UWU_PANIC("Fatal: An error ocurred while reading from pipe!");
-          } else if (read_result == 0) {
-            // EOF reached should close thread...
-            break;
-          } else {
+                      size_t data_length = 3 + conn_username.length +
+                                           message_length +
+                                           UWU_MESSAGE_STAMP_SIZE;
+                      char *data =
+                          UWU_Arena_alloc(&resp_arena, data_length, err);
+                      if (err != NO_ERROR) {
+                        UWU_PANIC(
+                            "Fatal: Failed to allocate memory for GOT_MESSAGE "
+                            "response!");
+                      } else {
 
-            int terminate_thread = buff[0] == 0;
-            if (terminate_thread) {
-              break;
-            }
+                        data[0] = GOT_MESSAGE;
+                        data[1] = conn_username.length;
+                        memcpy(&data[2], conn_username.data,
+                               conn_username.length);
+                        data[2 + conn_username.length] = message_length;
+                        memcpy(&data[3 + conn_username.length], content.data,
+                               message_length);
+                        write_message_stamp(
+                            &data[3 + conn_username.length + message_length],
+                            message_id, timestamp_ms);
 
-            // size_t msg_length = &buff[1];
-            char *msg_data = buff + 2;
+                        for (struct UWU_UserListNode *current =
+                                 UWU_STATE->active_users.start;
+                             current != NULL; current = current->next) {
 
-            switch (msg_data[0]) {
-            case GET_USER: {
-              char username_length = msg_data[1];
-              UWU_String user_to_get = {.data = &msg_data[2],
-                                        .length = username_length};
+                          if (current->is_sentinel) {
+                            continue;
+                          }
 
-              UWU_PanicIf(pthread_mutex_lock(&UWU_STATE->active_users.mx) != 0,
-                          "Fatal: Can't lock the active_users mutex!");
-              UWU_User *user = UWU_UserList_findByName(&UWU_STATE->active_users,
-                                                       &user_to_get);
+                          UWU_Bool is_sender = UWU_Username_equalString(
+                              &current->data.username, &conn_username,
+                              conn_username_hash);
+                          if (is_sender) {
+                            update_last_action(&current->data);
+                          }
 
-              if (user == NULL) {
-                MG_ERROR(("Error: User not found!"));
-              } else {
-                printf("Username: %.*s\n", (int)user->username.length,
-                       user->username.data);
-                printf("Status: %d\n", user->status);
+                          UWU_String current_username =
+                              UWU_Username_view(&current->data.username);
+                          if (is_sender || UWU_String_equal(&current_username,
+                                                            &msg_username)) {
+
+                            if (current->data.conn == NULL) {
+                              // The recipient is on another node, which
+                              // stores and delivers the message.
+                              send_direct_message_to_peer(
+                                  message_id, &conn_username, &msg_username,
+                                  &content, timestamp_ms);
+                              continue;
+                            }
 
-                size_t response_size = user->username.length + 2;
+                            if (current->data.status == INACTIVE) {
+                              current->data.status = ACTIVE;
+                              notify_idle_detector();
+                              UWU_String response =
+                                  create_changed_status_message(&resp_arena,
+                                                                &current->data);
+                              broadcast_presence(&response);
+                            }
 
-                char *data = UWU_Arena_alloc(&resp_arena, response_size, err);
-                if (err != NO_ERROR) {
-                  MG_ERROR(("Error: Memory allocation failed!"));
-                } else {
-                  data[0] = GOT_USER;
-                  memcpy(data + 1, user->username.data, user->username.length);
-                  data[user->username.length + 1] = (char)user->status;
+                            UWU_String response = {.data = data,
+                                                   .length = data_length};
+                            send_msg(current->data.conn, &response);
+                          }
+                        }
+                      }
+                    }
+                  }
+                  UWU_PanicIf(
+                      pthread_mutex_unlock(&UWU_STATE->active_users.mx) != 0,
+                      "Fatal: Can't unlock the active_users mutex!");
+                }
 
-                  UWU_String response = {.data = data, .length = response_size};
-                  send_msg(c, &response);
+                if (has_nonce && (message_id != 0 || queued)) {
+                  UWU_SentAck ack = {.nonce = nonce,
+                                     .id = message_id,
+                                     .timestamp_ms = timestamp_ms};
+                  UWU_SentAcks_remember(&sent_acks, ack);
+                  send_ack(c, &ack);
                 }
               }
-              UWU_PanicIf(pthread_mutex_unlock(&UWU_STATE->active_users.mx) !=
-                              0,
-                          "Fatal: Can't unlock the active_users mutex!");
-
             } break;
-            case LIST_USERS: {
-              UWU_PanicIf(pthread_mutex_lock(&UWU_STATE->active_users.mx) != 0,
-                          "Fatal: Can't lock the active_users mutex!");
-              char *data = UWU_Arena_alloc(
-                  &resp_arena, 2 + (255 + 1) * UWU_STATE->active_users.length,
-                  err);
-              if (err != NO_ERROR) {
-                UWU_PANIC("Fatal: Allocation of memory for response failed!");
 
+            case GET_MESSAGES: {
+              UWU_String req_username = request.get_messages.username;
+              if (req_username.length == 0) {
+                MG_ERROR(("The username is too short!\n"));
               } else {
-                data[0] = LISTED_USERS;
-                data[1] = UWU_STATE->active_users.length;
 
-                size_t data_length = 2;
-                for (struct UWU_UserListNode *current =
-                         UWU_STATE->active_users.start;
-                     current != NULL; current = current->next) {
+                if (request.get_messages.has_before) {
+                  uint64_t before = request.get_messages.before;
+                  UWU_String key = GROUP_CHAT_CHANNEL;
+                  if (!UWU_String_equal(&req_username, &GROUP_CHAT_CHANNEL)) {
+                    key = direct_chat_key(&req_username, &conn_username);
+                  }
+                  send_older_messages(c, &pending_answers, &req_username, &key,
+                                      before, monotonic_us());
+                  if (key.data != GROUP_CHAT_CHANNEL.data) {
+                    UWU_String_freeWithMalloc(&key);
+                  }
+                } else if (UWU_String_equal(&req_username,
+                                            &GROUP_CHAT_CHANNEL)) {
+                  UWU_ChannelHistory *group_chat = &UWU_STATE->group_chat;
+                  UWU_ChannelHistory_Range range =
+                      UWU_ChannelHistory_range(group_chat);
+                  // Messages overwritten while copying may not fit anymore,
+                  // they're skipped like the ones still being written.
+                  size_t msg_size =
+                      2 + UWU_ChannelHistory_sizeHint(group_chat, range);
+                  char *data = UWU_Arena_alloc(&resp_arena, msg_size, err);
+
+                  if (data == NULL) {
+                    UWU_PANIC(
+                        "Fatal: Arena couldn't allocate enough memory for "
+                        "message!");
+                  } else {
+                    data[0] = GOT_MESSAGES;
+                    uint8_t count = 0;
+                    size_t data_length = 2;
 
-                  if (current->is_sentinel) {
-                    continue;
+                    for (uint64_t pos = range.start; pos < range.end; pos++) {
+                      size_t copied = UWU_ChannelHistory_copyMessage(
+                          group_chat, pos, &data[data_length],
+                          msg_size - data_length, NULL);
+                      if (copied > 0) {
+                        data_length += copied;
+                        count++;
+                      }
+                    }
+                    data[1] = count;
+
+                    UWU_String response = {.data = data, .length = data_length};
+                    send_msg(c, &response);
                   }
+                } else {
+                  UWU_String *first = &req_username;
+                  UWU_String *other = &conn_username;
 
-                  if (UWU_String_equal(&conn_username,
-                                       &current->data.username)) {
-                    update_last_action(&current->data);
+                  if (!UWU_String_firstGoesFirst(first, other)) {
+                    first = &conn_username;
+                    other = &req_username;
                   }
 
-                  size_t username_length = current->data.username.length;
-                  data[data_length] = username_length;
-                  data_length++;
+                  UWU_String tmp =
+                      UWU_String_combineWithOther(first, &SEPARATOR);
+                  UWU_String combined =
+                      UWU_String_combineWithOther(&tmp, other);
+                  UWU_String_freeWithMalloc(&tmp);
 
-                  memcpy(data + data_length, current->data.username.data,
-                         username_length);
-                  data_length += username_length;
+                  UWU_MapStripe *stripe = NULL;
+                  UWU_ChatHistory *chat = pin_direct_chat(&combined, &stripe);
+                  UWU_String_freeWithMalloc(&combined);
 
-                  data[data_length] = current->data.status;
-                  data_length++;
+                  if (NULL == chat) {
+                    // Histories are created by the first message.
+                    char empty[] = {GOT_MESSAGES, 0};
+                    UWU_String response = {.data = empty,
+                                           .length = sizeof(empty)};
+                    send_msg(c, &response);
+                  } else {
+                    __atomic_store_n(&chat->used_ms, UWU_nowMs(),
+                                     __ATOMIC_RELAXED);
+                    UWU_String response =
+                        got_messages_response(&resp_arena, chat, err);
+                    if (response.data == NULL) {
+                      UWU_PANIC(
+                          "Fatal: Arena couldn't allocate enough memory for "
+                          "message!");
+                    } else {
+                      send_msg(c, &response);
+                    }
+                  }
+                  UWU_StripedMap_unpin(stripe);
                 }
-
-                UWU_String response = {.data = data, .length = data_length};
-                send_msg(c, &response);
               }
-              UWU_PanicIf(pthread_mutex_unlock(&UWU_STATE->active_users.mx) !=
-                              0,
-                          "Fatal: Can't unlock the active_users mutex!");
+
             } break;
-            case CHANGE_STATUS: {
-              // Message should contain at least a username length
-              char username_length = msg_data[1];
-              if (username_length <= 0) {
-                MG_ERROR(("The username is too short!"));
-              } else {
 
-                UWU_String req_username = {
-                    .data = &msg_data[2],
-                    .length = username_length,
-                };
+            case SEARCH:
+              search_messages(c, &pending_answers, &conn_username,
+                              &request.search.query, monotonic_us());
+              break;
 
-                if (!UWU_String_equal(&req_username, &conn_username)) {
-                  MG_ERROR(("Another username can't change the status of the "
-                            "current username!"));
-                } else {
+            default:
+              MG_ERROR(("Unrecognized message!"));
+            }
+          }
+        }
+      }
+      release_wakeups();
+    }
 
-                  UWU_PanicIf(pthread_mutex_lock(&UWU_STATE->active_users.mx) !=
-                                  0,
-                              "Fatal: Can't lock the active_users mutex!");
-                  UWU_User *old_user = UWU_UserList_findByName(
-                      &UWU_STATE->active_users, &req_username);
-                  if (NULL == old_user) {
-                    UWU_PANIC(
-                        "Fatal: No active user with the given username found!");
-                  } else {
+    UWU_Arena_deinit(req_arena);
+  }
 
-                    UWU_User new_user = {
-                        .username = req_username,
-                        .status = msg_data[2 + username_length],
-                    };
+  // The tiers thread sends them on the connection, which is freed once the
+  // handler exits.
+  wait_tier_answers(&pending_answers);
+  // Its mailbox was opened before the handler was told to exit.
+  mailbox_keep_acks(&conn_username, &sent_acks);
+  UWU_Arena_deinit(resp_arena);
+  UWU_Deflate_releaseThreadCtx();
+  UWU_Arena_releaseThreadBlocks();
+  UWU_Pools_releaseThreadCaches();
+  UWU_Pool_releaseThreadCache(&UWU_THREAD_INFO_POOL);
+  close(req_reader_fd);
+  return NULL;
+}
+
+/* *****************************************************************************
+Cluster
+***************************************************************************** */
+
+static void peer_fn(struct mg_connection *c, int ev, void *ev_data);
+
+// Sets up the nodes listed on `s_peers`, none of them is linked yet.
+//
+// Success: Returns TRUE.
+// Failure: Returns FALSE if they couldn't be allocated.
+UWU_Bool peers_init(UWU_ServerState *state) {
+  // A single server is a cluster of one node.
+  state->nodes = 1;
+  if (s_peers == NULL) {
+    return TRUE;
+  }
+  for (const char *url = s_peers; *url != '\0'; url++) {
+    if (*url == ',') {
+      state->nodes++;
+    }
+  }
+
+  state->peers = calloc(state->nodes, sizeof(UWU_Peer));
+  if (state->peers == NULL) {
+    return FALSE;
+  }
+
+  const char *url = s_peers;
+  for (size_t i = 0; i < state->nodes; i++) {
+    const char *end = strchr(url, ',');
+    size_t length = end == NULL ? strlen(url) : (size_t)(end - url);
+    state->peers[i].url.data = (char *)url;
+    state->peers[i].url.length = length;
+    if (!UWU_Outbox_init(&state->peers[i].outbox, NULL)) {
+      return FALSE;
+    }
+    url += length + 1;
+  }
+  return TRUE;
+}
+
+// Frees the nodes, their links MUST be closed already.
+void peers_deinit(UWU_ServerState *state) {
+  for (size_t i = 0; state->peers != NULL && i < state->nodes; i++) {
+    UWU_Outbox_deinit(&state->peers[i].outbox);
+  }
+  free(state->peers);
+  state->peers = NULL;
+}
+
+// Removes a user of another node and its DM histories, then tells the users
+// of this node and the follower it left.
+// PLEASE lock the active_users before calling this function!
+void forget_remote_user(UWU_User *user) {
+  char buff[3 + 255];
+  UWU_User gone = {.username = user->username, .status = DISCONNETED};
+  UWU_String msg = changed_status_builder(buff, &gone);
+  // The removal frees `user`, the frame has a copy of the username.
+  UWU_String username = {.data = &msg.data[2], .length = (uint8_t)msg.data[1]};
+
+  UWU_UserList_removeByUsernameIfExists(&UWU_STATE->active_users, &username);
+  forget_chats(remove_if_matches, &username);
+
+  // While shutting down everyone is leaving, there's nobody to tell.
+  if (!UWU_STATE->is_shutting_off) {
+    broadcast_msg(&msg);
+    char frame_buff[1 + sizeof(buff)];
+    UWU_String frame = peer_presence_builder(frame_buff, &msg);
+    send_to_follower(&frame);
+  }
+}
+
+// Checks a PEER_PRESENCE, without its type.
+UWU_Bool presence_is_valid(const char *data, size_t length) {
+  return length >= 4 && length == 3 + (uint8_t)data[1] &&
+         (data[0] == REGISTERED_USER || data[0] == CHANGED_STATUS) &&
+         (uint8_t)data[length - 1] <= INACTIVE;
+}
+
+// Adds, updates or forgets the user of a valid PEER_PRESENCE of a user
+// without a connection on this server. The users of this server and the
+// follower are told about it.
+void apply_presence(const char *data, size_t length) {
+  UWU_String username = {.data = (char *)&data[2],
+                         .length = (uint8_t)data[1]};
+  UWU_ConnStatus status = (uint8_t)data[length - 1];
+
+  char buff[3 + 255];
+  memcpy(buff, data, length);
+  UWU_String msg = {.data = buff, .length = length};
+  char frame_buff[1 + sizeof(buff)];
+
+  UWU_PanicIf(pthread_mutex_lock(&UWU_STATE->active_users.mx) != 0,
+              "Fatal: Can't lock the active_users mutex!");
+  UWU_User *user = UWU_UserList_findByName(&UWU_STATE->active_users, &username);
+  if (user != NULL && user->conn != NULL) {
+    MG_ERROR(("`%.*s` is connected to this server!", (int)username.length,
+              username.data));
+  } else if (status == DISCONNETED) {
+    if (user != NULL) {
+      forget_remote_user(user);
+    }
+  } else if (user == NULL) {
+    UWU_Err err = NO_ERROR;
+    UWU_User new_user = {.username = UWU_Username_borrow(&username),
+                         .status = status,
+                         .conn = NULL};
+    struct UWU_UserListNode user_node = UWU_UserListNode_newWithValue(new_user);
+    UWU_UserList_insertEnd(&UWU_STATE->active_users, &user_node, err);
+    if (err != NO_ERROR) {
+      MG_ERROR(("Can't add `%.*s` to the active users!", (int)username.length,
+                username.data));
+    } else {
+      buff[0] = REGISTERED_USER;
+      broadcast_msg(&msg);
+      UWU_String frame = peer_presence_builder(frame_buff, &msg);
+      send_to_follower(&frame);
+    }
+  } else if (user->status != status) {
+    user->status = status;
+    buff[0] = CHANGED_STATUS;
+    broadcast_msg(&msg);
+    UWU_String frame = peer_presence_builder(frame_buff, &msg);
+    send_to_follower(&frame);
+  }
+  UWU_PanicIf(pthread_mutex_unlock(&UWU_STATE->active_users.mx) != 0,
+              "Fatal: Can't unlock the active_users mutex!");
+}
+
+// Handles a PEER_PRESENCE from `node`, without its type.
+void peer_presence(size_t node, const char *data, size_t length) {
+  if (!presence_is_valid(data, length)) {
+    MG_ERROR(("Ignoring an invalid presence from node %lu!",
+              (unsigned long)node));
+    return;
+  }
+
+  UWU_String username = {.data = (char *)&data[2],
+                         .length = (uint8_t)data[1]};
+  if (UWU_Username_node(&username, UWU_STATE->nodes) != node) {
+    MG_ERROR(("Node %lu doesn't own `%.*s`!", (unsigned long)node,
+              (int)username.length, username.data));
+    return;
+  }
+
+  apply_presence(data, length);
+}
+
+// Handles a PEER_GROUP_MESSAGE of another node or the primary, without its
+// type. Messages of the primary keep its ID, the ones of other nodes get one
+// of this node.
+//
+// Success: Returns TRUE and sets `timestamp_ms` to when it was sent.
+// Failure: Returns FALSE if the frame is invalid.
+UWU_Bool peer_group_message(const char *data, size_t length,
+                            UWU_Bool from_primary, uint64_t *timestamp_ms) {
+  if (length < 18 || length != 17 + (uint8_t)data[16]) {
+    return FALSE;
+  }
+
+  uint64_t id = UWU_readBigEndian(data, 8);
+  *timestamp_ms = UWU_readBigEndian(&data[8], 8);
+  UWU_String content = {.data = (char *)&data[17],
+                        .length = (uint8_t)data[16]};
+  if (!from_primary) {
+    id = append_group_message(&GROUP_CHAT_CHANNEL, &content, *timestamp_ms);
+  } else if (!store_group_message(id, &content, *timestamp_ms)) {
+    // The sync and the change itself may both bring it.
+    return TRUE;
+  }
+
+  char buff[4 + 255 + UWU_MESSAGE_STAMP_SIZE];
+  buff[0] = GOT_MESSAGE;
+  buff[1] = 1;
+  buff[2] = '~';
+  buff[3] = content.length;
+  memcpy(&buff[4], content.data, content.length);
+  size_t response_length = 4 + content.length;
+  response_length +=
+      write_message_stamp(&buff[response_length], id, *timestamp_ms);
+  UWU_String response = {.data = buff, .length = response_length};
+
+  char frame_buff[1 + 8 + 8 + 1 + 255];
+  UWU_String frame =
+      group_message_builder(frame_buff, id, &content, *timestamp_ms);
+  send_to_follower(&frame);
+
+  UWU_PanicIf(pthread_mutex_lock(&UWU_STATE->active_users.mx) != 0,
+              "Fatal: Can't lock the active_users mutex!");
+  broadcast_msg(&response);
+  UWU_PanicIf(pthread_mutex_unlock(&UWU_STATE->active_users.mx) != 0,
+              "Fatal: Can't unlock the active_users mutex!");
+  return TRUE;
+}
+
+// Reads the fields of a PEER_DIRECT_MESSAGE, without its type. `fields` gets
+// the sender, the recipient and the message, as views into `data`.
+//
+// Success: Returns TRUE.
+// Failure: Returns FALSE if the frame is invalid.
+UWU_Bool direct_message_parse(const char *data, size_t length,
+                              UWU_String fields[3], uint64_t *id,
+                              uint64_t *timestamp_ms) {
+  size_t offset = 16;
+  for (size_t i = 0; i < 3; i++) {
+    if (offset >= length || data[offset] == 0 ||
+        offset + 1 + (uint8_t)data[offset] > length) {
+      return FALSE;
+    }
+    fields[i].data = (char *)&data[offset + 1];
+    fields[i].length = (uint8_t)data[offset];
+    offset += 1 + fields[i].length;
+  }
+  if (offset != length) {
+    return FALSE;
+  }
+
+  *id = UWU_readBigEndian(data, 8);
+  *timestamp_ms = UWU_readBigEndian(&data[8], 8);
+  return TRUE;
+}
+
+// Stores a DM another server sent on the history of both users, creating it
+// if it's the first one. The follower gets a copy.
+// PLEASE lock the active_users before calling this function!
+//
+// - id: The ID the primary gave the message, 0 if it came from another node
+// of the cluster and the history assigns one.
+//
+// Success: Returns TRUE and sets `id` to the ID the message got.
+// Failure: Returns FALSE if the history couldn't be created, or it already
+// had the message of the primary.
+UWU_Bool store_direct_message(const UWU_String *const from,
+                              const UWU_String *const to,
+                              const UWU_String *const content,
+                              uint64_t timestamp_ms, uint64_t *id) {
+  UWU_String combined = direct_chat_key(from, to);
+
+  UWU_Err err = NO_ERROR;
+  UWU_ChatHistory *history = get_or_create_chat(&combined, err);
+  if (history == NULL) {
+    MG_ERROR(("Can't create the chat history for key: %.*s",
+              (int)combined.length, combined.data));
+    UWU_String_freeWithMalloc(&combined);
+    return FALSE;
+  }
+  UWU_String_freeWithMalloc(&combined);
+
+  UWU_ChatEntry entry = {.content = *content,
+                         .origin_username = UWU_Username_borrow(from),
+                         .timestamp_ms = timestamp_ms};
+  if (*id == 0) {
+    *id = add_chat_message(history, &entry);
+  } else if (!add_chat_message_at(history, &entry, *id)) {
+    return FALSE;
+  }
 
-                    if (old_user->status == new_user.status) {
-                      MG_INFO(("Can't change status to the same status!"));
-                    } else {
+  send_direct_message_to_follower(*id, from, to, content, timestamp_ms);
+  return TRUE;
+}
 
-                      UWU_Bool transition_matrix[4][4] = {};
-                      transition_matrix[DISCONNETED][DISCONNETED] = TRUE;
+// Handles a PEER_DIRECT_MESSAGE from `node`, without its type.
+void peer_direct_message(size_t node, const char *data, size_t length) {
+  // from, to and msg.
+  UWU_String fields[3] = {};
+  uint64_t origin_id = 0;
+  uint64_t timestamp_ms = 0;
+  if (!direct_message_parse(data, length, fields, &origin_id,
+                            &timestamp_ms)) {
+    MG_ERROR(("Ignoring an invalid DM from node %lu!", (unsigned long)node));
+    return;
+  }
 
-                      transition_matrix[ACTIVE][BUSY] = TRUE;
-                      transition_matrix[BUSY][ACTIVE] = TRUE;
+  UWU_String *from = &fields[0];
+  UWU_String *to = &fields[1];
+  UWU_String *content = &fields[2];
+  if (UWU_Username_node(from, UWU_STATE->nodes) != node) {
+    MG_ERROR(("Node %lu doesn't own `%.*s`!", (unsigned long)node,
+              (int)from->length, from->data));
+    return;
+  }
 
-                      transition_matrix[INACTIVE][ACTIVE] = TRUE;
-                      transition_matrix[INACTIVE][BUSY] = TRUE;
+  UWU_PanicIf(pthread_mutex_lock(&UWU_STATE->active_users.mx) != 0,
+              "Fatal: Can't lock the active_users mutex!");
+  UWU_User *sender = UWU_UserList_findByName(&UWU_STATE->active_users, from);
+  UWU_User *recipient = UWU_UserList_findByName(&UWU_STATE->active_users, to);
+  UWU_Errors mailbox_error = USER_NOT_FOUND;
+  // The ID of `node` is only valid there, this one assigns its own.
+  uint64_t id = 0;
+  if (recipient == NULL &&
+      UWU_Username_node(to, UWU_STATE->nodes) == s_node_id &&
+      mailbox_push(to, from, content, timestamp_ms, &mailbox_error)) {
+    // It left, the DM waits on its mailbox.
+  } else if (sender == NULL || sender->conn != NULL || recipient == NULL ||
+             recipient->conn == NULL) {
+    // One of them left while the message was on its way.
+    MG_INFO(("Dropping a DM from `%.*s` to `%.*s`", (int)from->length,
+             from->data, (int)to->length, to->data));
+  } else if (store_direct_message(from, to, content, timestamp_ms, &id)) {
+    if (recipient->status == INACTIVE) {
+      recipient->status = ACTIVE;
+      notify_idle_detector();
+      char status_buff[3 + 255];
+      UWU_String status_msg = changed_status_builder(status_buff, recipient);
+      broadcast_presence(&status_msg);
+    }
 
-                      UWU_Bool valid_transition =
-                          transition_matrix[old_user->status][new_user.status];
-                      if (!valid_transition) {
-                        MG_ERROR(("Invalid transition of user state!"));
-                        char err_data[] = {(char)ERROR, (char)INVALID_STATUS};
+    char buff[3 + 255 + 255 + UWU_MESSAGE_STAMP_SIZE];
+    size_t response_length = 0;
+    buff[response_length++] = GOT_MESSAGE;
+    buff[response_length++] = from->length;
+    memcpy(&buff[response_length], from->data, from->length);
+    response_length += from->length;
+    buff[response_length++] = content->length;
+    memcpy(&buff[response_length], content->data, content->length);
+    response_length += content->length;
+    response_length +=
+        write_message_stamp(&buff[response_length], id, timestamp_ms);
+
+    UWU_String response = {.data = buff, .length = response_length};
+    send_msg(recipient->conn, &response);
+  }
+  UWU_PanicIf(pthread_mutex_unlock(&UWU_STATE->active_users.mx) != 0,
+              "Fatal: Can't unlock the active_users mutex!");
+}
 
-                        UWU_String err_response = {.data = err_data,
-                                                   .length = 2};
-                        send_msg(c, &err_response);
+// Checks a secret given on the command line fits on a header.
+UWU_Bool link_secret_is_valid(const char *secret) {
+  if (secret == NULL || *secret == '\0') {
+    return FALSE;
+  }
+  for (; *secret != '\0'; secret++) {
+    if (*secret <= ' ' || *secret > '~') {
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
 
-                      } else {
-                        MG_INFO(("Changing status %.*s to %d",
-                                 (int)new_user.username.length,
-                                 new_user.username.data, new_user.status));
+// Checks the `LINK_SECRET_HEADER` of a link against `secret`. It takes the
+// same time wherever they differ, so it can't be guessed byte by byte.
+UWU_Bool link_secret_matches(struct mg_http_message *hm, const char *secret) {
+  struct mg_str *header = mg_http_get_header(hm, LINK_SECRET_HEADER);
+  size_t length = strlen(secret);
+  if (header == NULL || header->len != length) {
+    return FALSE;
+  }
 
-                        old_user->status = new_user.status;
-                        update_last_action(old_user);
+  uint8_t difference = 0;
+  for (size_t i = 0; i < length; i++) {
+    difference |= (uint8_t)header->buf[i] ^ (uint8_t)secret[i];
+  }
+  return difference == 0;
+}
 
-                        UWU_String response = create_changed_status_message(
-                            &resp_arena, &new_user);
-                        broadcast_msg(&response);
-                      }
-                    }
-                  }
-                  UWU_PanicIf(
-                      pthread_mutex_unlock(&UWU_STATE->active_users.mx) != 0,
-                      "Fatal: Can't lock the active_users mutex!");
-                }
-              }
-            } break;
-            case SEND_MESSAGE: {
-              char username_length = msg_data[1];
-              char message_length = msg_data[2 + username_length];
+// Links this node to the nodes before it on `s_peers`, the nodes after it
+// link to this one. Retried every `PEER_RETRY_MS` while a link is down.
+void peer_dial_timer(void *arg) {
+  (void)arg;
+  for (size_t i = 0; i < s_node_id && !UWU_STATE->is_shutting_off; i++) {
+    UWU_Peer *peer = &UWU_STATE->peers[i];
+    if (peer->conn != NULL) {
+      continue;
+    }
 
-              // Message is empty
-              if (message_length <= 0) {
-                char error[2];
-                error[0] = ERROR;
-                error[1] = EMPTY_MESSAGE;
+    char url[512];
+    snprintf(url, sizeof(url), "%.*s/peer?node=%zu", (int)peer->url.length,
+             peer->url.data, s_node_id);
+    peer->conn = mg_ws_connect(&UWU_STATE->manager, url, peer_fn, peer,
+                               LINK_SECRET_HEADER ": %s\r\n", s_peer_secret);
+  }
+}
 
-                UWU_String response = {.data = error, .length = 2};
-                send_msg(c, &response);
-              } else if (username_length <= 0) {
+// Upgrades the link a node after this one opened, check `peer_dial_timer`.
+void peer_accept(struct mg_connection *c, struct mg_http_message *hm) {
+  if (UWU_STATE->nodes <= 1) {
+    mg_http_reply(c, 404, "", "NOT FOUND");
+    return;
+  }
+  if (!link_secret_matches(hm, s_peer_secret)) {
+    MG_ERROR(("Rejecting the link of a node without the secret!"));
+    mg_http_reply(c, 403, "", "INVALID SECRET");
+    return;
+  }
 
-                char error[2];
-                error[0] = ERROR;
-                error[1] = USER_NOT_FOUND;
+  char node_var[16];
+  size_t node = UWU_STATE->nodes;
+  if (mg_http_get_var(&hm->query, "node", node_var, sizeof(node_var)) > 0) {
+    node = strtoul(node_var, NULL, 10);
+  }
 
-                UWU_String response = {.data = error, .length = 2};
-                send_msg(c, &response);
-              } else {
+  if (node <= s_node_id || node >= UWU_STATE->nodes) {
+    MG_ERROR(("Rejecting the link of an unknown node!"));
+    mg_http_reply(c, 400, "", "INVALID NODE");
+    return;
+  }
 
-                UWU_String msg_username = {.data = &msg_data[2],
-                                           .length = username_length};
+  UWU_Peer *peer = &UWU_STATE->peers[node];
+  if (peer->conn != NULL) {
+    MG_ERROR(("Node %lu is already linked!", (unsigned long)node));
+    mg_http_reply(c, 409, "", "NODE ALREADY LINKED");
+    return;
+  }
 
-                UWU_String content = {.data = &msg_data[3 + username_length],
-                                      .length = message_length};
+  peer->conn = c;
+  c->fn = peer_fn;
+  c->fn_data = peer;
+  mg_ws_upgrade(c, hm, NULL);
+}
 
-                if (UWU_String_equal(&msg_username, &GROUP_CHAT_CHANNEL)) {
-                  MG_INFO(("Sending message to general chat..."));
-                  UWU_ChatEntry entry = {.content = content,
-                                         .origin_username = GROUP_CHAT_CHANNEL};
-                  UWU_PanicIf(pthread_mutex_lock(&UWU_STATE->group_chat.mx) !=
-                                  0,
-                              "Fatal: Can't lock the group_chat mutex!");
-                  UWU_ChatHistory_addMessage(&UWU_STATE->group_chat, &entry);
-                  UWU_PanicIf(pthread_mutex_unlock(&UWU_STATE->group_chat.mx) !=
-                                  0,
-                              "Fatal: Can't unlock the group_chat mutex!");
+// Handles both ends of the links between nodes.
+static void peer_fn(struct mg_connection *c, int ev, void *ev_data) {
+  UWU_Peer *peer = c->fn_data;
+  size_t node = peer - UWU_STATE->peers;
 
-                  size_t data_length = 3 + 1 + message_length;
-                  char *data = UWU_Arena_alloc(&resp_arena, data_length, err);
-                  if (err != NO_ERROR) {
-                    UWU_PANIC(
-                        "Fatal: Failed to allocate memory for GOT_MESSAGE "
-                        "response!");
-                  } else {
-                    data[0] = GOT_MESSAGE;
-                    data[1] = 1;
-                    data[2] = '~';
-                    data[3] = message_length;
-                    for (size_t i = 0; i < message_length; i++) {
-                      data[4 + i] = UWU_String_charAt(&content, i);
-                    }
+  if (ev == MG_EV_WS_OPEN) {
+    MG_INFO(("Linked to node %lu", (unsigned long)node));
+    peer->outbox.conn = c;
 
-                    UWU_String response = {.data = data, .length = data_length};
+    // The node forgot the users of this one when the link went down.
+    UWU_PanicIf(pthread_mutex_lock(&UWU_STATE->active_users.mx) != 0,
+                "Fatal: Can't lock the active_users mutex!");
+    for (struct UWU_UserListNode *current = UWU_STATE->active_users.start;
+         current != NULL; current = current->next) {
+      if (current->is_sentinel || current->data.conn == NULL) {
+        continue;
+      }
 
-                    UWU_PanicIf(
-                        pthread_mutex_lock(&UWU_STATE->active_users.mx) != 0,
-                        "Fatal: Can't lock the active_users mutex!");
-                    broadcast_msg(&response);
+      char buff[3 + 255];
+      UWU_String msg = changed_status_builder(buff, &current->data);
+      msg.data[0] = REGISTERED_USER;
+      char frame_buff[1 + sizeof(buff)];
+      UWU_String frame = peer_presence_builder(frame_buff, &msg);
+      send_to_peer(peer, &frame);
+    }
+    UWU_PanicIf(pthread_mutex_unlock(&UWU_STATE->active_users.mx) != 0,
+                "Fatal: Can't unlock the active_users mutex!");
+  } else if (ev == MG_EV_WS_MSG) {
+    struct mg_ws_message *wm = (struct mg_ws_message *)ev_data;
+    if (wm->data.len == 0) {
+      return;
+    }
 
-                    for (struct UWU_UserListNode *current =
-                             UWU_STATE->active_users.start;
-                         current != NULL; current = current->next) {
+    const char *data = &wm->data.buf[1];
+    size_t length = wm->data.len - 1;
+    switch (wm->data.buf[0]) {
+    case PEER_PRESENCE:
+      peer_presence(node, data, length);
+      break;
+    case PEER_GROUP_MESSAGE: {
+      uint64_t timestamp_ms = 0;
+      if (!peer_group_message(data, length, FALSE, &timestamp_ms)) {
+        MG_ERROR(("Ignoring an invalid group message from node %lu!",
+                  (unsigned long)node));
+      }
+      break;
+    }
+    case PEER_DIRECT_MESSAGE:
+      peer_direct_message(node, data, length);
+      break;
+    default:
+      MG_ERROR(("Unrecognized message from node %lu!", (unsigned long)node));
+    }
+  } else if (ev == MG_EV_CLOSE) {
+    if (peer->outbox.conn != NULL && !UWU_STATE->is_shutting_off) {
+      MG_ERROR(("Lost the link to node %lu!", (unsigned long)node));
+    }
+    peer->conn = NULL;
+    peer->outbox.conn = NULL;
 
-                      if (current->is_sentinel) {
-                        continue;
-                      }
-                      UWU_String current_username = current->data.username;
+    // Its users can't be reached anymore, they're synced again once the
+    // link comes back.
+    UWU_PanicIf(pthread_mutex_lock(&UWU_STATE->active_users.mx) != 0,
+                "Fatal: Can't lock the active_users mutex!");
+    for (struct UWU_UserListNode *current = UWU_STATE->active_users.start;
+         current != NULL;) {
+      struct UWU_UserListNode *next = current->next;
+      if (!current->is_sentinel && current->data.conn == NULL) {
+        UWU_String username = UWU_Username_view(&current->data.username);
+        if (UWU_Username_node(&username, UWU_STATE->nodes) == node) {
+          forget_remote_user(&current->data);
+        }
+      }
+      current = next;
+    }
+    UWU_PanicIf(pthread_mutex_unlock(&UWU_STATE->active_users.mx) != 0,
+                "Fatal: Can't unlock the active_users mutex!");
+  }
+}
 
-                      if (UWU_String_equal(&current_username, &conn_username)) {
-                        update_last_action(&current->data);
+/* *****************************************************************************
+Replication
+***************************************************************************** */
 
-                        if (current->data.status == INACTIVE) {
-                          current->data.status = ACTIVE;
-                          UWU_String response = create_changed_status_message(
-                              &resp_arena, &current->data);
-                          broadcast_msg(&response);
-                        }
-                      }
-                    }
+static void fn(struct mg_connection *c, int ev, void *ev_data);
+
+// Sends the DM history `value` to the follower, check `follower_sync`.
+void follower_sync_chat(void *context, UWU_String key, void *value) {
+  UWU_ChatHistory *history = value;
+
+  UWU_PanicIf(pthread_mutex_lock(&history->mx) != 0,
+              "Fatal: Can't lock the chat history mutex for `%.*s`!",
+              (int)key.length, key.data);
+  UWU_ChatHistory_Iterator iter = UWU_ChatHistory_iter(history);
+  for (size_t i = iter.start; i < iter.end; i++) {
+    UWU_ChatEntry entry = UWU_ChatHistory_get(history, i % history->capacity);
+    UWU_String from = UWU_Username_view(&entry.origin_username);
+    UWU_String to = chat_partner(&key, &from);
+
+    char buff[1 + 8 + 8 + 3 * (1 + 255)];
+    UWU_String frame = direct_message_builder(
+        buff, entry.id, &from, &to, &entry.content, entry.timestamp_ms);
+    send_to_peer(&UWU_REPLICATION.follower, &frame);
+  }
+  UWU_PanicIf(pthread_mutex_unlock(&history->mx) != 0,
+              "Fatal: Can't unlock the chat history mutex for `%.*s`!",
+              (int)key.length, key.data);
+}
 
-                    UWU_PanicIf(
-                        pthread_mutex_unlock(&UWU_STATE->active_users.mx) != 0,
-                        "Fatal: Can't unlock the active_users mutex!");
-                  }
-                } else {
+typedef struct {
+  UWU_ChatFloor *items;
+  size_t count;
+  size_t capacity;
+} UWU_ChatFloorList;
+
+// Copies a floor into the `UWU_ChatFloorList` given as context.
+// PLEASE lock the chat floors before calling this function!
+void collect_chat_floor(void *context, UWU_String key, void *value) {
+  UWU_ChatFloorList *floors = context;
+  if (floors->count == floors->capacity) {
+    size_t capacity = floors->capacity == 0 ? 16 : 2 * floors->capacity;
+    UWU_ChatFloor *items =
+        realloc(floors->items, sizeof(UWU_ChatFloor) * capacity);
+    if (items == NULL) {
+      MG_ERROR(("Can't send the floor of `%.*s` to the follower!",
+                (int)key.length, key.data));
+      return;
+    }
+    floors->items = items;
+    floors->capacity = capacity;
+  }
 
-                  UWU_PanicIf(pthread_mutex_lock(&UWU_STATE->active_users.mx) !=
-                                  0,
-                              "Fatal: Can't lock the active_users mutex!");
-                  UWU_Bool msg_username_exists =
-                      UWU_UserList_findByName(&UWU_STATE->active_users,
-                                              &msg_username) != NULL;
-                  if (!msg_username_exists) {
-                    char error[2];
-                    error[0] = ERROR;
-                    error[1] = USER_NOT_FOUND;
+  UWU_Err err = NO_ERROR;
+  UWU_ChatFloor floor = {.key = UWU_String_copy(&key, err),
+                         .next_idx = ((UWU_ChatFloor *)value)->next_idx};
+  if (floor.key.data != NULL) {
+    floors->items[floors->count++] = floor;
+  }
+}
 
-                    UWU_String response = {.data = error, .length = 2};
-                    send_msg(c, &response);
-                  } else {
+// Sends the floors of the DM histories to the follower. They're copied first,
+// nothing can be locked after the floors.
+void follower_sync_floors() {
+  UWU_ChatFloorList floors = {};
+  UWU_PanicIf(pthread_mutex_lock(&UWU_CHAT_FLOORS.mx) != 0,
+              "Fatal: Can't lock the chat floors mutex!");
+  UWU_FlatMap_forEach(&UWU_CHAT_FLOORS.map, collect_chat_floor, &floors);
+  UWU_PanicIf(pthread_mutex_unlock(&UWU_CHAT_FLOORS.mx) != 0,
+              "Fatal: Can't unlock the chat floors mutex!");
+
+  for (size_t i = 0; i < floors.count; i++) {
+    UWU_ChatFloor *floor = &floors.items[i];
+    char *data = malloc(9 + floor->key.length);
+    if (data != NULL) {
+      data[0] = PEER_CHAT_FLOOR;
+      UWU_writeBigEndian(&data[1], floor->next_idx, 8);
+      memcpy(&data[9], floor->key.data, floor->key.length);
+      UWU_String frame = {.data = data, .length = 9 + floor->key.length};
+      send_to_peer(&UWU_REPLICATION.follower, &frame);
+      free(data);
+    }
+    UWU_String_freeWithMalloc(&floor->key);
+  }
+  free(floors.items);
+}
 
-                    UWU_String *first = &conn_username;
-                    UWU_String *other = &msg_username;
+// Sends the evicted history `value` to the follower, check `follower_sync`.
+// PLEASE lock the memory budget before calling this function!
+void follower_sync_evicted(void *context, UWU_String key, void *value) {
+  UWU_EvictedChat *chat = value;
+  char *file = NULL;
+  UWU_String compressed = {.data = chat->data, .length = chat->length};
+  if (chat->data == NULL) {
+    // Nobody deletes the file while the active_users are locked.
+    char path[1024];
+    hex_file_path(path, sizeof(path), s_evict_dir, &key);
+    file = read_whole_file(path, &compressed.length);
+    compressed.data = file;
+  }
 
-                    if (!UWU_String_firstGoesFirst(first, other)) {
-                      first = &msg_username;
-                      other = &conn_username;
-                    }
+  char *data = NULL;
+  if (compressed.data != NULL) {
+    data = malloc(11 + key.length + compressed.length);
+  }
+  if (data == NULL) {
+    MG_ERROR(("Can't send the evicted history `%.*s` to the follower!",
+              (int)key.length, key.data));
+    free(file);
+    return;
+  }
 
-                    UWU_String tmp =
-                        UWU_String_combineWithOther(first, &SEPARATOR);
-                    UWU_String combined =
-                        UWU_String_combineWithOther(&tmp, other);
-                    UWU_String_freeWithMalloc(&tmp);
+  data[0] = PEER_EVICTED_CHAT;
+  UWU_writeBigEndian(&data[1], chat->next_idx, 8);
+  UWU_writeBigEndian(&data[9], key.length, 2);
+  memcpy(&data[11], key.data, key.length);
+  memcpy(&data[11 + key.length], compressed.data, compressed.length);
+  UWU_String frame = {.data = data,
+                      .length = 11 + key.length + compressed.length};
+  send_to_peer(&UWU_REPLICATION.follower, &frame);
+  free(data);
+  free(file);
+}
 
-                    UWU_PanicIf(pthread_mutex_lock(&UWU_STATE->chats_mx) != 0,
-                                "Fatal: Can't lock the chats mutex!");
-                    UWU_ChatHistory *history = (UWU_ChatHistory *)hashmap_get(
-                        &UWU_STATE->chats, combined.data, combined.length);
-                    UWU_PanicIf(pthread_mutex_unlock(&UWU_STATE->chats_mx) != 0,
-                                "Fatal: Can't unlock the chats mutex!");
+// Sends the whole state to the follower that just linked, then every change.
+// Messages keep their IDs, so the IDs clients saw stay valid on the follower.
+//
+// The users and DMs are sent holding `active_users.mx`, which every change to
+// them holds too, so the follower gets each of them once. Group chat appends
+// don't lock, so the ones that race with the sync may reach it twice, the
+// follower keeps the first.
+//
+// Older messages live on the history segments, the tiers thread sends the
+// ones written so far after the rest, check `send_segments_to_follower`. A
+// group chat segment whose writer is still sealing it when the sync starts is
+// missed, and the follower doesn't get the segments it's sent if the primary
+// goes down before they're through.
+void follower_sync() {
+  uint64_t start_ms = mg_millis();
+
+  UWU_PanicIf(pthread_mutex_lock(&UWU_STATE->active_users.mx) != 0,
+              "Fatal: Can't lock the active_users mutex!");
+  // Changes made from now on are sent to the follower too.
+  __atomic_store_n(&UWU_REPLICATION.follower_linked, TRUE, __ATOMIC_SEQ_CST);
+
+  size_t users = 0;
+  for (struct UWU_UserListNode *current = UWU_STATE->active_users.start;
+       current != NULL; current = current->next) {
+    if (current->is_sentinel) {
+      continue;
+    }
 
-                    if (history == NULL) {
-                      UWU_PANIC("Fatal: No chat history found for key: %.*s",
-                                combined.length, combined.data);
-                    } else {
+    char buff[3 + 255];
+    UWU_String msg = changed_status_builder(buff, &current->data);
+    msg.data[0] = REGISTERED_USER;
+    char frame_buff[1 + sizeof(buff)];
+    UWU_String frame = peer_presence_builder(frame_buff, &msg);
+    send_to_peer(&UWU_REPLICATION.follower, &frame);
+    users++;
+  }
 
-                      UWU_ChatEntry entry = {.content = content,
-                                             .origin_username = conn_username};
-
-                      UWU_PanicIf(pthread_mutex_lock(&history->mx) != 0,
-                                  "Fatal: Can't lock the chat history mutex "
-                                  "for `%.*s`!",
-                                  (int)history->channel_name.length,
-                                  history->channel_name.data);
-                      UWU_ChatHistory_addMessage(history, &entry);
-                      UWU_PanicIf(pthread_mutex_unlock(&history->mx) != 0,
-                                  "Fatal: Can't unlock the chat history mutex "
-                                  "for `%.*s`!",
-                                  (int)history->channel_name.length,
-                                  history->channel_name.data);
-
-                      size_t data_length =
-                          3 + conn_username.length + message_length;
-                      char *data =
-                          UWU_Arena_alloc(&resp_arena, data_length, err);
-                      if (err != NO_ERROR) {
-                        UWU_PANIC(
-                            "Fatal: Failed to allocate memory for GOT_MESSAGE "
-                            "response!");
-                      } else {
+  follower_sync_floors();
 
-                        data[0] = GOT_MESSAGE;
-                        data[1] = conn_username.length;
+  UWU_ChannelHistory *group_chat = &UWU_STATE->group_chat;
+  UWU_ChannelHistory_Range range = UWU_ChannelHistory_range(group_chat);
+  for (uint64_t pos = range.start; pos < range.end; pos++) {
+    char message[2 + 255 + 255];
+    uint64_t timestamp_ms = 0;
+    if (UWU_ChannelHistory_copyMessage(group_chat, pos, message,
+                                       sizeof(message), &timestamp_ms) == 0) {
+      continue;
+    }
 
-                        for (size_t i = 0; i < conn_username.length; i++) {
-                          data[2 + i] = UWU_String_charAt(&conn_username, i);
-                        }
+    // Skip the username, the group chat only stores its own name.
+    size_t content_offset = 1 + (uint8_t)message[0];
+    UWU_String content = {.data = &message[content_offset + 1],
+                          .length = (uint8_t)message[content_offset]};
+    char buff[1 + 8 + 8 + 1 + 255];
+    UWU_String frame =
+        group_message_builder(buff, pos + 1, &content, timestamp_ms);
+    send_to_peer(&UWU_REPLICATION.follower, &frame);
+  }
 
-                        data[2 + conn_username.length] = message_length;
-                        for (size_t i = 0; i < message_length; i++) {
-                          data[2 + conn_username.length + 1 + i] =
-                              UWU_String_charAt(&content, i);
-                        }
+  UWU_StripedMap_forEach(&UWU_STATE->chats, follower_sync_chat, NULL);
+  UWU_PanicIf(pthread_mutex_lock(&UWU_MEMORY.mx) != 0,
+              "Fatal: Can't lock the memory budget mutex!");
+  UWU_FlatMap_forEach(&UWU_MEMORY.evicted, follower_sync_evicted, NULL);
+  UWU_PanicIf(pthread_mutex_unlock(&UWU_MEMORY.mx) != 0,
+              "Fatal: Can't unlock the memory budget mutex!");
+
+  // Queued while the DMs can't change, so it finds every segment they sealed.
+  UWU_TierJob *job = calloc(1, sizeof(UWU_TierJob));
+  if (job != NULL) {
+    job->type = TIER_REPLICATE;
+    tier_queue(job);
+  } else {
+    MG_ERROR(("Can't send the history segments to the follower!"));
+  }
 
-                        for (struct UWU_UserListNode *current =
-                                 UWU_STATE->active_users.start;
-                             current != NULL; current = current->next) {
+  char synced = PEER_SYNCED;
+  UWU_String frame = {.data = &synced, .length = 1};
+  send_to_peer(&UWU_REPLICATION.follower, &frame);
+  UWU_PanicIf(pthread_mutex_unlock(&UWU_STATE->active_users.mx) != 0,
+              "Fatal: Can't unlock the active_users mutex!");
 
-                          if (current->is_sentinel) {
-                            continue;
-                          }
+  MG_INFO(("Synced the follower with %lu users in %llu ms",
+           (unsigned long)users,
+           (unsigned long long)(mg_millis() - start_ms)));
+}
 
-                          UWU_String current_username = current->data.username;
+// Handles the link of the follower on the primary.
+static void follower_fn(struct mg_connection *c, int ev, void *ev_data) {
+  if (ev == MG_EV_WS_OPEN) {
+    MG_INFO(("The follower linked"));
+    UWU_REPLICATION.follower.outbox.conn = c;
+    follower_sync();
+  } else if (ev == MG_EV_CLOSE) {
+    if (has_follower() && !UWU_STATE->is_shutting_off) {
+      MG_ERROR(("Lost the follower!"));
+    }
+    __atomic_store_n(&UWU_REPLICATION.follower_linked, FALSE,
+                     __ATOMIC_RELEASE);
+    UWU_REPLICATION.follower.conn = NULL;
+    UWU_REPLICATION.follower.outbox.conn = NULL;
+  }
+}
 
-                          if (UWU_String_equal(&current_username,
-                                               &conn_username)) {
-                            update_last_action(&current->data);
-                          }
+// Upgrades the link a follower opened, check `primary_dial_timer`.
+void follower_accept(struct mg_connection *c, struct mg_http_message *hm) {
+  if (s_replica_secret == NULL) {
+    mg_http_reply(c, 404, "", "NOT FOUND");
+    return;
+  }
+  if (!link_secret_matches(hm, s_replica_secret)) {
+    MG_ERROR(("Rejecting a follower without the secret!"));
+    mg_http_reply(c, 403, "", "INVALID SECRET");
+    return;
+  }
+  if (UWU_REPLICATION.follower.conn != NULL) {
+    MG_ERROR(("Rejecting a second follower!"));
+    mg_http_reply(c, 409, "", "ALREADY FOLLOWED");
+    return;
+  }
 
-                          if (UWU_String_equal(&current_username,
-                                               &conn_username) ||
-                              UWU_String_equal(&current_username,
-                                               &msg_username)) {
+  UWU_REPLICATION.follower.conn = c;
+  c->fn = follower_fn;
+  c->fn_data = NULL;
+  mg_ws_upgrade(c, hm, NULL);
+}
 
-                            if (current->data.status == INACTIVE) {
-                              current->data.status = ACTIVE;
-                              UWU_String response =
-                                  create_changed_status_message(&resp_arena,
-                                                                &current->data);
-                              broadcast_msg(&response);
-                            }
+// Counts a message the primary replicated and how long it took to get here.
+void replication_lag(uint64_t timestamp_ms) {
+  // Messages sent while syncing may be much older.
+  if (!UWU_REPLICATION.synced) {
+    return;
+  }
 
-                            UWU_String response = {.data = data,
-                                                   .length = data_length};
-                            send_msg(current->data.conn, &response);
-                          }
-                        }
-                      }
-                    }
-                  }
-                  UWU_PanicIf(
-                      pthread_mutex_unlock(&UWU_STATE->active_users.mx) != 0,
-                      "Fatal: Can't unlock the active_users mutex!");
-                }
-              }
-            } break;
+  uint64_t now_ms = UWU_nowMs();
+  uint64_t lag_ms = now_ms > timestamp_ms ? now_ms - timestamp_ms : 0;
+  UWU_ServerStats *stats = &UWU_STATE->stats;
+  __atomic_fetch_add(&stats->replicated_messages, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&stats->replication_lag_ms_total, lag_ms,
+                     __ATOMIC_RELAXED);
+  stats_update_max(&stats->replication_lag_ms_max, lag_ms);
+}
 
-            case GET_MESSAGES: {
-              char username_length = msg_data[1];
-              if (username_length <= 0) {
-                MG_ERROR(("The username is too short!\n"));
-              } else {
+// Stores a DM the primary replicated, without its type.
+void replica_direct_message(const char *data, size_t length) {
+  UWU_String fields[3] = {};
+  uint64_t id = 0;
+  uint64_t timestamp_ms = 0;
+  if (!direct_message_parse(data, length, fields, &id, &timestamp_ms) ||
+      id == 0) {
+    MG_ERROR(("Ignoring an invalid DM from the primary!"));
+    return;
+  }
 
-                UWU_String req_username = {
-                    .data = &msg_data[2],
-                    .length = username_length,
-                };
+  // Histories are only kept while both users are there.
+  UWU_PanicIf(pthread_mutex_lock(&UWU_STATE->active_users.mx) != 0,
+              "Fatal: Can't lock the active_users mutex!");
+  if (UWU_UserList_findByName(&UWU_STATE->active_users, &fields[0]) != NULL &&
+      UWU_UserList_findByName(&UWU_STATE->active_users, &fields[1]) != NULL) {
+    store_direct_message(&fields[0], &fields[1], &fields[2], timestamp_ms,
+                         &id);
+  }
+  UWU_PanicIf(pthread_mutex_unlock(&UWU_STATE->active_users.mx) != 0,
+              "Fatal: Can't unlock the active_users mutex!");
+  replication_lag(timestamp_ms);
+}
 
-                if (UWU_String_equal(&req_username, &GROUP_CHAT_CHANNEL)) {
-                  size_t max_msg_size = 1 + 1 + 255 * (1 + 255 + 1 + 255);
-                  char *data = UWU_Arena_alloc(&resp_arena, max_msg_size, err);
+// Raises the floor of a DM history with the one of the primary, without its
+// type.
+void replica_chat_floor(const char *data, size_t length) {
+  if (length <= 8) {
+    MG_ERROR(("Ignoring an invalid floor from the primary!"));
+    return;
+  }
+  UWU_String key = {.data = (char *)&data[8], .length = length - 8};
+  chat_floor_raise(&key, UWU_readBigEndian(data, 8));
+}
 
-                  if (err != NO_ERROR) {
-                    UWU_PANIC(
-                        "Fatal: Arena couldn't allocate enough memory for "
-                        "message!");
-                  } else {
-                    UWU_PanicIf(pthread_mutex_lock(&UWU_STATE->group_chat.mx) !=
-                                    0,
-                                "Fatal: Can't lock the group_chat mutex!");
-                    data[0] = GOT_MESSAGES;
-                    data[1] = UWU_STATE->group_chat.count;
-                    size_t data_length = 2;
+// Reads the key of a PEER_EVICTED_CHAT or PEER_SEGMENT, without its type, and
+// the rest of the frame.
+//
+// Success: Returns TRUE.
+// Failure: Returns FALSE if the frame is invalid.
+UWU_Bool replica_chat_parse(const char *data, size_t length, UWU_String *key,
+                            UWU_String *rest) {
+  if (length < 10) {
+    return FALSE;
+  }
+  key->data = (char *)&data[10];
+  key->length = UWU_readBigEndian(&data[8], 2);
+  if (key->length == 0 || 10 + key->length >= length) {
+    return FALSE;
+  }
+  rest->data = &key->data[key->length];
+  rest->length = length - 10 - key->length;
+  return TRUE;
+}
 
-                    UWU_ChatHistory_Iterator iter =
-                        UWU_ChatHistory_iter(&UWU_STATE->group_chat);
-                    for (size_t i = iter.start; i < iter.end; i++) {
-                      UWU_ChatEntry entry = UWU_ChatHistory_get(
-                          &UWU_STATE->group_chat,
-                          i % UWU_STATE->group_chat.capacity);
-
-                      data[data_length] = entry.origin_username.length;
-                      data_length++;
-
-                      for (size_t j = 0; j < entry.origin_username.length;
-                           j++) {
-                        data[data_length] =
-                            UWU_String_getChar(&entry.origin_username, j);
-                        data_length++;
-                      }
+// Keeps a DM history the primary evicted like this server had evicted it,
+// without its type.
+void replica_evicted_chat(const char *data, size_t length) {
+  UWU_String key = {};
+  UWU_String compressed = {};
+  if (!replica_chat_parse(data, length, &key, &compressed)) {
+    MG_ERROR(("Ignoring an invalid evicted history from the primary!"));
+    return;
+  }
 
-                      data[data_length] = entry.content.length;
-                      data_length++;
+  UWU_Err err = NO_ERROR;
+  UWU_EvictedChat *evicted = calloc(1, sizeof(UWU_EvictedChat));
+  if (evicted != NULL) {
+    evicted->key = UWU_String_copy(&key, err);
+    evicted->data = malloc(compressed.length);
+    evicted->length = compressed.length;
+    evicted->next_idx = UWU_readBigEndian(data, 8);
+  }
+  if (evicted == NULL || evicted->key.data == NULL || evicted->data == NULL) {
+    MG_ERROR(("Can't keep the evicted history `%.*s` of the primary!",
+              (int)key.length, key.data));
+    if (evicted != NULL) {
+      UWU_String_freeWithMalloc(&evicted->key);
+      free(evicted->data);
+    }
+    free(evicted);
+    return;
+  }
+  memcpy(evicted->data, compressed.data, compressed.length);
+
+  // Histories are only kept while both users are there, and the primary may
+  // have loaded it back meanwhile.
+  UWU_PanicIf(pthread_mutex_lock(&UWU_STATE->active_users.mx) != 0,
+              "Fatal: Can't lock the active_users mutex!");
+  UWU_Bool kept = FALSE;
+  if (chat_users_connected(&key) &&
+      UWU_StripedMap_get(&UWU_STATE->chats, &key) == NULL) {
+    UWU_PanicIf(pthread_mutex_lock(&UWU_MEMORY.mx) != 0,
+                "Fatal: Can't lock the memory budget mutex!");
+    kept = UWU_FlatMap_get(&UWU_MEMORY.evicted, &key) == NULL &&
+           UWU_FlatMap_put(&UWU_MEMORY.evicted, &evicted->key, evicted, err);
+    UWU_PanicIf(pthread_mutex_unlock(&UWU_MEMORY.mx) != 0,
+                "Fatal: Can't unlock the memory budget mutex!");
+  }
+  UWU_PanicIf(pthread_mutex_unlock(&UWU_STATE->active_users.mx) != 0,
+              "Fatal: Can't unlock the active_users mutex!");
 
-                      for (size_t j = 0; j < entry.content.length; j++) {
-                        data[data_length] =
-                            UWU_String_getChar(&entry.content, j);
-                        data_length++;
-                      }
-                    }
-                    UWU_PanicIf(
-                        pthread_mutex_unlock(&UWU_STATE->group_chat.mx) != 0,
-                        "Fatal: Can't unlock the group_chat mutex!");
+  if (kept) {
+    __atomic_fetch_add(&UWU_STATE->stats.evicted_histories, 1,
+                       __ATOMIC_RELAXED);
+  } else {
+    UWU_String_freeWithMalloc(&evicted->key);
+    free(evicted->data);
+    free(evicted);
+  }
+}
 
-                    UWU_String response = {.data = data, .length = data_length};
-                    send_msg(c, &response);
-                  }
-                } else {
-                  UWU_String *first = &req_username;
-                  UWU_String *other = &conn_username;
+// Writes a history segment the primary sent, without its type.
+void replica_segment(const char *data, size_t length) {
+  UWU_String key = {};
+  UWU_String file = {};
+  if (!replica_chat_parse(data, length, &key, &file)) {
+    MG_ERROR(("Ignoring an invalid history segment from the primary!"));
+    return;
+  }
 
-                  if (!UWU_String_firstGoesFirst(first, other)) {
-                    first = &conn_username;
-                    other = &req_username;
-                  }
+  UWU_Err err = NO_ERROR;
+  UWU_String records = UWU_Segment_records(&file, HISTORY_SEGMENT_MESSAGES, err);
+  size_t count = 0;
+  UWU_SegmentRecord record = {};
+  for (size_t offset = 0; UWU_SegmentRecord_next(&records, &offset, &record);) {
+    count++;
+  }
+  char *copy = NULL;
+  if (count > 0) {
+    copy = malloc(records.length);
+  }
+  if (copy == NULL) {
+    MG_ERROR(("Can't keep the history segment of `%.*s` of the primary!",
+              (int)key.length, key.data));
+    return;
+  }
+  memcpy(copy, records.data, records.length);
+
+  // The segments of a DM history are deleted once one of its users leaves,
+  // they may have left since the primary read it.
+  UWU_PanicIf(pthread_mutex_lock(&UWU_STATE->active_users.mx) != 0,
+              "Fatal: Can't lock the active_users mutex!");
+  if (UWU_String_equal(&key, &GROUP_CHAT_CHANNEL) ||
+      chat_users_connected(&key)) {
+    seal_segment(&key, UWU_readBigEndian(data, 8), copy, records.length,
+                 count);
+  } else {
+    free(copy);
+  }
+  UWU_PanicIf(pthread_mutex_unlock(&UWU_STATE->active_users.mx) != 0,
+              "Fatal: Can't unlock the active_users mutex!");
+}
 
-                  UWU_String tmp =
-                      UWU_String_combineWithOther(first, &SEPARATOR);
-                  UWU_String combined =
-                      UWU_String_combineWithOther(&tmp, other);
-                  UWU_String_freeWithMalloc(&tmp);
+// Handles the link of the follower to its primary.
+static void primary_fn(struct mg_connection *c, int ev, void *ev_data) {
+  if (ev == MG_EV_WS_OPEN) {
+    MG_INFO(("Following %s", s_follow));
+    UWU_REPLICATION.linked = TRUE;
+  } else if (ev == MG_EV_WS_MSG) {
+    struct mg_ws_message *wm = (struct mg_ws_message *)ev_data;
+    if (wm->data.len == 0) {
+      return;
+    }
 
-                  UWU_PanicIf(pthread_mutex_lock(&UWU_STATE->chats_mx) != 0,
-                              "Fatal: Can't lock the chats mutex!");
-                  UWU_ChatHistory *chat = hashmap_get(
-                      &UWU_STATE->chats, combined.data, combined.length);
-                  UWU_PanicIf(pthread_mutex_unlock(&UWU_STATE->chats_mx) != 0,
-                              "Fatal: Can't unlock the chats mutex!");
+    __atomic_fetch_add(&UWU_STATE->stats.replicated_frames, 1,
+                       __ATOMIC_RELAXED);
+    const char *data = &wm->data.buf[1];
+    size_t length = wm->data.len - 1;
+    switch (wm->data.buf[0]) {
+    case PEER_PRESENCE:
+      if (!presence_is_valid(data, length)) {
+        MG_ERROR(("Ignoring an invalid presence from the primary!"));
+      } else {
+        apply_presence(data, length);
+      }
+      break;
+    case PEER_GROUP_MESSAGE: {
+      uint64_t timestamp_ms = 0;
+      if (!peer_group_message(data, length, TRUE, &timestamp_ms)) {
+        MG_ERROR(("Ignoring an invalid group message from the primary!"));
+      } else {
+        replication_lag(timestamp_ms);
+      }
+      break;
+    }
+    case PEER_DIRECT_MESSAGE:
+      replica_direct_message(data, length);
+      break;
+    case PEER_SYNCED:
+      MG_INFO(("Synced with the primary"));
+      UWU_REPLICATION.synced = TRUE;
+      break;
+    case PEER_CHAT_FLOOR:
+      replica_chat_floor(data, length);
+      break;
+    case PEER_EVICTED_CHAT:
+      replica_evicted_chat(data, length);
+      break;
+    case PEER_SEGMENT:
+      replica_segment(data, length);
+      break;
+    default:
+      MG_ERROR(("Unrecognized message from the primary!"));
+    }
+  } else if (ev == MG_EV_CLOSE) {
+    if (UWU_REPLICATION.linked) {
+      MG_ERROR(("Lost the primary!"));
+      UWU_REPLICATION.lost_at_ms = mg_millis();
+    }
+    UWU_REPLICATION.primary = NULL;
+    UWU_REPLICATION.linked = FALSE;
+    UWU_REPLICATION.synced = FALSE;
+  }
+}
 
-                  if (NULL == chat) {
-                    MG_ERROR(("Can't get chat associated with: %.*s",
-                              (int)combined.length, combined.data));
-                  } else {
-                    size_t max_msg_size = 1 + 1 + 255 * (1 + 255 + 1 + 255);
-                    char *data =
-                        UWU_Arena_alloc(&resp_arena, max_msg_size, err);
+// Links the follower to its primary, retried every `PEER_RETRY_MS` while
+// the primary isn't there.
+void primary_dial_timer(void *arg) {
+  (void)arg;
+  if (UWU_REPLICATION.primary != NULL || UWU_REPLICATION.lost_at_ms != 0 ||
+      UWU_STATE->is_shutting_off) {
+    return;
+  }
 
-                    if (err != NO_ERROR) {
-                      UWU_PANIC(
-                          "Fatal: Arena couldn't allocate enough memory for "
-                          "message!");
-                    } else {
-                      data[0] = GOT_MESSAGES;
-                      data[1] = chat->count;
-                      size_t data_length = 2;
-
-                      UWU_ChatHistory_Iterator iter =
-                          UWU_ChatHistory_iter(chat);
-                      for (size_t i = iter.start; i < iter.end; i++) {
-                        UWU_ChatEntry entry =
-                            UWU_ChatHistory_get(chat, i % chat->capacity);
-
-                        data[data_length] = entry.origin_username.length;
-                        data_length++;
-
-                        for (size_t j = 0; j < entry.origin_username.length;
-                             j++) {
-                          data[data_length] =
-                              UWU_String_getChar(&entry.origin_username, j);
-                          data_length++;
-                        }
+  char url[512];
+  snprintf(url, sizeof(url), "%s/replica", s_follow);
+  UWU_REPLICATION.primary =
+      mg_ws_connect(&UWU_STATE->manager, url, primary_fn, NULL,
+                    LINK_SECRET_HEADER ": %s\r\n", s_replica_secret);
+}
 
-                        data[data_length] = entry.content.length;
-                        data_length++;
+// Forgets the users of the old primary, they have to connect again. Their
+// DM histories are kept for `FAILOVER_GRACE_MS`, check
+// `failover_grace_timer`.
+void take_over() {
+  UWU_PanicIf(pthread_mutex_lock(&UWU_STATE->active_users.mx) != 0,
+              "Fatal: Can't lock the active_users mutex!");
+  for (struct UWU_UserListNode *current = UWU_STATE->active_users.start;
+       current != NULL;) {
+    struct UWU_UserListNode *next = current->next;
+    if (!current->is_sentinel) {
+      // The removal frees the username.
+      char buff[255];
+      UWU_String view = UWU_Username_view(&current->data.username);
+      memcpy(buff, view.data, view.length);
+      UWU_String username = {.data = buff, .length = view.length};
+      UWU_UserList_removeByUsernameIfExists(&UWU_STATE->active_users,
+                                            &username);
+    }
+    current = next;
+  }
+  UWU_PanicIf(pthread_mutex_unlock(&UWU_STATE->active_users.mx) != 0,
+              "Fatal: Can't unlock the active_users mutex!");
+
+  UWU_ServerStats *stats = &UWU_STATE->stats;
+  uint64_t failover_ms = mg_millis() - UWU_REPLICATION.lost_at_ms;
+  __atomic_store_n(&stats->failover_ms, failover_ms, __ATOMIC_RELAXED);
+  uint64_t messages =
+      __atomic_load_n(&stats->replicated_messages, __ATOMIC_RELAXED);
+  uint64_t lag_ms_total =
+      __atomic_load_n(&stats->replication_lag_ms_total, __ATOMIC_RELAXED);
+  MG_INFO(("Took over %s in %llu ms, replication lag avg %llu ms, max %llu ms",
+           s_listen_on, (unsigned long long)failover_ms,
+           (unsigned long long)(messages == 0 ? 0 : lag_ms_total / messages),
+           (unsigned long long)__atomic_load_n(&stats->replication_lag_ms_max,
+                                               __ATOMIC_RELAXED)));
+}
 
-                        for (size_t j = 0; j < entry.content.length; j++) {
-                          data[data_length] =
-                              UWU_String_getChar(&entry.content, j);
-                          data_length++;
-                        }
-                      }
+// Returns TRUE for the DM histories with a user that isn't connected.
+// PLEASE lock the active_users before calling this function!
+UWU_Bool remove_if_user_missing(void *context, UWU_String key, void *value) {
+  return !chat_users_connected(&key);
+}
 
-                      UWU_String response = {.data = data,
-                                             .length = data_length};
-                      send_msg(c, &response);
-                    }
-                  }
-                }
-              }
+// Drops the DM histories of the users of the old primary that didn't come
+// back after the failover.
+void failover_grace_timer(void *arg) {
+  (void)arg;
+  UWU_PanicIf(pthread_mutex_lock(&UWU_STATE->active_users.mx) != 0,
+              "Fatal: Can't lock the active_users mutex!");
+  size_t removed = forget_chats(remove_if_user_missing, NULL);
+  UWU_PanicIf(pthread_mutex_unlock(&UWU_STATE->active_users.mx) != 0,
+              "Fatal: Can't unlock the active_users mutex!");
+  MG_INFO(("Dropped %lu DM histories of users that didn't come back",
+           (unsigned long)removed));
+}
 
-            } break;
+// Keeps a copy of the state of the primary at `s_follow` until the link to it
+// closes, then listens on `s_listen_on` in its place.
+//
+// Success: Returns the listener.
+// Failure: Returns NULL if the server is shutting down.
+struct mg_connection *follow_primary() {
+  struct mg_mgr *manager = &UWU_STATE->manager;
+  struct mg_timer *timer =
+      mg_timer_add(manager, PEER_RETRY_MS, MG_TIMER_REPEAT | MG_TIMER_RUN_NOW,
+                   primary_dial_timer, NULL);
+
+  struct mg_connection *listener = NULL;
+  while (listener == NULL && !UWU_STATE->is_shutting_off) {
+    poll_event_loop((int)PEER_RETRY_MS);
+    if (UWU_REPLICATION.lost_at_ms == 0) {
+      continue;
+    }
 
-            default:
-              MG_ERROR(("Unrecognized message!"));
-            }
-          }
-        }
+    uint64_t deadline = UWU_REPLICATION.lost_at_ms + FAILOVER_LISTEN_MS;
+    while (listener == NULL && !UWU_STATE->is_shutting_off &&
+           mg_millis() < deadline) {
+      listener = mg_http_listen(manager, s_listen_on, fn, NULL);
+      if (listener == NULL) {
+        poll_event_loop(10);
       }
     }
-
-    UWU_Arena_deinit(req_arena);
+    if (listener == NULL) {
+      // Only the link went down, the primary is still there.
+      MG_ERROR(("%s is still taken, following the primary again!",
+                s_listen_on));
+      UWU_REPLICATION.lost_at_ms = 0;
+    }
   }
 
-  UWU_Arena_deinit(resp_arena);
-  close(req_reader_fd);
-  return NULL;
+  mg_timer_free(&manager->timers, timer);
+  free(timer);
+  if (listener != NULL) {
+    take_over();
+    mg_timer_add(manager, FAILOVER_GRACE_MS, 0, failover_grace_timer, NULL);
+  }
+  return listener;
 }
 
+/* *****************************************************************************
+Connections
+***************************************************************************** */
+
 // This RESTful server implements the following endpoints:
 //   /websocket - upgrade to Websocket, and implement websocket echo server
 //   /rest - respond with JSON string {"result": 123}
@@ -898,13 +6587,34 @@ static void fn(struct mg_connection *c, int ev, void *ev_data) {
   if (ev == MG_EV_OPEN) {
     // c->is_hexdumping = 1;
   } else if (ev == MG_EV_ACCEPT && mg_url_is_ssl(s_listen_on)) {
-    struct mg_str ca = mg_file_read(&mg_fs_posix, s_ca_path);
-    struct mg_str cert = mg_file_read(&mg_fs_posix, s_cert_path);
-    struct mg_str key = mg_file_read(&mg_fs_posix, s_key_path);
-    struct mg_tls_opts opts = {.ca = ca, .cert = cert, .key = key};
-    mg_tls_init(c, &opts);
+    tls_accept(c);
+  } else if (ev == MG_EV_TLS_HS) {
+    tls_handshake_done(c);
+  } else if (ev == MG_EV_WAKEUP) {
+    if (s_coalesce_ms == 0 || UWU_STATE->is_shutting_off) {
+      flush_woken_outboxes();
+    } else if (UWU_STATE->flush_at_ms == 0) {
+      // Other threads won't send more wakeups until `poll_event_loop` flushes.
+      UWU_STATE->flush_at_ms = mg_millis() + s_coalesce_ms;
+    }
   } else if (ev == MG_EV_HTTP_MSG) {
     struct mg_http_message *hm = (struct mg_http_message *)ev_data;
+    if (mg_match(hm->uri, mg_str("/stats"), NULL)) {
+      char buff[8192];
+      UWU_String json = stats_to_json(buff, sizeof(buff));
+      mg_http_reply(c, 200, "Content-Type: application/json\r\n", "%.*s",
+                    (int)json.length, json.data);
+      return;
+    }
+    if (mg_match(hm->uri, mg_str("/peer"), NULL)) {
+      peer_accept(c, hm);
+      return;
+    }
+    if (mg_match(hm->uri, mg_str("/replica"), NULL)) {
+      follower_accept(c, hm);
+      return;
+    }
+
     // We treat all requests as attempting to connect to the server...
     if (hm->query.len < 6) {
       MG_ERROR(("Query must contain at least a `name` parameter!"));
@@ -949,148 +6659,120 @@ static void fn(struct mg_connection *c, int ev, void *ev_data) {
       return;
     }
 
-    UWU_PanicIf(pthread_mutex_lock(&UWU_STATE->active_users.mx) != 0,
-                "Fatal: Can't lock the active_users mutex!");
-    {
-      UWU_User *user =
-          UWU_UserList_findByName(&UWU_STATE->active_users, &source_username);
-      if (user != NULL) {
-        MG_ERROR(("Can't connect to an already used username!"));
-        mg_http_reply(c, 400, "", "INVALID USERNAME");
-        UWU_PanicIf(pthread_mutex_unlock(&UWU_STATE->active_users.mx) != 0,
-                    "Fatal: Can't unlock the active_users mutex!");
-        return;
-      }
+    // Every username has a single node, so it can't join twice.
+    size_t owner = UWU_Username_node(&source_username, UWU_STATE->nodes);
+    if (owner != s_node_id) {
+      UWU_String *url = &UWU_STATE->peers[owner].url;
+      MG_INFO(("Redirecting `%.*s` to node %lu", (int)source_username.length,
+               source_username.data, (unsigned long)owner));
+      char headers[1024];
+      snprintf(headers, sizeof(headers), "Location: %.*s%.*s?%.*s\r\n",
+               (int)url->length, url->data, (int)hm->uri.len, hm->uri.buf,
+               (int)hm->query.len, hm->query.buf);
+      mg_http_reply(c, 307, headers, "WRONG NODE");
+      return;
     }
 
-    UWU_User user = {.username = source_username, .status = ACTIVE, .conn = c};
-    update_last_action(&user);
+    UWU_Bool deflate = accepts_deflate(hm);
 
+    // Resources of the connection are set up before touching the active
+    // users, so the critical section only reserves the username:
+    // - DM histories are created by their first message.
+    // - The handler thread announces the new user.
     UWU_Err err = NO_ERROR;
-    struct UWU_UserListNode node = UWU_UserListNode_newWithValue(user);
-    UWU_UserList_insertEnd(&UWU_STATE->active_users, &node, err);
-    if (err != NO_ERROR) {
-      UWU_PANIC("Fatal: Failed to add username `%.*s` to the UserCollection!\n",
-                source_username.length, source_username.data);
-      UWU_PanicIf(pthread_mutex_unlock(&UWU_STATE->active_users.mx) != 0,
-                  "Fatal: Can't unlock the active_users mutex!");
+    UWU_WSConnInfo *conn_info = UWU_Pool_alloc(&UWU_CONN_INFO_POOL, err);
+    if (conn_info == NULL) {
+      MG_ERROR(("Error: Can't allocate enough memory to create WSConnInfo!"));
+      mg_http_reply(c, 500, "", "RAN OUT OF MEMORY");
+      return;
+    }
+    conn_info->deflate = deflate;
+    UWU_RateLimiter_init(&conn_info->limiter, mg_millis());
+    if (!UWU_Outbox_init(&conn_info->outbox, c)) {
+      MG_ERROR(("Error: Can't initialize the outbox of the connection!"));
+      mg_http_reply(c, 500, "", "INTERNAL SERVER ERROR");
+      UWU_Pool_free(&UWU_CONN_INFO_POOL, conn_info);
       return;
     }
-    MG_INFO(
-        ("Currently %d active users!", (int)UWU_STATE->active_users.length));
-
-    for (struct UWU_UserListNode *current = UWU_STATE->active_users.start;
-         current != NULL; current = current->next) {
-
-      if (current->is_sentinel) {
-        continue;
-      }
-
-      UWU_String current_username = current->data.username;
-      UWU_String *first = &current_username;
-      UWU_String *other = &source_username;
 
-      if (!UWU_String_firstGoesFirst(first, other)) {
-        first = &source_username;
-        other = &current_username;
-      }
+    conn_info->username = UWU_String_copyPooled(&source_username, err);
+    if (err != NO_ERROR) {
+      MG_ERROR(("Error: Can't allocate enough memory to save username!"));
+      mg_http_reply(c, 500, "", "RAN OUT OF MEMORY");
+      pthread_mutex_destroy(&conn_info->outbox.mx);
+      UWU_Pool_free(&UWU_CONN_INFO_POOL, conn_info);
+      return;
+    }
 
-      UWU_String tmp = UWU_String_combineWithOther(first, &SEPARATOR);
-      UWU_String combined = UWU_String_combineWithOther(&tmp, other);
-      UWU_String_freeWithMalloc(&tmp);
-
-      UWU_ChatHistory *ht = malloc(sizeof(UWU_ChatHistory));
-      *ht = UWU_ChatHistory_init(MAX_MESSAGES_PER_CHAT, combined, err);
-      UWU_PanicIf(pthread_mutex_lock(&UWU_STATE->chats_mx) != 0,
-                  "Fatal: Can't lock the chats mutex!");
-      if (0 !=
-          hashmap_put(&UWU_STATE->chats, combined.data, combined.length, ht)) {
-        UWU_PANIC("Fatal: Error creating shared chat for `%.*s`!\n",
-                  combined.length, combined.data);
-      } else {
-        UWU_PanicIf(pthread_mutex_unlock(&UWU_STATE->chats_mx) != 0,
-                    "Fatal: Can't unlock the chats mutex!");
-      }
+    int pipe_fd[2];
+    if (pipe(pipe_fd) < 0) {
+      MG_ERROR(("Error: Can't initialize pipe to transmit messages!"));
+      mg_http_reply(c, 500, "", "INTERNAL SERVER ERROR");
+      UWU_WSConnInfo_deinit(conn_info);
+      UWU_Pool_free(&UWU_CONN_INFO_POOL, conn_info);
+      return;
     }
+    int reader = pipe_fd[0];
+    conn_info->writer = pipe_fd[1];
 
-    c->fn_data = malloc(sizeof(UWU_WSConnInfo));
+    UWU_PanicIf(pthread_mutex_lock(&UWU_STATE->active_users.mx) != 0,
+                "Fatal: Can't lock the active_users mutex!");
     {
-      if (c->fn_data == NULL) {
-        MG_ERROR(("Error: Can't allocate enough memory to create WSConnInfo!"));
-        mg_http_reply(c, 500, "", "RAN OUT OF MEMORY");
+      UWU_User *user =
+          UWU_UserList_findByName(&UWU_STATE->active_users, &source_username);
+      if (user != NULL) {
         UWU_PanicIf(pthread_mutex_unlock(&UWU_STATE->active_users.mx) != 0,
                     "Fatal: Can't unlock the active_users mutex!");
+        MG_ERROR(("Can't connect to an already used username!"));
+        mg_http_reply(c, 400, "", "INVALID USERNAME");
+        close(reader);
+        close(conn_info->writer);
+        UWU_WSConnInfo_deinit(conn_info);
+        UWU_Pool_free(&UWU_CONN_INFO_POOL, conn_info);
         return;
       }
 
-      UWU_String copied_username = UWU_String_copy(&source_username, err);
-      if (err != NO_ERROR) {
-        MG_ERROR(("Error: Can't allocate enough memory to save username!"));
-        mg_http_reply(c, 500, "", "RAN OUT OF MEMORY");
-        UWU_PanicIf(pthread_mutex_unlock(&UWU_STATE->active_users.mx) != 0,
-                    "Fatal: Can't unlock the active_users mutex!");
-        return;
+      // Once the user is on the list other threads can send to it, so the
+      // upgrade response MUST be queued first.
+      c->fn_data = conn_info;
+      if (deflate) {
+        mg_ws_upgrade(c, hm, "Sec-WebSocket-Extensions: %s\r\n",
+                      UWU_WS_DEFLATE_EXTENSION);
+      } else {
+        mg_ws_upgrade(c, hm, NULL);
       }
 
-      int pipe_fd[2];
-      if (pipe(pipe_fd) < 0) {
-        MG_ERROR(("Error: Can't initialize pipe to transmit messages!"));
-        mg_http_reply(c, 500, "", "INTERNAL SERVER ERROR");
-        UWU_PanicIf(pthread_mutex_unlock(&UWU_STATE->active_users.mx) != 0,
-                    "Fatal: Can't unlock the active_users mutex!");
-        return;
-      }
-      int reader = pipe_fd[0];
-      int writer = pipe_fd[1];
-
-      pthread_t pid;
-      UWU_ThreadConnInfo *thread_conn_info = malloc(sizeof(UWU_ThreadConnInfo));
-      thread_conn_info->username = copied_username;
-      thread_conn_info->reader = reader;
-      thread_conn_info->c = c;
-      pthread_create(&pid, NULL, message_handler, thread_conn_info);
-
-      ((UWU_WSConnInfo *)c->fn_data)->username = copied_username;
-      ((UWU_WSConnInfo *)c->fn_data)->writer = writer;
-      ((UWU_WSConnInfo *)c->fn_data)->pid = pid;
+      UWU_User new_user = {.username = UWU_Username_borrow(&source_username),
+                           .status = ACTIVE,
+                           .conn = c};
+      update_last_action(&new_user);
+
+      struct UWU_UserListNode node = UWU_UserListNode_newWithValue(new_user);
+      UWU_UserList_insertEnd(&UWU_STATE->active_users, &node, err);
       if (err != NO_ERROR) {
-        MG_ERROR(("Error: Can't allocate enough memory to copy username!"));
-        mg_http_reply(c, 500, "", "RAN OUT OF MEMORY");
+        UWU_PANIC(
+            "Fatal: Failed to add username `%.*s` to the UserCollection!\n",
+            source_username.length, source_username.data);
         UWU_PanicIf(pthread_mutex_unlock(&UWU_STATE->active_users.mx) != 0,
                     "Fatal: Can't unlock the active_users mutex!");
         return;
       }
-    }
-
-    // Tell all other users that a new connection has arrived...
-    {
-      size_t max_length = 3 + 255;
-      char buff[max_length];
-      UWU_String msg = changed_status_builder(buff, &user);
-      msg.data[0] = REGISTERED_USER;
-
-      for (struct UWU_UserListNode *current = UWU_STATE->active_users.start;
-           current != NULL; current = current->next) {
-
-        if (current->is_sentinel ||
-            UWU_String_equal(&current->data.username, &user.username)) {
-          continue;
-        }
-
-        MG_INFO(("Sending welcome of `%.*s` to `%.*s`",
-                 (int)source_username.length, source_username.data,
-                 (int)current->data.username.length,
-                 current->data.username.data));
-
-        send_msg(current->data.conn, &msg);
-      }
+      MG_INFO(
+          ("Currently %d active users!", (int)UWU_STATE->active_users.length));
+      notify_idle_detector();
     }
     UWU_PanicIf(pthread_mutex_unlock(&UWU_STATE->active_users.mx) != 0,
                 "Fatal: Can't unlock the active_users mutex!");
 
-    // c->data[0] = 10;
-
-    mg_ws_upgrade(c, hm, NULL);
+    UWU_ThreadConnInfo *thread_conn_info =
+        UWU_Pool_alloc(&UWU_THREAD_INFO_POOL, err);
+    UWU_PanicIf(thread_conn_info == NULL,
+                "Fatal: Can't allocate the thread info of `%.*s`!",
+                (int)source_username.length, source_username.data);
+    thread_conn_info->username = conn_info->username;
+    thread_conn_info->reader = reader;
+    thread_conn_info->c = c;
+    pthread_create(&conn_info->pid, NULL, message_handler, thread_conn_info);
     // Serve REST response
     // mg_http_reply(c, 200, "", "{\"result\": %d}", 123);
   } else if (ev == MG_EV_WS_MSG) {
@@ -1103,12 +6785,60 @@ static void fn(struct mg_connection *c, int ev, void *ev_data) {
 
     UWU_WSConnInfo *conn_info = c->fn_data;
 
-    const size_t buff_len = 2 + REQ_ARENA_MAX_SIZE;
+    if (wm->flags & UWU_WS_FLAG_COMPRESSED) {
+      if (!conn_info->deflate) {
+        MG_ERROR(("Got a compressed frame without negotiating compression!"));
+        return;
+      }
+
+      UWU_Err err = NO_ERROR;
+      UWU_String compressed = {.data = msg_data, .length = msg_len};
+      UWU_String inflated =
+          UWU_Deflate_inflate(&compressed, REQ_ARENA_MAX_SIZE, err);
+      if (err != NO_ERROR || inflated.data == NULL) {
+        MG_ERROR(("Failed to inflate frame from `%.*s`!",
+                  (int)conn_info->username.length, conn_info->username.data));
+        return;
+      }
+
+      msg_data = inflated.data;
+      msg_len = inflated.length;
+    }
+
+    if (msg_len == 0 || msg_len > REQ_ARENA_MAX_SIZE) {
+      MG_ERROR(("Ignoring a frame of %lu bytes from `%.*s`!",
+                (unsigned long)msg_len, (int)conn_info->username.length,
+                conn_info->username.data));
+      return;
+    }
+
+    // Checked before the frame reaches the handler, so a flood never gets to
+    // lock the active users or touch the histories.
+    uint8_t type = msg_data[0];
+    if (!UWU_RateLimiter_allow(&conn_info->limiter, type, mg_millis())) {
+      size_t stat_idx = type < UWU_SERVER_MESSAGE_TYPES ? type : 0;
+      __atomic_fetch_add(&UWU_STATE->stats.rate_limited[stat_idx], 1,
+                         __ATOMIC_RELAXED);
+
+      if (!conn_info->limiter.notified) {
+        conn_info->limiter.notified = TRUE;
+        __atomic_fetch_add(&UWU_STATE->stats.rate_limited_replies, 1,
+                           __ATOMIC_RELAXED);
+
+        char error[] = {ERROR, RATE_LIMITED};
+        UWU_String response = {.data = error, .length = sizeof(error)};
+        send_msg(c, &response);
+      }
+      return;
+    }
+    conn_info->limiter.notified = FALSE;
+
+    const size_t buff_len = REQ_PIPE_HEADER_SIZE + REQ_ARENA_MAX_SIZE;
     char buf[buff_len];
     buf[0] = 1;
-    buf[1] = msg_len;
+    UWU_writeBigEndian(&buf[1], msg_len, 2);
 
-    memcpy(buf + 2, msg_data, msg_len);
+    memcpy(buf + REQ_PIPE_HEADER_SIZE, msg_data, msg_len);
 
     if (-1 == write(conn_info->writer, buf, buff_len)) {
       UWU_PANIC("Fatal: Failed to write msg for connection of `%.*s`",
@@ -1124,54 +6854,58 @@ static void fn(struct mg_connection *c, int ev, void *ev_data) {
       return;
     }
 
-    UWU_User user = {.username = conn_info->username, .status = DISCONNETED};
+    UWU_User user = {.username = UWU_Username_borrow(&conn_info->username),
+                     .status = DISCONNETED};
 
     MG_INFO(("Disconnecting %.*s", (int)conn_info->username.length,
              conn_info->username.data));
 
     UWU_PanicIf(pthread_mutex_lock(&UWU_STATE->active_users.mx) != 0,
                 "Fatal: Can't lock the active_users mutex!");
+    // Opened before the user leaves the list, so no DM can miss both.
+    if (!UWU_STATE->is_shutting_off) {
+      mailbox_open(&conn_info->username);
+    }
     UWU_UserList_removeByUsernameIfExists(&UWU_STATE->active_users,
                                           &conn_info->username);
     UWU_PanicIf(pthread_mutex_unlock(&UWU_STATE->active_users.mx) != 0,
                 "Fatal: Can't unlock the active_users mutex!");
 
-    UWU_PanicIf(pthread_mutex_lock(&UWU_STATE->chats_mx) != 0,
-                "Fatal: Can't lock the chats mutex!");
-    hashmap_iterate_pairs(&UWU_STATE->chats, remove_if_matches, conn_info);
-    UWU_PanicIf(pthread_mutex_unlock(&UWU_STATE->chats_mx) != 0,
-                "Fatal: Can't unlock the chats mutex!");
+    forget_chats(remove_if_matches, &conn_info->username);
 
-    if (-1 == write(conn_info->writer, EXIT_PTHREAD_MSG, 1)) {
+    // While shutting down the handler may have already stopped and closed its
+    // end of the pipe.
+    if (-1 == write(conn_info->writer, EXIT_PTHREAD_MSG, 1) &&
+        !(errno == EPIPE && UWU_STATE->is_shutting_off)) {
       UWU_PANIC("Fatal: Failed to write msg for connection of `%.*s`",
                 (int)conn_info->username.length, conn_info->username.data);
       return;
     }
     pthread_join(conn_info->pid, NULL);
     close(conn_info->writer);
+    // Nobody can queue frames for the connection anymore.
+    UWU_Outbox_unschedule(&conn_info->outbox);
 
-    int max_length = 3 + 255;
-    char buff[max_length];
-    UWU_String msg = changed_status_builder(buff, &user);
-    MG_INFO(("Broadcasting %.*s disconnection ",
-             (int)conn_info->username.length, conn_info->username.data));
-    broadcast_msg(&msg);
+    // While shutting down everyone is leaving, there's nobody to tell.
+    if (!UWU_STATE->is_shutting_off) {
+      int max_length = 3 + 255;
+      char buff[max_length];
+      UWU_String msg = changed_status_builder(buff, &user);
+      MG_INFO(("Broadcasting %.*s disconnection ",
+               (int)conn_info->username.length, conn_info->username.data));
+      broadcast_presence(&msg);
+    }
 
     UWU_WSConnInfo_deinit(conn_info);
-    free(conn_info);
+    UWU_Pool_free(&UWU_CONN_INFO_POOL, conn_info);
   }
 }
 
 void shutdown_server(int signal) {
   MG_INFO(("Shutting down server..."));
   UWU_STATE->is_shutting_off = TRUE;
-}
-
-void *shutdown_with_time(void *a) {
-  const struct timespec wait_time = {.tv_sec = 5, .tv_nsec = 0};
-  nanosleep(&wait_time, NULL);
-  // shutdown_server(0);
-  return NULL;
+  // `mg_wakeup` only calls `send`, so it's safe inside a signal handler.
+  mg_wakeup(&UWU_STATE->manager, UWU_STATE->wakeup_conn_id, "", 0);
 }
 
 int main(int argc, char *argv[]) {
@@ -1181,11 +6915,9 @@ int main(int argc, char *argv[]) {
   sigaction(SIGINT, &action, NULL);
   sigaction(SIGTERM, &action, NULL);
 
-  pthread_t timer_shutdown;
-  pthread_create(&timer_shutdown, NULL, shutdown_with_time, NULL);
-
-  pthread_t idle_detector_pid;
-  pthread_create(&idle_detector_pid, NULL, idle_detector, NULL);
+  struct sigaction reload_action = {};
+  reload_action.sa_handler = request_tls_reload;
+  sigaction(SIGHUP, &reload_action, NULL);
 
   // Parse command-line flags
   for (int i = 1; i < argc; i++) {
@@ -1197,19 +6929,110 @@ int main(int argc, char *argv[]) {
       s_cert_path = argv[++i];
     } else if (strcmp(argv[i], "-key") == 0 && argv[i + 1] != NULL) {
       s_key_path = argv[++i];
+    } else if (strcmp(argv[i], "-deflate-min") == 0 && argv[i + 1] != NULL) {
+      s_deflate_min_size = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-io-uring") == 0) {
+      s_io_uring = TRUE;
+    } else if (strcmp(argv[i], "-zerocopy-min") == 0 && argv[i + 1] != NULL) {
+      s_zerocopy_min = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-coalesce-ms") == 0 && argv[i + 1] != NULL) {
+      s_coalesce_ms = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-peers") == 0 && argv[i + 1] != NULL) {
+      s_peers = argv[++i];
+    } else if (strcmp(argv[i], "-node") == 0 && argv[i + 1] != NULL) {
+      s_node_id = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-peer-secret") == 0 && argv[i + 1] != NULL) {
+      s_peer_secret = argv[++i];
+    } else if (strcmp(argv[i], "-follow") == 0 && argv[i + 1] != NULL) {
+      s_follow = argv[++i];
+    } else if (strcmp(argv[i], "-replica-secret") == 0 &&
+               argv[i + 1] != NULL) {
+      s_replica_secret = argv[++i];
+    } else if (strcmp(argv[i], "-mailbox-budget") == 0 &&
+               argv[i + 1] != NULL) {
+      s_mailbox_budget = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-mailbox-dir") == 0 && argv[i + 1] != NULL) {
+      s_mailbox_dir = argv[++i];
+    } else if (strcmp(argv[i], "-memory-budget") == 0 &&
+               argv[i + 1] != NULL) {
+      s_memory_budget = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-evict-dir") == 0 && argv[i + 1] != NULL) {
+      s_evict_dir = argv[++i];
+    } else if (strcmp(argv[i], "-evict-drop") == 0) {
+      s_evict_drop = TRUE;
+    } else if (strcmp(argv[i], "-history-dir") == 0 && argv[i + 1] != NULL) {
+      s_history_dir = argv[++i];
+    } else if (strcmp(argv[i], "-rate-conn") == 0 && argv[i + 1] != NULL) {
+      s_conn_rate.per_second = strtoull(argv[++i], NULL, 10);
+      s_conn_rate.burst = 2 * s_conn_rate.per_second;
+    } else if (strcmp(argv[i], "-rate-send") == 0 && argv[i + 1] != NULL) {
+      s_opcode_rates[SEND_MESSAGE].per_second = strtoull(argv[++i], NULL, 10);
+      s_opcode_rates[SEND_MESSAGE].burst =
+          2 * s_opcode_rates[SEND_MESSAGE].per_second;
+    } else if (strcmp(argv[i], "-rate-get") == 0 && argv[i + 1] != NULL) {
+      s_opcode_rates[GET_MESSAGES].per_second = strtoull(argv[++i], NULL, 10);
+      s_opcode_rates[GET_MESSAGES].burst =
+          2 * s_opcode_rates[GET_MESSAGES].per_second;
+    } else if (strcmp(argv[i], "-rate-search") == 0 && argv[i + 1] != NULL) {
+      s_opcode_rates[SEARCH].per_second = strtoull(argv[++i], NULL, 10);
+      s_opcode_rates[SEARCH].burst = 2 * s_opcode_rates[SEARCH].per_second;
     } else {
       printf("Usage: %s OPTIONS\n"
              "  -ca PATH  - Path to the CA file, default: '%s'\n"
              "  -cert PATH  - Path to the CERT file, default: '%s'\n"
              "  -key PATH  - Path to the KEY file, default: '%s'\n"
-             "  -url URL  - Listen on URL, default: '%s'\n",
-             argv[0], s_ca_path, s_cert_path, s_key_path, s_listen_on);
+             "  -url URL  - Listen on URL, default: '%s'\n"
+             "  -deflate-min BYTES  - Smallest frame to compress, default: "
+             "%zu\n"
+             "  -io-uring  - Send queued frames with io_uring (Linux only)\n"
+             "  -zerocopy-min BYTES  - Smallest frame to send without copying "
+             "it, needs -io-uring, 0 disables it, default: %zu\n"
+             "  -coalesce-ms MS  - Longest time queued frames are held to "
+             "send them together, default: %llu\n"
+             "  -peers URLS  - Comma separated URLs of all the nodes of the "
+             "cluster, this one included\n"
+             "  -node N  - Position of this node on -peers, default: %zu\n"
+             "  -peer-secret SECRET  - Shared by all the nodes of the "
+             "cluster, needed with -peers\n"
+             "  -follow URL  - Be a hot standby of the primary at URL and "
+             "take over -url when it goes away\n"
+             "  -replica-secret SECRET  - Shared by a primary and its "
+             "follower, the primary can't be followed without it\n"
+             "  -mailbox-budget BYTES  - Memory for the DMs of disconnected "
+             "users, the rest go to disk, default: %zu\n"
+             "  -mailbox-dir PATH  - Where mailboxes over the budget are "
+             "written, default: '%s'\n"
+             "  -memory-budget BYTES  - Memory to stay under by evicting DM "
+             "histories, 0 disables it, default: %zu\n"
+             "  -evict-dir PATH  - Where evicted DM histories are written, "
+             "default: '%s'\n"
+             "  -evict-drop  - Drop evicted DM histories instead of writing "
+             "them\n"
+             "  -history-dir PATH  - Where older messages are sealed into "
+             "segments, default: '%s'\n"
+             "  -rate-conn N  - Frames per second per connection, 0 disables "
+             "it, default: %llu\n"
+             "  -rate-send N  - SEND_MESSAGEs per second per connection, "
+             "default: %llu\n"
+             "  -rate-get N  - GET_MESSAGES per second per connection, "
+             "default: %llu\n"
+             "  -rate-search N  - SEARCHes per second per connection, "
+             "default: %llu\n",
+             argv[0], s_ca_path, s_cert_path, s_key_path, s_listen_on,
+             s_deflate_min_size, s_zerocopy_min,
+             (unsigned long long)s_coalesce_ms, s_node_id, s_mailbox_budget,
+             s_mailbox_dir, s_memory_budget, s_evict_dir, s_history_dir,
+             (unsigned long long)s_conn_rate.per_second,
+             (unsigned long long)s_opcode_rates[SEND_MESSAGE].per_second,
+             (unsigned long long)s_opcode_rates[GET_MESSAGES].per_second,
+             (unsigned long long)s_opcode_rates[SEARCH].per_second);
       return 1;
     }
   }
 
   UWU_Err err = NO_ERROR;
   UWU_ServerState state = initialize_server_state(err);
+
   if (err != NO_ERROR) {
     fprintf(stderr, "Fatal: Failed to initialize server state! Error: %zu\n",
             *err);
@@ -1217,24 +7040,176 @@ int main(int argc, char *argv[]) {
   }
   UWU_STATE = &state;
 
-  printf("Starting WS listener on %s\n", s_listen_on);
-  mg_http_listen(&state.manager, s_listen_on, fn, NULL); // Create HTTP listener
-  for (; !UWU_STATE->is_shutting_off;)
-    mg_mgr_poll(&state.manager, 1000); // Infinite event loop
+  if (!peers_init(&state)) {
+    fprintf(stderr, "Fatal: Can't set up the nodes of the cluster!\n");
+    return 1;
+  }
+  if (s_node_id >= state.nodes) {
+    fprintf(stderr, "Fatal: Node %zu isn't on the list of peers!\n",
+            s_node_id);
+    return 1;
+  }
+  if (state.nodes > 1 && !link_secret_is_valid(s_peer_secret)) {
+    fprintf(stderr, "Fatal: A cluster needs a -peer-secret of printable "
+                    "characters without spaces!\n");
+    return 1;
+  }
+  if ((s_follow != NULL || s_replica_secret != NULL) &&
+      !link_secret_is_valid(s_replica_secret)) {
+    fprintf(stderr, "Fatal: Replication needs a -replica-secret of printable "
+                    "characters without spaces!\n");
+    return 1;
+  }
+  if (!UWU_Outbox_init(&UWU_REPLICATION.follower.outbox, NULL)) {
+    fprintf(stderr, "Fatal: Can't set up the replication!\n");
+    return 1;
+  }
+  if (!mailboxes_init()) {
+    fprintf(stderr, "Fatal: Can't set up the offline mailboxes!\n");
+    return 1;
+  }
+  if (!memory_budget_init()) {
+    fprintf(stderr, "Fatal: Can't set up the memory budget!\n");
+    return 1;
+  }
+  if (!history_tiers_init()) {
+    fprintf(stderr, "Fatal: Can't set up the history tiers!\n");
+    return 1;
+  }
 
-  pthread_join(timer_shutdown, NULL);
-  pthread_join(idle_detector_pid, NULL);
+  // Mongoose connections point to their manager, so this can only be done
+  // once the state is in its final place.
+  if (!mg_wakeup_init(&state.manager)) {
+    fprintf(stderr, "Fatal: Can't initialize the event loop wakeups!\n");
+    return 1;
+  }
 
-  // Closes all connections in the server...
-  for (struct UWU_UserListNode *current = UWU_STATE->active_users.start;
-       current != NULL; current = current->next) {
-    if (current->is_sentinel) {
-      continue;
+  // The detector reads the global state, so it can only start after it's
+  // initialized.
+  pthread_t idle_detector_pid;
+  pthread_create(&idle_detector_pid, NULL, idle_detector, NULL);
+  pthread_t history_evictor_pid;
+  pthread_create(&history_evictor_pid, NULL, history_evictor, NULL);
+
+  if (mg_url_is_ssl(s_listen_on)) {
+#if MG_TLS == MG_TLS_OPENSSL
+    mg_random(UWU_TLS.ticket_keys, sizeof(UWU_TLS.ticket_keys));
+#endif
+    tls_credentials_reload(TRUE);
+    mg_timer_add(&state.manager, TLS_RELOAD_CHECK_MS, MG_TIMER_REPEAT,
+                 tls_reload_timer, NULL);
+  }
+
+  UWU_STATE->event_loop = pthread_self();
+  struct mg_connection *listener = NULL;
+  if (s_follow != NULL) {
+    printf("Following %s, taking over %s when it goes away\n", s_follow,
+           s_listen_on);
+    listener = follow_primary();
+  } else {
+    printf("Starting WS listener on %s\n", s_listen_on);
+    listener = mg_http_listen(&state.manager, s_listen_on, fn, NULL);
+  }
+  if (listener == NULL && !UWU_STATE->is_shutting_off) {
+    fprintf(stderr, "Fatal: Can't listen on %s!\n", s_listen_on);
+    return 1;
+  }
+  // A follower that shut down before taking over has no listener.
+  UWU_STATE->wakeup_conn_id = listener != NULL ? listener->id : 0;
+
+  if (s_io_uring) {
+#ifdef __linux__
+    if (!UWU_Ring_init(&UWU_RING)) {
+      MG_ERROR(("Can't set up io_uring, sending with mongoose instead!"));
+      s_io_uring = FALSE;
+    }
+#else
+    MG_ERROR(("io_uring is only available on Linux!"));
+    s_io_uring = FALSE;
+#endif
+  }
+  if (s_zerocopy_min > 0 && !s_io_uring) {
+    MG_ERROR(("Zero copy sends need io_uring, they're disabled!"));
+    s_zerocopy_min = 0;
+  }
+
+  if (state.nodes > 1) {
+    MG_INFO(("Node %lu of a cluster of %lu", (unsigned long)s_node_id,
+             (unsigned long)state.nodes));
+    mg_timer_add(&state.manager, PEER_RETRY_MS,
+                 MG_TIMER_REPEAT | MG_TIMER_RUN_NOW, peer_dial_timer, NULL);
+  }
+
+  // Other threads wake the loop up when they queue data, so it only needs a
+  // timeout to run the TLS reload, peer and failover timers.
+  int poll_ms = mg_url_is_ssl(s_listen_on) ? (int)TLS_RELOAD_CHECK_MS : -1;
+  if (state.nodes > 1 || s_follow != NULL) {
+    poll_ms = (int)PEER_RETRY_MS;
+  }
+  for (; !UWU_STATE->is_shutting_off;)
+    poll_event_loop(poll_ms); // Infinite event loop
+
+  // Stop accepting and let every connection flush what it has queued.
+  // Closing them also stops their threads.
+  uint64_t drain_deadline = mg_millis() + SHUTDOWN_DRAIN_MS;
+  for (UWU_Bool draining = TRUE; draining && mg_millis() < drain_deadline;) {
+    draining = FALSE;
+    for (struct mg_connection *c = state.manager.conns; c != NULL;
+         c = c->next) {
+      if (c->fn == fn) {
+        c->is_draining = 1;
+        draining = TRUE;
+      }
     }
+    if (draining) {
+      poll_event_loop(10);
+    }
+  }
 
-    mg_close_conn(current->data.conn);
+  // The follower gets everything the handlers did before it takes over.
+  if (UWU_REPLICATION.follower.conn != NULL) {
+    flush_pending_outboxes();
+    UWU_REPLICATION.follower.conn->is_draining = 1;
+    uint64_t follower_deadline = mg_millis() + SHUTDOWN_DRAIN_MS;
+    while (UWU_REPLICATION.follower.conn != NULL &&
+           mg_millis() < follower_deadline) {
+      poll_event_loop(10);
+    }
   }
 
+  UWU_PanicIf(pthread_mutex_lock(&UWU_STATE->active_users.mx) != 0,
+              "Fatal: Can't lock the active_users mutex!");
+  pthread_cond_signal(&UWU_STATE->idle_cond);
+  UWU_PanicIf(pthread_mutex_unlock(&UWU_STATE->active_users.mx) != 0,
+              "Fatal: Can't unlock the active_users mutex!");
+  pthread_join(idle_detector_pid, NULL);
+  UWU_PanicIf(pthread_mutex_lock(&UWU_MEMORY.mx) != 0,
+              "Fatal: Can't lock the memory budget mutex!");
+  pthread_cond_signal(&UWU_MEMORY.cond);
+  UWU_PanicIf(pthread_mutex_unlock(&UWU_MEMORY.mx) != 0,
+              "Fatal: Can't unlock the memory budget mutex!");
+  pthread_join(history_evictor_pid, NULL);
+
+  // `mg_mgr_free` closes all connections in the server. Closing them here
+  // would remove users from the list while we iterate it!
   deinitialize_server_state(UWU_STATE);
+  // The handlers are gone, so are the pages they asked for.
+  history_tiers_deinit();
+  peers_deinit(UWU_STATE);
+  UWU_Outbox_deinit(&UWU_REPLICATION.follower.outbox);
+  mailboxes_deinit();
+  memory_budget_deinit();
+#ifdef __linux__
+  UWU_Ring_deinit(&UWU_RING);
+#endif
+  tls_credentials_free(&UWU_TLS);
+  UWU_Deflate_releaseThreadCtx();
+  UWU_Arena_releaseThreadBlocks();
+  UWU_Pools_releaseThreadCaches();
+  UWU_Pool_releaseThreadCache(&UWU_CONN_INFO_POOL);
+  UWU_Pool_releaseThreadCache(&UWU_THREAD_INFO_POOL);
+  UWU_Pool_deinit(&UWU_CONN_INFO_POOL);
+  UWU_Pool_deinit(&UWU_THREAD_INFO_POOL);
+  UWU_Pools_deinit();
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,229 @@
+// Micro benchmark of the chats index used by `./nob -map-bench`.
+//
+// Compares `UWU_FlatMap` against the old `hashmap.h` map using keys with the
+// same shape as the server's DM chats (`<username>-<username>`). Every phase
+// is repeated `-reps` times and the best time is reported as Mops/s.
+//
+// The `worst` line is the slowest single insert while filling a new map, the
+// pause a caller holding the chats lock would see when the map grows.
+#include "../../lib/lib.c"
+#include "../deps/hashmap/hashmap.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+static size_t s_keys = 1 << 16;
+static size_t s_reps = 5;
+
+// Keeps the compiler from optimizing lookups away.
+static volatile uintptr_t SINK = 0;
+
+typedef struct {
+  UWU_String *items;
+  char *buffer;
+  size_t count;
+} UWU_BenchKeys;
+
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// Generates `count` chat keys. When `missing` is TRUE the keys use usernames
+// that never appear in the other set.
+UWU_BenchKeys keys_generate(size_t count, UWU_Bool missing) {
+  UWU_BenchKeys keys = {
+      .items = malloc(sizeof(UWU_String) * count),
+      .buffer = malloc(count * 32),
+      .count = count,
+  };
+  if (keys.items == NULL || keys.buffer == NULL) {
+    fprintf(stderr, "Error: Can't allocate the benchmark keys!\n");
+    exit(1);
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    char *data = &keys.buffer[i * 32];
+    int length = snprintf(data, 32, "%s%zu-user%zu", missing ? "ghost" : "user",
+                          i, (i * 7919) % count);
+    keys.items[i].data = data;
+    keys.items[i].length = length;
+  }
+
+  return keys;
+}
+
+void keys_free(UWU_BenchKeys *keys) {
+  free(keys->items);
+  free(keys->buffer);
+}
+
+void report(const char *map, const char *phase, size_t ops, uint64_t ns) {
+  printf("%-10s %-8s %8.2f Mops/s\n", map, phase,
+         (double)ops * 1000.0 / (double)(ns == 0 ? 1 : ns));
+}
+
+void report_worst(const char *map, uint64_t ns) {
+  printf("%-10s %-8s %8.2f us\n", map, "worst", (double)ns / 1000.0);
+}
+
+void bench_flatmap(UWU_BenchKeys *hits, UWU_BenchKeys *misses) {
+  uint64_t best[4] = {UINT64_MAX, UINT64_MAX, UINT64_MAX, UINT64_MAX};
+  UWU_Err err = NO_ERROR;
+
+  for (size_t rep = 0; rep < s_reps; rep++) {
+    UWU_FlatMap map = UWU_FlatMap_init(16, err);
+
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < hits->count; i++) {
+      if (!UWU_FlatMap_put(&map, &hits->items[i], &hits->items[i], err)) {
+        fprintf(stderr, "Error: Can't insert into the flat map!\n");
+        exit(1);
+      }
+    }
+    uint64_t elapsed = now_ns() - start;
+    best[0] = elapsed < best[0] ? elapsed : best[0];
+
+    start = now_ns();
+    for (size_t i = 0; i < hits->count; i++) {
+      SINK += (uintptr_t)UWU_FlatMap_get(&map, &hits->items[i]);
+    }
+    elapsed = now_ns() - start;
+    best[1] = elapsed < best[1] ? elapsed : best[1];
+
+    start = now_ns();
+    for (size_t i = 0; i < misses->count; i++) {
+      SINK += (uintptr_t)UWU_FlatMap_get(&map, &misses->items[i]);
+    }
+    elapsed = now_ns() - start;
+    best[2] = elapsed < best[2] ? elapsed : best[2];
+
+    start = now_ns();
+    for (size_t i = 0; i < hits->count; i++) {
+      SINK += (uintptr_t)UWU_FlatMap_remove(&map, &hits->items[i]);
+    }
+    elapsed = now_ns() - start;
+    best[3] = elapsed < best[3] ? elapsed : best[3];
+
+    UWU_FlatMap_deinit(&map);
+  }
+
+  uint64_t worst = 0;
+  UWU_FlatMap map = UWU_FlatMap_init(16, err);
+  for (size_t i = 0; i < hits->count; i++) {
+    uint64_t start = now_ns();
+    UWU_FlatMap_put(&map, &hits->items[i], &hits->items[i], err);
+    uint64_t elapsed = now_ns() - start;
+    worst = elapsed > worst ? elapsed : worst;
+  }
+  UWU_FlatMap_deinit(&map);
+
+  report("flatmap", "insert", hits->count, best[0]);
+  report("flatmap", "hit", hits->count, best[1]);
+  report("flatmap", "miss", misses->count, best[2]);
+  report("flatmap", "remove", hits->count, best[3]);
+  report_worst("flatmap", worst);
+}
+
+void bench_hashmap(UWU_BenchKeys *hits, UWU_BenchKeys *misses) {
+  uint64_t best[4] = {UINT64_MAX, UINT64_MAX, UINT64_MAX, UINT64_MAX};
+
+  for (size_t rep = 0; rep < s_reps; rep++) {
+    struct hashmap_s map;
+    if (0 != hashmap_create(8, &map)) {
+      fprintf(stderr, "Error: Can't create the hashmap!\n");
+      exit(1);
+    }
+
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < hits->count; i++) {
+      UWU_String *key = &hits->items[i];
+      if (0 != hashmap_put(&map, key->data, key->length, key)) {
+        fprintf(stderr, "Error: Can't insert into the hashmap!\n");
+        exit(1);
+      }
+    }
+    uint64_t elapsed = now_ns() - start;
+    best[0] = elapsed < best[0] ? elapsed : best[0];
+
+    start = now_ns();
+    for (size_t i = 0; i < hits->count; i++) {
+      UWU_String *key = &hits->items[i];
+      SINK += (uintptr_t)hashmap_get(&map, key->data, key->length);
+    }
+    elapsed = now_ns() - start;
+    best[1] = elapsed < best[1] ? elapsed : best[1];
+
+    start = now_ns();
+    for (size_t i = 0; i < misses->count; i++) {
+      UWU_String *key = &misses->items[i];
+      SINK += (uintptr_t)hashmap_get(&map, key->data, key->length);
+    }
+    elapsed = now_ns() - start;
+    best[2] = elapsed < best[2] ? elapsed : best[2];
+
+    start = now_ns();
+    for (size_t i = 0; i < hits->count; i++) {
+      UWU_String *key = &hits->items[i];
+      SINK += (uintptr_t)hashmap_remove(&map, key->data, key->length);
+    }
+    elapsed = now_ns() - start;
+    best[3] = elapsed < best[3] ? elapsed : best[3];
+
+    hashmap_destroy(&map);
+  }
+
+  uint64_t worst = 0;
+  struct hashmap_s map;
+  if (0 != hashmap_create(8, &map)) {
+    fprintf(stderr, "Error: Can't create the hashmap!\n");
+    exit(1);
+  }
+  for (size_t i = 0; i < hits->count; i++) {
+    UWU_String *key = &hits->items[i];
+    uint64_t start = now_ns();
+    hashmap_put(&map, key->data, key->length, key);
+    uint64_t elapsed = now_ns() - start;
+    worst = elapsed > worst ? elapsed : worst;
+  }
+  hashmap_destroy(&map);
+
+  report("hashmap.h", "insert", hits->count, best[0]);
+  report("hashmap.h", "hit", hits->count, best[1]);
+  report("hashmap.h", "miss", misses->count, best[2]);
+  report("hashmap.h", "remove", hits->count, best[3]);
+  report_worst("hashmap.h", worst);
+}
+
+int main(int argc, char *argv[]) {
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-keys") == 0 && argv[i + 1] != NULL) {
+      s_keys = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-reps") == 0 && argv[i + 1] != NULL) {
+      s_reps = strtoul(argv[++i], NULL, 10);
+    } else {
+      printf("Usage: %s OPTIONS\n"
+             "  -keys N  - Number of chats, default: %zu\n"
+             "  -reps N  - Repetitions of every phase, default: %zu\n",
+             argv[0], s_keys, s_reps);
+      return 1;
+    }
+  }
+
+  if (s_keys == 0 || s_reps == 0) {
+    fprintf(stderr, "Error: The benchmark needs at least 1 key and 1 rep!\n");
+    return 1;
+  }
+
+  UWU_BenchKeys hits = keys_generate(s_keys, FALSE);
+  UWU_BenchKeys misses = keys_generate(s_keys, TRUE);
+
+  printf("%zu chats, best of %zu\n", s_keys, s_reps);
+  bench_flatmap(&hits, &misses);
+  bench_hashmap(&hits, &misses);
+
+  keys_free(&hits);
+  keys_free(&misses);
+  return 0;
+}
@@ -0,0 +1,219 @@
+// Micro benchmark of the request decoder used by `./nob -request-bench`.
+//
+// Decodes `-frames` frames of every type `-rounds` times and compares it
+// against reading the same fields without checking any length, like the
+// handler did before `UWU_Request_decode`. Truncated frames measure how fast
+// invalid ones are dropped.
+#include "../../lib/lib.c"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+static size_t s_frames = 4096;
+static size_t s_rounds = 500;
+
+// Every frame starts at a multiple of this inside the buffer.
+static const size_t BENCH_FRAME_STRIDE = 1 + 3 * 256;
+
+// Keeps the compiler from removing the reads.
+static volatile size_t SINK = 0;
+static uint64_t RNG = 0x9E3779B97F4A7C15ull;
+
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+uint64_t next_random() {
+  RNG ^= RNG << 13;
+  RNG ^= RNG >> 7;
+  RNG ^= RNG << 17;
+  return RNG;
+}
+
+// Writes a random string of `min` to `max` bytes with its length before it.
+size_t write_string(char *dest, size_t min, size_t max) {
+  size_t length = min + next_random() % (max - min + 1);
+  dest[0] = (char)length;
+  for (size_t i = 0; i < length; i++) {
+    dest[1 + i] = 'a' + next_random() % 26;
+  }
+  return 1 + length;
+}
+
+// Writes a valid frame of `type` like the clients send them.
+size_t write_frame(char *dest, UWU_ServerMessages type) {
+  size_t length = 0;
+  dest[length++] = type;
+  switch (type) {
+  case LIST_USERS:
+    break;
+  case GET_USER:
+    length += write_string(&dest[length], 3, 16);
+    break;
+  case CHANGE_STATUS:
+    length += write_string(&dest[length], 3, 16);
+    dest[length++] = BUSY;
+    break;
+  case SEND_MESSAGE:
+    length += write_string(&dest[length], 1, 16);
+    length += write_string(&dest[length], 1, 255);
+    if (next_random() % 2 == 0) {
+      UWU_writeBigEndian(&dest[length], next_random(), UWU_NONCE_SIZE);
+      length += UWU_NONCE_SIZE;
+    }
+    break;
+  case GET_MESSAGES:
+    length += write_string(&dest[length], 1, 16);
+    if (next_random() % 2 == 0) {
+      UWU_writeBigEndian(&dest[length], next_random(), UWU_PAGE_BEFORE_SIZE);
+      length += UWU_PAGE_BEFORE_SIZE;
+    }
+    break;
+  case SEARCH:
+    length += write_string(&dest[length], 2, 40);
+    break;
+  }
+  return length;
+}
+
+// Reads the fields of the frame trusting its lengths.
+size_t read_unchecked(char *data, size_t length) {
+  switch (data[0]) {
+  case LIST_USERS:
+    return 1;
+  case GET_USER:
+  case SEARCH:
+    return (uint8_t)data[1];
+  case CHANGE_STATUS:
+    return (uint8_t)data[2 + (uint8_t)data[1]];
+  case SEND_MESSAGE: {
+    size_t username_length = (uint8_t)data[1];
+    size_t message_length = (uint8_t)data[2 + username_length];
+    size_t nonce = 0;
+    if (length == 3 + username_length + message_length + UWU_NONCE_SIZE) {
+      nonce = UWU_readBigEndian(&data[3 + username_length + message_length],
+                                UWU_NONCE_SIZE);
+    }
+    return username_length + message_length + nonce;
+  }
+  case GET_MESSAGES: {
+    size_t username_length = (uint8_t)data[1];
+    size_t before = 0;
+    if (length == 2 + username_length + UWU_PAGE_BEFORE_SIZE) {
+      before = UWU_readBigEndian(&data[2 + username_length],
+                                 UWU_PAGE_BEFORE_SIZE);
+    }
+    return username_length + before;
+  }
+  }
+  return 0;
+}
+
+// Reads the same fields with the decoder.
+size_t read_decoded(char *data, size_t length) {
+  UWU_Request request;
+  if (!UWU_Request_decode(data, length, &request)) {
+    return 0;
+  }
+  switch (request.type) {
+  case LIST_USERS:
+    return 1;
+  case GET_USER:
+    return request.get_user.username.length;
+  case SEARCH:
+    return request.search.query.length;
+  case CHANGE_STATUS:
+    return request.change_status.status;
+  case SEND_MESSAGE:
+    return request.send_message.username.length +
+           request.send_message.content.length + request.send_message.nonce;
+  case GET_MESSAGES:
+    return request.get_messages.username.length + request.get_messages.before;
+  }
+  return 0;
+}
+
+// Reads every frame `s_rounds` times.
+//
+// Returns the nanoseconds per frame.
+double run(size_t (*read)(char *, size_t), char *frames, size_t *lengths) {
+  size_t sum = 0;
+  uint64_t start = now_ns();
+  for (size_t round = 0; round < s_rounds; round++) {
+    for (size_t i = 0; i < s_frames; i++) {
+      sum += read(&frames[i * BENCH_FRAME_STRIDE], lengths[i]);
+    }
+  }
+  uint64_t elapsed = now_ns() - start;
+  SINK += sum;
+  return (double)elapsed / (double)(s_rounds * s_frames);
+}
+
+// Prints the time to read frames of `type`, all of them if `type` is 0.
+//
+// - truncate: Whether to cut the frames short so they're all invalid.
+void bench(const char *name, UWU_ServerMessages type, UWU_Bool truncate) {
+  char *frames = malloc(s_frames * BENCH_FRAME_STRIDE);
+  size_t *lengths = malloc(s_frames * sizeof(size_t));
+  if (frames == NULL || lengths == NULL) {
+    fprintf(stderr, "Error: Can't allocate the frames!\n");
+    exit(1);
+  }
+
+  size_t bytes = 0;
+  for (size_t i = 0; i < s_frames; i++) {
+    UWU_ServerMessages frame_type =
+        type != 0 ? type : (UWU_ServerMessages)(LIST_USERS + i % SEARCH);
+    lengths[i] = write_frame(&frames[i * BENCH_FRAME_STRIDE], frame_type);
+    if (truncate) {
+      // LIST_USERS has nothing to cut, it gets an extra byte instead.
+      lengths[i] = lengths[i] == 1 ? 2 : 1 + next_random() % (lengths[i] - 1);
+    }
+    bytes += lengths[i];
+  }
+
+  double decoded_ns = run(read_decoded, frames, lengths);
+  printf("%-20s %10.1f %12.2f %14.2f %10.0f\n", name,
+         (double)bytes / (double)s_frames, decoded_ns,
+         // Truncated frames may make the unchecked reads go past them.
+         truncate ? 0.0 : run(read_unchecked, frames, lengths),
+         (double)bytes / decoded_ns * 1e9 / 1e6 / (double)s_frames);
+  free(frames);
+  free(lengths);
+}
+
+int main(int argc, char *argv[]) {
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-frames") == 0 && argv[i + 1] != NULL) {
+      s_frames = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-rounds") == 0 && argv[i + 1] != NULL) {
+      s_rounds = strtoul(argv[++i], NULL, 10);
+    } else {
+      printf("Usage: %s OPTIONS\n"
+             "  -frames N  - Different frames of every type, default: %zu\n"
+             "  -rounds N  - Times every frame is read, default: %zu\n",
+             argv[0], s_frames, s_rounds);
+      return 1;
+    }
+  }
+
+  if (s_frames == 0 || s_rounds == 0) {
+    fprintf(stderr, "Error: The benchmark needs at least 1 frame and 1 "
+                    "round!\n");
+    return 1;
+  }
+
+  printf("%-20s %10s %12s %14s %10s\n", "frames", "bytes", "decode ns",
+         "unchecked ns", "MB/s");
+  bench("LIST_USERS", LIST_USERS, FALSE);
+  bench("GET_USER", GET_USER, FALSE);
+  bench("CHANGE_STATUS", CHANGE_STATUS, FALSE);
+  bench("SEND_MESSAGE", SEND_MESSAGE, FALSE);
+  bench("GET_MESSAGES", GET_MESSAGES, FALSE);
+  bench("SEARCH", SEARCH, FALSE);
+  bench("mixed", (UWU_ServerMessages)0, FALSE);
+  bench("mixed, truncated", (UWU_ServerMessages)0, TRUE);
+  return 0;
+}
@@ -0,0 +1,105 @@
+// Fuzz target of the request decoder used by `./nob -fuzz`, built with
+// libFuzzer and the address and undefined behaviour sanitizers.
+//
+// Every frame is copied to a buffer of its exact size, so reading past it
+// crashes. Frames that decode must only point inside themselves and encode
+// back to the same bytes, so nothing the server acts on was skipped.
+#include "../../lib/lib.c"
+#include <stdio.h>
+#include <string.h>
+
+// Writes `str` with its length before it.
+size_t encode_string(char *dest, const UWU_String *str) {
+  dest[0] = (char)str->length;
+  memcpy(&dest[1], str->data, str->length);
+  return 1 + str->length;
+}
+
+// Writes `request` back into a frame, `dest` must have at least 1 + 3 * 256
+// bytes.
+size_t encode_request(char *dest, const UWU_Request *request) {
+  size_t length = 0;
+  dest[length++] = (char)request->type;
+  switch (request->type) {
+  case LIST_USERS:
+    break;
+  case GET_USER:
+    length += encode_string(&dest[length], &request->get_user.username);
+    break;
+  case CHANGE_STATUS:
+    length += encode_string(&dest[length], &request->change_status.username);
+    dest[length++] = (char)request->change_status.status;
+    break;
+  case SEND_MESSAGE:
+    length += encode_string(&dest[length], &request->send_message.username);
+    length += encode_string(&dest[length], &request->send_message.content);
+    if (request->send_message.has_nonce) {
+      UWU_writeBigEndian(&dest[length], request->send_message.nonce,
+                         UWU_NONCE_SIZE);
+      length += UWU_NONCE_SIZE;
+    }
+    break;
+  case GET_MESSAGES:
+    length += encode_string(&dest[length], &request->get_messages.username);
+    if (request->get_messages.has_before) {
+      UWU_writeBigEndian(&dest[length], request->get_messages.before,
+                         UWU_PAGE_BEFORE_SIZE);
+      length += UWU_PAGE_BEFORE_SIZE;
+    }
+    break;
+  case SEARCH:
+    length += encode_string(&dest[length], &request->search.query);
+    break;
+  }
+  return length;
+}
+
+// Crashes unless `str` is inside the frame.
+void check_inside(const UWU_String *str, const char *frame, size_t length) {
+  if (str->data < frame || str->data + str->length > frame + length) {
+    fprintf(stderr, "Error: A field points outside the frame!\n");
+    abort();
+  }
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  char *frame = malloc(size);
+  if (frame == NULL) {
+    return 0;
+  }
+  memcpy(frame, data, size);
+
+  UWU_Request request;
+  if (UWU_Request_decode(frame, size, &request)) {
+    switch (request.type) {
+    case GET_USER:
+      check_inside(&request.get_user.username, frame, size);
+      break;
+    case CHANGE_STATUS:
+      check_inside(&request.change_status.username, frame, size);
+      break;
+    case SEND_MESSAGE:
+      check_inside(&request.send_message.username, frame, size);
+      check_inside(&request.send_message.content, frame, size);
+      break;
+    case GET_MESSAGES:
+      check_inside(&request.get_messages.username, frame, size);
+      break;
+    case SEARCH:
+      check_inside(&request.search.query, frame, size);
+      break;
+    default:
+      break;
+    }
+
+    char encoded[1 + 3 * 256];
+    size_t length = encode_request(encoded, &request);
+    if (length != size || memcmp(encoded, frame, size) != 0) {
+      fprintf(stderr, "Error: The request doesn't encode back to its frame!\n");
+      abort();
+    }
+  }
+
+  free(frame);
+  return 0;
+}
@@ -0,0 +1,292 @@
+// Micro benchmark of the search index used by `./nob -search-bench`.
+//
+// Indexes `-messages` synthetic messages, sealed in segments of 50 spread over
+// `-chats` chats like the server does, and reports the memory of the index.
+// Then it runs `-queries` queries of a few kinds and compares the time to find
+// the newest 20 hits against scanning the messages from the newest one, the
+// way a client would without the index. Words follow a Zipf distribution, so
+// a few are on most messages and most are rare.
+#include "../../lib/lib.c"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// Same as the server.
+static const size_t BENCH_SEGMENT_MESSAGES = 50;
+static const size_t BENCH_RESULTS = 20;
+
+static const size_t BENCH_VOCABULARY = 50000;
+static const size_t BENCH_MIN_WORDS = 4;
+static const size_t BENCH_MAX_WORDS = 12;
+
+static size_t s_messages = 2000000;
+static size_t s_chats = 1000;
+static size_t s_queries = 200;
+static size_t s_scan_queries = 5;
+
+// The messages as they were sent, for the scans.
+static char *TEXT = NULL;
+static uint32_t *OFFSETS = NULL;
+// Chance of every word, added up.
+static double *CDF = NULL;
+static uint64_t RNG = 0x9E3779B97F4A7C15ull;
+
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+uint64_t next_random() {
+  RNG ^= RNG << 13;
+  RNG ^= RNG >> 7;
+  RNG ^= RNG << 17;
+  return RNG;
+}
+
+// A word with the Zipf distribution, 0 is the most common.
+size_t random_word() {
+  double x = (double)(next_random() >> 11) / (double)(1ull << 53);
+  size_t low = 0;
+  size_t high = BENCH_VOCABULARY - 1;
+  while (low < high) {
+    size_t mid = (low + high) / 2;
+    if (CDF[mid] < x) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+UWU_String message(size_t i) {
+  UWU_String text = {.data = &TEXT[OFFSETS[i]],
+                     .length = OFFSETS[i + 1] - OFFSETS[i]};
+  return text;
+}
+
+// Builds the messages and indexes them.
+//
+// Returns the time it took to index them, in nanoseconds.
+uint64_t build(UWU_SearchIndex *index) {
+  CDF = malloc(BENCH_VOCABULARY * sizeof(double));
+  OFFSETS = malloc((s_messages + 1) * sizeof(uint32_t));
+  TEXT = malloc(s_messages * BENCH_MAX_WORDS * 8);
+  if (CDF == NULL || OFFSETS == NULL || TEXT == NULL) {
+    fprintf(stderr, "Error: Can't allocate the messages!\n");
+    exit(1);
+  }
+
+  double sum = 0;
+  for (size_t i = 0; i < BENCH_VOCABULARY; i++) {
+    sum += 1.0 / (double)(i + 1);
+    CDF[i] = sum;
+  }
+  for (size_t i = 0; i < BENCH_VOCABULARY; i++) {
+    CDF[i] /= sum;
+  }
+
+  size_t length = 0;
+  for (size_t i = 0; i < s_messages; i++) {
+    OFFSETS[i] = length;
+    size_t words = BENCH_MIN_WORDS +
+                   next_random() % (BENCH_MAX_WORDS - BENCH_MIN_WORDS + 1);
+    for (size_t w = 0; w < words; w++) {
+      length += sprintf(&TEXT[length], w == 0 ? "w%lu" : " w%lu",
+                        (unsigned long)random_word());
+    }
+  }
+  OFFSETS[s_messages] = length;
+
+  // Chat `c` gets the segments `c`, `c + s_chats`... in order.
+  size_t records_size = BENCH_SEGMENT_MESSAGES * UWU_SEGMENT_MAX_RECORD_SIZE;
+  char *records = malloc(records_size);
+  if (records == NULL) {
+    fprintf(stderr, "Error: Can't allocate the segments!\n");
+    exit(1);
+  }
+  uint64_t elapsed = 0;
+  for (size_t first = 0; first < s_messages; first += BENCH_SEGMENT_MESSAGES) {
+    size_t segment = first / BENCH_SEGMENT_MESSAGES;
+    char key_data[32];
+    UWU_String key = {.data = key_data,
+                      .length = (size_t)sprintf(key_data, "chat%lu",
+                                                (unsigned long)(segment %
+                                                                s_chats))};
+
+    size_t records_length = 0;
+    for (size_t i = first;
+         i < first + BENCH_SEGMENT_MESSAGES && i < s_messages; i++) {
+      UWU_SegmentRecord record = {
+          .id = i - first + 1 +
+                segment / s_chats * BENCH_SEGMENT_MESSAGES,
+          .timestamp_ms = i,
+          .from = key,
+          .content = message(i),
+      };
+      records_length +=
+          UWU_SegmentRecord_write(&records[records_length], &record);
+    }
+
+    UWU_String raw = {.data = records, .length = records_length};
+    uint64_t start = now_ns();
+    if (!UWU_SearchIndex_addSegment(index, &key, segment / s_chats, &raw)) {
+      fprintf(stderr, "Error: Can't index the messages!\n");
+      exit(1);
+    }
+    elapsed += now_ns() - start;
+  }
+  free(records);
+  return elapsed;
+}
+
+// Finds the newest hits with the index.
+size_t query_index(const UWU_SearchIndex *index,
+                   const UWU_SearchTerms *terms) {
+  static UWU_SearchQuery query;
+  UWU_SearchQuery_init(&query, index, terms, NULL, NULL);
+  UWU_SearchHit hit = {};
+  size_t found = 0;
+  while (found < BENCH_RESULTS && UWU_SearchQuery_next(&query, &hit)) {
+    found++;
+  }
+  return found;
+}
+
+// Finds the newest hits reading every message from the newest one.
+size_t query_scan(const UWU_SearchTerms *terms) {
+  size_t found = 0;
+  for (size_t i = s_messages; i > 0 && found < BENCH_RESULTS; i--) {
+    UWU_String text = message(i - 1);
+    if (UWU_SearchTerms_match(terms, &text)) {
+      found++;
+    }
+  }
+  return found;
+}
+
+int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Runs `s_queries` queries made of a word of every band of ranks and prints
+// the percentiles of their time.
+void run_queries(const UWU_SearchIndex *index, const char *name,
+                 const size_t (*bands)[2], size_t band_count) {
+  uint64_t *index_ns = malloc(s_queries * sizeof(uint64_t));
+  uint64_t *scan_ns = malloc(s_scan_queries * sizeof(uint64_t));
+  if (index_ns == NULL || scan_ns == NULL) {
+    fprintf(stderr, "Error: Can't allocate the timings!\n");
+    exit(1);
+  }
+
+  size_t hits = 0;
+  for (size_t q = 0; q < s_queries; q++) {
+    char query_data[256];
+    size_t length = 0;
+    for (size_t b = 0; b < band_count; b++) {
+      size_t word = bands[b][0] + next_random() % (bands[b][1] - bands[b][0]);
+      length += sprintf(&query_data[length], " w%lu", (unsigned long)word);
+    }
+    UWU_String query = {.data = query_data, .length = length};
+    UWU_SearchTerms terms = UWU_SearchTerms_parse(&query);
+
+    uint64_t start = now_ns();
+    hits += query_index(index, &terms);
+    index_ns[q] = now_ns() - start;
+
+    if (q < s_scan_queries) {
+      start = now_ns();
+      size_t scanned = query_scan(&terms);
+      scan_ns[q] = now_ns() - start;
+      if (scanned != query_index(index, &terms)) {
+        fprintf(stderr, "Error: The index and the scan disagree!\n");
+        exit(1);
+      }
+    }
+  }
+
+  qsort(index_ns, s_queries, sizeof(uint64_t), compare_u64);
+  size_t scans = s_scan_queries < s_queries ? s_scan_queries : s_queries;
+  qsort(scan_ns, scans, sizeof(uint64_t), compare_u64);
+  printf("%-22s %8.1f %10.1f %10.1f %12.1f %12.1f\n", name,
+         (double)hits / (double)s_queries, index_ns[s_queries / 2] / 1e3,
+         index_ns[s_queries * 99 / 100] / 1e3,
+         scans > 0 ? scan_ns[scans / 2] / 1e3 : 0.0,
+         scans > 0 ? scan_ns[scans - 1] / 1e3 : 0.0);
+  free(index_ns);
+  free(scan_ns);
+}
+
+int main(int argc, char *argv[]) {
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-messages") == 0 && argv[i + 1] != NULL) {
+      s_messages = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-chats") == 0 && argv[i + 1] != NULL) {
+      s_chats = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-queries") == 0 && argv[i + 1] != NULL) {
+      s_queries = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-scan-queries") == 0 && argv[i + 1] != NULL) {
+      s_scan_queries = strtoul(argv[++i], NULL, 10);
+    } else {
+      printf("Usage: %s OPTIONS\n"
+             "  -messages N  - Messages to index, default: %zu\n"
+             "  -chats N  - Chats the messages are spread over, default: %zu\n"
+             "  -queries N  - Queries of every kind, default: %zu\n"
+             "  -scan-queries N  - How many of those are also scanned, "
+             "default: %zu\n",
+             argv[0], s_messages, s_chats, s_queries, s_scan_queries);
+      return 1;
+    }
+  }
+
+  if (s_messages == 0 || s_chats == 0 || s_queries == 0) {
+    fprintf(stderr, "Error: The benchmark needs at least 1 message, 1 chat "
+                    "and 1 query!\n");
+    return 1;
+  }
+
+  UWU_Err err = NO_ERROR;
+  UWU_SearchIndex index = UWU_SearchIndex_init(BENCH_SEGMENT_MESSAGES, err);
+  if (index.terms.table.capacity == 0) {
+    fprintf(stderr, "Error: Can't allocate the index!\n");
+    return 1;
+  }
+
+  uint64_t elapsed = build(&index);
+  size_t bytes = UWU_SearchIndex_bytesUsed(&index);
+  printf("%zu messages on %zu chats, %zu terms\n", s_messages, s_chats,
+         (size_t)index.terms.count);
+  printf("indexed at %.0f msg/s, %.1f MB of index, %.1f bytes per message "
+         "(%.1f MB of text)\n",
+         (double)s_messages * 1e9 / (double)(elapsed == 0 ? 1 : elapsed),
+         bytes / 1e6, (double)bytes / (double)s_messages,
+         OFFSETS[s_messages] / 1e6);
+
+  // Bands of word ranks, from the common words to the rare ones.
+  static const size_t common[][2] = {{0, 10}};
+  static const size_t medium[][2] = {{100, 1000}};
+  static const size_t rare[][2] = {{10000, 50000}};
+  static const size_t common_medium[][2] = {{0, 10}, {100, 1000}};
+  static const size_t medium_medium[][2] = {{100, 1000}, {100, 1000}};
+  static const size_t three[][2] = {{0, 10}, {10, 100}, {100, 1000}};
+
+  printf("%-22s %8s %10s %10s %12s %12s\n", "query", "hits", "index p50",
+         "index p99", "scan p50", "scan max");
+  run_queries(&index, "common", common, 1);
+  run_queries(&index, "medium", medium, 1);
+  run_queries(&index, "rare", rare, 1);
+  run_queries(&index, "common + medium", common_medium, 2);
+  run_queries(&index, "medium + medium", medium_medium, 2);
+  run_queries(&index, "three words", three, 3);
+  printf("times in us\n");
+
+  UWU_SearchIndex_deinit(&index);
+  free(TEXT);
+  free(OFFSETS);
+  free(CDF);
+  return 0;
+}
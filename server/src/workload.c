@@ -0,0 +1,302 @@
+// Synthetic workload used by `./nob -pgo` and `./nob -bench`.
+//
+// It connects `-users` clients to a running server. Once all of them are
+// connected every client runs `-rounds` rounds, each round being:
+//   1. A message to the group chat.
+//   2. A DM to the next client.
+//   3. A GET_MESSAGES of the group chat.
+//   4. A LIST_USERS.
+// The server handles the requests of a connection in order, so receiving the
+// LISTED_USERS response means the whole round was processed.
+//
+// DMs carry the time they were sent, so the time they take to reach the
+// other client is reported too. `-url` takes the URLs of all the nodes of a
+// cluster, every client connects to the node that owns its username.
+//
+// The last line printed on stdout is parsed by `nob.c`, don't change it!
+#include "../../lib/lib.c"
+#include "../deps/mongoose/mongoose.c"
+#include <stdio.h>
+#include <string.h>
+
+// The server stores message lengths on a signed char.
+static const size_t MAX_WORKLOAD_MSG_LENGTH = 120;
+// If nothing happens during this amount of time the workload fails.
+static const uint64_t WORKLOAD_TIMEOUT_MS = 30000;
+// How many times a client retries connecting while the server starts.
+static const int MAX_CONNECT_ATTEMPTS = 50;
+// Time to wait between connection attempts.
+static const uint64_t CONNECT_RETRY_MS = 100;
+// Time the nodes of a cluster get to tell each other about the clients
+// before the rounds start.
+static const uint64_t CLUSTER_SETTLE_MS = 250;
+// DMs start with the time they were sent, as hex microseconds.
+#define DM_TIME_LENGTH 16
+
+static const char *s_url = "ws://localhost:8765";
+static size_t s_users = 16;
+static size_t s_rounds = 20;
+
+typedef struct {
+  char username[24];
+  size_t idx;
+  struct mg_connection *conn;
+  UWU_Bool is_open;
+  size_t rounds_done;
+  int connect_attempts;
+  uint64_t retry_at_ms;
+} UWU_WorkloadClient;
+
+static UWU_WorkloadClient *CLIENTS = NULL;
+static size_t OPEN_CLIENTS = 0;
+static size_t FINISHED_CLIENTS = 0;
+static size_t REQUESTS_SENT = 0;
+static UWU_Bool STARTED = FALSE;
+static UWU_Bool FAILED = FALSE;
+static uint64_t LAST_PROGRESS_MS = 0;
+// The nodes to connect to, parsed from `s_url`.
+static UWU_String *NODES = NULL;
+static size_t NODES_COUNT = 0;
+// Time each DM took to arrive, in microseconds.
+static uint64_t *DM_LATENCIES = NULL;
+static size_t DM_LATENCIES_COUNT = 0;
+
+uint64_t now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000ull + (uint64_t)ts.tv_nsec / 1000;
+}
+
+int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void client_fn(struct mg_connection *c, int ev, void *ev_data);
+
+void client_connect(struct mg_mgr *mgr, UWU_WorkloadClient *client) {
+  UWU_String username = {.data = client->username,
+                         .length = strlen(client->username)};
+  UWU_String *node = &NODES[UWU_Username_node(&username, NODES_COUNT)];
+  char url[256];
+  snprintf(url, sizeof(url), "%.*s/?name=%s", (int)node->length, node->data,
+           client->username);
+  client->connect_attempts++;
+  client->conn = mg_ws_connect(mgr, url, client_fn, client, NULL);
+}
+
+void send_round(UWU_WorkloadClient *client) {
+  struct mg_connection *c = client->conn;
+  char buff[3 + 24 + MAX_WORKLOAD_MSG_LENGTH];
+
+  size_t msg_length = 20 + (client->idx * 7 + client->rounds_done * 13) %
+                               (MAX_WORKLOAD_MSG_LENGTH - 20);
+
+  // Group message
+  buff[0] = SEND_MESSAGE;
+  buff[1] = 1;
+  buff[2] = '~';
+  buff[3] = msg_length;
+  for (size_t i = 0; i < msg_length; i++) {
+    buff[4 + i] = 'a' + (i + client->rounds_done) % 26;
+  }
+  mg_ws_send(c, buff, 4 + msg_length, WEBSOCKET_OP_BINARY);
+
+  // DM to the next client
+  UWU_WorkloadClient *next = &CLIENTS[(client->idx + 1) % s_users];
+  size_t next_length = strlen(next->username);
+  buff[0] = SEND_MESSAGE;
+  buff[1] = next_length;
+  memcpy(&buff[2], next->username, next_length);
+  buff[2 + next_length] = msg_length;
+  char sent_at[DM_TIME_LENGTH + 1];
+  snprintf(sent_at, sizeof(sent_at), "%016llx", (unsigned long long)now_us());
+  memcpy(&buff[3 + next_length], sent_at, DM_TIME_LENGTH);
+  for (size_t i = DM_TIME_LENGTH; i < msg_length; i++) {
+    buff[3 + next_length + i] = 'A' + (i + client->idx) % 26;
+  }
+  mg_ws_send(c, buff, 3 + next_length + msg_length, WEBSOCKET_OP_BINARY);
+
+  char get_messages[] = {GET_MESSAGES, 1, '~'};
+  mg_ws_send(c, get_messages, sizeof(get_messages), WEBSOCKET_OP_BINARY);
+
+  char list_users[] = {LIST_USERS};
+  mg_ws_send(c, list_users, sizeof(list_users), WEBSOCKET_OP_BINARY);
+
+  REQUESTS_SENT += 4;
+}
+
+static void client_fn(struct mg_connection *c, int ev, void *ev_data) {
+  UWU_WorkloadClient *client = (UWU_WorkloadClient *)c->fn_data;
+
+  if (ev == MG_EV_WS_OPEN) {
+    client->is_open = TRUE;
+    OPEN_CLIENTS++;
+    LAST_PROGRESS_MS = mg_millis();
+  } else if (ev == MG_EV_WS_MSG) {
+    struct mg_ws_message *wm = (struct mg_ws_message *)ev_data;
+    const char *data = wm->data.buf;
+    size_t length = wm->data.len;
+    if (length > 2 && data[0] == GOT_MESSAGE) {
+      // | type | length user | user | length msg | msg |
+      size_t user_length = (uint8_t)data[1];
+      size_t msg_offset = 3 + user_length;
+      UWU_Bool is_dm = !(user_length == 1 && data[2] == '~') &&
+                       !(user_length == strlen(client->username) &&
+                         memcmp(&data[2], client->username, user_length) == 0);
+      if (is_dm && msg_offset + DM_TIME_LENGTH <= length &&
+          DM_LATENCIES_COUNT < s_users * s_rounds) {
+        char sent_at[DM_TIME_LENGTH + 1] = {};
+        memcpy(sent_at, &data[msg_offset], DM_TIME_LENGTH);
+        DM_LATENCIES[DM_LATENCIES_COUNT++] =
+            now_us() - strtoull(sent_at, NULL, 16);
+      }
+      return;
+    }
+    if (length == 0 || data[0] != LISTED_USERS) {
+      return;
+    }
+
+    LAST_PROGRESS_MS = mg_millis();
+    client->rounds_done++;
+    if (client->rounds_done >= s_rounds) {
+      FINISHED_CLIENTS++;
+    } else {
+      send_round(client);
+    }
+  } else if (ev == MG_EV_CLOSE) {
+    if (!client->is_open) {
+      // The server may not be listening yet.
+      if (client->connect_attempts >= MAX_CONNECT_ATTEMPTS) {
+        fprintf(stderr, "Error: `%s` couldn't connect!\n", client->username);
+        FAILED = TRUE;
+      } else {
+        client->conn = NULL;
+        client->retry_at_ms = mg_millis() + CONNECT_RETRY_MS;
+      }
+    } else if (client->rounds_done < s_rounds) {
+      fprintf(stderr, "Error: `%s` was disconnected!\n", client->username);
+      FAILED = TRUE;
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-url") == 0 && argv[i + 1] != NULL) {
+      s_url = argv[++i];
+    } else if (strcmp(argv[i], "-users") == 0 && argv[i + 1] != NULL) {
+      s_users = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-rounds") == 0 && argv[i + 1] != NULL) {
+      s_rounds = strtoul(argv[++i], NULL, 10);
+    } else {
+      printf("Usage: %s OPTIONS\n"
+             "  -url URLS  - Comma separated nodes to connect to, default: "
+             "'%s'\n"
+             "  -users N  - Number of clients, default: %zu\n"
+             "  -rounds N  - Rounds each client runs, default: %zu\n",
+             argv[0], s_url, s_users, s_rounds);
+      return 1;
+    }
+  }
+
+  if (s_users < 2 || s_rounds == 0) {
+    fprintf(stderr, "Error: The workload needs at least 2 users and 1 round!\n");
+    return 1;
+  }
+
+  NODES_COUNT = 1;
+  for (const char *url = s_url; *url != '\0'; url++) {
+    NODES_COUNT += *url == ',';
+  }
+  NODES = calloc(NODES_COUNT, sizeof(UWU_String));
+  const char *url = s_url;
+  for (size_t i = 0; NODES != NULL && i < NODES_COUNT; i++) {
+    const char *end = strchr(url, ',');
+    NODES[i].data = (char *)url;
+    NODES[i].length = end == NULL ? strlen(url) : (size_t)(end - url);
+    url += NODES[i].length + 1;
+  }
+
+  CLIENTS = calloc(s_users, sizeof(UWU_WorkloadClient));
+  DM_LATENCIES = calloc(s_users * s_rounds, sizeof(uint64_t));
+  if (CLIENTS == NULL || NODES == NULL || DM_LATENCIES == NULL) {
+    fprintf(stderr, "Error: Can't allocate the workload clients!\n");
+    return 1;
+  }
+
+  struct mg_mgr mgr;
+  mg_mgr_init(&mgr);
+  mg_log_set(MG_LL_ERROR);
+
+  for (size_t i = 0; i < s_users; i++) {
+    CLIENTS[i].idx = i;
+    snprintf(CLIENTS[i].username, sizeof(CLIENTS[i].username), "w%zu", i);
+  }
+
+  LAST_PROGRESS_MS = mg_millis();
+  uint64_t start_ms = 0;
+  uint64_t all_open_ms = 0;
+  while (!FAILED && FINISHED_CLIENTS < s_users) {
+    mg_mgr_poll(&mgr, 50);
+
+    // Connect clients one at a time so the join order is stable.
+    for (size_t i = 0; i < s_users; i++) {
+      if (CLIENTS[i].conn == NULL && !CLIENTS[i].is_open) {
+        if (mg_millis() >= CLIENTS[i].retry_at_ms) {
+          client_connect(&mgr, &CLIENTS[i]);
+        }
+        break;
+      }
+      if (!CLIENTS[i].is_open) {
+        break;
+      }
+    }
+
+    if (all_open_ms == 0 && OPEN_CLIENTS == s_users) {
+      all_open_ms = mg_millis();
+    }
+    uint64_t settle_ms = NODES_COUNT > 1 ? CLUSTER_SETTLE_MS : 0;
+    if (!STARTED && all_open_ms != 0 &&
+        mg_millis() >= all_open_ms + settle_ms) {
+      STARTED = TRUE;
+      start_ms = mg_millis();
+      for (size_t i = 0; i < s_users; i++) {
+        send_round(&CLIENTS[i]);
+      }
+    }
+
+    if (mg_millis() - LAST_PROGRESS_MS > WORKLOAD_TIMEOUT_MS) {
+      fprintf(stderr, "Error: The workload timed out!\n");
+      FAILED = TRUE;
+    }
+  }
+
+  uint64_t elapsed_ms = mg_millis() - start_ms;
+  mg_mgr_free(&mgr);
+  free(CLIENTS);
+  free(NODES);
+
+  if (FAILED) {
+    free(DM_LATENCIES);
+    return 1;
+  }
+
+  if (DM_LATENCIES_COUNT > 0) {
+    qsort(DM_LATENCIES, DM_LATENCIES_COUNT, sizeof(uint64_t), compare_u64);
+    printf("workload: %zu DMs, latency p50 %.2f ms, p99 %.2f ms\n",
+           DM_LATENCIES_COUNT,
+           (double)DM_LATENCIES[DM_LATENCIES_COUNT / 2] / 1000.0,
+           (double)DM_LATENCIES[DM_LATENCIES_COUNT * 99 / 100] / 1000.0);
+  }
+  free(DM_LATENCIES);
+
+  if (elapsed_ms == 0) {
+    elapsed_ms = 1;
+  }
+  printf("workload: %zu requests in %llu ms (%.1f req/s)\n", REQUESTS_SENT,
+         (unsigned long long)elapsed_ms,
+         (double)REQUESTS_SENT * 1000.0 / (double)elapsed_ms);
+  return 0;
+}